@@ -0,0 +1,328 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include "SDL.h"
+#include "musashi/m68k.h"
+#include "version.h"
+#include "state.h"
+#include "memory.h"
+#include "sched.h"
+#include "insnhook.h"
+#include "video.h"
+#include "stats.h"
+#include "bench.h"
+
+#ifndef BENCH_DEBUG
+#define NDEBUG
+#endif
+#include "utils.h"
+
+/// Number of times each microbenchmark is run; the fastest run is reported
+#define BENCH_RUNS		5
+/// Most microbenchmarks and milestones in one report
+#define BENCH_MAX		32
+
+/// A microbenchmark result
+typedef struct {
+	const char	*name;
+	uint32_t	ops;			///< Operations per run
+	uint64_t	ns;				///< Time taken by the fastest run
+} BENCH_RESULT;
+
+/// A boot run milestone
+typedef struct {
+	char		*name;
+	uint64_t	ns;				///< Time since bench_start()
+	uint64_t	cycles;			///< Emulated cycles run by the machine which reached it
+} BENCH_MARK;
+
+static BENCH_RESULT results[BENCH_MAX];
+static int nresults = 0;
+static BENCH_MARK marks[BENCH_MAX];
+static int nmarks = 0;
+
+/// Host time at the start of the boot run, or 0 if there isn't one
+static uint64_t start_ns = 0;
+/// Emulated time of the machines being timed at the start of the boot run
+static uint64_t start_cycles = 0;
+/// Instructions executed since the start of the boot run
+static uint64_t instructions = 0;
+#ifdef ENABLE_STATS
+/// Counters at the start of the boot run, to leave the microbenchmarks out
+static STATS start_stats;
+#endif
+
+/// Somewhere for microbenchmarks to put their results, so the compiler
+/// can't optimise the work away
+static volatile uint32_t sink;
+
+uint64_t bench_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+void bench_micro(const char *name, BENCH_FN fn, uint32_t n)
+{
+	uint64_t best = UINT64_MAX;
+
+	// One untimed run to warm up the caches
+	fn(n);
+	for (int i = 0; i < BENCH_RUNS; i++) {
+		uint64_t t = bench_ns();
+		fn(n);
+		t = bench_ns() - t;
+		if (t < best)
+			best = t;
+	}
+
+	LOG("%s: %u ops in %llu ns", name, n, (unsigned long long)best);
+	if (nresults < BENCH_MAX) {
+		results[nresults].name = name;
+		results[nresults].ops = n;
+		results[nresults].ns = best;
+		nresults++;
+	}
+}
+
+/********************************************************
+ * Built-in microbenchmarks
+ ********************************************************/
+
+void bench_identity_map(void)
+{
+	// Present, dirty and write enabled, so nothing takes the Page Status
+	// update path after the first access
+	for (int page = 0; page < MEM_NUM_MAP_PAGES; page++) {
+		state->map[page * 2] = 0xE0 | ((page >> 8) & 0x03);
+		state->map[(page * 2) + 1] = page & 0xFF;
+	}
+	state->romlmap = true;
+	memory_rebuild_page_table();
+	// Function code 5 is supervisor data
+	memory_fc_callback(5);
+}
+
+/// Sequential reads and writes walk through the whole RAM zone
+#define RAM_ZONE_MASK	0x3FFFFF
+
+static void bench_read16(uint32_t n)
+{
+	uint32_t sum = 0;
+	for (uint32_t i = 0; i < n; i++)
+		sum += m68k_read_memory_16((i * 2) & RAM_ZONE_MASK);
+	sink = sum;
+}
+
+static void bench_read32(uint32_t n)
+{
+	uint32_t sum = 0;
+	for (uint32_t i = 0; i < n; i++)
+		sum += m68k_read_memory_32((i * 4) & RAM_ZONE_MASK);
+	sink = sum;
+}
+
+static void bench_write32(uint32_t n)
+{
+	for (uint32_t i = 0; i < n; i++)
+		m68k_write_memory_32((i * 4) & RAM_ZONE_MASK, i);
+}
+
+static void bench_rom_read16(uint32_t n)
+{
+	uint32_t sum = 0;
+	for (uint32_t i = 0; i < n; i++)
+		sum += m68k_read_memory_16(0x800000 + ((i * 2) & (ROM_SIZE - 1)));
+	sink = sum;
+}
+
+static void bench_mmu(uint32_t n)
+{
+	uint32_t sum = 0;
+	for (uint32_t i = 0; i < n; i++) {
+		uint32_t addr = (i * 4) & RAM_ZONE_MASK;
+		sum += checkMemoryAccess(addr, (i & 1) != 0, false);
+		sum += mapAddr(addr, (i & 1) != 0);
+	}
+	sink = sum;
+}
+
+/// Display surface for the screen refresh benchmark
+static SDL_Surface *bench_surface = NULL;
+
+static void bench_screen(uint32_t n)
+{
+	for (uint32_t i = 0; i < n; i++) {
+		// Change every scanline, as a full screen redraw would
+		memory_vram_invalidate();
+		video_publish_frame();
+		video_refresh(bench_surface);
+	}
+}
+
+void bench_micro_suite(void)
+{
+	bench_identity_map();
+
+	bench_micro("m68k_read_memory_16", bench_read16, 1 << 22);
+	bench_micro("m68k_read_memory_32", bench_read32, 1 << 22);
+	bench_micro("m68k_write_memory_32", bench_write32, 1 << 22);
+	bench_micro("m68k_read_memory_16_rom", bench_rom_read16, 1 << 22);
+	bench_micro("checkMemoryAccess_mapAddr", bench_mmu, 1 << 22);
+
+	// Draw on an off-screen surface in the usual display format. This
+	// leaves the video module set up for it, which is fine when running
+	// headless (there's nothing else to draw on).
+	bench_surface = SDL_CreateRGBSurface(SDL_SWSURFACE, 720, 348, 32, 0xFF0000, 0x00FF00, 0x0000FF, 0);
+	if (bench_surface != NULL) {
+		video_init(bench_surface, VIDEO_PAL_GREEN);
+		bench_micro("screen_refresh", bench_screen, 200);
+		SDL_FreeSurface(bench_surface);
+		bench_surface = NULL;
+	} else {
+		fprintf(stderr, "ERROR: Could not create surface for the screen benchmark: %s.\n", SDL_GetError());
+	}
+}
+
+/********************************************************
+ * Boot run
+ ********************************************************/
+
+/// Instruction hook: count instructions
+static void count_instruction(unsigned int pc)
+{
+	(void)pc;
+	instructions++;
+}
+
+void bench_start(void)
+{
+	if (start_ns == 0) {
+		start_ns = bench_ns();
+#ifdef ENABLE_STATS
+		stats_total(&start_stats);
+#endif
+	}
+	start_cycles += sched_now();
+	insn_hook_add(count_instruction);
+}
+
+void bench_mark(const char *name)
+{
+	if ((start_ns == 0) || (nmarks >= BENCH_MAX))
+		return;
+	if ((marks[nmarks].name = strdup(name)) == NULL)
+		return;
+	marks[nmarks].ns = bench_ns() - start_ns;
+	marks[nmarks].cycles = sched_now();
+	LOG("mark '%s' at %llu ns", name, (unsigned long long)marks[nmarks].ns);
+	nmarks++;
+}
+
+/********************************************************
+ * Report
+ ********************************************************/
+
+/// Write a string as a JSON string literal
+static void write_json_string(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+	for (; *s; s++) {
+		if ((*s == '"') || (*s == '\\'))
+			fprintf(fp, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(fp, "\\u%04x", (unsigned char)*s);
+		else
+			fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
+static void write_report(FILE *fp, uint64_t cycles)
+{
+	fprintf(fp, "{\n\t\"version\": ");
+	write_json_string(fp, VER_FULLSTR);
+	fprintf(fp, ",\n\t\"build_type\": ");
+	write_json_string(fp, VER_BUILD_TYPE);
+	fprintf(fp, ",\n\t\"cflags\": ");
+	write_json_string(fp, VER_CFLAGS);
+
+	fprintf(fp, ",\n\t\"micro\": [");
+	for (int i = 0; i < nresults; i++) {
+		fprintf(fp, "%s\n\t\t{ \"name\": ", i ? "," : "");
+		write_json_string(fp, results[i].name);
+		fprintf(fp, ", \"ops\": %u, \"ns\": %llu, \"ns_per_op\": %.3f }",
+				results[i].ops, (unsigned long long)results[i].ns, (double)results[i].ns / results[i].ops);
+	}
+	fprintf(fp, "%s]", nresults ? "\n\t" : "");
+
+	fprintf(fp, ",\n\t\"boot\": ");
+	if (start_ns != 0) {
+		uint64_t ns = bench_ns() - start_ns;
+		cycles -= start_cycles;
+		fprintf(fp, "{\n\t\t\"wall_ns\": %llu,\n\t\t\"cycles\": %llu,\n\t\t\"cycles_per_sec\": %.0f,\n",
+				(unsigned long long)ns, (unsigned long long)cycles, ns ? (cycles * 1e9) / ns : 0.0);
+		// No instructions means the CPU core doesn't call the hook
+		if (instructions > 0)
+			fprintf(fp, "\t\t\"instructions\": %llu,\n\t\t\"ns_per_instruction\": %.3f,\n",
+					(unsigned long long)instructions, (double)ns / instructions);
+		else
+			fprintf(fp, "\t\t\"instructions\": null,\n\t\t\"ns_per_instruction\": null,\n");
+		fprintf(fp, "\t\t\"marks\": [");
+		for (int i = 0; i < nmarks; i++) {
+			fprintf(fp, "%s\n\t\t\t{ \"name\": ", i ? "," : "");
+			write_json_string(fp, marks[i].name);
+			fprintf(fp, ", \"wall_ns\": %llu, \"cycles\": %llu }",
+					(unsigned long long)marks[i].ns, (unsigned long long)marks[i].cycles);
+		}
+		fprintf(fp, "%s]\n\t}", nmarks ? "\n\t\t" : "");
+	} else {
+		fprintf(fp, "null");
+	}
+
+	// Memory handler calls by region during the boot run, if they were counted
+	fprintf(fp, ",\n\t\"memory\": ");
+#ifdef ENABLE_STATS
+	STATS total;
+	stats_total(&total);
+	fprintf(fp, "{");
+	for (int i = 0; i < STAT_RGN_COUNT; i++)
+		fprintf(fp, "%s\n\t\t\"%s\": { \"reads\": %llu, \"writes\": %llu }", i ? "," : "",
+				stats_region_names[i], (unsigned long long)(total.mem_reads[i] - start_stats.mem_reads[i]),
+				(unsigned long long)(total.mem_writes[i] - start_stats.mem_writes[i]));
+	fprintf(fp, "\n\t}\n}\n");
+#else
+	fprintf(fp, "null\n}\n");
+#endif
+}
+
+bool bench_write(const char *filename, uint64_t cycles)
+{
+	bool ok;
+
+	char *tmpname = malloc(strlen(filename) + 5);
+	if (tmpname == NULL)
+		return false;
+	sprintf(tmpname, "%s.tmp", filename);
+
+	FILE *fp = fopen(tmpname, "w");
+	if (fp == NULL) {
+		free(tmpname);
+		return false;
+	}
+	write_report(fp, cycles);
+	ok = !ferror(fp);
+	ok = (fclose(fp) == 0) && ok;
+	if (ok)
+		ok = (rename(tmpname, filename) == 0);
+	if (!ok)
+		remove(tmpname);
+
+	LOG("wrote '%s', %s", filename, ok ? "ok" : "failed");
+	free(tmpname);
+	return ok;
+}
@@ -0,0 +1,85 @@
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Benchmarking.
+ *
+ * Two kinds of measurement go into one report. Microbenchmarks time the
+ * emulator's hot paths in isolation, on a scratch machine. The boot run
+ * times the emulator running a deterministic headless session (fixed ROM,
+ * disc image and input script, or a snapshot), with milestones set by the
+ * script's "mark" command.
+ *
+ * Times are host wall clock times, in nanoseconds.
+ */
+
+/// Microbenchmark body: do the operation being measured n times
+typedef void (*BENCH_FN)(uint32_t n);
+
+/**
+ * @brief	Get the host time.
+ * @return	Monotonic time in nanoseconds.
+ */
+uint64_t bench_ns(void);
+
+/**
+ * @brief	Time a microbenchmark and add it to the report.
+ * @param	name	Name to report it under.
+ * @param	fn		Benchmark body.
+ * @param	n		Number of operations to time in each run.
+ *
+ * The body is run a few times and the fastest run is kept, so a run which
+ * gets interrupted by the host doesn't skew the result.
+ */
+void bench_micro(const char *name, BENCH_FN fn, uint32_t n);
+
+/**
+ * @brief	Run the built-in microbenchmarks.
+ *
+ * Covers the CPU memory handlers, address translation and permission checks,
+ * and screen refresh. Sets up the current machine with an identity map in
+ * supervisor mode, so it must be a scratch machine (see state_new()).
+ */
+void bench_micro_suite(void);
+
+/**
+ * @brief	Set up the current machine's Map RAM for a microbenchmark.
+ *
+ * Maps every page of the RAM zone to the same physical page, present, dirty
+ * and write enabled, sets ROMLMAP and puts the memory handlers in
+ * supervisor mode.
+ */
+void bench_identity_map(void);
+
+/**
+ * @brief	Start timing the boot run.
+ *
+ * Counts the instructions executed by the current machine from here on, if
+ * the emulator was built with ENABLE_INSN_HOOK (see insnhook.h). Call once for each
+ * machine to be counted, after any snapshot has been restored.
+ */
+void bench_start(void);
+
+/**
+ * @brief	Record a boot run milestone (e.g. reaching the login prompt).
+ * @param	name	Name to report it under.
+ *
+ * Records the host time since bench_start() and the current machine's
+ * emulated time since reset. Does nothing unless bench_start() has been
+ * called.
+ */
+void bench_mark(const char *name);
+
+/**
+ * @brief	Write the report.
+ * @param	filename	Output file name (JSON). Replaced atomically if it exists.
+ * @param	cycles		Emulated time of every machine passed to bench_start()
+ * 						added together (sched_now() for each).
+ * @return	true on success.
+ */
+bool bench_write(const char *filename, uint64_t cycles);
+
+#endif
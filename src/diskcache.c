@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "SDL.h"
+#include "diskcache.h"
+
+#ifndef DISKCACHE_DEBUG
+#define NDEBUG
+#endif
+#include "utils.h"
+
+/// Longest time dirty data is left in the cache, milliseconds
+#define FLUSH_INTERVAL_MS	1000
+
+/// Batch entries are sorted by LBA; the slot number rides along in the low word
+#define BATCH_ENTRY(lba, slot)	(((uint64_t)(lba) << 32) | (uint32_t)(slot))
+#define BATCH_LBA(e)			((uint32_t)((e) >> 32))
+#define BATCH_SLOT(e)			((uint32_t)(e))
+
+static inline size_t hash_lba(DISKCACHE *c, uint32_t lba)
+{
+	return (lba * 2654435761u) % c->nslots;
+}
+
+static inline uint8_t *slot_data(DISKCACHE *c, size_t slot)
+{
+	return c->slot_data + (slot * c->secsz);
+}
+
+/**
+ * @brief	Find the slot holding a sector.
+ * @return	Slot number, or -1 if the sector isn't cached.
+ */
+static int32_t lookup(DISKCACHE *c, uint32_t lba)
+{
+	int32_t i = c->hash[hash_lba(c, lba)];
+	while ((i >= 0) && (c->slots[i].lba != lba))
+		i = c->slots[i].next;
+	return i;
+}
+
+/**
+ * @brief	Remove a slot from its hash chain.
+ */
+static void unlink_slot(DISKCACHE *c, int32_t slot)
+{
+	int32_t *p = &c->hash[hash_lba(c, c->slots[slot].lba)];
+	while (*p != slot)
+		p = &c->slots[*p].next;
+	*p = c->slots[slot].next;
+	c->slots[slot].valid = false;
+}
+
+/**
+ * @brief	Find a slot for a new sector, evicting a clean one if need be.
+ *
+ * If every slot is waiting to be written out, waits for the flusher.
+ * Called with the lock held.
+ */
+static int32_t alloc_slot(DISKCACHE *c, uint32_t lba)
+{
+	for (;;) {
+		for (size_t n = 0; n < c->nslots; n++) {
+			int32_t i = c->clock;
+			c->clock = (c->clock + 1) % c->nslots;
+			if (c->slots[i].valid && (c->slots[i].dirty || c->slots[i].pending))
+				continue;
+			if (c->slots[i].valid)
+				unlink_slot(c, i);
+
+			size_t h = hash_lba(c, lba);
+			c->slots[i].lba = lba;
+			c->slots[i].valid = true;
+			c->slots[i].dirty = c->slots[i].pending = false;
+			c->slots[i].next = c->hash[h];
+			c->hash[h] = i;
+			return i;
+		}
+
+		// Cache is full of unwritten data
+		LOGS("cache full, waiting for flush");
+		c->waiters++;
+		SDL_CondSignal(c->work);
+		SDL_CondWait(c->done, c->lock);
+		c->waiters--;
+	}
+}
+
+static int compare_batch(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * @brief	Write out every dirty sector.
+ *
+ * Called by the flusher with the lock held. The sector data is copied
+ * out, so the lock is dropped while the file is being written and the
+ * emulation can carry on writing to the cache.
+ */
+static void write_batch(DISKCACHE *c)
+{
+	size_t n = 0;
+
+	// Gather the dirty sectors in LBA order
+	for (size_t i = 0; i < c->nslots; i++)
+		if (c->slots[i].dirty)
+			c->batch[n++] = BATCH_ENTRY(c->slots[i].lba, i);
+	qsort(c->batch, n, sizeof(c->batch[0]), compare_batch);
+
+	for (size_t k = 0; k < n; k++) {
+		DISKCACHE_SLOT *s = &c->slots[BATCH_SLOT(c->batch[k])];
+		memcpy(c->staging + (k * c->secsz), slot_data(c, BATCH_SLOT(c->batch[k])), c->secsz);
+		s->dirty = false;
+		s->pending = true;
+	}
+	c->ndirty -= n;
+	c->flushing = true;
+	SDL_UnlockMutex(c->lock);
+
+	// Write each run of adjacent sectors in one go
+	for (size_t k = 0, j; k < n; k = j) {
+		for (j = k + 1; (j < n) && (BATCH_LBA(c->batch[j]) == BATCH_LBA(c->batch[j - 1]) + 1); j++)
+			;
+
+		const uint8_t *p = c->staging + (k * c->secsz);
+		size_t len = (j - k) * c->secsz;
+		off_t pos = (off_t)BATCH_LBA(c->batch[k]) * c->secsz;
+		LOG("flush lba %u, %zu sectors", BATCH_LBA(c->batch[k]), j - k);
+		while (len > 0) {
+			ssize_t w = pwrite(c->fd, p, len, pos);
+			if (w < 0) {
+				if (errno == EINTR)
+					continue;
+				fprintf(stderr, "ERROR: Disc image write failed: %s\n", strerror(errno));
+				break;
+			}
+			p += w; len -= w; pos += w;
+		}
+	}
+
+	SDL_LockMutex(c->lock);
+	for (size_t k = 0; k < n; k++)
+		c->slots[BATCH_SLOT(c->batch[k])].pending = false;
+	c->flushing = false;
+	SDL_CondBroadcast(c->done);
+}
+
+static int flusher(void *arg)
+{
+	DISKCACHE *c = arg;
+
+	SDL_LockMutex(c->lock);
+	for (;;) {
+		if (c->ndirty == 0) {
+			if (c->stopping)
+				break;
+			SDL_CondWait(c->work, c->lock);
+			continue;
+		}
+
+		// Write out straight away if asked to or over the limit, otherwise
+		// give the dirty data a while to collect neighbours
+		bool urgent = c->stopping || (c->waiters > 0) || ((c->ndirty * c->secsz) >= c->dirty_limit);
+		if (!urgent && (SDL_CondWaitTimeout(c->work, c->lock, FLUSH_INTERVAL_MS) != SDL_MUTEX_TIMEDOUT))
+			continue;
+
+		write_batch(c);
+	}
+	SDL_UnlockMutex(c->lock);
+
+	return 0;
+}
+
+bool diskcache_init(DISKCACHE *cache, int fd, size_t secsz, size_t dirty_limit)
+{
+	memset(cache, 0, sizeof(*cache));
+	cache->fd = fd;
+	cache->secsz = secsz;
+	cache->dirty_limit = dirty_limit;
+
+	// Room for twice the dirty limit, so there's space to keep going while
+	// a flush is in progress
+	cache->nslots = (2 * dirty_limit) / secsz;
+	if (cache->nslots < 64)
+		cache->nslots = 64;
+
+	cache->slots = malloc(cache->nslots * sizeof(DISKCACHE_SLOT));
+	cache->slot_data = malloc(cache->nslots * secsz);
+	cache->hash = malloc(cache->nslots * sizeof(int32_t));
+	cache->batch = malloc(cache->nslots * sizeof(uint64_t));
+	cache->staging = malloc(cache->nslots * secsz);
+	cache->lock = SDL_CreateMutex();
+	cache->work = SDL_CreateCond();
+	cache->done = SDL_CreateCond();
+	if (!cache->slots || !cache->slot_data || !cache->hash || !cache->batch || !cache->staging ||
+			!cache->lock || !cache->work || !cache->done) {
+		diskcache_done(cache);
+		return false;
+	}
+
+	for (size_t i = 0; i < cache->nslots; i++) {
+		cache->slots[i].valid = false;
+		cache->hash[i] = -1;
+	}
+
+	if ((cache->thread = SDL_CreateThread(flusher, cache)) == NULL) {
+		diskcache_done(cache);
+		return false;
+	}
+
+	LOG("%zu sector cache, dirty limit %zu bytes", cache->nslots, dirty_limit);
+	return true;
+}
+
+void diskcache_done(DISKCACHE *cache)
+{
+	if (cache->thread != NULL) {
+		// The flusher writes out whatever's left before it exits
+		SDL_LockMutex(cache->lock);
+		cache->stopping = true;
+		SDL_CondSignal(cache->work);
+		SDL_UnlockMutex(cache->lock);
+		SDL_WaitThread(cache->thread, NULL);
+		cache->thread = NULL;
+	}
+
+	if (cache->done)	SDL_DestroyCond(cache->done);
+	if (cache->work)	SDL_DestroyCond(cache->work);
+	if (cache->lock)	SDL_DestroyMutex(cache->lock);
+	free(cache->staging);
+	free(cache->batch);
+	free(cache->hash);
+	free(cache->slot_data);
+	free(cache->slots);
+	memset(cache, 0, sizeof(*cache));
+}
+
+size_t diskcache_read(DISKCACHE *cache, uint32_t lba, uint8_t *buf, size_t count)
+{
+	size_t total = 0;
+
+	SDL_LockMutex(cache->lock);
+	for (size_t i = 0; i < count; i++, lba++) {
+		int32_t slot = lookup(cache, lba);
+		if (slot >= 0) {
+			memcpy(buf + total, slot_data(cache, slot), cache->secsz);
+			total += cache->secsz;
+		} else {
+			// Not cached, so the file is up to date
+			ssize_t r = pread(cache->fd, buf + total, cache->secsz, (off_t)lba * cache->secsz);
+			if (r > 0)
+				total += r;
+		}
+	}
+	SDL_UnlockMutex(cache->lock);
+
+	return total;
+}
+
+void diskcache_write(DISKCACHE *cache, uint32_t lba, const uint8_t *buf, size_t count)
+{
+	SDL_LockMutex(cache->lock);
+	bool was_clean = (cache->ndirty == 0);
+	for (size_t i = 0; i < count; i++, lba++) {
+		int32_t slot = lookup(cache, lba);
+		if (slot < 0)
+			slot = alloc_slot(cache, lba);
+
+		memcpy(slot_data(cache, slot), buf + (i * cache->secsz), cache->secsz);
+		if (!cache->slots[slot].dirty) {
+			cache->slots[slot].dirty = true;
+			cache->ndirty++;
+		}
+	}
+
+	// Wake the flusher to start its timer, or to write out straight away if
+	// we're over the limit
+	if (was_clean || ((cache->ndirty * cache->secsz) >= cache->dirty_limit))
+		SDL_CondSignal(cache->work);
+	SDL_UnlockMutex(cache->lock);
+}
+
+void diskcache_flush(DISKCACHE *cache)
+{
+	SDL_LockMutex(cache->lock);
+	cache->waiters++;
+	while ((cache->ndirty > 0) || cache->flushing) {
+		SDL_CondSignal(cache->work);
+		SDL_CondWait(cache->done, cache->lock);
+	}
+	cache->waiters--;
+	SDL_UnlockMutex(cache->lock);
+}
@@ -0,0 +1,98 @@
+#ifndef _DISKCACHE_H
+#define _DISKCACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "SDL.h"
+
+/// One cached sector
+typedef struct {
+	uint32_t	lba;			///< Sector number
+	bool		valid;			///< Slot holds a sector
+	bool		dirty;			///< Sector has changed since it was last written out
+	bool		pending;		///< Sector is being written out by the flusher
+	int32_t		next;			///< Next slot in the same hash chain, -1 at the end
+} DISKCACHE_SLOT;
+
+/**
+ * @brief Write-back sector cache for a disc image
+ *
+ * Writes land in the cache and are written to the image file by a
+ * background thread, with runs of adjacent dirty sectors coalesced into a
+ * single pwrite(). Reads of cached sectors are served from the cache.
+ * All fields are protected by the lock.
+ */
+typedef struct {
+	int				fd;				///< Image file descriptor
+	size_t			secsz;			///< Sector size in bytes
+	size_t			nslots;			///< Number of sectors the cache can hold
+	size_t			dirty_limit;	///< Dirty bytes which trigger a background flush
+	DISKCACHE_SLOT	*slots;			///< Slot state
+	uint8_t			*slot_data;		///< Sector data, secsz bytes per slot
+	int32_t			*hash;			///< Hash chain heads, nslots entries
+	size_t			ndirty;			///< Number of dirty slots
+	size_t			clock;			///< Next slot to consider for eviction
+	int				waiters;		///< Threads waiting for a flush to finish
+	bool			flushing;		///< The flusher has a batch in flight
+	bool			stopping;		///< The flusher has been asked to exit
+
+	// Flusher state
+	uint64_t		*batch;			///< LBA and slot of each sector in the current batch
+	uint8_t			*staging;		///< Copy of the batch's sector data
+
+	SDL_mutex		*lock;
+	SDL_cond		*work;			///< Signalled when there's something to flush
+	SDL_cond		*done;			///< Signalled when a batch has been written
+	SDL_Thread		*thread;
+} DISKCACHE;
+
+/**
+ * @brief	Set up a sector cache and start its flusher thread.
+ * @param	cache		Cache context.
+ * @param	fd			Image file descriptor. stdio must not be used to read
+ * 						or write the file while the cache is active.
+ * @param	secsz		Sector size in bytes.
+ * @param	dirty_limit	Number of dirty bytes which triggers a flush. Dirty
+ * 						data is also written out at least once a second.
+ * @return	true on success, false if out of memory or the thread couldn't
+ * 			be started.
+ */
+bool diskcache_init(DISKCACHE *cache, int fd, size_t secsz, size_t dirty_limit);
+
+/**
+ * @brief	Write everything back to the image, stop the flusher and free
+ * 			the cache.
+ */
+void diskcache_done(DISKCACHE *cache);
+
+/**
+ * @brief	Read sectors, from the cache if they're there, else from the image.
+ * @param	cache	Cache context.
+ * @param	lba		First sector number.
+ * @param	buf		Buffer for count * secsz bytes.
+ * @param	count	Number of sectors.
+ * @return	Number of bytes read; short if the image ends early.
+ */
+size_t diskcache_read(DISKCACHE *cache, uint32_t lba, uint8_t *buf, size_t count);
+
+/**
+ * @brief	Write sectors into the cache.
+ * @param	cache	Cache context.
+ * @param	lba		First sector number.
+ * @param	buf		count * secsz bytes of data.
+ * @param	count	Number of sectors.
+ *
+ * Only blocks if the cache is full of data which hasn't been written out.
+ */
+void diskcache_write(DISKCACHE *cache, uint32_t lba, const uint8_t *buf, size_t count);
+
+/**
+ * @brief	Wait until all dirty sectors have been written to the image.
+ *
+ * Use before saving a snapshot or closing the image, so the file is in a
+ * known state.
+ */
+void diskcache_flush(DISKCACHE *cache);
+
+#endif
@@ -0,0 +1,334 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#if defined(SYS_openat2) && __has_include(<linux/openat2.h>)
+#include <linux/openat2.h>
+#define HAVE_OPENAT2
+#endif
+#include "state.h"
+#include "memory.h"
+#include "stats.h"
+#include "hostio.h"
+
+#ifndef HOSTIO_DEBUG
+#define NDEBUG
+#endif
+#include "utils.h"
+
+/// Host directory guest file names are relative to, or -1 if disabled
+static int root_fd = -1;
+
+bool hostio_set_root(const char *dir)
+{
+	int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (fd < 0)
+		return false;
+	if (root_fd >= 0)
+		close(root_fd);
+	root_fd = fd;
+	return true;
+}
+
+bool hostio_enabled(void)
+{
+	return (root_fd >= 0);
+}
+
+void hostio_init(HOSTIO_CTX *ctx)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	hostio_forget(ctx);
+}
+
+void hostio_done(HOSTIO_CTX *ctx)
+{
+	for (int i = 0; i < HOSTIO_MAX_FILES; i++)
+		if (ctx->fd[i] >= 0)
+			close(ctx->fd[i]);
+	hostio_forget(ctx);
+}
+
+void hostio_forget(HOSTIO_CTX *ctx)
+{
+	for (int i = 0; i < HOSTIO_MAX_FILES; i++) {
+		ctx->fd[i] = -1;
+		ctx->writable[i] = false;
+	}
+}
+
+/**
+ * @brief	Get the guest RAM page a transfer uses next.
+ * @param	addr	CPU address.
+ * @param	writing	true if the transfer writes to guest RAM.
+ * @param	phys	Set to the physical address.
+ * @return	Host pointer (NULL if the physical page isn't populated), or
+ * 			NULL with *phys set to -1 if the page isn't present.
+ */
+static uint8_t *guest_page(uint32_t addr, bool writing, uint32_t *phys)
+{
+	if ((addr >= 0x400000) || (checkMemoryAccess(addr, writing, true) != MEM_ALLOWED)) {
+		*phys = (uint32_t)-1;
+		return NULL;
+	}
+	*phys = mapAddr(addr, writing);
+	return memory_phys_ptr(*phys, writing);
+}
+
+/**
+ * @brief	Copy the file name for an OPEN command out of guest memory.
+ */
+static HOSTIO_STATUS get_path(HOSTIO_CTX *ctx, char *path)
+{
+	uint32_t n = 0;
+
+	if ((ctx->len == 0) || (ctx->len > HOSTIO_MAX_PATH))
+		return HOSTIO_E_BAD_PATH;
+	while (n < ctx->len) {
+		uint32_t phys;
+		uint8_t *ram = guest_page(ctx->addr + n, false, &phys);
+		if (phys == (uint32_t)-1)
+			return HOSTIO_E_FAULT;
+		path[n++] = (ram != NULL) ? *ram : 0xff;
+	}
+	path[n] = '\0';
+	// Stop at a NUL, in case the driver passed the buffer size
+	n = strlen(path);
+
+	// Stay inside the host directory (open_beneath() sees to symlinks)
+	if ((n == 0) || (path[0] == '/'))
+		return HOSTIO_E_BAD_PATH;
+	for (const char *p = path; p != NULL; p = strchr(p, '/')) {
+		if (*p == '/')
+			p++;
+		if ((p[0] == '.') && (p[1] == '.') && ((p[2] == '/') || (p[2] == '\0')))
+			return HOSTIO_E_BAD_PATH;
+	}
+	return HOSTIO_OK;
+}
+
+/**
+ * @brief	Open a file in the host directory, without following a symlink
+ * 			out of it.
+ * @return	File descriptor, or -1 with errno set.
+ *
+ * openat2() resolves the whole path beneath the host directory. On a kernel
+ * without it, the path is walked a component at a time with O_NOFOLLOW, so
+ * no symlink is followed at all.
+ */
+static int open_beneath(const char *path, int flags, mode_t mode)
+{
+#ifdef HAVE_OPENAT2
+	static bool no_openat2 = false;
+	if (!no_openat2) {
+		struct open_how how = {
+			.flags		= flags,
+			.mode		= (flags & O_CREAT) ? mode : 0,
+			.resolve	= RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS
+		};
+		int fd = syscall(SYS_openat2, root_fd, path, &how, sizeof(how));
+		if ((fd >= 0) || (errno != ENOSYS))
+			return fd;
+		no_openat2 = true;
+	}
+#endif
+
+	int dir = root_fd;
+	const char *name = path;
+	for (const char *slash; (slash = strchr(name, '/')) != NULL; name = slash + 1) {
+		char part[HOSTIO_MAX_PATH + 1];
+		if (slash == name)
+			continue;
+		memcpy(part, name, slash - name);
+		part[slash - name] = '\0';
+		int next = openat(dir, part, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (dir != root_fd)
+			close(dir);
+		if (next < 0)
+			return -1;
+		dir = next;
+	}
+
+	int fd = -1;
+	if (*name == '\0')
+		errno = EISDIR;
+	else
+		fd = openat(dir, name, flags | O_NOFOLLOW, mode);
+	if (dir != root_fd) {
+		int err = errno;
+		close(dir);
+		errno = err;
+	}
+	return fd;
+}
+
+static HOSTIO_STATUS cmd_open(HOSTIO_CTX *ctx, bool writing)
+{
+	char path[HOSTIO_MAX_PATH + 1];
+	HOSTIO_STATUS st;
+	struct stat sb;
+	int h;
+
+	if ((st = get_path(ctx, path)) != HOSTIO_OK)
+		return st;
+	for (h = 0; (h < HOSTIO_MAX_FILES) && (ctx->fd[h] >= 0); h++)
+		;
+	if (h == HOSTIO_MAX_FILES)
+		return HOSTIO_E_NO_HANDLES;
+
+	int fd = writing ? open_beneath(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)
+					 : open_beneath(path, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0) {
+		LOG("can't open '%s': %s", path, strerror(errno));
+		return HOSTIO_E_NOT_FOUND;
+	}
+	if ((fstat(fd, &sb) < 0) || !S_ISREG(sb.st_mode)) {
+		close(fd);
+		return HOSTIO_E_NOT_FOUND;
+	}
+
+	ctx->fd[h] = fd;
+	ctx->writable[h] = writing;
+	ctx->handle = h;
+	ctx->result = (sb.st_size > UINT32_MAX) ? UINT32_MAX : (uint32_t)sb.st_size;
+	LOG("opened '%s' for %s as handle %d", path, writing ? "writing" : "reading", h);
+	return HOSTIO_OK;
+}
+
+/**
+ * @brief	Move data between an open file and guest memory, a page at a
+ * 			time, straight into or out of the guest's RAM.
+ */
+static HOSTIO_STATUS cmd_transfer(HOSTIO_CTX *ctx, bool to_guest)
+{
+	uint32_t len = (ctx->len < HOSTIO_MAX_XFER) ? ctx->len : HOSTIO_MAX_XFER;
+	HOSTIO_STATUS st = HOSTIO_OK;
+	int fd;
+
+	ctx->result = 0;
+	if ((ctx->handle >= HOSTIO_MAX_FILES) || ((fd = ctx->fd[ctx->handle]) < 0) ||
+			(ctx->writable[ctx->handle] == to_guest))
+		return HOSTIO_E_BAD_HANDLE;
+
+	while (ctx->result < len) {
+		uint32_t addr = ctx->addr + ctx->result, phys;
+		uint32_t n = MEM_PAGE_SIZE - (addr & (MEM_PAGE_SIZE - 1));
+		if (n > len - ctx->result)
+			n = len - ctx->result;
+
+		uint8_t scratch[MEM_PAGE_SIZE];
+		uint8_t *ram = guest_page(addr, to_guest, &phys);
+		if (phys == (uint32_t)-1) {
+			st = HOSTIO_E_FAULT;
+			break;
+		}
+		if (ram == NULL) {
+			// Unpopulated RAM: reads from it are 0xFF, writes are dropped
+			ram = scratch;
+			memset(scratch, 0xff, n);
+		}
+
+		off_t off = (off_t)ctx->offset + ctx->result;
+		ssize_t r = to_guest ? pread(fd, ram, n, off) : pwrite(fd, ram, n, off);
+		if (r < 0) {
+			st = HOSTIO_E_IO;
+			break;
+		}
+		if (to_guest && (r > 0) && (ram != scratch))
+			memory_phys_written(phys);
+		ctx->result += r;
+		if ((uint32_t)r < n)
+			// End of the file
+			break;
+	}
+
+	STAT_ADD(hostio_bytes, ctx->result);
+	return st;
+}
+
+static HOSTIO_STATUS cmd_close(HOSTIO_CTX *ctx)
+{
+	if ((ctx->handle >= HOSTIO_MAX_FILES) || (ctx->fd[ctx->handle] < 0))
+		return HOSTIO_E_BAD_HANDLE;
+	if (close(ctx->fd[ctx->handle]) < 0)
+		LOG("close on handle %d failed: %s", ctx->handle, strerror(errno));
+	ctx->fd[ctx->handle] = -1;
+	ctx->writable[ctx->handle] = false;
+	return HOSTIO_OK;
+}
+
+static void run_command(HOSTIO_CTX *ctx, uint16_t cmd)
+{
+	switch (cmd) {
+		case HOSTIO_CMD_OPEN_READ:	ctx->status = cmd_open(ctx, false);		break;
+		case HOSTIO_CMD_OPEN_WRITE:	ctx->status = cmd_open(ctx, true);		break;
+		case HOSTIO_CMD_READ:		ctx->status = cmd_transfer(ctx, true);	break;
+		case HOSTIO_CMD_WRITE:		ctx->status = cmd_transfer(ctx, false);	break;
+		case HOSTIO_CMD_CLOSE:		ctx->status = cmd_close(ctx);			break;
+		default:					ctx->status = HOSTIO_E_BAD_CMD;			break;
+	}
+	LOG_IF(ctx->status != HOSTIO_OK, "command %d failed with status %d", cmd, ctx->status);
+}
+
+/// Half of a 32-bit register
+static uint16_t reg_half(uint32_t v, bool hi)
+{
+	return hi ? (v >> 16) : (v & 0xffff);
+}
+
+/// Write half of a 32-bit register
+static void set_half(uint32_t *v, bool hi, uint16_t val)
+{
+	*v = hi ? ((*v & 0x0000ffff) | ((uint32_t)val << 16)) : ((*v & 0xffff0000) | val);
+}
+
+uint32_t hostio_read_reg(HOSTIO_CTX *ctx, int reg, int bits)
+{
+	if (bits == 32)
+		return (hostio_read_reg(ctx, reg, 16) << 16) | hostio_read_reg(ctx, reg + 1, 16);
+
+	switch (reg) {
+		case HOSTIO_REG_ID:			return HOSTIO_ID;
+		case HOSTIO_REG_CMD:		return ctx->status;
+		case HOSTIO_REG_ADDR_HI:
+		case HOSTIO_REG_ADDR_LO:	return reg_half(ctx->addr, reg == HOSTIO_REG_ADDR_HI);
+		case HOSTIO_REG_LEN_HI:
+		case HOSTIO_REG_LEN_LO:		return reg_half(ctx->len, reg == HOSTIO_REG_LEN_HI);
+		case HOSTIO_REG_OFFSET_HI:
+		case HOSTIO_REG_OFFSET_LO:	return reg_half(ctx->offset, reg == HOSTIO_REG_OFFSET_HI);
+		case HOSTIO_REG_HANDLE:		return ctx->handle;
+		case HOSTIO_REG_RESULT_HI:
+		case HOSTIO_REG_RESULT_LO:	return reg_half(ctx->result, reg == HOSTIO_REG_RESULT_HI);
+		default:					return 0;
+	}
+}
+
+void hostio_write_reg(HOSTIO_CTX *ctx, int reg, uint32_t val, int bits)
+{
+	if (bits == 32) {
+		hostio_write_reg(ctx, reg, val >> 16, 16);
+		hostio_write_reg(ctx, reg + 1, val & 0xffff, 16);
+		return;
+	}
+
+	switch (reg) {
+		case HOSTIO_REG_CMD:		run_command(ctx, val);		break;
+		case HOSTIO_REG_ADDR_HI:
+		case HOSTIO_REG_ADDR_LO:	set_half(&ctx->addr, reg == HOSTIO_REG_ADDR_HI, val);		break;
+		case HOSTIO_REG_LEN_HI:
+		case HOSTIO_REG_LEN_LO:		set_half(&ctx->len, reg == HOSTIO_REG_LEN_HI, val);		break;
+		case HOSTIO_REG_OFFSET_HI:
+		case HOSTIO_REG_OFFSET_LO:	set_half(&ctx->offset, reg == HOSTIO_REG_OFFSET_HI, val);	break;
+		case HOSTIO_REG_HANDLE:		ctx->handle = val;			break;
+		default:
+			LOG("write to read-only register %d", reg);
+			break;
+	}
+}
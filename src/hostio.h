@@ -0,0 +1,154 @@
+#ifndef _HOSTIO_H
+#define _HOSTIO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Paravirtual host file transfer device.
+ *
+ * Lets software in the guest read and write files in a host directory
+ * (--host-dir) at memory speed, instead of going through floppy images.
+ * There's no such thing on a real 3B1; it sits in a free slot of the
+ * control register area and isn't decoded at all unless a directory has
+ * been given, so the guest sees the same empty space as before.
+ *
+ * The registers are 16 bits wide, at HOSTIO_BASE + 2 * HOSTIO_REG_xxx
+ * (mirrored at 0xEExxxx and 0xF6xxxx like the rest of the area). The
+ * _HI/_LO pairs can be written or read in one go with a 32-bit access to
+ * the _HI register. A command runs to completion during the write to
+ * HOSTIO_REG_CMD, moving data straight between guest memory and the host
+ * file, so there's no interrupt and nothing to wait for.
+ *
+ * Guest buffers are addressed the way the disc DMA engine addresses them:
+ * through the Map RAM, a page at a time, setting the Page Status bits. The
+ * device runs as a DMA master, so only Supervisor code can use it; a page
+ * which isn't present stops the transfer with HOSTIO_E_FAULT and the
+ * count of bytes moved before it in RESULT, so a driver can fault the page
+ * in and carry on.
+ *
+ * Commands:
+ *
+ *   OPEN_READ		Open the file named by the LEN bytes at ADDR (relative to
+ *   OPEN_WRITE		the host directory, no '..') for reading, or create or
+ *   				truncate it for writing. Sets HANDLE, and RESULT to the
+ *   				file's size. A symlink leading out of the host directory
+ *   				isn't followed (before Linux 5.6, no symlink is).
+ *   READ			Read up to LEN bytes (at most HOSTIO_MAX_XFER) at file
+ *   WRITE			offset OFFSET from file HANDLE into ADDR, or write them
+ *   				from ADDR. RESULT is the number of bytes moved; a short
+ *   				read means the end of the file.
+ *   CLOSE			Close file HANDLE.
+ *
+ * STATUS is HOSTIO_OK or the reason the last command failed. Handles are
+ * host resources, so restoring a snapshot closes them.
+ */
+
+/// Base address of the registers
+#define HOSTIO_BASE			0xE6F000
+/// Value of HOSTIO_REG_ID: "HX"
+#define HOSTIO_ID			0x4858
+/// Files each machine can have open at once
+#define HOSTIO_MAX_FILES	8
+/// Most bytes moved by one READ or WRITE
+#define HOSTIO_MAX_XFER		(256 * 1024)
+/// Longest file name, in bytes
+#define HOSTIO_MAX_PATH		255
+
+/// Registers
+typedef enum {
+	HOSTIO_REG_ID		= 0,	///< Read: HOSTIO_ID
+	HOSTIO_REG_CMD		= 1,	///< Write: command (HOSTIO_CMD_xxx); read: status (HOSTIO_STATUS)
+	HOSTIO_REG_ADDR_HI	= 2,	///< Guest buffer address
+	HOSTIO_REG_ADDR_LO	= 3,
+	HOSTIO_REG_LEN_HI	= 4,	///< Buffer length in bytes
+	HOSTIO_REG_LEN_LO	= 5,
+	HOSTIO_REG_OFFSET_HI	= 6,	///< File offset
+	HOSTIO_REG_OFFSET_LO	= 7,
+	HOSTIO_REG_HANDLE	= 8,	///< File handle
+	HOSTIO_REG_RESULT_HI	= 9,	///< Read only: bytes moved, or file size
+	HOSTIO_REG_RESULT_LO	= 10
+} HOSTIO_REG;
+
+/// Commands
+typedef enum {
+	HOSTIO_CMD_OPEN_READ	= 1,
+	HOSTIO_CMD_OPEN_WRITE	= 2,
+	HOSTIO_CMD_READ			= 3,
+	HOSTIO_CMD_WRITE		= 4,
+	HOSTIO_CMD_CLOSE		= 5
+} HOSTIO_CMD;
+
+/// Command status
+typedef enum {
+	HOSTIO_OK				= 0,	///< Command succeeded
+	HOSTIO_E_BAD_CMD		= 1,	///< Unknown command
+	HOSTIO_E_BAD_PATH		= 2,	///< File name empty, too long, absolute or containing '..'
+	HOSTIO_E_NOT_FOUND		= 3,	///< File couldn't be opened or created
+	HOSTIO_E_NO_HANDLES		= 4,	///< HOSTIO_MAX_FILES files already open
+	HOSTIO_E_BAD_HANDLE		= 5,	///< HANDLE isn't an open file, or not open that way
+	HOSTIO_E_FAULT			= 6,	///< Guest buffer page not present
+	HOSTIO_E_IO				= 7		///< Host read or write failed
+} HOSTIO_STATUS;
+
+/**
+ * @brief Host transfer device state
+ */
+typedef struct {
+	uint32_t	addr;						///< HOSTIO_REG_ADDR
+	uint32_t	len;						///< HOSTIO_REG_LEN
+	uint32_t	offset;						///< HOSTIO_REG_OFFSET
+	uint32_t	result;						///< HOSTIO_REG_RESULT
+	uint16_t	handle;						///< HOSTIO_REG_HANDLE
+	uint16_t	status;						///< Status of the last command
+	int			fd[HOSTIO_MAX_FILES];		///< Host file for each handle, or -1
+	bool		writable[HOSTIO_MAX_FILES];	///< Handle was opened for writing
+} HOSTIO_CTX;
+
+/**
+ * @brief	Choose the host directory, and enable the device.
+ * @param	dir		Directory guest file names are relative to.
+ * @return	true on success, false if the directory can't be opened.
+ *
+ * Shared by every machine in the process.
+ */
+bool hostio_set_root(const char *dir);
+
+/**
+ * @brief	Check whether the device is enabled (hostio_set_root() has been
+ * 			called).
+ */
+bool hostio_enabled(void);
+
+/**
+ * @brief	Initialise the device, with no files open.
+ */
+void hostio_init(HOSTIO_CTX *ctx);
+
+/**
+ * @brief	Close any open files.
+ */
+void hostio_done(HOSTIO_CTX *ctx);
+
+/**
+ * @brief	Forget handles which came from somewhere else (e.g. a snapshot),
+ * 			without closing anything.
+ */
+void hostio_forget(HOSTIO_CTX *ctx);
+
+/**
+ * @brief	Read a register.
+ * @param	reg		Register number (HOSTIO_REG_xxx).
+ * @param	bits	Size of the access: 32 reads a _HI/_LO pair.
+ */
+uint32_t hostio_read_reg(HOSTIO_CTX *ctx, int reg, int bits);
+
+/**
+ * @brief	Write a register, running a command if it's HOSTIO_REG_CMD.
+ * @param	reg		Register number (HOSTIO_REG_xxx).
+ * @param	val		Value.
+ * @param	bits	Size of the access: 32 writes a _HI/_LO pair.
+ */
+void hostio_write_reg(HOSTIO_CTX *ctx, int reg, uint32_t val, int bits);
+
+#endif
@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "input.h"
+
+#ifndef INPUT_DEBUG
+#define NDEBUG
+#endif
+#include "utils.h"
+
+/// Input queue length. Must be a binary power of two.
+#define INPUT_QUEUE_LEN 256
+
+/*
+ * Single-consumer ring. The head is only written by a producer holding
+ * push_lock and the tail only by the consumer; both are free-running and
+ * wrapped on access. Events are rare, so producers just spin on the lock.
+ */
+static INPUT_EVENT queue[INPUT_QUEUE_LEN];
+static uint32_t head = 0, tail = 0;
+static bool push_lock = false;
+
+bool input_push(const INPUT_EVENT *ev)
+{
+	bool ok = false;
+
+	while (__atomic_test_and_set(&push_lock, __ATOMIC_ACQUIRE))
+		;
+
+	uint32_t h = __atomic_load_n(&head, __ATOMIC_RELAXED);
+	if ((h - __atomic_load_n(&tail, __ATOMIC_ACQUIRE)) < INPUT_QUEUE_LEN) {
+		queue[h % INPUT_QUEUE_LEN] = *ev;
+		__atomic_store_n(&head, h + 1, __ATOMIC_RELEASE);
+		ok = true;
+	}
+
+	__atomic_clear(&push_lock, __ATOMIC_RELEASE);
+	LOG_IFS(!ok, "input queue full, event dropped");
+	return ok;
+}
+
+bool input_pop(INPUT_EVENT *ev)
+{
+	uint32_t t = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+
+	if (t == __atomic_load_n(&head, __ATOMIC_ACQUIRE))
+		return false;
+
+	*ev = queue[t % INPUT_QUEUE_LEN];
+	__atomic_store_n(&tail, t + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/********************************************************
+ * Recording
+ ********************************************************/
+
+static FILE *record_fp = NULL;
+
+bool input_record_start(const char *filename)
+{
+	if ((record_fp = fopen(filename, "w")) == NULL)
+		return false;
+	fprintf(record_fp, "# FreeBee input recording\n");
+	return true;
+}
+
+void input_record(const INPUT_EVENT *ev, uint64_t cycle)
+{
+	if (record_fp == NULL)
+		return;
+
+	switch (ev->type) {
+		case INPUT_KEY:
+			fprintf(record_fp, "%llu key %s %d %d\n", (unsigned long long)cycle,
+					(ev->key.type == SDL_KEYDOWN) ? "down" : "up", (int)ev->key.key.keysym.sym, (int)ev->key.key.keysym.mod);
+			break;
+		case INPUT_MOUSE:
+			fprintf(record_fp, "%llu mouse %d %d %d\n", (unsigned long long)cycle, ev->mouse.dx, ev->mouse.dy, ev->mouse.buttons);
+			break;
+		case INPUT_FLOPPY_SWAP:
+			fprintf(record_fp, "%llu floppy\n", (unsigned long long)cycle);
+			break;
+	}
+}
+
+bool input_record_done(uint64_t cycle)
+{
+	if (record_fp == NULL)
+		return true;
+
+	fprintf(record_fp, "%llu end\n", (unsigned long long)cycle);
+	bool ok = !ferror(record_fp);
+	ok = (fclose(record_fp) == 0) && ok;
+	record_fp = NULL;
+	return ok;
+}
+
+/********************************************************
+ * Replay
+ ********************************************************/
+
+static FILE *replay_fp = NULL;
+static int replay_lineno = 0;
+/// Next event, read ahead so its time can be checked
+static INPUT_EVENT replay_ev;
+static uint64_t replay_cycle;
+/// True if replay_ev is valid, false if the next line hasn't been read
+static bool replay_have_ev = false;
+/// True once the end of the recording has been read
+static bool replay_at_end = false;
+
+bool input_replay_start(const char *filename)
+{
+	if ((replay_fp = fopen(filename, "r")) == NULL)
+		return false;
+	replay_lineno = 0;
+	replay_have_ev = replay_at_end = false;
+	return true;
+}
+
+/**
+ * @brief	Read the next event from the recording into replay_ev.
+ *
+ * Sets replay_at_end instead at the end line or the end of the file.
+ */
+static void replay_read(void)
+{
+	char line[128], what[16], dir[8];
+	unsigned long long cycle;
+	int a, b, c;
+
+	while (fgets(line, sizeof(line), replay_fp) != NULL) {
+		replay_lineno++;
+		if ((line[0] == '#') || (line[strspn(line, " \t\r\n")] == '\0'))
+			continue;
+
+		memset(&replay_ev, 0, sizeof(replay_ev));
+		if (sscanf(line, "%llu %15s", &cycle, what) != 2) {
+			fprintf(stderr, "replay:%d: bad line\n", replay_lineno);
+			continue;
+		}
+		replay_cycle = cycle;
+
+		if (strcmp(what, "key") == 0) {
+			if ((sscanf(line, "%*u %*s %7s %d %d", dir, &a, &b) != 3) || ((strcmp(dir, "down") != 0) && (strcmp(dir, "up") != 0))) {
+				fprintf(stderr, "replay:%d: bad key event\n", replay_lineno);
+				continue;
+			}
+			replay_ev.type = INPUT_KEY;
+			replay_ev.key.type = (strcmp(dir, "down") == 0) ? SDL_KEYDOWN : SDL_KEYUP;
+			replay_ev.key.key.keysym.sym = a;
+			replay_ev.key.key.keysym.mod = b;
+		} else if (strcmp(what, "mouse") == 0) {
+			if (sscanf(line, "%*u %*s %d %d %d", &a, &b, &c) != 3) {
+				fprintf(stderr, "replay:%d: bad mouse event\n", replay_lineno);
+				continue;
+			}
+			replay_ev.type = INPUT_MOUSE;
+			replay_ev.mouse.dx = a;
+			replay_ev.mouse.dy = b;
+			replay_ev.mouse.buttons = c;
+		} else if (strcmp(what, "floppy") == 0) {
+			replay_ev.type = INPUT_FLOPPY_SWAP;
+		} else if (strcmp(what, "end") == 0) {
+			replay_at_end = true;
+			return;
+		} else {
+			fprintf(stderr, "replay:%d: unknown event '%s'\n", replay_lineno, what);
+			continue;
+		}
+		replay_have_ev = true;
+		return;
+	}
+
+	// A recording cut short (e.g. by a crash) just ends at its last event
+	replay_cycle = 0;
+	replay_at_end = true;
+}
+
+INPUT_REPLAY input_replay_pop(uint64_t now, INPUT_EVENT *ev)
+{
+	if (replay_fp == NULL)
+		return INPUT_REPLAY_END;
+
+	if (!replay_have_ev && !replay_at_end)
+		replay_read();
+	if (replay_cycle > now)
+		return INPUT_REPLAY_WAIT;
+
+	if (replay_at_end) {
+		LOG("replay finished at line %d, cycle %llu", replay_lineno, (unsigned long long)now);
+		fclose(replay_fp);
+		replay_fp = NULL;
+		return INPUT_REPLAY_END;
+	}
+	*ev = replay_ev;
+	replay_have_ev = false;
+	return INPUT_REPLAY_EVENT;
+}
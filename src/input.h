@@ -0,0 +1,111 @@
+#ifndef _INPUT_H
+#define _INPUT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "SDL.h"
+
+/**
+ * Input event types passed from the display thread to the emulation thread
+ */
+typedef enum {
+	INPUT_KEY,				///< Key press or release
+	INPUT_MOUSE,			///< Mouse movement and/or button change
+	INPUT_FLOPPY_SWAP		///< Load or unload the floppy disc image
+} INPUT_TYPE;
+
+/**
+ * An input event
+ */
+typedef struct {
+	INPUT_TYPE	type;
+	SDL_Event	key;		///< INPUT_KEY: the SDL keyboard event
+	struct {
+		int dx, dy;			///< Relative motion
+		int buttons;		///< MOUSE_BUTTON_* bitmap
+	} mouse;				///< INPUT_MOUSE: mouse state
+} INPUT_EVENT;
+
+/**
+ * @brief	Queue an input event for the emulation thread.
+ * @param	ev		Event to queue.
+ * @return	true on success, false if the queue is full (the event is dropped).
+ *
+ * May be called from any thread (the display thread and the VNC server).
+ */
+bool input_push(const INPUT_EVENT *ev);
+
+/**
+ * @brief	Take the oldest event off the input queue.
+ * @param	ev		Buffer for the event.
+ * @return	true if an event was returned, false if the queue is empty.
+ *
+ * Must only be called from one thread (the emulation thread).
+ */
+bool input_pop(INPUT_EVENT *ev);
+
+/**
+ * Input recording and replay.
+ *
+ * A recording is a text file with one event per line, each stamped with the
+ * primary machine's emulated time (sched_now()) when it was applied:
+ *
+ *   CYCLE key down|up SYM MOD	Key event (SDLKey and SDLMod numbers)
+ *   CYCLE mouse DX DY BUTTONS	Mouse movement and/or button change
+ *   CYCLE floppy				Floppy disc swap (F11)
+ *   CYCLE end					End of the recording
+ *
+ * Lines starting with '#' are comments. Input is applied at timeslot
+ * boundaries, which fall on the same cycles every run, so replaying a
+ * recording from the same starting point (a fresh boot or the same
+ * snapshot, and the same disc images) gives the same run.
+ */
+
+/**
+ * @brief	Start recording input.
+ * @param	filename	Recording to write. Replaced if it exists.
+ * @return	true on success.
+ */
+bool input_record_start(const char *filename);
+
+/**
+ * @brief	Add an event to the recording. Does nothing if not recording.
+ * @param	ev		Event being applied.
+ * @param	cycle	Emulated time it is being applied at.
+ */
+void input_record(const INPUT_EVENT *ev, uint64_t cycle);
+
+/**
+ * @brief	Finish the recording. Does nothing if not recording.
+ * @param	cycle	Emulated time the run ended at.
+ * @return	true if the recording was written successfully.
+ */
+bool input_record_done(uint64_t cycle);
+
+/// Result of input_replay_pop()
+typedef enum {
+	INPUT_REPLAY_WAIT,		///< Nothing due yet
+	INPUT_REPLAY_EVENT,		///< An event is due
+	INPUT_REPLAY_END		///< The recording has run out
+} INPUT_REPLAY;
+
+/**
+ * @brief	Start replaying a recording.
+ * @param	filename	Recording to read.
+ * @return	true on success.
+ */
+bool input_replay_start(const char *filename);
+
+/**
+ * @brief	Get the next recorded event which is due.
+ * @param	now		Current emulated time.
+ * @param	ev		Buffer for the event.
+ * @return	INPUT_REPLAY_EVENT if ev is due at or before now.
+ *
+ * Events are returned in order; call again until the result isn't
+ * INPUT_REPLAY_EVENT. Once INPUT_REPLAY_END has been returned the recording
+ * is closed.
+ */
+INPUT_REPLAY input_replay_pop(uint64_t now, INPUT_EVENT *ev);
+
+#endif
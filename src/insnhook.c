@@ -0,0 +1,62 @@
+#include <stdbool.h>
+#include "musashi/m68k.h"
+#include "state.h"
+#include "insnhook.h"
+
+#ifndef INSNHOOK_DEBUG
+#define NDEBUG
+#endif
+#include "utils.h"
+
+/**
+ * @brief	Musashi instruction hook: call everything added for the machine.
+ *
+ * Goes from the last function to the first, so one which removes itself
+ * doesn't make the next one be skipped.
+ */
+static void dispatch(unsigned int pc)
+{
+	INSN_HOOKS *h = &state->insn_hooks;
+
+	for (int i = h->count - 1; i >= 0; i--)
+		h->fn[i](pc);
+}
+
+bool insn_hook_add(INSN_HOOK_FN fn)
+{
+#if M68K_INSTRUCTION_HOOK != OPT_ON
+	(void)fn;
+	return false;
+#else
+	INSN_HOOKS *h = &state->insn_hooks;
+
+	for (int i = 0; i < h->count; i++)
+		if (h->fn[i] == fn)
+			return true;
+	if (h->count >= INSN_HOOK_MAX)
+		return false;
+	h->fn[h->count++] = fn;
+	insn_hook_install();
+	return true;
+#endif
+}
+
+void insn_hook_remove(INSN_HOOK_FN fn)
+{
+	INSN_HOOKS *h = &state->insn_hooks;
+
+	for (int i = 0; i < h->count; i++) {
+		if (h->fn[i] == fn) {
+			for (h->count--; i < h->count; i++)
+				h->fn[i] = h->fn[i + 1];
+			break;
+		}
+	}
+	insn_hook_install();
+}
+
+void insn_hook_install(void)
+{
+	// With nothing to call, leave the core its own empty hook
+	m68k_set_instr_hook_callback((state->insn_hooks.count > 0) ? dispatch : NULL);
+}
@@ -0,0 +1,52 @@
+#ifndef _INSNHOOK_H
+#define _INSNHOOK_H
+
+#include <stdbool.h>
+
+/**
+ * Musashi instruction hook, shared by everything which wants it.
+ *
+ * The CPU core has a single instruction hook, so it is given one dispatcher
+ * which calls each function added for the current machine in turn. Built
+ * in only with 'make ENABLE_INSN_HOOK=yes' (see musashi_conf.h), since the
+ * core then makes a call before every instruction whether or not anything
+ * is listening.
+ */
+
+/// Most functions one machine's hook can call
+#define INSN_HOOK_MAX		4
+
+/// Called with the address of each instruction before it's executed
+typedef void (*INSN_HOOK_FN)(unsigned int pc);
+
+/// Functions the current machine's hook calls
+typedef struct {
+	INSN_HOOK_FN	fn[INSN_HOOK_MAX];
+	int				count;
+} INSN_HOOKS;
+
+/**
+ * @brief	Call a function before every instruction the current machine
+ * 			executes.
+ * @param	fn		Function. Adding the same one twice does nothing.
+ * @return	true on success, false if the CPU core was built without the
+ * 			instruction hook or INSN_HOOK_MAX functions are already added.
+ */
+bool insn_hook_add(INSN_HOOK_FN fn);
+
+/**
+ * @brief	Stop calling a function added with insn_hook_add().
+ *
+ * A function may remove itself while it's being called.
+ */
+void insn_hook_remove(INSN_HOOK_FN fn);
+
+/**
+ * @brief	Give the CPU core the current machine's hook again.
+ *
+ * Call after replacing the CPU context from somewhere else (a snapshot),
+ * since the hook pointer in it belongs to the process which saved it.
+ */
+void insn_hook_install(void);
+
+#endif
@@ -0,0 +1,99 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include "musashi/m68k.h"
+#include "state.h"
+#include "irq.h"
+
+#ifndef IRQ_DEBUG
+#define NDEBUG
+#endif
+#include "utils.h"
+
+/// Interrupt level of each line
+static const int line_level[IRQ_COUNT] = {
+	[IRQ_FDC]	= 2,
+	[IRQ_HDC]	= 2,
+	[IRQ_KBD]	= 3,
+	[IRQ_TIMER]	= 6
+};
+
+/**
+ * Work out the highest interrupt level being asserted and pass it on to the
+ * CPU if it's changed.
+ */
+static void update(IRQ_CTX *ctx)
+{
+	uint32_t active = ctx->pending & ctx->enabled;
+	int level = 0;
+
+	for (int i = 0; active != 0; i++, active >>= 1)
+		if ((active & 1) && (line_level[i] > level))
+			level = line_level[i];
+
+	if (level == ctx->level)
+		return;
+
+	LOG("level %d -> %d", ctx->level, level);
+	ctx->level = level;
+	m68k_set_irq(level);
+	sched_sync();
+}
+
+void irq_init(IRQ_CTX *ctx)
+{
+	ctx->pending = 0;
+	ctx->enabled = (1u << IRQ_COUNT) - 1;
+	ctx->level = 0;
+	ctx->nmi = false;
+}
+
+void irq_set(IRQ_LINE line, bool asserted)
+{
+	uint32_t pending = state->irq.pending;
+
+	if (asserted)
+		pending |= 1u << line;
+	else
+		pending &= ~(1u << line);
+	if (pending == state->irq.pending)
+		return;
+
+	state->irq.pending = pending;
+	update(&state->irq);
+}
+
+void irq_set_enabled(IRQ_LINE line, bool enabled)
+{
+	uint32_t mask = state->irq.enabled;
+
+	if (enabled)
+		mask |= 1u << line;
+	else
+		mask &= ~(1u << line);
+	if (mask == state->irq.enabled)
+		return;
+
+	state->irq.enabled = mask;
+	update(&state->irq);
+}
+
+bool irq_asserted(IRQ_LINE line)
+{
+	return (state->irq.pending & (1u << line)) != 0;
+}
+
+bool irq_wakes_cpu(int mask)
+{
+	if (state->irq.nmi) {
+		state->irq.nmi = false;
+		return true;
+	}
+	return state->irq.level > mask;
+}
+
+void irq_nmi(void)
+{
+	m68k_set_irq(7);
+	m68k_set_irq(state->irq.level);
+	state->irq.nmi = true;
+}
@@ -0,0 +1,77 @@
+#ifndef _IRQ_H
+#define _IRQ_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Interrupt sources. Each is a line into the interrupt controller, which
+ * the device raises and lowers as its state changes.
+ */
+typedef enum {
+	IRQ_FDC,			///< WD2797 floppy disc controller -- level 2
+	IRQ_HDC,			///< WD2010 hard disc controller -- level 2
+	IRQ_KBD,			///< Keyboard ACIA -- level 3
+	IRQ_TIMER,			///< 60Hz timer -- level 6
+	IRQ_COUNT			///< Number of lines (not a line)
+} IRQ_LINE;
+
+/**
+ * @brief Interrupt controller state
+ */
+typedef struct {
+	uint32_t	pending;		///< Lines being asserted, one bit each
+	uint32_t	enabled;		///< Lines which aren't masked, one bit each
+	int			level;			///< Interrupt level the CPU was last given
+	bool		nmi;			///< A level 7 pulse the CPU may not have taken yet
+} IRQ_CTX;
+
+/**
+ * @brief	Initialise the interrupt controller. No lines are asserted and
+ * 			none are masked afterwards.
+ */
+void irq_init(IRQ_CTX *ctx);
+
+/**
+ * @brief	Raise or lower an interrupt line.
+ * @param	line		Line.
+ * @param	asserted	true to raise the line, false to lower it.
+ *
+ * The CPU's interrupt level is only changed if the highest unmasked level
+ * being asserted changes. If that happens during a CPU burst, the burst is
+ * ended so the scheduler gets to look at the machine straight away.
+ */
+void irq_set(IRQ_LINE line, bool asserted);
+
+/**
+ * @brief	Mask or unmask an interrupt line.
+ * @param	line		Line.
+ * @param	enabled		false to mask the line.
+ *
+ * A masked line can still be raised and lowered; it just doesn't interrupt
+ * the CPU until it's unmasked.
+ */
+void irq_set_enabled(IRQ_LINE line, bool enabled);
+
+/**
+ * @brief	Check whether a line is being asserted, whether or not it's
+ * 			masked.
+ */
+bool irq_asserted(IRQ_LINE line);
+
+/**
+ * @brief	Check whether the CPU would take an interrupt if it ran now.
+ * @param	mask	The CPU's interrupt priority mask (SR bits 8 to 10).
+ *
+ * Forgets any level 7 pulse, so only call this just before running the CPU.
+ */
+bool irq_wakes_cpu(int mask);
+
+/**
+ * @brief	Give the CPU a level 7 (non-maskable) interrupt.
+ *
+ * Level 7 is edge-triggered, so this is a pulse rather than a line.
+ */
+void irq_nmi(void);
+
+#endif
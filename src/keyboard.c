@@ -2,6 +2,7 @@
 #include "SDL.h"
 #include "utils.h"
 #include "keyboard.h"
+#include "irq.h"
 
 // Enable/disable KBC debugging
 #define kbc_debug false
@@ -155,6 +156,13 @@ enum {
 	KEY_CMD_MOUSE_DISABLE	= 0xD1		///< Disable mouse
 };
 
+/// Pass the keyboard's interrupt status on to the interrupt controller.
+/// Called whenever something it depends on changes.
+static void update_irq(KEYBOARD_STATE *ks)
+{
+	irq_set(IRQ_KBD, keyboard_get_irq(ks));
+}
+
 void keyboard_init(KEYBOARD_STATE *ks)
 {
 	// Set all key states to "not pressed"
@@ -170,6 +178,7 @@ void keyboard_init(KEYBOARD_STATE *ks)
 
 	ks->mouse_enabled = 0;
 	ks->lastdata_mouse = 0;
+	update_irq(ks);
 }
 
 void keyboard_event(KEYBOARD_STATE *ks, SDL_Event *ev)
@@ -253,6 +262,7 @@ bool mouse_event(KEYBOARD_STATE *ks, int dx, int dy, int db)
 	if (ks->buflen < KEYBOARD_BUFFER_SIZE) ks->buflen++;
 
 	ks->lastdata_mouse = 1;
+	update_irq(ks);
 	return 1;
 }
 
@@ -297,6 +307,7 @@ void keyboard_scan(KEYBOARD_STATE *ks)
 
 	// Clear the update flag
 	ks->update_flag = false;
+	update_irq(ks);
 }
 
 bool keyboard_get_irq(KEYBOARD_STATE *ks)
@@ -338,6 +349,7 @@ uint8_t keyboard_read(KEYBOARD_STATE *ks, uint8_t addr)
 		uint8_t x = ks->buffer[ks->readp];
 		ks->readp = (ks->readp + 1) % KEYBOARD_BUFFER_SIZE;
 		if (ks->buflen > 0) ks->buflen--;
+		update_irq(ks);
 		//LOG_IF(kbc_debug, "\tKBC DBG: rxd=%02X\n", x);
 		return x;
 	}
@@ -375,5 +387,6 @@ void keyboard_write(KEYBOARD_STATE *ks, uint8_t addr, uint8_t val)
 			LOG("KBC TODO: write keyboard data 0x%02X\n", val);
 		}
 	}
+	update_irq(ks);
 }
 
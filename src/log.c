@@ -0,0 +1,463 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include "SDL.h"
+#include "log.h"
+
+/// Number of records in the ring (a power of two)
+#define LOG_RING_SIZE		4096
+/// Bytes in each record for copies of string arguments
+#define LOG_STR_BYTES		96
+/// Most category names in a filter
+#define LOG_MAX_FILTERS		32
+/// Longest category name
+#define LOG_CATEGORY_MAX	24
+/// How long the background thread sleeps when there's nothing to write, ms
+#define LOG_IDLE_MS			10
+
+/// Argument types
+enum {
+	ARG_INT,				///< int, or anything promoted to it
+	ARG_LONG,
+	ARG_LLONG,
+	ARG_SIZE,				///< size_t (%zu)
+	ARG_INTMAX,
+	ARG_PTRDIFF,
+	ARG_PTR,
+	ARG_DOUBLE,
+	ARG_STR					///< String, copied into the record
+};
+
+/// A log message waiting to be written
+typedef struct {
+	uint32_t		seq;					///< Ring slot sequence number
+	const LOG_SITE	*site;
+	uint32_t		suppressed;				///< Messages from this site dropped before this one
+	union {
+		long long	i;
+		double		d;
+		const void	*p;
+		size_t		s;						///< Offset into str[] for ARG_STR
+	} arg[LOG_MAX_ARGS];
+	char			str[LOG_STR_BYTES];
+} LOG_RECORD;
+
+static LOG_RECORD ring[LOG_RING_SIZE];
+/// Next slot to write and next slot to read
+static uint32_t ring_head = 0, ring_tail = 0;
+/// Messages lost because the ring was full
+static uint32_t ring_dropped = 0;
+
+static SDL_Thread *writer = NULL;
+static bool writer_stop = false;
+
+/// Messages per second per site, 0 for no limit
+static uint32_t rate_limit = 100;
+
+/// Category filter, applied in order; each site looks it up again when the
+/// generation number changes
+static struct {
+	char	name[LOG_CATEGORY_MAX];			///< Empty for "all" or "none"
+	bool	on;
+} filters[LOG_MAX_FILTERS];
+static int nfilters = 0;
+static uint32_t filter_gen = 1;
+static SDL_mutex *filter_lock = NULL;
+
+/********************************************************
+ * Formats
+ ********************************************************/
+
+/**
+ * @brief	Find the next conversion in a format.
+ * @param	p		Where to start looking.
+ * @param	len		Set to the length of the conversion spec.
+ * @return	The '%' starting the conversion, or NULL at the end of the format.
+ *
+ * "%%" is left in the literal text.
+ */
+static const char *next_conversion(const char *p, size_t *len)
+{
+	for (; (p = strchr(p, '%')) != NULL; p += 2) {
+		if (p[1] == '%')
+			continue;
+		size_t n = 1 + strspn(p + 1, "-+ #0123456789.*");
+		n += strspn(p + n, "hljztL");
+		if (p[n] != '\0')
+			n++;
+		*len = n;
+		return p;
+	}
+	return NULL;
+}
+
+/**
+ * @brief	Work out the argument types for a site's format.
+ */
+static void parse_format(LOG_SITE *site)
+{
+	const char *p = site->fmt;
+	size_t len;
+	int n = 0;
+
+	while ((p = next_conversion(p, &len)) != NULL) {
+		char conv = p[len - 1];
+		const char *mod = p + strspn(p + 1, "-+ #0123456789.*") + 1;
+		uint8_t type;
+
+		// '*' widths and precisions take an int each
+		for (size_t i = 1; i < len; i++)
+			if ((p[i] == '*') && (n < LOG_MAX_ARGS))
+				site->types[n++] = ARG_INT;
+
+		if (strchr("diouxXc", conv) != NULL) {
+			if (strncmp(mod, "ll", 2) == 0)			type = ARG_LLONG;
+			else if (*mod == 'l')					type = ARG_LONG;
+			else if (*mod == 'z')					type = ARG_SIZE;
+			else if (*mod == 'j')					type = ARG_INTMAX;
+			else if (*mod == 't')					type = ARG_PTRDIFF;
+			else									type = ARG_INT;
+		} else if (strchr("eEfFgGaA", conv) != NULL) {
+			type = ARG_DOUBLE;
+		} else if (conv == 's') {
+			type = ARG_STR;
+		} else {
+			type = ARG_PTR;
+		}
+		if (n < LOG_MAX_ARGS)
+			site->types[n++] = type;
+		p += len;
+	}
+	site->nargs = n;
+}
+
+/**
+ * @brief	Format a record and write it out.
+ */
+static void write_record(const LOG_RECORD *r)
+{
+	const LOG_SITE *site = r->site;
+	char spec[32];
+	const char *p = site->fmt;
+	int arg = 0;
+
+	if (site->flags & LOG_F_WHERE)
+		fprintf(stderr, "%s:%d:%s(): ", site->file, site->line, site->func);
+
+	for (;;) {
+		size_t len;
+		const char *conv = next_conversion(p, &len);
+
+		// Literal text, with "%%" turned back into '%'
+		for (const char *end = conv ? conv : p + strlen(p); p < end; p++) {
+			fputc(*p, stderr);
+			if ((p[0] == '%') && (p[1] == '%'))
+				p++;
+		}
+		if (conv == NULL)
+			break;
+
+		// Print this conversion on its own, with its '*' arguments
+		if (len >= sizeof(spec))
+			len = sizeof(spec) - 1;
+		memcpy(spec, conv, len);
+		spec[len] = '\0';
+		p = conv + len;
+
+		int star[2], nstar = 0;
+		for (size_t i = 1; i < len; i++)
+			if ((spec[i] == '*') && (nstar < 2) && (arg < site->nargs))
+				star[nstar++] = (int)r->arg[arg++].i;
+		if (arg >= site->nargs)
+			break;
+
+#define PRINT_ARG(value)									\
+		do {												\
+			if (nstar == 2)									\
+				fprintf(stderr, spec, star[0], star[1], value);	\
+			else if (nstar == 1)							\
+				fprintf(stderr, spec, star[0], value);		\
+			else											\
+				fprintf(stderr, spec, value);				\
+		} while (0)
+
+		switch (site->types[arg]) {
+			case ARG_INT:		PRINT_ARG((int)r->arg[arg].i);			break;
+			case ARG_LONG:		PRINT_ARG((long)r->arg[arg].i);			break;
+			case ARG_LLONG:		PRINT_ARG(r->arg[arg].i);				break;
+			case ARG_SIZE:		PRINT_ARG((size_t)r->arg[arg].i);		break;
+			case ARG_INTMAX:	PRINT_ARG((intmax_t)r->arg[arg].i);		break;
+			case ARG_PTRDIFF:	PRINT_ARG((ptrdiff_t)r->arg[arg].i);	break;
+			case ARG_DOUBLE:	PRINT_ARG(r->arg[arg].d);				break;
+			case ARG_STR:		PRINT_ARG(&r->str[r->arg[arg].s]);		break;
+			default:			PRINT_ARG(r->arg[arg].p);				break;
+		}
+#undef PRINT_ARG
+		arg++;
+	}
+	fputc('\n', stderr);
+
+	if (r->suppressed > 0)
+		fprintf(stderr, "[log] %u similar message%s suppressed\n", r->suppressed, (r->suppressed == 1) ? "" : "s");
+}
+
+/********************************************************
+ * Filters
+ ********************************************************/
+
+/**
+ * @brief	Check whether a site's category is switched on.
+ */
+static bool site_enabled(const LOG_SITE *site)
+{
+	// The category is the file name without the directory or extension
+	const char *cat = strrchr(site->file, '/');
+	cat = cat ? cat + 1 : site->file;
+	size_t catlen = strcspn(cat, ".");
+
+	bool on = true;
+	if (filter_lock)
+		SDL_mutexP(filter_lock);
+	for (int i = 0; i < nfilters; i++) {
+		if ((filters[i].name[0] == '\0') ||
+				((strlen(filters[i].name) == catlen) && (strncmp(filters[i].name, cat, catlen) == 0)))
+			on = filters[i].on;
+	}
+	if (filter_lock)
+		SDL_mutexV(filter_lock);
+	return on;
+}
+
+bool log_set_filter(const char *spec)
+{
+	bool ok = true;
+
+	if (filter_lock)
+		SDL_mutexP(filter_lock);
+	nfilters = 0;
+	while (*spec != '\0') {
+		size_t field = strcspn(spec, ","), len = field;
+		const char *name = spec;
+		bool on = true;
+
+		if ((len > 0) && (*name == '-')) {
+			name++;
+			len--;
+			on = false;
+		}
+		if ((len == 3) && (strncmp(name, "all", 3) == 0)) {
+			len = 0;
+		} else if ((len == 4) && (strncmp(name, "none", 4) == 0)) {
+			len = 0;
+			on = false;
+		}
+
+		if (nfilters == LOG_MAX_FILTERS) {
+			ok = false;
+		} else if (len < LOG_CATEGORY_MAX) {
+			memcpy(filters[nfilters].name, name, len);
+			filters[nfilters].name[len] = '\0';
+			filters[nfilters].on = on;
+			nfilters++;
+		}
+
+		spec += field;
+		if (*spec == ',')
+			spec++;
+	}
+	__atomic_add_fetch(&filter_gen, 1, __ATOMIC_RELEASE);
+	if (filter_lock)
+		SDL_mutexV(filter_lock);
+	return ok;
+}
+
+void log_set_rate(uint32_t per_sec)
+{
+	__atomic_store_n(&rate_limit, per_sec, __ATOMIC_RELAXED);
+}
+
+/********************************************************
+ * Writing messages
+ ********************************************************/
+
+void log_write(LOG_SITE *site, ...)
+{
+	// Work out the argument types the first time through. Two threads may
+	// do it at once, but they come up with the same answer.
+	if (!__atomic_load_n(&site->ready, __ATOMIC_ACQUIRE)) {
+		parse_format(site);
+		__atomic_store_n(&site->ready, 1, __ATOMIC_RELEASE);
+	}
+
+	// Is this category wanted?
+	uint32_t gen = __atomic_load_n(&filter_gen, __ATOMIC_ACQUIRE);
+	if (site->filter_gen != gen) {
+		site->enabled = site_enabled(site);
+		site->filter_gen = gen;
+	}
+	if (!site->enabled)
+		return;
+
+	// Rate limit. Racing threads may let one or two extra through.
+	uint32_t limit = __atomic_load_n(&rate_limit, __ATOMIC_RELAXED);
+	if (limit > 0) {
+		uint32_t now = SDL_GetTicks() / 1000;
+		if (__atomic_load_n(&site->window, __ATOMIC_RELAXED) != now) {
+			__atomic_store_n(&site->window, now, __ATOMIC_RELAXED);
+			__atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+		}
+		if (__atomic_fetch_add(&site->count, 1, __ATOMIC_RELAXED) >= limit) {
+			__atomic_fetch_add(&site->suppressed, 1, __ATOMIC_RELAXED);
+			return;
+		}
+	}
+
+	// Claim a slot. Each slot's sequence number says whose turn it is: equal
+	// to the position when it's free for that writer, one more once it has
+	// been filled in.
+	LOG_RECORD local, *r = &local;
+	uint32_t pos = 0;
+	bool async = __atomic_load_n(&writer, __ATOMIC_ACQUIRE) != NULL;
+	if (async) {
+		pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+		for (;;) {
+			r = &ring[pos & (LOG_RING_SIZE - 1)];
+			int32_t diff = (int32_t)(__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) - pos);
+			if (diff == 0) {
+				if (__atomic_compare_exchange_n(&ring_head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+					break;
+			} else if (diff < 0) {
+				// Full -- the writer thread has fallen behind
+				__atomic_fetch_add(&ring_dropped, 1, __ATOMIC_RELAXED);
+				return;
+			} else {
+				pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+			}
+		}
+	}
+
+	// Copy the arguments in
+	va_list ap;
+	size_t str_used = 0;
+	va_start(ap, site);
+	for (int i = 0; i < site->nargs; i++) {
+		switch (site->types[i]) {
+			case ARG_INT:		r->arg[i].i = va_arg(ap, int);			break;
+			case ARG_LONG:		r->arg[i].i = va_arg(ap, long);			break;
+			case ARG_LLONG:		r->arg[i].i = va_arg(ap, long long);	break;
+			case ARG_SIZE:		r->arg[i].i = va_arg(ap, size_t);		break;
+			case ARG_INTMAX:	r->arg[i].i = va_arg(ap, intmax_t);		break;
+			case ARG_PTRDIFF:	r->arg[i].i = va_arg(ap, ptrdiff_t);	break;
+			case ARG_DOUBLE:	r->arg[i].d = va_arg(ap, double);		break;
+			case ARG_STR: {
+				// Strings may not outlive the call, so keep a copy (cut
+				// short if there isn't room)
+				const char *s = va_arg(ap, const char *);
+				if (s == NULL)
+					s = "(null)";
+				size_t n = strlen(s);
+				if (n > LOG_STR_BYTES - 1 - str_used)
+					n = LOG_STR_BYTES - 1 - str_used;
+				memcpy(&r->str[str_used], s, n);
+				r->str[str_used + n] = '\0';
+				r->arg[i].s = str_used;
+				// Once the buffer is full, later strings share the last NUL
+				str_used += n;
+				if (str_used < LOG_STR_BYTES - 1)
+					str_used++;
+				break;
+			}
+			default:			r->arg[i].p = va_arg(ap, void *);		break;
+		}
+	}
+	va_end(ap);
+	r->site = site;
+	r->suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+
+	if (async)
+		__atomic_store_n(&r->seq, pos + 1, __ATOMIC_RELEASE);
+	else
+		write_record(r);
+}
+
+/**
+ * @brief	Write out every message in the ring.
+ * @return	Number of messages written.
+ */
+static int drain(void)
+{
+	int n = 0;
+
+	for (;;) {
+		LOG_RECORD *r = &ring[ring_tail & (LOG_RING_SIZE - 1)];
+		if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != ring_tail + 1)
+			break;
+		write_record(r);
+		// Hand the slot back for the writer which will go round next time
+		__atomic_store_n(&r->seq, ring_tail + LOG_RING_SIZE, __ATOMIC_RELEASE);
+		ring_tail++;
+		n++;
+	}
+
+	uint32_t dropped = __atomic_exchange_n(&ring_dropped, 0, __ATOMIC_RELAXED);
+	if (dropped > 0)
+		fprintf(stderr, "[log] %u message%s lost, the log couldn't keep up\n", dropped, (dropped == 1) ? "" : "s");
+	if ((n > 0) || (dropped > 0))
+		fflush(stderr);
+	return n;
+}
+
+/**
+ * @brief	Background thread: write messages out as they arrive.
+ */
+static int writer_thread(void *arg)
+{
+	(void)arg;
+
+	while (!__atomic_load_n(&writer_stop, __ATOMIC_ACQUIRE)) {
+		if (drain() == 0)
+			SDL_Delay(LOG_IDLE_MS);
+	}
+	return 0;
+}
+
+bool log_init(void)
+{
+	if (writer != NULL)
+		return true;
+
+	if ((filter_lock == NULL) && ((filter_lock = SDL_CreateMutex()) == NULL))
+		return false;
+
+	for (uint32_t i = 0; i < LOG_RING_SIZE; i++)
+		ring[i].seq = i;
+	ring_head = ring_tail = 0;
+	writer_stop = false;
+
+	SDL_Thread *t = SDL_CreateThread(writer_thread, NULL);
+	if (t == NULL) {
+		fprintf(stderr, "ERROR: Could not start the log thread: %s.\n", SDL_GetError());
+		return false;
+	}
+	__atomic_store_n(&writer, t, __ATOMIC_RELEASE);
+	return true;
+}
+
+void log_done(void)
+{
+	SDL_Thread *t = __atomic_exchange_n(&writer, NULL, __ATOMIC_ACQ_REL);
+	if (t == NULL)
+		return;
+
+	// New messages are written straight away from here on. Any writer
+	// which claimed a slot just before finishes filling it in while the
+	// thread winds down, and the last drain picks it up.
+	__atomic_store_n(&writer_stop, true, __ATOMIC_RELEASE);
+	SDL_WaitThread(t, NULL);
+	SDL_Delay(1);
+	drain();
+}
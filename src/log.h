@@ -0,0 +1,97 @@
+#ifndef _LOG_H
+#define _LOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Asynchronous logger.
+ *
+ * Calls to LOG() and friends (see utils.h) don't format anything. They copy
+ * their arguments into a fixed-size record on a lock-free ring, and a
+ * background thread formats and writes them out. That makes logging cheap
+ * enough to leave on in hot paths.
+ *
+ * Each call site (LOG_SITE) is rate-limited to so many messages a second;
+ * anything over the limit is counted, and the count is reported with the
+ * next message from that site which gets through. Sites can be switched on
+ * and off at run time by category, which is the name of the source file
+ * they're in without the extension (e.g. "memory" or "wd2010").
+ *
+ * Until log_init() has been called (and after log_done()), messages are
+ * formatted and written straight away.
+ */
+
+/// Most arguments a log message can have; any more are ignored
+#define LOG_MAX_ARGS		8
+
+/// Site flags
+enum {
+	LOG_F_WHERE		= 0x01		///< Prefix the message with the file, line and function
+};
+
+/**
+ * @brief	A place in the code which writes log messages.
+ *
+ * Declared (static) by the LOG macros; the fields after flags are filled in
+ * by the logger.
+ */
+typedef struct {
+	const char	*file;
+	int			line;
+	const char	*func;
+	const char	*fmt;					///< printf-style format
+	uint8_t		flags;					///< LOG_F_xxx
+	// Worked out from the format on first use
+	uint32_t	ready;					///< Nonzero once nargs and types are valid
+	uint8_t		nargs;
+	uint8_t		types[LOG_MAX_ARGS];
+	// Category filter
+	uint32_t	filter_gen;				///< Filter generation 'enabled' was worked out for
+	bool		enabled;
+	// Rate limiting
+	uint32_t	window;					///< Second the count is for
+	uint32_t	count;					///< Messages written in that second
+	uint32_t	suppressed;				///< Messages dropped since the last one written
+} LOG_SITE;
+
+/**
+ * @brief	Write a log message.
+ * @param	site	Call site, giving the format.
+ *
+ * Use the LOG macros rather than calling this.
+ */
+void log_write(LOG_SITE *site, ...);
+
+/**
+ * @brief	Start the background thread which writes log messages out.
+ * @return	true on success; on failure messages carry on being written
+ * 			straight away.
+ */
+bool log_init(void);
+
+/**
+ * @brief	Write any messages still waiting, and stop the background thread.
+ *
+ * Safe to call more than once, e.g. from atexit().
+ */
+void log_done(void);
+
+/**
+ * @brief	Choose which categories are logged.
+ * @param	spec	Comma-separated list, applied in order: "all", "none", a
+ * 					category name to switch it on, or a category name with
+ * 					'-' in front to switch it off. E.g. "none,wd2010" or
+ * 					"all,-memory". Everything is logged by default.
+ * @return	false if the list had too many names in it.
+ */
+bool log_set_filter(const char *spec);
+
+/**
+ * @brief	Set the rate limit.
+ * @param	per_sec		Most messages each call site may write in a second,
+ * 						or 0 for no limit. The default is 100.
+ */
+void log_set_rate(uint32_t per_sec);
+
+#endif
@@ -4,6 +4,10 @@
 #include <stdbool.h>
 #include <malloc.h>
 #include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
 
 #include "SDL.h"
 
@@ -11,9 +15,101 @@
 #include "version.h"
 #include "state.h"
 #include "memory.h"
+#include "utils.h"
+#include "video.h"
+#include "input.h"
+#include "script.h"
+#include "sched.h"
+#include "irq.h"
+#include "overlay.h"
+#include "zimage.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "profile.h"
+#include "bench.h"
+#include "log.h"
+#include "trace.h"
+#include "vnc.h"
+#include "hostio.h"
 
 extern int cpu_log_enabled;
 
+/// Set by the display thread to tell the emulation thread to stop
+static bool exit_requested = false;
+
+/// Run without a display (--headless)
+static bool headless = false;
+/// Input script (--script), or NULL
+static const char *script_file = NULL;
+/// Screen dump to write on exit (--dump), or NULL
+static const char *dump_file = NULL;
+/// Emulation speed as a multiple of real time (--speed), or 0 for unthrottled (--turbo)
+static double emu_speed = 1.0;
+/// Achieved emulated CPU clock in kHz, updated about once a second
+static uint32_t emu_khz = 0;
+/// Memory-map the hard disc image (--mmap-hd), and when to write it back
+static bool hd_mmap = false;
+static WD2010_SYNC hd_sync = WD2010_SYNC_COMMAND;
+/// Dirty bytes limit for the hard disc write-back cache (--hd-cache), 0 for no cache
+static size_t hd_cache_limit = 0;
+/// Compress a disc image and exit (--compress-image)
+static bool compress_image = false;
+/// Copy-on-write overlays for the hard and floppy disc images (--hd-overlay, --fd-overlay), or NULL
+static const char *hd_overlay = NULL;
+static const char *fd_overlay = NULL;
+/// Floppy disc images (--floppy), cycled through with F11
+static const char **fd_images = NULL;
+static int fd_nimages = 0;
+/// Snapshots to restore at startup (--load-state) and save on exit (--save-state), or NULL
+static const char *load_state_file = NULL;
+static const char *save_state_file = NULL;
+/// Checkpoint file (--checkpoint), or NULL, and how often to write it (--checkpoint-interval)
+static const char *checkpoint_file = NULL;
+static uint32_t checkpoint_secs = 10;
+/// Resume from the last checkpoint in this file at startup (--resume), or NULL
+static const char *resume_file = NULL;
+/// Machines to run (--instances). The first is the primary machine, which
+/// owns the display, the input devices and the floppy discs.
+static S_state **machines = NULL;
+static int nmachines = 1;
+/// Write the instrumentation counters here on exit (--stats), or NULL
+static const char *stats_file = NULL;
+/// Write a guest profile here on exit (--profile), or NULL, and how to take it
+/// (--profile-interval, --profile-depth, --profile-syms)
+static const char *profile_file = NULL;
+static uint32_t profile_interval = 10000;
+static int profile_depth = 0;
+static const char *profile_syms = NULL;
+/// Benchmark report to write on exit (--bench), or NULL
+static const char *bench_file = NULL;
+/// Binary trace file (--trace), or NULL, and how to record it (--trace-size
+/// in MiB, --trace-mem, --trace-stop)
+static const char *trace_file = NULL;
+static size_t trace_size = 64;
+static uint32_t trace_flags = 0;
+static int64_t trace_stop = -1;
+/// Trace file to decode and exit (--decode-trace), or NULL
+static const char *decode_trace_file = NULL;
+/// Record input to this file (--record-input), or NULL
+static const char *record_input_file = NULL;
+/// Replay input from this file (--replay-input), or NULL, and whether the
+/// replay is still going
+static const char *replay_input_file = NULL;
+static bool replaying = false;
+/// Real-time clock source (--rtc), and its time at emulated cycle 0
+/// (--rtc-epoch), or -1 for the host's time when the machine was set up
+static TC8250_CLOCK rtc_clock = TC8250_CLOCK_HOST;
+static int64_t rtc_epoch = -1;
+/// Machine profile (--machine or the options it's made of): RAM sizes in
+/// KiB, hard disc image, display palette, and Boot PROM files with the
+/// interleaved image's cache (NULL for the defaults, "" for no cache)
+static unsigned long base_ram_kb = 2048, exp_ram_kb = 2048;
+static const char *hd_image = "hd.img";
+static VIDEO_PALETTE palette = VIDEO_PAL_GREEN;
+static const char *rom_14c = NULL, *rom_15c = NULL, *rom_cache = NULL;
+/// Where the VNC server listens (--vnc), or NULL for no server
+static const char *vnc_addr = NULL;
+
 void FAIL(char *err)
 {
 	state_done();
@@ -21,160 +117,193 @@ void FAIL(char *err)
 	exit(EXIT_FAILURE);
 }
 
-static int load_fd()
+/**
+ * @brief	Open a floppy disc image and read it into memory.
+ * @return	The image file, or NULL on error.
+ */
+static FILE *open_fd(const char *filename, WD2797_DISC *disc)
 {
+	FILE *fp;
 
 	int writeable = 1;
-	state.fdc_disc = fopen("discim", "r+b");
-	if (!state.fdc_disc){
-		writeable = 0;
-		state.fdc_disc = fopen("discim", "rb");
-	}
-	if (!state.fdc_disc){
-		fprintf(stderr, "ERROR loading disc image 'discim'.\n");
-		state.fdc_disc = NULL;
-		return (0);
-	}else{
-		wd2797_load(&state.fdc_ctx, state.fdc_disc, 512, 10, 2, writeable);
-		fprintf(stderr, "Disc image loaded.\n");
-		return (1);
+	if (fd_overlay != NULL) {
+		// Writes go to the overlay, so the base image can be read-only
+		fp = overlay_open(filename, fd_overlay, 512);
+	} else {
+		fp = zimage_open(filename, true);
+		if (!fp){
+			writeable = 0;
+			fp = zimage_open(filename, false);
+		}
+	}
+	if (!fp){
+		if (fd_overlay != NULL)
+			fprintf(stderr, "ERROR loading disc image '%s' with overlay '%s': %s.\n", filename, fd_overlay, strerror(errno));
+		else
+			fprintf(stderr, "ERROR loading disc image '%s'.\n", filename);
+		return NULL;
+	}
+	if (wd2797_disc_open(disc, fp, 512, 10, 2, writeable) != WD2797_ERR_OK) {
+		fprintf(stderr, "ERROR reading disc image '%s'.\n", filename);
+		fclose(fp);
+		return NULL;
 	}
+	return fp;
 }
 
-static int load_hd()
+/**
+ * @brief	Open the default floppy disc image, for state_fd_set_reopen().
+ */
+static FILE *reopen_fd(int n, WD2797_DISC *disc)
 {
-
-	state.hdc_disc0 = fopen("hd.img", "r+b");
-	if (!state.hdc_disc0){
-		fprintf(stderr, "ERROR loading disc image 'hd.img'.\n");
-		state.hdc_disc0 = NULL;
-		return (0);
-	}else{
-		wd2010_init(&state.hdc_ctx, state.hdc_disc0, 512, 16, 8);
-		fprintf(stderr, "Disc image loaded.\n");
-		return (1);
-	}
+	(void)n;
+	return open_fd("discim", disc);
 }
 
-
-
 /**
- * @brief Set the pixel at (x, y) to the given value
- * @note The surface must be locked before calling this!
- * @param	surface		SDL surface upon which to draw
- * @param	x			X co-ordinate
- * @param	y			Y co-ordinate
- * @param	pixel		Pixel value (from SDL_MapRGB)
+ * @brief	Read all the floppy disc images into memory and load the first.
+ * @return	Number of images loaded.
+ *
+ * Without --floppy, "discim" is read again each time it's inserted, so the
+ * next disc of a set can be copied over it while the drive is empty.
  */
-void putpixel(SDL_Surface *surface, int x, int y, Uint32 pixel)
+static int load_fd()
 {
-	int bpp = surface->format->BytesPerPixel;
-	/* Here p is the address to the pixel we want to set */
-	Uint8 *p = (Uint8 *)surface->pixels + y * surface->pitch + x * bpp;
+	int count = (fd_nimages > 0) ? fd_nimages : 1;
 
-	switch (bpp) {
-		case 1:
-			*p = pixel;
-			break;
+	state->fdc_discs = calloc(count, sizeof(WD2797_DISC));
+	state->fdc_files = calloc(count, sizeof(FILE *));
+	if (!state->fdc_discs || !state->fdc_files)
+		return (0);
 
-		case 2:
-			*(Uint16 *)p = pixel;
-			break;
+	if (fd_nimages == 0) {
+		state_fd_set_reopen(reopen_fd);
+		state->fdc_ndiscs = 1;
+		state_fd_select(0);
+		return (state->fdc_cur >= 0) ? 1 : 0;
+	}
 
-		case 3:
-			if (SDL_BYTEORDER == SDL_BIG_ENDIAN) {
-				p[0] = (pixel >> 16) & 0xff;
-				p[1] = (pixel >> 8) & 0xff;
-				p[2] = pixel & 0xff;
-			}
-			else {
-				p[0] = pixel & 0xff;
-				p[1] = (pixel >> 8) & 0xff;
-				p[2] = (pixel >> 16) & 0xff;
-			}
-			break;
+	for (int i = 0; i < count; i++) {
+		FILE *fp = open_fd(fd_images[i], &state->fdc_discs[state->fdc_ndiscs]);
+		if (fp != NULL)
+			state->fdc_files[state->fdc_ndiscs++] = fp;
+	}
 
-		case 4:
-			*(Uint32 *)p = pixel;
-			break;
+	state_fd_select((state->fdc_ndiscs > 0) ? 0 : -1);
+	return (state->fdc_ndiscs);
+}
 
-		default:
-			break;           /* shouldn't happen, but avoids warnings */
-	} // switch
+static int load_hd(const char *overlay)
+{
+
+	if (overlay != NULL)
+		state->hdc_disc0 = overlay_open(hd_image, overlay, 512);
+	else
+		state->hdc_disc0 = zimage_open(hd_image, true);
+	if (!state->hdc_disc0){
+		if (overlay != NULL)
+			fprintf(stderr, "ERROR loading disc image '%s' with overlay '%s': %s.\n", hd_image, overlay, strerror(errno));
+		else
+			fprintf(stderr, "ERROR loading disc image '%s'.\n", hd_image);
+		state->hdc_disc0 = NULL;
+		return (0);
+	}else{
+		wd2010_init(&state->hdc_ctx, state->hdc_disc0, 512, 16, 8);
+		if (hd_mmap && (wd2010_map_image(&state->hdc_ctx, hd_sync) != WD2010_ERR_OK))
+			fprintf(stderr, "WARNING: Couldn't memory-map '%s', using normal file access.\n", hd_image);
+		if ((hd_cache_limit > 0) && (wd2010_cache_image(&state->hdc_ctx, hd_cache_limit) != WD2010_ERR_OK))
+			fprintf(stderr, "WARNING: Couldn't set up the hard disc cache.\n");
+		fprintf(stderr, "Disc image loaded.\n");
+		return (1);
+	}
 }
 
 
+
 /**
- * @brief	Refresh the screen.
- * @param	surface		SDL surface upon which to draw.
+ * @brief	Set up one of the extra machines asked for with --instances.
+ * @param	n	Instance number, from 1.
+ * @return	The new machine, or NULL on error.
+ *
+ * Each extra machine boots from its own hard disc overlay (the --hd-overlay
+ * file name with ".n" on the end) with an empty floppy drive. The ROMs are
+ * shared with the primary machine, and so is the --load-state snapshot: its
+ * RAM is mapped copy-on-write, so every machine shares the pages none of
+ * them has written to.
  */
-void refreshScreen(SDL_Surface *s)
+static S_state *start_instance(int n)
 {
-	// Lock the screen surface (if necessary)
-	if (SDL_MUSTLOCK(s)) {
-		if (SDL_LockSurface(s) < 0) {
-			fprintf(stderr, "ERROR: Unable to lock screen!\n");
-			exit(EXIT_FAILURE);
-		}
-	}
+	S_state *primary = state;
+	S_state *s = state_new();
+	if (s == NULL)
+		return NULL;
 
-	// Map the foreground and background colours
-	Uint32 fg = SDL_MapRGB(s->format, 0x00, 0xFF, 0x00);	// green foreground
-//	Uint32 fg = SDL_MapRGB(s->format, 0xFF, 0xC1, 0x06);	// amber foreground
-//	Uint32 fg = SDL_MapRGB(s->format, 0xFF, 0xFF, 0xFF);	// white foreground
-	Uint32 bg = SDL_MapRGB(s->format, 0x00, 0x00, 0x00);	// black background
-
-	// Refresh the 3B1 screen area first. TODO: only do this if VRAM has actually changed!
-	uint32_t vram_address = 0;
-	for (int y=0; y<348; y++) {
-		for (int x=0; x<720; x+=16) {	// 720 pixels, monochrome, packed into 16bit words
-			// Get the pixel
-			uint16_t val = RD16(state.vram, vram_address, sizeof(state.vram)-1);
-			vram_address += 2;
-			// Now copy it to the video buffer
-			for (int px=0; px<16; px++) {
-				if (val & 1)
-					putpixel(s, x+px, y, fg);
-				else
-					putpixel(s, x+px, y, bg);
-				val >>= 1;
-			}
+	state_select(s);
+	bool ok = (state_init(base_ram_kb * 1024, exp_ram_kb * 1024) == STATE_E_OK);
+	if (ok) {
+		m68k_set_cpu_type(M68K_CPU_TYPE_68010);
+		m68k_set_fc_callback(memory_fc_callback);
+		m68k_pulse_reset();
+
+		char *overlay = malloc(strlen(hd_overlay) + 16);
+		if (overlay != NULL) {
+			sprintf(overlay, "%s.%d", hd_overlay, n);
+			ok = (load_hd(overlay) == 1);
+			free(overlay);
+		} else {
+			ok = false;
 		}
 	}
-
-	// TODO: blit LEDs and status info
-
-	// Unlock the screen surface
-	if (SDL_MUSTLOCK(s)) {
-		SDL_UnlockSurface(s);
+	if (ok && load_state_file)
+		ok = snapshot_load(load_state_file);
+	if (ok)
+		tc8250_set_clock(&state->rtc_ctx, rtc_clock, rtc_epoch);
+	if (!ok) {
+		state_done();
+		state_select(primary);
+		state_free(s);
+		return NULL;
 	}
 
-	// Trigger a refresh -- TODO: partial refresh depending on whether we
-	// refreshed the screen area, status area, both, or none. Use SDL_UpdateRect() for this.
-	SDL_Flip(s);
+	state_select(primary);
+	return s;
 }
 
 /**
  * @brief	Handle events posted by SDL.
+ *
+ * Runs on the display thread. Anything which affects the emulated machine
+ * is queued for the emulation thread rather than handled here.
  */
 bool HandleSDLEvents(SDL_Surface *screen)
 {
 	SDL_Event event;
+	INPUT_EVENT ev;
 	static int mouse_grabbed = 0, mouse_buttons = 0;
 	int dx = 0, dy = 0;
 
 	while (SDL_PollEvent(&event))
 	{
 		if ((event.type == SDL_KEYDOWN) || (event.type == SDL_KEYUP)) {
-			keyboard_event(&state.kbd, &event);
+			ev.type = INPUT_KEY;
+			ev.key = event;
+			input_push(&ev);
 		}
 
 		switch (event.type) {
 			case SDL_QUIT:
 				// Quit button tagged. Exit.
 				return true;
+			case SDL_VIDEOEXPOSE:
+				// Window contents were lost, redraw the lot
+				video_invalidate();
+				break;
 			case SDL_KEYDOWN:
 				switch (event.key.keysym.sym) {
+					case SDLK_F9:
+						// Cycle through the display colour schemes
+						video_set_palette((video_get_palette() + 1) % VIDEO_PAL_COUNT);
+						break;
 					case SDLK_F10:
 						if (mouse_grabbed){
 							SDL_ShowCursor(1);
@@ -187,14 +316,8 @@ bool HandleSDLEvents(SDL_Surface *screen)
 						}
 						break;
 					case SDLK_F11:
-						if (state.fdc_disc) {
-							wd2797_unload(&state.fdc_ctx);
-							fclose(state.fdc_disc);
-							state.fdc_disc = NULL;
-							fprintf(stderr, "Disc image unloaded.\n");
-						} else {
-							load_fd();
-						}
+						ev.type = INPUT_FLOPPY_SWAP;
+						input_push(&ev);
 						break;
 					case SDLK_F12:
 						if (event.key.keysym.mod & (KMOD_LALT | KMOD_RALT))
@@ -227,7 +350,11 @@ bool HandleSDLEvents(SDL_Surface *screen)
 							mouse_buttons &= ~MOUSE_BUTTON_RIGHT;
 						}
 					}
-					mouse_event(&state.kbd, dx, dy, mouse_buttons);
+					ev.type = INPUT_MOUSE;
+					ev.mouse.dx = dx;
+					ev.mouse.dy = dy;
+					ev.mouse.buttons = mouse_buttons;
+					input_push(&ev);
 					dx = 0;
 					dy = 0;
 				}
@@ -240,13 +367,948 @@ bool HandleSDLEvents(SDL_Surface *screen)
 	return false;
 }
 
+/**
+ * @brief	Apply an input event to the primary machine.
+ */
+static void apply_input(INPUT_EVENT *ev)
+{
+	input_record(ev, sched_now());
+
+	switch (ev->type) {
+		case INPUT_KEY:
+			keyboard_event(&state->kbd, &ev->key);
+			break;
+		case INPUT_MOUSE:
+			mouse_event(&state->kbd, ev->mouse.dx, ev->mouse.dy, ev->mouse.buttons);
+			break;
+		case INPUT_FLOPPY_SWAP:
+			state_fd_next();
+			break;
+	}
+}
+
+/**
+ * @brief	Apply input events queued by the display thread, or replayed
+ * 			from a recording.
+ *
+ * Runs on the emulation thread, at timeslot boundaries.
+ */
+static void process_input(void)
+{
+	INPUT_EVENT ev;
+
+	if (replaying) {
+		INPUT_REPLAY r;
+		while ((r = input_replay_pop(sched_now(), &ev)) == INPUT_REPLAY_EVENT)
+			apply_input(&ev);
+		// Live input would make the run different, so throw it away
+		while (input_pop(&ev))
+			;
+		if (r == INPUT_REPLAY_END) {
+			// Finish the run where the recording did, or hand over to the
+			// keyboard and mouse
+			fprintf(stderr, "Input replay finished.\n");
+			replaying = false;
+			if (headless)
+				__atomic_store_n(&exit_requested, true, __ATOMIC_RELEASE);
+		}
+		return;
+	}
+
+	while (input_pop(&ev))
+		apply_input(&ev);
+}
+
+/// 3B1 timing. The CPU clock is SCHED_CLOCK_HZ (10MHz).
+#define CLOCKS_PER_60HZ		(SCHED_CLOCK_HZ / 60)
+/// Length of the 60Hz interrupt pulse, in CPU cycles
+#define TIMER_PULSE_CYCLES	200
+/// Delay between a device raising DRQ and the DMA engine servicing it
+#define DMA_POLL_CYCLES		200
+/// Maximum number of words the DMA engine moves in one go
+#define DMA_MAX_WORDS		10000
+
+/**
+ * @brief	Get direct access to the selected controller's data buffer.
+ * @param	buf		Set to point at the next byte to be transferred.
+ * @return	Number of bytes which can be moved in one go, or zero if the
+ * 			transfer has to go through the controller's data register.
+ */
+static size_t dma_dev_buffer(uint8_t **buf)
+{
+	if (state->dma_dev == DMA_DEV_FD)
+		return wd2797_dma_buffer(&state->fdc_ctx, state->dma_reading, buf);
+	else if (state->dma_dev == DMA_DEV_HD0)
+		return wd2010_dma_buffer(&state->hdc_ctx, state->dma_reading, buf);
+	return 0;
+}
+
+/**
+ * @brief	Tell the selected controller how many bytes were moved.
+ */
+static void dma_dev_done(size_t count)
+{
+	if (state->dma_dev == DMA_DEV_FD)
+		wd2797_dma_done(&state->fdc_ctx, state->dma_reading, count);
+	else if (state->dma_dev == DMA_DEV_HD0)
+		wd2010_dma_done(&state->hdc_ctx, state->dma_reading, count);
+}
+
+/**
+ * @brief	Scheduler event: disc DMA engine service.
+ *
+ * Sector data is copied directly between the controller's data buffer and
+ * RAM, one guest page at a time. Each run stops at a page boundary, so
+ * permissions are checked and the address mapped once per page.
+ */
+static void dma_event(void *arg)
+{
+	(void)arg;
+
+	if (state->dmaen) {
+		// DMA ready to go -- so do it.
+		size_t num = 0;
+		while (state->dma_count < 0x4000) {
+			uint16_t d = 0;
+
+			// num tells us how many words we've copied. If this is greater than the DMA maximum, bail out!
+			if (num > DMA_MAX_WORDS) break;
+	
+			// Evidently we have more words to copy. Copy them.
+			if (state->dma_dev == DMA_DEV_FD){
+				if (!wd2797_get_drq(&state->fdc_ctx)) {
+					// Bail out, no data available. Try again later.
+					break;
+				}
+			}else if (state->dma_dev == DMA_DEV_HD0){
+				if (!wd2010_get_drq(&state->hdc_ctx)) {
+					// Bail out, no data available. Try again later.
+					break;
+				}
+			}else{
+				printf("ERROR: DMA attempt with no drive selected!\n");
+			}
+			if (!access_check_dma(state->dma_reading)) {
+				break;
+			}
+			uint32_t newAddr;
+			// Map logical address to a physical RAM address
+			newAddr = mapAddr(state->dma_address, !state->dma_reading);
+
+			// Move as much as we can in one go: up to the end of the page,
+			// the end of the DMA count or the end of the controller's buffer.
+			uint8_t *buf;
+			size_t words = dma_dev_buffer(&buf) / 2;
+			if (words > 0) {
+				size_t page_words = (0x1000 - (state->dma_address & 0xfff)) / 2;
+				if (words > page_words) words = page_words;
+				if (words > (size_t)(0x4000 - state->dma_count)) words = 0x4000 - state->dma_count;
+				if (words > (DMA_MAX_WORDS + 1 - num)) words = DMA_MAX_WORDS + 1 - num;
+
+				// Words are big-endian on both sides, so the bytes go across in order
+				uint8_t *ram = memory_phys_ptr(newAddr, !state->dma_reading);
+				if (!state->dma_reading) {
+					if (ram != NULL) {
+						memcpy(ram, buf, words * 2);
+						memory_phys_written(newAddr);
+					}
+				} else {
+					if (ram != NULL)
+						memcpy(buf, ram, words * 2);
+					else
+						memset(buf, 0xff, words * 2);
+				}
+				dma_dev_done(words * 2);
+				STAT_ADD(dma_words, words);
+
+				state->dma_address += words * 2;
+				num += words; state->dma_count += words;
+				continue;
+			}
+
+			// Odd cases (no drive, format commands, stray bytes) go a word
+			// at a time through the controller's data register.
+			if (!state->dma_reading) {
+				// Data available. Get it from the FDC or HDC.
+				if (state->dma_dev == DMA_DEV_FD) {
+					d = wd2797_read_reg(&state->fdc_ctx, WD2797_REG_DATA);
+					d <<= 8;
+					d += wd2797_read_reg(&state->fdc_ctx, WD2797_REG_DATA);
+				}else if (state->dma_dev == DMA_DEV_HD0) {
+					d = wd2010_read_data(&state->hdc_ctx);
+					d <<= 8;
+					d += wd2010_read_data(&state->hdc_ctx);
+				}
+				// Writes to unpopulated RAM are dropped
+				uint8_t *ram = memory_phys_ptr(newAddr, true);
+				if (ram != NULL) {
+					ram[0] = d >> 8;
+					ram[1] = d & 0xff;
+					memory_phys_written(newAddr);
+				}
+			} else {
+				// Data write to FDC or HDC.
+
+				// Get the data from RAM
+				const uint8_t *ram = memory_phys_ptr(newAddr, false);
+				d = (ram != NULL) ? (((uint16_t)ram[0] << 8) | ram[1]) : 0xffff;
+	
+				// Send the data to the FDD or HDD
+				if (state->dma_dev == DMA_DEV_FD){
+					wd2797_write_reg(&state->fdc_ctx, WD2797_REG_DATA, (d >> 8));
+					wd2797_write_reg(&state->fdc_ctx, WD2797_REG_DATA, (d & 0xff));
+				}else if (state->dma_dev == DMA_DEV_HD0){
+					wd2010_write_data(&state->hdc_ctx, (d >> 8));
+					wd2010_write_data(&state->hdc_ctx, (d & 0xff));
+				}
+			}
+
+			STAT_INC(dma_words);
+
+			// Increment DMA address
+			state->dma_address+=2;
+			// Increment number of words transferred
+			num++; state->dma_count++;
+		}
+
+		// Turn off DMA engine if we finished this cycle
+		if (state->dma_count >= 0x4000) {
+			// FIXME? apparently this isn't required... or is it?
+			state->dma_count = 0x3fff;
+			/*state->dmaen = false;*/
+		}
+	}else if (wd2010_get_drq(&state->hdc_ctx)){
+		wd2010_dma_miss(&state->hdc_ctx);
+	}else if (wd2797_get_drq(&state->fdc_ctx)){
+		wd2797_dma_miss(&state->fdc_ctx);
+	}
+}
+
+/// Sectors moved by each run of the DMA microbenchmark
+#define BENCH_DMA_SECTORS	16
+
+/**
+ * @brief	Microbenchmark: read sectors from the hard disc into RAM by DMA.
+ */
+static void bench_dma(uint32_t n)
+{
+	for (uint32_t i = 0; i < n; i++) {
+		// Multi-sector read of the start of cylinder 0, 512-byte sectors
+		wd2010_write_reg(&state->hdc_ctx, WD2010_REG_SECTOR_COUNT, BENCH_DMA_SECTORS);
+		wd2010_write_reg(&state->hdc_ctx, WD2010_REG_SECTOR_NUMBER, 0);
+		wd2010_write_reg(&state->hdc_ctx, WD2010_REG_CYLINDER_LOW, 0);
+		wd2010_write_reg(&state->hdc_ctx, WD2010_REG_CYLINDER_HIGH, 0);
+		wd2010_write_reg(&state->hdc_ctx, WD2010_REG_SDH, 0x20);
+		wd2010_write_reg(&state->hdc_ctx, WD2010_REG_COMMAND, 0x24);
+
+		state->dma_dev = DMA_DEV_HD0;
+		state->dma_reading = false;
+		state->dmaen = true;
+		state->dma_address = 0x10000;
+		state->dma_count = 0x4000 - (BENCH_DMA_SECTORS * 512 / 2);
+		while (wd2010_get_drq(&state->hdc_ctx) && (state->dma_count < 0x4000))
+			dma_event(NULL);
+	}
+}
+
+/**
+ * @brief	Run the microbenchmarks (--bench).
+ *
+ * They run on a scratch machine with a scratch hard disc, so the machine
+ * being benchmarked afterwards starts from the same state as always.
+ */
+static void run_microbenchmarks(void)
+{
+	S_state *primary = state;
+	S_state *s = state_new();
+	if (s == NULL)
+		FAIL("Out of memory starting the benchmark machine.");
+
+	state_select(s);
+	if (state_init(2048*1024, 2048*1024) != STATE_E_OK)
+		FAIL("Could not set up the benchmark machine.");
+	m68k_set_cpu_type(M68K_CPU_TYPE_68010);
+	m68k_set_fc_callback(memory_fc_callback);
+	m68k_pulse_reset();
+
+	bench_micro_suite();
+
+	// Two cylinders of empty disc are enough for the DMA benchmark
+	FILE *disc = tmpfile();
+	if ((disc != NULL) && (fseek(disc, (2 * 8 * 16 * 512) - 1, SEEK_SET) == 0) && (fputc(0, disc) != EOF) &&
+			(wd2010_init(&state->hdc_ctx, disc, 512, 16, 8) == WD2010_ERR_OK)) {
+		state->hdc_disc0 = disc;
+		bench_micro("dma_hd_read_8k", bench_dma, 1000);
+	} else {
+		fprintf(stderr, "ERROR: Could not create a scratch disc for the DMA benchmark.\n");
+		if (disc != NULL)
+			fclose(disc);
+	}
+
+	state_done();
+	if (state->hdc_disc0 != NULL)
+		fclose(state->hdc_disc0);
+	state_select(primary);
+	state_free(s);
+}
+
+/**
+ * @brief	Scheduler event: end of the 60Hz interrupt pulse.
+ */
+static void timer_pulse_event(void *arg)
+{
+	(void)arg;
+	irq_set(IRQ_TIMER, false);
+}
+
+/**
+ * @brief	Scheduler event: 60Hz periodic interrupt, vertical refresh and
+ * 			keyboard scan.
+ */
+static void tick60_event(void *arg)
+{
+	(void)arg;
+
+	// Hand the finished frame over to the VNC server and the display thread
+	if (state == machines[0]) {
+		vnc_publish_frame();
+		if (!headless)
+			video_publish_frame();
+		else
+			memset(state->vram_dirty, 0, sizeof(state->vram_dirty));
+	}
+	// Feed in the next part of the input script
+	if (script_file && (state == machines[0]) && script_frame())
+		__atomic_store_n(&exit_requested, true, __ATOMIC_RELEASE);
+	if (state->timer_enabled){
+		irq_set(IRQ_TIMER, true);
+		state->timer_asserted = true;
+		sched_add(SCHED_EV_TIMER_PULSE, TIMER_PULSE_CYCLES);
+	}
+	// scan the keyboard
+	keyboard_scan(&state->kbd);
+
+	sched_add_at(SCHED_EV_TICK60, sched_deadline(SCHED_EV_TICK60) + CLOCKS_PER_60HZ);
+}
+
+/**
+ * @brief	Re-evaluate the DMA requests.
+ *
+ * Called by the scheduler after each CPU burst and batch of events. The
+ * interrupt lines look after themselves (see irq.h).
+ */
+static void sync_devices(void)
+{
+	// Give the DMA engine a look-in if a controller wants data moved
+	if ((wd2797_get_drq(&state->fdc_ctx) || wd2010_get_drq(&state->hdc_ctx)) && !sched_pending(SCHED_EV_DMA))
+		sched_add(SCHED_EV_DMA, DMA_POLL_CYCLES);
+}
+
+/**
+ * @brief	Emulation thread: runs the CPU and peripherals in real time.
+ *
+ * Completed video frames are handed to the display thread through
+ * video_publish_frame(), so a slow display never holds up the CPU.
+ */
+static int emulation_thread(void *arg)
+{
+	/***
+	 * The 3B1 CPU runs at 10MHz, with DMA running at 1MHz and video refreshing at
+	 * around 60Hz (???), with a 60Hz periodic interrupt.
+	 *
+	 * Emulated time is kept by the scheduler; real time is only used to
+	 * throttle each timeslot.
+	 */
+	const uint32_t SYSTEM_CLOCK = SCHED_CLOCK_HZ; // Hz
+	const uint32_t TIMESLOT_FREQUENCY = 100;//240;	// Hz
+	const uint32_t MILLISECS_PER_TIMESLOT = 1e3 / TIMESLOT_FREQUENCY;
+	const uint32_t MILLISECS_PER_SPEED_REPORT = 1000;
+	double next_timeslot = SDL_GetTicks() + (MILLISECS_PER_TIMESLOT / emu_speed);
+	uint64_t total_cycles = 0, report_cycles = 0;
+	uint32_t report_time = SDL_GetTicks(), reports = 0;
+	uint32_t checkpoint_time = SDL_GetTicks();
+
+	(void)arg;
+
+	stats_thread_register();
+
+	// Set up the periodic events
+	sched_register(SCHED_EV_TICK60, tick60_event, NULL);
+	sched_register(SCHED_EV_TIMER_PULSE, timer_pulse_event, NULL);
+	sched_register(SCHED_EV_DMA, dma_event, NULL);
+	sched_set_sync_hook(sync_devices);
+	// A restored snapshot already has the next tick scheduled
+	for (int m = 0; m < nmachines; m++) {
+		state_select(machines[m]);
+		if (!sched_pending(SCHED_EV_TICK60))
+			sched_add(SCHED_EV_TICK60, CLOCKS_PER_60HZ);
+	}
+	state_select(machines[0]);
+
+	for (;;) {
+		// Pick up any keyboard/mouse input
+		process_input();
+		// The end of an input replay may have finished the run
+		if (__atomic_load_n(&exit_requested, __ATOMIC_ACQUIRE)) break;
+
+		// Run the CPU and devices for one timeslot's worth of cycles, on each
+		// machine in turn
+		for (int m = 0; m < nmachines; m++) {
+			state_select(machines[m]);
+			total_cycles += sched_run(SYSTEM_CLOCK / TIMESLOT_FREQUENCY);
+		}
+		state_select(machines[0]);
+
+		// Save a snapshot if the script asked for one
+		snapshot_service();
+
+		// Save a checkpoint if it's time to
+		if (checkpoint_file && ((SDL_GetTicks() - checkpoint_time) >= (checkpoint_secs * 1000))) {
+			if (!snapshot_checkpoint(checkpoint_file))
+				fprintf(stderr, "ERROR: Could not save checkpoint '%s'.\n", checkpoint_file);
+			checkpoint_time = SDL_GetTicks();
+		}
+
+		// make sure frame rate is equal to real time (or a multiple of it)
+		uint32_t now = SDL_GetTicks();
+		if (emu_speed > 0) {
+			if (now < next_timeslot) {
+				// timeslot finished early -- eat up some time
+				SDL_Delay((uint32_t)(next_timeslot - now));
+			} else {
+				// timeslot finished late -- skip ahead to gain time
+				// TODO: if this happens a lot, we should let the user know
+				// that their PC might not be fast enough...
+				next_timeslot = now;
+			}
+			// advance to the next timeslot
+			next_timeslot += MILLISECS_PER_TIMESLOT / emu_speed;
+		}
+
+		// Work out how fast we're really going
+		if ((now - report_time) >= MILLISECS_PER_SPEED_REPORT) {
+			uint32_t khz = (total_cycles - report_cycles) / (now - report_time);
+			__atomic_store_n(&emu_khz, khz, __ATOMIC_RELAXED);
+			report_cycles = total_cycles;
+			report_time = now;
+			// Write the hard disc back to its image file if it's time to;
+			// a compressed one always holds some changes back until then
+			if (hd_sync == WD2010_SYNC_PERIODIC)
+				wd2010_sync(&state->hdc_ctx);
+			else if ((hd_sync == WD2010_SYNC_COMMAND) && (state->hdc_ctx.disc_image != NULL))
+				zimage_sync(state->hdc_ctx.disc_image);
+			// No window title to put it in, so log it every few seconds
+			if (headless && ((++reports % 10) == 0))
+				fprintf(stderr, "Emulated CPU speed: %u.%02u MHz (%u%% of %u MHz)\n",
+						khz / 1000, (khz % 1000) / 10, khz / (SYSTEM_CLOCK / 100000), SYSTEM_CLOCK / 1000000);
+		}
+
+		// if we've been asked to exit the emulator, then do so.
+		if (__atomic_load_n(&exit_requested, __ATOMIC_ACQUIRE)) break;
+	}
+
+	stats_thread_done();
+	return 0;
+}
+
+
+/**
+ * @brief	Signal handler for headless mode: exit cleanly on SIGINT/SIGTERM.
+ */
+static void exit_signal(int sig)
+{
+	(void)sig;
+	__atomic_store_n(&exit_requested, true, __ATOMIC_RELEASE);
+}
+
+static void usage(const char *progname)
+{
+	printf("Usage: %s [options]\n", progname);
+	printf("  --headless       run without a display\n");
+	printf("  --script FILE    take keyboard input from a script\n");
+	printf("  --dump FILE      write the screen to FILE (PBM format) on exit\n");
+	printf("  --speed N        run at N times real speed (default 1)\n");
+	printf("  --turbo          run as fast as possible\n");
+	printf("  --mmap-hd[=SYNC] memory-map the hard disc image; write it back after\n");
+	printf("                   every command (SYNC=command, default), every second\n");
+	printf("                   (periodic) or on exit (shutdown)\n");
+	printf("  --hd-cache[=KB]  cache hard disc writes, flushing in the background once\n");
+	printf("                   KB kilobytes are dirty (default 1024)\n");
+	printf("  --hd-overlay FILE\n");
+	printf("                   keep hard disc changes in FILE, leaving hd.img untouched\n");
+	printf("  --fd-overlay FILE\n");
+	printf("                   keep floppy disc changes in FILE, leaving discim untouched\n");
+	printf("  --floppy FILE    use FILE as a floppy disc image instead of discim; repeat\n");
+	printf("                   to preload several images, and press F11 to swap them\n");
+	printf("  --load-state FILE\n");
+	printf("                   restore the machine from snapshot FILE at startup\n");
+	printf("  --save-state FILE\n");
+	printf("                   save a snapshot of the machine to FILE on exit\n");
+	printf("  --checkpoint FILE\n");
+	printf("                   checkpoint the machine to FILE (and FILE.log) as it runs\n");
+	printf("  --checkpoint-interval SECS\n");
+	printf("                   seconds between checkpoints (default 10)\n");
+	printf("  --resume FILE    restore the machine from the last checkpoint in FILE\n");
+	printf("  --instances N    run N machines (headless only); the extra machines use\n");
+	printf("                   the --hd-overlay file name with .1, .2 ... on the end\n");
+	printf("  --stats FILE     write the instrumentation counters to FILE on exit (JSON\n");
+	printf("                   if it ends in .json, otherwise Prometheus text); needs a\n");
+	printf("                   build with ENABLE_STATS=yes\n");
+	printf("  --profile FILE   sample the guest PC and write the samples to FILE on exit,\n");
+	printf("                   in folded stack format for flame graphs\n");
+	printf("  --profile-interval CYCLES\n");
+	printf("                   CPU cycles between samples (default 10000)\n");
+	printf("  --profile-depth N\n");
+	printf("                   record up to N callers with each sample by following the\n");
+	printf("                   A6 frame pointer chain (default 0, maximum %d)\n", PROFILE_MAX_DEPTH);
+	printf("  --profile-syms FILE\n");
+	printf("                   name the sampled code using the symbols in FILE (a COFF\n");
+	printf("                   or a.out kernel or program, or nm output)\n");
+	printf("  --bench FILE     benchmark (headless only): time the emulator's hot paths,\n");
+	printf("                   then the run itself, and write a JSON report to FILE on\n");
+	printf("                   exit; use the script 'mark' command to time milestones\n");
+	printf("  --trace FILE     record every instruction executed into a ring in FILE, for\n");
+	printf("                   --decode-trace; extra machines trace to FILE.1, FILE.2 ...\n");
+	printf("  --trace-size MB  size of the trace ring in MiB (default 64)\n");
+	printf("  --trace-mem      record data accesses in the trace too\n");
+	printf("  --trace-stop ADDR\n");
+	printf("                   stop tracing when the CPU reaches ADDR, e.g. the guest's\n");
+	printf("                   panic routine\n");
+	printf("  --record-input FILE\n");
+	printf("                   record keyboard and mouse input to FILE, stamped with the\n");
+	printf("                   emulated time it reached the machine\n");
+	printf("  --replay-input FILE\n");
+	printf("                   replay input recorded with --record-input at the same\n");
+	printf("                   emulated times; live input is ignored until it ends, and\n");
+	printf("                   headless runs exit where the recording did\n");
+	printf("  --rtc MODE       where the real-time clock gets the time: 'host' for the\n");
+	printf("                   host's clock (default), or 'virtual' to count emulated\n");
+	printf("                   time from the epoch, so turbo runs, restored snapshots\n");
+	printf("                   and replays see the same time\n");
+	printf("  --rtc-epoch SECS time of the virtual clock at reset, in seconds since 1970\n");
+	printf("                   (default: the time the emulator started)\n");
+	printf("  --log SPEC       choose which source files' messages are logged: a comma-\n");
+	printf("                   separated list of 'all', 'none', NAME or -NAME, e.g.\n");
+	printf("                   'none,wd2010' (default all)\n");
+	printf("  --log-rate N     log at most N messages a second from each place in the\n");
+	printf("                   code, or 0 for no limit (default 100)\n");
+	printf("  --machine FILE   read options from machine profile FILE, one per line\n");
+	printf("                   without the dashes, e.g. 'base-ram 1024'\n");
+	printf("  --base-ram KB    base RAM size: 512, 1024, 1536 or 2048 (default 2048)\n");
+	printf("  --exp-ram KB     expansion RAM size: 0 to 2048 in steps of 512 (default\n");
+	printf("                   2048)\n");
+	printf("  --hd FILE        use FILE as the hard disc image instead of hd.img\n");
+	printf("  --palette NAME   display colour: green (default), amber or white\n");
+	printf("  --rom-14c FILE   boot PROM 14C (default roms/14c.bin)\n");
+	printf("  --rom-15c FILE   boot PROM 15C (default roms/15c.bin)\n");
+	printf("  --rom-cache FILE keep the interleaved boot PROM image in FILE, or 'none'\n");
+	printf("                   (default roms/rom.img)\n");
+	printf("  --vnc [HOST:]PORT serve the screen, keyboard and mouse over VNC, with no\n");
+	printf("                   password (HOST defaults to 127.0.0.1)\n");
+	printf("  --host-dir DIR   let guest drivers read and write files in DIR through the\n");
+	printf("                   host transfer device\n");
+	printf("  --help           show this help\n");
+	printf("\n");
+	printf("Or: %s --compress-image IN OUT\n", progname);
+	printf("  compress disc image IN into OUT, which can be used in place of hd.img or\n");
+	printf("  discim\n");
+	printf("Or: %s --decode-trace FILE\n", progname);
+	printf("  list the instructions and data accesses in trace FILE, oldest first\n");
+}
+
+/// Options which only have a long form
+enum {
+	OPT_MACHINE = 256,
+	OPT_BASE_RAM,
+	OPT_EXP_RAM,
+	OPT_HD,
+	OPT_PALETTE,
+	OPT_ROM_14C,
+	OPT_ROM_15C,
+	OPT_ROM_CACHE,
+	OPT_VNC,
+	OPT_HOST_DIR
+};
+
+/// Long options. The machine profile (--machine) uses the same names.
+static const struct option long_opts[] = {
+	{ "headless",	no_argument,		NULL, 'H' },
+	{ "script",		required_argument,	NULL, 's' },
+	{ "dump",		required_argument,	NULL, 'd' },
+	{ "speed",		required_argument,	NULL, 'S' },
+	{ "turbo",		no_argument,		NULL, 'T' },
+	{ "mmap-hd",	optional_argument,	NULL, 'M' },
+	{ "hd-cache",	optional_argument,	NULL, 'C' },
+	{ "hd-overlay",	required_argument,	NULL, 'o' },
+	{ "fd-overlay",	required_argument,	NULL, 'O' },
+	{ "floppy",		required_argument,	NULL, 'f' },
+	{ "load-state",	required_argument,	NULL, 'l' },
+	{ "save-state",	required_argument,	NULL, 'w' },
+	{ "checkpoint",	required_argument,	NULL, 'c' },
+	{ "checkpoint-interval",	required_argument,	NULL, 'i' },
+	{ "resume",		required_argument,	NULL, 'r' },
+	{ "instances",	required_argument,	NULL, 'n' },
+	{ "stats",		required_argument,	NULL, 'x' },
+	{ "profile",	required_argument,	NULL, 'p' },
+	{ "profile-interval",	required_argument,	NULL, 'P' },
+	{ "profile-depth",	required_argument,	NULL, 'D' },
+	{ "profile-syms",	required_argument,	NULL, 'y' },
+	{ "bench",		required_argument,	NULL, 'b' },
+	{ "trace",		required_argument,	NULL, 't' },
+	{ "trace-size",	required_argument,	NULL, 'e' },
+	{ "trace-mem",	no_argument,		NULL, 'm' },
+	{ "trace-stop",	required_argument,	NULL, 'k' },
+	{ "decode-trace",	required_argument,	NULL, 'X' },
+	{ "record-input",	required_argument,	NULL, 'R' },
+	{ "replay-input",	required_argument,	NULL, 'I' },
+	{ "rtc",		required_argument,	NULL, 'q' },
+	{ "rtc-epoch",	required_argument,	NULL, 'E' },
+	{ "log",		required_argument,	NULL, 'g' },
+	{ "log-rate",	required_argument,	NULL, 'G' },
+	{ "compress-image",	no_argument,	NULL, 'Z' },
+	{ "machine",	required_argument,	NULL, OPT_MACHINE },
+	{ "base-ram",	required_argument,	NULL, OPT_BASE_RAM },
+	{ "exp-ram",	required_argument,	NULL, OPT_EXP_RAM },
+	{ "hd",			required_argument,	NULL, OPT_HD },
+	{ "palette",	required_argument,	NULL, OPT_PALETTE },
+	{ "rom-14c",	required_argument,	NULL, OPT_ROM_14C },
+	{ "rom-15c",	required_argument,	NULL, OPT_ROM_15C },
+	{ "rom-cache",	required_argument,	NULL, OPT_ROM_CACHE },
+	{ "vnc",		required_argument,	NULL, OPT_VNC },
+	{ "host-dir",	required_argument,	NULL, OPT_HOST_DIR },
+	{ "help",		no_argument,		NULL, 'h' },
+	{ NULL,			0,					NULL, 0 }
+};
+
+/// set_option() result: carry on
+#define OPT_OK		-1
+
+/// Program name, for usage()
+static const char *program_name;
+
+static int load_machine_profile(const char *filename);
+
+/**
+ * @brief	Apply an option from the command line or a machine profile.
+ * @param	opt		The option (long_opts val).
+ * @param	arg		Its argument, or NULL.
+ * @return	OPT_OK, or the exit status if the program should stop.
+ */
+static int set_option(int opt, char *arg)
+{
+	switch (opt) {
+		case 'H':	headless = true;		break;
+		case 's':	script_file = arg;	break;
+		case 'd':	dump_file = arg;		break;
+		case 'S': {
+			// Nothing but a number, so '2x' or a typo isn't taken as 2
+			char *end;
+			errno = 0;
+			emu_speed = strtod(arg, &end);
+			if ((end == arg) || (*end != '\0') || (errno == ERANGE) || !isfinite(emu_speed) || (emu_speed <= 0)) {
+				fprintf(stderr, "ERROR: Speed must be a number greater than zero, not '%s'.\n", arg);
+				return EXIT_FAILURE;
+			}
+			break;
+		}
+		case 'T':	emu_speed = 0;			break;
+		case 'M':
+			hd_mmap = true;
+			if ((arg == NULL) || (strcmp(arg, "command") == 0)) {
+				hd_sync = WD2010_SYNC_COMMAND;
+			} else if (strcmp(arg, "periodic") == 0) {
+				hd_sync = WD2010_SYNC_PERIODIC;
+			} else if (strcmp(arg, "shutdown") == 0) {
+				hd_sync = WD2010_SYNC_SHUTDOWN;
+			} else {
+				fprintf(stderr, "ERROR: Unknown hard disc sync policy '%s'.\n", arg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'C':
+			hd_cache_limit = (arg == NULL) ? 1024 : strtoul(arg, NULL, 0);
+			if (hd_cache_limit == 0) {
+				fprintf(stderr, "ERROR: Hard disc cache limit must be greater than zero.\n");
+				return EXIT_FAILURE;
+			}
+			hd_cache_limit *= 1024;
+			break;
+		case 'o':	hd_overlay = arg;	break;
+		case 'O':	fd_overlay = arg;	break;
+		case 'f': {
+			const char **p = realloc(fd_images, (fd_nimages + 1) * sizeof(*fd_images));
+			if (p == NULL) {
+				fprintf(stderr, "ERROR: Out of memory.\n");
+				return EXIT_FAILURE;
+			}
+			fd_images = p;
+			fd_images[fd_nimages++] = arg;
+			break;
+		}
+		case 'l':	load_state_file = arg;	break;
+		case 'w':	save_state_file = arg;	break;
+		case 'c':	checkpoint_file = arg;	break;
+		case 'i':
+			checkpoint_secs = strtoul(arg, NULL, 0);
+			if (checkpoint_secs == 0) {
+				fprintf(stderr, "ERROR: Checkpoint interval must be greater than zero.\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'r':	resume_file = arg;		break;
+		case 'n':
+			nmachines = strtol(arg, NULL, 0);
+			if (nmachines < 1) {
+				fprintf(stderr, "ERROR: Number of instances must be at least 1.\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'x':	stats_file = arg;		break;
+		case 'p':	profile_file = arg;		break;
+		case 'P':
+			profile_interval = strtoul(arg, NULL, 0);
+			if (profile_interval == 0) {
+				fprintf(stderr, "ERROR: Profile interval must be greater than zero.\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'D':
+			profile_depth = strtol(arg, NULL, 0);
+			if ((profile_depth < 0) || (profile_depth > PROFILE_MAX_DEPTH)) {
+				fprintf(stderr, "ERROR: Profile depth must be between 0 and %d.\n", PROFILE_MAX_DEPTH);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'y':	profile_syms = arg;		break;
+		case 'b':	bench_file = arg;		break;
+		case 't':	trace_file = arg;		break;
+		case 'e':
+			trace_size = strtoul(arg, NULL, 0);
+			if (trace_size == 0) {
+				fprintf(stderr, "ERROR: Trace size must be greater than zero.\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'm':	trace_flags |= TRACE_F_MEM;	break;
+		case 'k':	trace_stop = strtoul(arg, NULL, 0);	break;
+		case 'X':	decode_trace_file = arg;	break;
+		case 'R':	record_input_file = arg;	break;
+		case 'I':	replay_input_file = arg;	break;
+		case 'q':
+			if (strcmp(arg, "host") == 0)
+				rtc_clock = TC8250_CLOCK_HOST;
+			else if (strcmp(arg, "virtual") == 0)
+				rtc_clock = TC8250_CLOCK_VIRTUAL;
+			else {
+				fprintf(stderr, "ERROR: RTC mode must be 'host' or 'virtual'.\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'E':
+			rtc_epoch = strtoll(arg, NULL, 0);
+			if (rtc_epoch < 0) {
+				fprintf(stderr, "ERROR: RTC epoch must not be negative.\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'g':
+			if (!log_set_filter(arg)) {
+				fprintf(stderr, "ERROR: Too many names in the log filter.\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'G':	log_set_rate(strtoul(arg, NULL, 0));	break;
+		case 'Z':	compress_image = true;	break;
+		case 'h':
+			usage(program_name);
+			return EXIT_SUCCESS;
+		case OPT_MACHINE:
+			return load_machine_profile(arg);
+		case OPT_BASE_RAM:
+			base_ram_kb = strtoul(arg, NULL, 0);
+			if ((base_ram_kb < 512) || (base_ram_kb > 2048) || ((base_ram_kb % 512) != 0)) {
+				fprintf(stderr, "ERROR: Base RAM must be 512, 1024, 1536 or 2048 KiB.\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPT_EXP_RAM:
+			exp_ram_kb = strtoul(arg, NULL, 0);
+			if ((exp_ram_kb > 2048) || ((exp_ram_kb % 512) != 0)) {
+				fprintf(stderr, "ERROR: Expansion RAM must be 0, 512, 1024, 1536 or 2048 KiB.\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPT_HD:		hd_image = arg;		break;
+		case OPT_PALETTE:
+			if (strcmp(arg, "green") == 0)
+				palette = VIDEO_PAL_GREEN;
+			else if (strcmp(arg, "amber") == 0)
+				palette = VIDEO_PAL_AMBER;
+			else if (strcmp(arg, "white") == 0)
+				palette = VIDEO_PAL_WHITE;
+			else {
+				fprintf(stderr, "ERROR: Palette must be 'green', 'amber' or 'white'.\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPT_ROM_14C:	rom_14c = arg;		break;
+		case OPT_ROM_15C:	rom_15c = arg;		break;
+		case OPT_ROM_CACHE:
+			rom_cache = (strcmp(arg, "none") == 0) ? "" : arg;
+			break;
+		case OPT_VNC:		vnc_addr = arg;		break;
+		case OPT_HOST_DIR:
+			if (!hostio_set_root(arg)) {
+				fprintf(stderr, "ERROR: Could not open host directory '%s': %s.\n", arg, strerror(errno));
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			usage(program_name);
+			return EXIT_FAILURE;
+	}
+	return OPT_OK;
+}
+
+
+/**
+ * @brief	Read a machine profile.
+ * @param	filename	Profile file.
+ * @return	OPT_OK, or the exit status if the program should stop.
+ *
+ * Each line is a long option without the dashes, then its argument if it has
+ * one, e.g. "base-ram 1024" or "headless"; an '=' between them is allowed.
+ * Blank lines and lines starting with '#' are skipped. The options are
+ * applied in order, as if they'd been given on the command line in place of
+ * --machine.
+ */
+static int load_machine_profile(const char *filename)
+{
+	FILE *fp = fopen(filename, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "ERROR: Could not open machine profile '%s': %s.\n", filename, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	char line[1024];
+	int lineno = 0, rc = OPT_OK;
+	while ((rc == OPT_OK) && (fgets(line, sizeof(line), fp) != NULL)) {
+		lineno++;
+		char *name = line + strspn(line, " \t");
+		name[strcspn(name, "\r\n")] = '\0';
+		if ((*name == '\0') || (*name == '#'))
+			continue;
+
+		// Split off the argument, trimming the blanks round it
+		char *arg = name + strcspn(name, " \t=");
+		if (*arg != '\0') {
+			*arg++ = '\0';
+			arg += strspn(arg, " \t");
+			if (*arg == '=')
+				arg += 1 + strspn(arg + 1, " \t");
+			char *end = arg + strlen(arg);
+			while ((end > arg) && ((end[-1] == ' ') || (end[-1] == '\t')))
+				*--end = '\0';
+		}
+		bool has_arg = (*arg != '\0');
+
+		const struct option *o = long_opts;
+		while ((o->name != NULL) && (strcmp(o->name, name) != 0))
+			o++;
+		if (o->name == NULL) {
+			fprintf(stderr, "ERROR: %s:%d: unknown option '%s'.\n", filename, lineno, name);
+			rc = EXIT_FAILURE;
+		} else if (o->val == OPT_MACHINE) {
+			fprintf(stderr, "ERROR: %s:%d: a machine profile can't read another.\n", filename, lineno);
+			rc = EXIT_FAILURE;
+		} else if (has_arg && (o->has_arg == no_argument)) {
+			fprintf(stderr, "ERROR: %s:%d: '%s' doesn't take an argument.\n", filename, lineno, name);
+			rc = EXIT_FAILURE;
+		} else if (!has_arg && (o->has_arg == required_argument)) {
+			fprintf(stderr, "ERROR: %s:%d: '%s' needs an argument.\n", filename, lineno, name);
+			rc = EXIT_FAILURE;
+		} else {
+			// The options keep pointers to their arguments, like they do
+			// into argv
+			char *copy = has_arg ? strdup(arg) : NULL;
+			if (has_arg && (copy == NULL)) {
+				fprintf(stderr, "ERROR: Out of memory.\n");
+				rc = EXIT_FAILURE;
+			} else {
+				rc = set_option(o->val, copy);
+			}
+		}
+	}
+
+	fclose(fp);
+	return rc;
+}
+
 
 /****************************
  * blessed be thy main()...
  ****************************/
 
-int main(void)
+int main(int argc, char *argv[])
 {
+	int opt;
+
+	program_name = argv[0];
+	while ((opt = getopt_long(argc, argv, "Hs:d:S:TM::C::o:O:f:l:w:c:i:r:n:x:p:P:D:y:b:t:e:mk:X:R:I:q:E:g:G:Zh", long_opts, NULL)) != -1) {
+		int rc = set_option(opt, optarg);
+		if (rc != OPT_OK)
+			return rc;
+	}
+
+	if (compress_image) {
+		if ((argc - optind) != 2) {
+			usage(program_name);
+			return EXIT_FAILURE;
+		}
+		if (!zimage_create(argv[optind], argv[optind + 1], ZIMAGE_DEFAULT_CHUNK)) {
+			fprintf(stderr, "ERROR: Could not compress '%s' into '%s'.\n", argv[optind], argv[optind + 1]);
+			return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
+	}
+
+	if (decode_trace_file) {
+		if (!trace_decode(decode_trace_file, stdout)) {
+			fprintf(stderr, "ERROR: Could not decode trace '%s'.\n", decode_trace_file);
+			return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
+	}
+
+	if (hd_mmap && (hd_cache_limit > 0)) {
+		fprintf(stderr, "ERROR: --mmap-hd and --hd-cache can't be used together.\n");
+		return EXIT_FAILURE;
+	}
+	if (fd_overlay && (fd_nimages > 1)) {
+		fprintf(stderr, "ERROR: --fd-overlay can only be used with a single floppy disc image.\n");
+		return EXIT_FAILURE;
+	}
+	if (load_state_file && resume_file) {
+		fprintf(stderr, "ERROR: --load-state and --resume can't be used together.\n");
+		return EXIT_FAILURE;
+	}
+	if ((nmachines > 1) && (!headless || !hd_overlay)) {
+		fprintf(stderr, "ERROR: --instances needs --headless and --hd-overlay.\n");
+		return EXIT_FAILURE;
+	}
+	if (bench_file && !headless) {
+		fprintf(stderr, "ERROR: --bench needs --headless.\n");
+		return EXIT_FAILURE;
+	}
+	if (trace_file && bench_file) {
+		fprintf(stderr, "ERROR: --trace and --bench can't be used together.\n");
+		return EXIT_FAILURE;
+	}
+	if (hd_overlay && (hd_mmap || (hd_cache_limit > 0))) {
+		fprintf(stderr, "ERROR: --hd-overlay can't be used with --mmap-hd or --hd-cache.\n");
+		return EXIT_FAILURE;
+	}
+
 	// copyright banner
 	printf("FreeBee: A Quick-and-Dirty AT&T 3B1 Emulator. Version %s, %s mode.\n", VER_FULLSTR, VER_BUILD_TYPE);
 	printf("Copyright (C) 2010 P. A. Pemberton. All rights reserved.\nLicensed under the Apache License Version 2.0.\n");
@@ -257,9 +1319,9 @@ int main(void)
 	printf("\n");
 
 	// set up system state
-	// 512K of RAM
+	state_set_rom_files(rom_14c, rom_15c, rom_cache);
 	int i;
-	if ((i = state_init(2048*1024, 2048*1024)) != STATE_E_OK) {
+	if ((i = state_init(base_ram_kb * 1024, exp_ram_kb * 1024)) != STATE_E_OK) {
 		fprintf(stderr, "ERROR: Emulator initialisation failed. Error code %d.\n", i);
 		return i;
 	}
@@ -267,10 +1329,12 @@ int main(void)
 	// set up musashi and reset the CPU
 	m68k_init();
 	m68k_set_cpu_type(M68K_CPU_TYPE_68010);
+	// Track supervisor/user mode for the memory fast path
+	m68k_set_fc_callback(memory_fc_callback);
 	m68k_pulse_reset();
 
-	// Set up SDL
-	if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER) == -1) {
+	// Set up SDL. The timer is needed even without a display (for throttling).
+	if (SDL_Init(headless ? SDL_INIT_TIMER : (SDL_INIT_VIDEO | SDL_INIT_TIMER)) == -1) {
 		printf("Could not initialise SDL: %s.\n", SDL_GetError());
 		exit(EXIT_FAILURE);
 	}
@@ -278,191 +1342,227 @@ int main(void)
 	// Make sure SDL cleans up after itself
 	atexit(SDL_Quit);
 
+	// Write log messages on a thread of their own. Registered after
+	// SDL_Quit, so it runs first and the last messages get out.
+	log_init();
+	atexit(log_done);
+
+	// Count what the machine does on this thread (the emulation thread
+	// registers itself too)
+	stats_thread_register();
+
+	// Time the hot paths before anything else runs
+	if (bench_file)
+		run_microbenchmarks();
+
 	// Set up the video display
 	SDL_Surface *screen = NULL;
-	if ((screen = SDL_SetVideoMode(720, 348, 8, SDL_SWSURFACE | SDL_ANYFORMAT)) == NULL) {
-		printf("Could not find a suitable video mode: %s.\n", SDL_GetError());
+	if (!headless) {
+		if ((screen = SDL_SetVideoMode(720, 348, 8, SDL_SWSURFACE | SDL_ANYFORMAT)) == NULL) {
+			printf("Could not find a suitable video mode: %s.\n", SDL_GetError());
+			exit(EXIT_FAILURE);
+		}
+		printf("Set %dx%d at %d bits-per-pixel mode\n\n", screen->w, screen->h, screen->format->BitsPerPixel);
+		SDL_WM_SetCaption("FreeBee 3B1 emulator", "FreeBee");
+		video_init(screen, palette);
+	} else {
+		// Nothing to draw on, but the VNC server wants the colours
+		video_set_palette(palette);
+	}
+
+	// Load the input script
+	if (script_file && !script_load(script_file)) {
+		fprintf(stderr, "ERROR: Could not open script file '%s'.\n", script_file);
 		exit(EXIT_FAILURE);
 	}
-	printf("Set %dx%d at %d bits-per-pixel mode\n\n", screen->w, screen->h, screen->format->BitsPerPixel);
-	SDL_WM_SetCaption("FreeBee 3B1 emulator", "FreeBee");
 
 	// Load a disc image
 	load_fd();
 
-	load_hd();
+	load_hd(hd_overlay);
 
-	/***
-	 * The 3B1 CPU runs at 10MHz, with DMA running at 1MHz and video refreshing at
-	 * around 60Hz (???), with a 60Hz periodic interrupt.
-	 */
-	const uint32_t SYSTEM_CLOCK = 10e6; // Hz
-	const uint32_t TIMESLOT_FREQUENCY = 100;//240;	// Hz
-	const uint32_t MILLISECS_PER_TIMESLOT = 1e3 / TIMESLOT_FREQUENCY;
-	const uint32_t CLOCKS_PER_60HZ = (SYSTEM_CLOCK / 60);
-	const uint32_t NUM_CPU_TIMESLOTS = 500;
-	uint32_t next_timeslot = SDL_GetTicks() + MILLISECS_PER_TIMESLOT;
-	uint32_t clock_cycles = 0, tmp;
-	bool exitEmu = false;
+	// Pick up where a previous run left off
+	if (load_state_file && !snapshot_load(load_state_file))
+		exit(EXIT_FAILURE);
+	if (resume_file && !snapshot_resume(resume_file))
+		exit(EXIT_FAILURE);
+	// Set up the clock afterwards: it comes back with the rest of the
+	// machine, so a virtual clock carries on from the snapshot's time unless
+	// there's a new epoch
+	tc8250_set_clock(&state->rtc_ctx, rtc_clock, rtc_epoch);
 
-	/*bool lastirq_fdc = false;*/
-	for (;;) {
-		for (i = 0; i < NUM_CPU_TIMESLOTS; i++){
-			// Run the CPU for however many cycles we need to. CPU core clock is
-			// 10MHz, and we're running at 240Hz/timeslot. Thus: 10e6/240 or
-			// 41667 cycles per timeslot.
-			tmp = m68k_execute(SYSTEM_CLOCK/TIMESLOT_FREQUENCY / NUM_CPU_TIMESLOTS);
-			clock_cycles += tmp;
-
-			// Run the DMA engine
-			if (state.dmaen) {
-				// DMA ready to go -- so do it.
-				size_t num = 0;
-				while (state.dma_count < 0x4000) {
-					uint16_t d = 0;
-
-					// num tells us how many words we've copied. If this is greater than the per-timeslot DMA maximum, bail out!
-					if (num > (1e6/TIMESLOT_FREQUENCY)) break;
-	
-					// Evidently we have more words to copy. Copy them.
-					if (state.dma_dev == DMA_DEV_FD){
-						if (!wd2797_get_drq(&state.fdc_ctx)) {
-							// Bail out, no data available. Try again later.
-							break;
-						}
-					}else if (state.dma_dev == DMA_DEV_HD0){
-						if (!wd2010_get_drq(&state.hdc_ctx)) {
-							// Bail out, no data available. Try again later.
-							break;
-						}
-					}else{
-						printf("ERROR: DMA attempt with no drive selected!\n");
-					}
-					if (!access_check_dma(state.dma_reading)) {
-						break;
-					}
-					uint32_t newAddr;
-					// Map logical address to a physical RAM address
-					newAddr = mapAddr(state.dma_address, !state.dma_reading);
-	
-					if (!state.dma_reading) {
-						// Data available. Get it from the FDC or HDC.
-						if (state.dma_dev == DMA_DEV_FD) {
-							d = wd2797_read_reg(&state.fdc_ctx, WD2797_REG_DATA);
-							d <<= 8;
-							d += wd2797_read_reg(&state.fdc_ctx, WD2797_REG_DATA);
-						}else if (state.dma_dev == DMA_DEV_HD0) {
-							d = wd2010_read_data(&state.hdc_ctx);
-							d <<= 8;
-							d += wd2010_read_data(&state.hdc_ctx);
-						}
-						if (newAddr <= 0x1FFFFF) {
-							WR16(state.base_ram, newAddr, state.base_ram_size - 1, d);
-						} else if (newAddr >= 0x200000) {
-							WR16(state.exp_ram, newAddr - 0x200000, state.exp_ram_size - 1, d);
-						}
-					} else {
-						// Data write to FDC or HDC.
-
-						// Get the data from RAM
-						if (newAddr <= 0x1fffff) {
-							d = RD16(state.base_ram, newAddr, state.base_ram_size - 1);
-						} else {
-							if (newAddr <= (state.exp_ram_size + 0x200000 - 1))
-								d = RD16(state.exp_ram, newAddr - 0x200000, state.exp_ram_size - 1);
-							else
-								d = 0xffff;
-						}
-	
-						// Send the data to the FDD or HDD
-						if (state.dma_dev == DMA_DEV_FD){
-							wd2797_write_reg(&state.fdc_ctx, WD2797_REG_DATA, (d >> 8));
-							wd2797_write_reg(&state.fdc_ctx, WD2797_REG_DATA, (d & 0xff));
-						}else if (state.dma_dev == DMA_DEV_HD0){
-							wd2010_write_data(&state.hdc_ctx, (d >> 8));
-							wd2010_write_data(&state.hdc_ctx, (d & 0xff));
-						}
-					}
+	// Start profiling the primary machine
+	if (profile_file) {
+		if (profile_syms && !profile_load_symbols(profile_syms)) {
+			fprintf(stderr, "ERROR: Could not read symbols from '%s'.\n", profile_syms);
+			exit(EXIT_FAILURE);
+		}
+		profile_start(profile_interval, profile_depth);
+	}
 
-					// Increment DMA address
-					state.dma_address+=2;
-					// Increment number of words transferred
-					num++; state.dma_count++;
-				}
+	// Set up any extra machines
+	if ((machines = calloc(nmachines, sizeof(S_state *))) == NULL) {
+		fprintf(stderr, "ERROR: Out of memory.\n");
+		exit(EXIT_FAILURE);
+	}
+	machines[0] = state;
+	for (int m = 1; m < nmachines; m++) {
+		if ((machines[m] = start_instance(m)) == NULL) {
+			fprintf(stderr, "ERROR: Could not start instance %d.\n", m);
+			exit(EXIT_FAILURE);
+		}
+	}
 
-				// Turn off DMA engine if we finished this cycle
-				if (state.dma_count >= 0x4000) {
-					// FIXME? apparently this isn't required... or is it?
-					state.dma_count = 0x3fff;
-					/*state.dmaen = false;*/
-				}
-			}else if (wd2010_get_drq(&state.hdc_ctx)){
-				wd2010_dma_miss(&state.hdc_ctx);
-			}else if (wd2797_get_drq(&state.fdc_ctx)){
-				wd2797_dma_miss(&state.fdc_ctx);
-			}
+	// Start timing the run itself
+	if (bench_file) {
+		for (int m = 0; m < nmachines; m++) {
+			state_select(machines[m]);
+			bench_start();
+		}
+		state_select(machines[0]);
+	}
 
+	// Record and replay input on the primary machine
+	if (record_input_file && !input_record_start(record_input_file)) {
+		fprintf(stderr, "ERROR: Could not create input recording '%s': %s.\n", record_input_file, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if (replay_input_file) {
+		if (!input_replay_start(replay_input_file)) {
+			fprintf(stderr, "ERROR: Could not open input recording '%s': %s.\n", replay_input_file, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		replaying = true;
+	}
 
-			// Any interrupts? --> TODO: masking
-/*			if (!lastirq_fdc) {
-				if (wd2797_get_irq(&state.fdc_ctx)) {
-					lastirq_fdc = true;
-					m68k_set_irq(2);
-				}
-			}
-*/
-			if (wd2797_get_irq(&state.fdc_ctx) || wd2010_get_irq(&state.hdc_ctx)) {
-				m68k_set_irq(2);
-			}else if (keyboard_get_irq(&state.kbd)) {
-				m68k_set_irq(3);
-			} else {
-//				if (!state.timer_asserted){
-					m68k_set_irq(0);
-//				}
+	// Start tracing
+	if (trace_file) {
+		char *name = malloc(strlen(trace_file) + 16);
+		if (name == NULL) {
+			fprintf(stderr, "ERROR: Out of memory.\n");
+			exit(EXIT_FAILURE);
+		}
+		for (int m = 0; m < nmachines; m++) {
+			if (m == 0)
+				strcpy(name, trace_file);
+			else
+				sprintf(name, "%s.%d", trace_file, m);
+			state_select(machines[m]);
+			if (!trace_start(name, trace_size * 1024 * 1024, trace_flags, trace_stop)) {
+				fprintf(stderr, "ERROR: Could not start trace '%s': %s.\n", name, strerror(errno));
+				exit(EXIT_FAILURE);
 			}
 		}
-		// Is it time to run the 60Hz periodic interrupt yet?
-		if (clock_cycles > CLOCKS_PER_60HZ) {
-			// Refresh the screen
-			refreshScreen(screen);
-			if (state.timer_enabled){
-				m68k_set_irq(6);
-				state.timer_asserted = true;
+		state_select(machines[0]);
+		free(name);
+	}
+
+	// Let remote clients see and drive the primary machine
+	if (vnc_addr && !vnc_start(vnc_addr))
+		exit(EXIT_FAILURE);
+
+	if (headless) {
+		// No display, so just run the emulation on this thread
+		signal(SIGINT, exit_signal);
+		signal(SIGTERM, exit_signal);
+		emulation_thread(NULL);
+	} else {
+		// Start the emulation thread
+		SDL_Thread *emu_thread = SDL_CreateThread(emulation_thread, NULL);
+		if (emu_thread == NULL) {
+			printf("Could not start emulation thread: %s.\n", SDL_GetError());
+			exit(EXIT_FAILURE);
+		}
+
+		// This thread looks after the display and SDL events (SDL 1.2 requires
+		// both to be on the thread which set the video mode). Aim for 60Hz.
+		const uint32_t MILLISECS_PER_FRAME = 1e3 / 60;
+		uint32_t shown_khz = 0;
+		for (;;) {
+			uint32_t frame_start = SDL_GetTicks();
+
+			// handle SDL events -- returns true if we need to exit
+			if (HandleSDLEvents(screen) || __atomic_load_n(&exit_requested, __ATOMIC_ACQUIRE))
+				break;
+
+			// Draw the latest frame from the emulation thread
+			video_refresh(screen);
+
+			// Show the achieved emulation speed in the title bar
+			uint32_t khz = __atomic_load_n(&emu_khz, __ATOMIC_RELAXED);
+			if (khz != shown_khz) {
+				char caption[64];
+				snprintf(caption, sizeof(caption), "FreeBee 3B1 emulator - %u.%02u MHz", khz / 1000, (khz % 1000) / 10);
+				SDL_WM_SetCaption(caption, "FreeBee");
+				shown_khz = khz;
 			}
-			// scan the keyboard
-			keyboard_scan(&state.kbd);
-			// decrement clock cycle counter, we've handled the intr.
-			clock_cycles -= CLOCKS_PER_60HZ;
+
+			uint32_t elapsed = SDL_GetTicks() - frame_start;
+			if (elapsed < MILLISECS_PER_FRAME)
+				SDL_Delay(MILLISECS_PER_FRAME - elapsed);
 		}
 
-		// handle SDL events -- returns true if we need to exit
-		if (HandleSDLEvents(screen))
-			exitEmu = true;
+		// Stop the emulation thread
+		__atomic_store_n(&exit_requested, true, __ATOMIC_RELEASE);
+		SDL_WaitThread(emu_thread, NULL);
+	}
 
-		// make sure frame rate is equal to real time
-		uint32_t now = SDL_GetTicks();
-		if (now < next_timeslot) {
-			// timeslot finished early -- eat up some time
-			SDL_Delay(next_timeslot - now);
-		} else {
-			// timeslot finished late -- skip ahead to gain time
-			// TODO: if this happens a lot, we should let the user know
-			// that their PC might not be fast enough...
-			next_timeslot = now;
+	// Nothing more to show, so let the client go
+	vnc_done();
+
+	// Finish the input recording where the run ended
+	if (!input_record_done(sched_now()))
+		fprintf(stderr, "ERROR: Could not write input recording '%s'.\n", record_input_file);
+
+	// Write the benchmark report while the timings are fresh
+	if (bench_file) {
+		uint64_t cycles = 0;
+		for (int m = 0; m < nmachines; m++) {
+			state_select(machines[m]);
+			cycles += sched_now();
 		}
-		// advance to the next timeslot
-		next_timeslot += MILLISECS_PER_TIMESLOT;
+		state_select(machines[0]);
+		if (!bench_write(bench_file, cycles))
+			fprintf(stderr, "ERROR: Could not write benchmark report '%s'.\n", bench_file);
+	}
 
-		// if we've been asked to exit the emulator, then do so.
-		if (exitEmu) break;
+	// Save the final screen contents if we've been asked to
+	if (dump_file && !video_dump_pbm(dump_file))
+		fprintf(stderr, "ERROR: Could not write screen dump '%s'.\n", dump_file);
+
+	// Export the counters if we've been asked to
+	if (stats_file && !stats_write(stats_file, stats_format_for(stats_file)))
+		fprintf(stderr, "ERROR: Could not write counters to '%s'.\n", stats_file);
+
+	// Write out the guest profile
+	if (profile_file) {
+		if (!profile_write(profile_file))
+			fprintf(stderr, "ERROR: Could not write profile '%s'.\n", profile_file);
+		profile_done();
 	}
 
-	// Close the disc images before exiting
-	wd2797_unload(&state.fdc_ctx);
+	// Save the machine state if we've been asked to
+	if (save_state_file && !snapshot_save(save_state_file))
+		fprintf(stderr, "ERROR: Could not save snapshot '%s'.\n", save_state_file);
 
-	if (state.fdc_disc != NULL) {
-		fclose(state.fdc_disc);
+	// Close the trace files
+	if (trace_file) {
+		for (int m = 0; m < nmachines; m++) {
+			state_select(machines[m]);
+			trace_done();
+		}
+		state_select(machines[0]);
 	}
 
+	// Write back and close the disc images before exiting
+	for (int m = 1; m < nmachines; m++) {
+		state_select(machines[m]);
+		state_done();
+		state_select(machines[0]);
+		state_free(machines[m]);
+	}
+	free(machines);
+	state_done();
+
 	return 0;
 }
@@ -3,10 +3,15 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <string.h>
 #include "musashi/m68k.h"
 #include "state.h"
 #include "utils.h"
 #include "memory.h"
+#include "sched.h"
+#include "irq.h"
+#include "stats.h"
+#include "trace.h"
 
 // The value which will be returned if the CPU attempts to read from empty memory
 // TODO (FIXME?) - need to figure out if R/W ops wrap around. This seems to appease the UNIX kernel and P4TEST.
@@ -18,7 +23,39 @@
  * Memory mapping
  ******************/
 
-#define MAPRAM(addr) (((uint16_t)state.map[addr*2] << 8) + ((uint16_t)state.map[(addr*2)+1]))
+#define MAPRAM(addr) (((uint16_t)state->map[addr*2] << 8) + ((uint16_t)state->map[(addr*2)+1]))
+
+/// CPU address with the ROMLMAP override applied
+#define ROMLMAP_ADDR(addr) (state->romlmap ? (addr) : ((addr) | 0x800000))
+
+/// Record a CPU memory access in the binary trace, if there is one
+#define TRACE_MEM(address, bits, writing, value, st) do {					\
+	if (state->trace)														\
+		trace_mem(address, bits, writing, value, st);						\
+} while (0)
+
+/// Permission bit needed in a PAGE_ENTRY to take the fast path for an access
+#define PERM_NEEDED(writing) ((cpu_is_supervisor() ? PERM_SUPER_RD : PERM_USER_RD) << ((writing) ? 1 : 0))
+
+/**
+ * @brief	Check whether the CPU is in supervisor mode.
+ */
+static inline bool cpu_is_supervisor(void)
+{
+#if M68K_EMULATE_FC == OPT_ON
+	return state->supervisor;
+#else
+	// Without the function code callback, the only option is to ask the CPU
+	return (m68k_get_reg(NULL, M68K_REG_SR) & 0x2000) != 0;
+#endif
+}
+
+void memory_fc_callback(unsigned int fc)
+{
+	// FC2 is set for supervisor data and program accesses (and CPU space)
+	state->supervisor = (fc & 4) != 0;
+	state->program = (fc & 3) == 2;
+}
 
 static uint32_t map_address_debug(uint32_t addr)
 {
@@ -29,6 +66,124 @@ static uint32_t map_address_debug(uint32_t addr)
 	return (new_page_addr << 12) + (addr & 0xFFF);
 }
 
+void memory_peek_code(uint32_t address, uint16_t *words, int n)
+{
+	for (int i = 0; i < n; i++, address += 2) {
+		uint32_t a = ROMLMAP_ADDR(address);
+		const PAGE_ENTRY *pe = &state->pages[(a >> 12) & (MEM_NUM_PAGES - 1)];
+		if (((pe->type == PAGE_ROM) || (pe->type == PAGE_RAM)) && (pe->rd != NULL))
+			words[i] = RD16_FAST(pe->rd, a, pe->mask);
+		else
+			words[i] = EMPTY & 0xffff;
+	}
+}
+
+/**
+ * @brief	Point a RAM zone dispatch entry at the physical page selected by
+ * 			its TLB entry.
+ * @param	pe			Dispatch table entry.
+ * @param	page		RAM zone page number (0 to 1023).
+ */
+static void set_ram_page(PAGE_ENTRY *pe, uint16_t page)/*{{{*/
+{
+	uint32_t phys = (uint32_t)state->tlb[page].phys << 12;
+
+	pe->type = PAGE_RAM;
+	pe->perm = state->tlb[page].perm;
+	pe->mask = 0xFFF;
+	pe->rd = pe->wr = NULL;
+	if (phys <= 0x1fffff) {
+		// Base memory wraps around on reads, but writes past the end are discarded
+		pe->rd = state->base_ram + (phys & (state->base_ram_size - 1));
+		if (phys < state->base_ram_size)
+			pe->wr = state->base_ram + phys;
+	} else if ((phys - 0x200000) < state->exp_ram_size) {
+		pe->rd = pe->wr = state->exp_ram + (phys - 0x200000);
+	}
+}/*}}}*/
+
+/**
+ * @brief	Decode a Map RAM entry into the TLB, and refresh the matching
+ * 			dispatch table entry.
+ * @param	page		RAM zone page number (0 to 1023).
+ */
+static void tlb_refresh(uint16_t page)/*{{{*/
+{
+	TLB_ENTRY *te = &state->tlb[page];
+	uint16_t mapent = MAPRAM(page);
+
+	te->phys = mapent & 0x3FF;
+	te->status = (mapent >> 13) & 0x03;
+	te->we = (mapent & 0x8000) != 0;
+
+	// Accesses which would update the Page Status bits take the slow path,
+	// so only the first read and the first write to a page pay for it.
+	te->perm = 0;
+	if (te->status >= 2)
+		te->perm |= PERM_SUPER_RD;
+	if (te->status == 3)
+		te->perm |= PERM_SUPER_WR;
+	// User mode can't touch the kernel's pages (A19..A22 low); the "user may
+	// read off the bottom of page 0" case is left to the slow path.
+	if (page >= 0x80) {
+		if (te->status >= 2)
+			te->perm |= PERM_USER_RD;
+		if (te->status == 3 && te->we)
+			te->perm |= PERM_USER_WR;
+	}
+
+	// The RAM zone is only mapped into the dispatch table if ROMLMAP is set
+	if (state->romlmap)
+		set_ram_page(&state->pages[page], page);
+}/*}}}*/
+
+/**
+ * @brief	Update the Page Status bits in the Map RAM for a RAM access.
+ * @param	page		RAM zone page number (0 to 1023).
+ * @param	writing		true if writing to memory, false if reading.
+ */
+static inline void updatePageStatus(uint16_t page, bool writing)/*{{{*/
+{
+	// Nothing to do if the page has already been accessed this way
+	if (state->tlb[page].status >= (writing ? 3 : 2))
+		return;
+
+	// Pagebits --
+	//   0 = not present
+	//   1 = present but not accessed
+	//   2 = present, accessed (read from)
+	//   3 = present, dirty (written to)
+	switch (state->tlb[page].status) {
+		case 0:
+			// Page not present
+			// This should cause a page fault
+			LOGS("Whoa! Pagebit update, when the page is not present!");
+			return;
+
+		case 1:
+			// Page present -- first access
+			state->map[page*2] &= 0x9F;	// turn off "present" bit (but not write enable!)
+			if (writing)
+				state->map[page*2] |= 0x60;		// Page written to (dirty)
+			else
+				state->map[page*2] |= 0x40;		// Page accessed but not written
+			break;
+
+		case 2:
+			// Page present, 2nd or later access
+			if (!writing)
+				return;
+			state->map[page*2] |= 0x60;		// Page written to (dirty)
+			break;
+
+		case 3:
+			// Already dirty; nothing to do
+			return;
+	}
+
+	tlb_refresh(page);
+}/*}}}*/
+
 uint32_t mapAddr(uint32_t addr, bool writing)/*{{{*/
 {
 	if (addr < 0x400000) {
@@ -36,42 +191,11 @@ uint32_t mapAddr(uint32_t addr, bool writing)/*{{{*/
 		// Start by getting the original page address
 		uint16_t page = (addr >> 12) & 0x3FF;
 
-		// Look it up in the map RAM and get the physical page address
-		uint32_t new_page_addr = MAPRAM(page) & 0x3FF;
-
 		// Update the Page Status bits
-		uint8_t pagebits = (MAPRAM(page) >> 13) & 0x03;
-		// Pagebits --
-		//   0 = not present
-		//   1 = present but not accessed
-		//   2 = present, accessed (read from)
-		//   3 = present, dirty (written to)
-		switch (pagebits) {
-			case 0:
-				// Page not present
-				// This should cause a page fault
-				LOGS("Whoa! Pagebit update, when the page is not present!");
-				break;
-
-			case 1:
-				// Page present -- first access
-				state.map[page*2] &= 0x9F;	// turn off "present" bit (but not write enable!)
-				if (writing)
-					state.map[page*2] |= 0x60;		// Page written to (dirty)
-				else
-					state.map[page*2] |= 0x40;		// Page accessed but not written
-				break;
-
-			case 2:
-			case 3:
-				// Page present, 2nd or later access
-				if (writing)
-					state.map[page*2] |= 0x60;		// Page written to (dirty)
-				break;
-		}
+		updatePageStatus(page, writing);
 
 		// Return the address with the new physical page spliced in
-		return (new_page_addr << 12) + (addr & 0xFFF);
+		return ((uint32_t)state->tlb[page].phys << 12) + (addr & 0xFFF);
 	} else {
 		// I/O, VRAM or MapRAM space; no mapping is performed or required
 		// TODO: assert here?
@@ -79,20 +203,130 @@ uint32_t mapAddr(uint32_t addr, bool writing)/*{{{*/
 	}
 }/*}}}*/
 
+uint8_t *memory_phys_ptr(uint32_t addr, bool writing)
+{
+	if (addr <= 0x1FFFFF)
+		return state->base_ram + (addr & (state->base_ram_size - 1));
+	if (state->exp_ram_size == 0)
+		return NULL;
+	if (writing || (addr <= (state->exp_ram_size + 0x200000 - 1)))
+		return state->exp_ram + ((addr - 0x200000) & (state->exp_ram_size - 1));
+	return NULL;
+}
+
+void memory_phys_written(uint32_t addr)
+{
+	if (addr <= 0x1FFFFF)
+		RAM_PAGE_WRITTEN((addr & (state->base_ram_size - 1)) >> 12);
+	else if (state->exp_ram_size > 0)
+		RAM_PAGE_WRITTEN((0x200000 + ((addr - 0x200000) & (state->exp_ram_size - 1))) >> 12);
+}
+
+/********************************************************
+ * Page dispatch table
+ ********************************************************/
+
+void memory_rebuild_page_table(void)/*{{{*/
+{
+	// Decode the Map RAM first, the RAM zone entries are built from it
+	for (uint16_t page = 0; page < MEM_NUM_MAP_PAGES; page++)
+		tlb_refresh(page);
+
+	for (uint32_t page = 0; page < MEM_NUM_PAGES; page++) {
+		PAGE_ENTRY *pe = &state->pages[page];
+		// If ROMLMAP is clear, the system is forced to access ROM
+		uint32_t address = ROMLMAP_ADDR(page << 12);
+
+		if (address <= 0x3FFFFF) {
+			// RAM, mapped through the Map RAM
+			set_ram_page(pe, page);
+			continue;
+		}
+
+		// Everything outside the RAM zone is supervisor-only
+		pe->perm = PERM_SUPER_RD | PERM_SUPER_WR;
+		pe->rd = pe->wr = NULL;
+		pe->mask = 0;
+		if ((address >= 0x800000) && (address <= 0xBFFFFF)) {
+			// ROM -- read only
+			pe->type = PAGE_ROM;
+			pe->rd = state->rom;
+			pe->mask = ROM_SIZE - 1;
+		} else if ((address >= 0x400000) && (address <= 0x7FFFFF)) {
+			// I/O register space, zone A
+			switch (address & 0x0F0000) {
+				case 0x000000:				// Map RAM
+					pe->type = PAGE_MAP;
+					pe->rd = pe->wr = state->map;
+					pe->mask = 0x7FF;
+					break;
+				case 0x020000:				// Video RAM
+					pe->type = PAGE_VRAM;
+					pe->rd = pe->wr = state->vram;
+					pe->mask = 0x7FFF;
+					break;
+				default:
+					pe->type = PAGE_IO;
+					break;
+			}
+		} else {
+			// I/O register space, zone B
+			pe->type = PAGE_IO;
+		}
+	}
+}/*}}}*/
+
+/**
+ * @brief	Mark the scanlines touched by a Video RAM write as dirty.
+ * @param	address		Address of the write.
+ * @param	len			Number of bytes written.
+ */
+static inline void vram_written(uint32_t address, int len)/*{{{*/
+{
+	uint32_t offset = address & (sizeof(state->vram) - 1);
+	uint32_t last = offset + len - 1;
+
+	// The end of VRAM past the last scanline isn't displayed
+	if (offset >= VRAM_HEIGHT * VRAM_LINE_BYTES)
+		return;
+	if (last >= VRAM_HEIGHT * VRAM_LINE_BYTES)
+		last = (VRAM_HEIGHT * VRAM_LINE_BYTES) - 1;
+
+	for (uint32_t line = offset / VRAM_LINE_BYTES; line <= last / VRAM_LINE_BYTES; line++)
+		state->vram_dirty[line / 32] |= (uint32_t)1 << (line % 32);
+}/*}}}*/
+
+void memory_vram_invalidate(void)/*{{{*/
+{
+	memset(state->vram_dirty, 0xff, sizeof(state->vram_dirty));
+}/*}}}*/
+
+/**
+ * @brief	Refresh the TLB entries affected by a Map RAM write.
+ * @param	address		Address of the write.
+ * @param	len			Number of bytes written.
+ */
+static void map_ram_written(uint32_t address, int len)/*{{{*/
+{
+	// Each Map RAM entry is two bytes wide
+	for (uint32_t a = address & ~1; a < address + len; a += 2)
+		tlb_refresh((a & 0x7FF) >> 1);
+}/*}}}*/
+
 MEM_STATUS checkMemoryAccess(uint32_t addr, bool writing, bool dma)/*{{{*/
 {
-	// Get the page bits for this page.
+	// Get the decoded Map RAM entry for this page.
 	uint16_t page = (addr >> 12) & 0x3FF;
-	uint8_t pagebits = (MAPRAM(page) >> 13) & 0x07;
+	const TLB_ENTRY *te = &state->tlb[page];
 
 	// Check page is present (but only for RAM zone)
-	if ((addr < 0x400000) && ((pagebits & 0x03) == 0)) {
+	if ((addr < 0x400000) && (te->status == 0)) {
 		LOG("Page not mapped in: addr %08X, page %04X, mapbits %04X", addr, page, MAPRAM(page));
 		return MEM_PAGEFAULT;
 	}
 
 	// Are we in Supervisor mode?
-	if (dma || (m68k_get_reg(NULL, M68K_REG_SR) & 0x2000))
+	if (dma || cpu_is_supervisor())
 		// Yes. We can do anything we like.
 		return MEM_ALLOWED;
 
@@ -111,9 +345,9 @@ MEM_STATUS checkMemoryAccess(uint32_t addr, bool writing, bool dma)/*{{{*/
 	}
 
 	// Check page is write enabled
-	if (writing && ((pagebits & 0x04) == 0)) {
+	if (writing && !te->we) {
 		LOG("Page not write enabled: inaddr %08X, page %04X, mapram %04X [%02X %02X], pagebits %d",
-				addr, page, MAPRAM(page), state.map[page*2], state.map[(page*2)+1], pagebits);
+				addr, page, MAPRAM(page), state->map[page*2], state->map[(page*2)+1], (MAPRAM(page) >> 13) & 0x07);
 		return MEM_PAGE_NO_WE;
 	}
 	// Page access allowed.
@@ -128,19 +362,19 @@ MEM_STATUS checkMemoryAccess(uint32_t addr, bool writing, bool dma)/*{{{*/
 				break;												\
 			case MEM_PAGEFAULT:										\
 				/* Page fault */									\
-				state.genstat = 0x8BFF | (state.pie ? 0x0400 : 0);	\
+				state->genstat = 0x8BFF | (state->pie ? 0x0400 : 0);	\
 				fault = true;										\
 				break;												\
 			case MEM_UIE:											\
 				/* User access to memory above 4MB */				\
-				state.genstat = 0x9AFF | (state.pie ? 0x0400 : 0);	\
+				state->genstat = 0x9AFF | (state->pie ? 0x0400 : 0);	\
 				fault = true;										\
 				break;												\
 			case MEM_KERNEL:										\
 			case MEM_PAGE_NO_WE:									\
 				/* kernel access or page not write enabled */		\
 				/* XXX: is this the correct value? */				\
-				state.genstat = 0x9BFF | (state.pie ? 0x0400 : 0);	\
+				state->genstat = 0x9BFF | (state->pie ? 0x0400 : 0);	\
 				fault = true;										\
 				break;												\
 		}															\
@@ -161,8 +395,8 @@ MEM_STATUS checkMemoryAccess(uint32_t addr, bool writing, bool dma)/*{{{*/
  * 			in a non-void function, even if it's impossible to ever reach the
  * 			return-with-no-value. UGH!
  */
-/*{{{ macro: ACCESS_CHECK_WR(address, bits)*/
-#define ACCESS_CHECK_WR(address, bits)								\
+/*{{{ macro: ACCESS_CHECK_WR(address, bits, value)*/
+#define ACCESS_CHECK_WR(address, bits, value)						\
 	do {															\
 		bool fault = false;											\
 		MEM_STATUS st;												\
@@ -172,14 +406,16 @@ MEM_STATUS checkMemoryAccess(uint32_t addr, bool writing, bool dma)/*{{{*/
 			_ACCESS_CHECK_WR_BYTE(address + 3);						\
 		}															\
 		if (fault) {												\
+			STAT_INC(faults[st]);									\
 			if (bits >= 16)											\
-				state.bsr0 = 0x7C00;								\
+				state->bsr0 = 0x7C00;								\
 			else													\
-				state.bsr0 = (address & 1) ? 0x7E00 : 0x7D00;		\
-			state.bsr0 |= (address >> 16);							\
-			state.bsr1 = address & 0xffff;							\
+				state->bsr0 = (address & 1) ? 0x7E00 : 0x7D00;		\
+			state->bsr0 |= (address >> 16);							\
+			state->bsr1 = address & 0xffff;							\
 			LOG("Bus Error while writing, addr %08X, statcode %d", address, st);		\
-			if (state.ee) m68k_pulse_bus_error();					\
+			TRACE_MEM(address, bits, true, value, st);					\
+			if (state->ee) m68k_pulse_bus_error();					\
 			return;													\
 		}															\
 	} while (0)
@@ -193,19 +429,19 @@ MEM_STATUS checkMemoryAccess(uint32_t addr, bool writing, bool dma)/*{{{*/
 				break;												\
 			case MEM_PAGEFAULT:										\
 				/* Page fault */									\
-				state.genstat = 0xCBFF | (state.pie ? 0x0400 : 0);	\
+				state->genstat = 0xCBFF | (state->pie ? 0x0400 : 0);	\
 				fault = true;										\
 				break;												\
 			case MEM_UIE:											\
 				/* User access to memory above 4MB */				\
-				state.genstat = 0xDAFF | (state.pie ? 0x0400 : 0);	\
+				state->genstat = 0xDAFF | (state->pie ? 0x0400 : 0);	\
 				fault = true;										\
 				break;												\
 			case MEM_KERNEL:										\
 			case MEM_PAGE_NO_WE:									\
 				/* kernel access or page not write enabled */		\
 				/* XXX: is this the correct value? */				\
-				state.genstat = 0xDBFF | (state.pie ? 0x0400 : 0);	\
+				state->genstat = 0xDBFF | (state->pie ? 0x0400 : 0);	\
 				fault = true;										\
 				break;												\
 		}															\
@@ -234,14 +470,16 @@ MEM_STATUS checkMemoryAccess(uint32_t addr, bool writing, bool dma)/*{{{*/
 		}															\
 																	\
 		if (fault) {												\
+			STAT_INC(faults[st]);									\
 			if (bits >= 16)											\
-				state.bsr0 = 0x7C00;								\
+				state->bsr0 = 0x7C00;								\
 			else													\
-				state.bsr0 = (faultAddr & 1) ? 0x7E00 : 0x7D00;		\
-			state.bsr0 |= (faultAddr >> 16);							\
-			state.bsr1 = faultAddr & 0xffff;							\
+				state->bsr0 = (faultAddr & 1) ? 0x7E00 : 0x7D00;		\
+			state->bsr0 |= (faultAddr >> 16);							\
+			state->bsr1 = faultAddr & 0xffff;							\
 			LOG("Bus Error while reading, addr %08X, statcode %d", faultAddr, st);		\
-			if (state.ee) m68k_pulse_bus_error();					\
+			TRACE_MEM(faultAddr, bits, false, EMPTY, st);				\
+			if (state->ee) m68k_pulse_bus_error();					\
 			if (bits >= 32)											\
 				return EMPTY & 0xFFFFFFFF;									\
 			else													\
@@ -254,21 +492,22 @@ bool access_check_dma(int reading)
 {
 	// Check memory access permissions
 	bool access_ok = false;
-	switch (checkMemoryAccess(state.dma_address, !reading, true)) {
+	MEM_STATUS st = checkMemoryAccess(state->dma_address, !reading, true);
+	switch (st) {
 		case MEM_PAGEFAULT:
 			// Page fault
-			state.genstat = 0xABFF
+			state->genstat = 0xABFF
 				| (reading ? 0x4000 : 0)
-				| (state.pie ? 0x0400 : 0);
+				| (state->pie ? 0x0400 : 0);
 			access_ok = false;
 			break;
 
 		case MEM_UIE:
 			// User access to memory above 4MB
 			// FIXME? Shouldn't be possible with DMA... assert this?
-			state.genstat = 0xBAFF
+			state->genstat = 0xBAFF
 				| (reading ? 0x4000 : 0)
-				| (state.pie ? 0x0400 : 0);
+				| (state->pie ? 0x0400 : 0);
 			access_ok = false;
 			break;
 
@@ -276,9 +515,9 @@ bool access_check_dma(int reading)
 		case MEM_PAGE_NO_WE:
 			// Kernel access or page not write enabled
 			/* XXX: is this correct? */
-			state.genstat = 0xBBFF
+			state->genstat = 0xBBFF
 				| (reading ? 0x4000 : 0)
-				| (state.pie ? 0x0400 : 0);
+				| (state->pie ? 0x0400 : 0);
 			access_ok = false;
 			break;
 
@@ -287,21 +526,22 @@ bool access_check_dma(int reading)
 			break;
 	}
 	if (!access_ok) {
-		state.bsr0 = 0x3C00;
-		state.bsr0 |= (state.dma_address >> 16);
-		state.bsr1 = state.dma_address & 0xffff;
-		if (state.ee) m68k_set_irq(7);
-		printf("BUS ERROR FROM DMA: genstat=%04X, bsr0=%04X, bsr1=%04X\n", state.genstat, state.bsr0, state.bsr1);
+		STAT_INC(faults[st]);
+		state->bsr0 = 0x3C00;
+		state->bsr0 |= (state->dma_address >> 16);
+		state->bsr1 = state->dma_address & 0xffff;
+		if (state->ee) irq_nmi();
+		LOG_NOTE("BUS ERROR FROM DMA: genstat=%04X, bsr0=%04X, bsr1=%04X", state->genstat, state->bsr0, state->bsr1);
 	}
 	return (access_ok);
 }
 
 // Logging macros
 #define LOG_NOT_HANDLED_R(bits)															\
-	if (!handled) printf("unhandled read%02d, addr=0x%08X\n", bits, address);
+	if (!handled) LOG_NOTE("unhandled read%02d, addr=0x%08X", bits, address);
 
 #define LOG_NOT_HANDLED_W(bits)															\
-	if (!handled) printf("unhandled write%02d, addr=0x%08X, data=0x%08X\n", bits, address, data);
+	if (!handled) LOG_NOTE("unhandled write%02d, addr=0x%08X, data=0x%08X", bits, address, data);
 
 /********************************************************
  * I/O read/write functions
@@ -314,7 +554,7 @@ inline static void ENFORCE_SIZE(int bits, uint32_t address, bool read, int allow
 {
 	assert((bits == 8) || (bits == 16) || (bits == 32));
 	if ((bits & allowed) == 0) {
-		printf("WARNING: %s 0x%08X (%s) with invalid size %d!\n", read ? "read from" : "write to", address, regname, bits);
+		LOG_NOTE("WARNING: %s 0x%08X (%s) with invalid size %d!", read ? "read from" : "write to", address, regname, bits);
 	}
 }
 
@@ -330,6 +570,11 @@ inline static void ENFORCE_SIZE_W(int bits, uint32_t address, int allowed, char
 
 void IoWrite(uint32_t address, uint32_t data, int bits)/*{{{*/
 {
+	// Device registers may change interrupt or DMA state, so let the main
+	// loop look at them as soon as this instruction finishes
+	sched_sync();
+	STAT_INC(io_writes[stats_io_reg(address)]);
+
 	bool handled = false;
 
 	if ((address >= 0x400000) && (address <= 0x7FFFFF)) {
@@ -337,12 +582,12 @@ void IoWrite(uint32_t address, uint32_t data, int bits)/*{{{*/
 		switch (address & 0x0F0000) {
 			case 0x010000:				// General Status Register
 				if (bits == 16)
-					state.genstat = (data & 0xffff);
+					state->genstat = (data & 0xffff);
 				else if (bits == 8) {
 					if (address & 0)
-						state.genstat = data;
+						state->genstat = data;
 					else
-						state.genstat = data << 8;
+						state->genstat = data << 8;
 				}
 				handled = true;
 				break;
@@ -354,24 +599,24 @@ void IoWrite(uint32_t address, uint32_t data, int bits)/*{{{*/
 				break;
 			case 0x060000:				// DMA Count
 				ENFORCE_SIZE_W(bits, address, 16, "DMACOUNT");
-				state.dma_count = (data & 0x3FFF);
-				state.idmarw = ((data & 0x4000) == 0x4000);
-				state.dmaen = ((data & 0x8000) == 0x8000);
+				state->dma_count = (data & 0x3FFF);
+				state->idmarw = ((data & 0x4000) == 0x4000);
+				state->dmaen = ((data & 0x8000) == 0x8000);
 				// This handles the "dummy DMA transfer" mentioned in the docs
 				// disabled because it causes the floppy test to fail
 #if 0
-				if (!state.idmarw){
+				if (!state->idmarw){
 					if (access_check_dma(true)){
-						uint32_t newAddr = mapAddr(state.dma_address, true);
+						uint32_t newAddr = mapAddr(state->dma_address, true);
 						// RAM access
 						if (newAddr <= 0x1fffff)
-							WR16(state.base_ram, newAddr, state.base_ram_size - 1, 0xFF);
+							WR16(state->base_ram, newAddr, state->base_ram_size - 1, 0xFF);
 						else if (address <= 0x3FFFFF)
-							WR16(state.exp_ram, newAddr - 0x200000, state.exp_ram_size - 1, 0xFF);
+							WR16(state->exp_ram, newAddr - 0x200000, state->exp_ram_size - 1, 0xFF);
 					}
 				}
 #endif
-				state.dma_count++;
+				state->dma_count++;
 				handled = true;
 				break;
 			case 0x070000:				// Line Printer Status Register
@@ -379,10 +624,10 @@ void IoWrite(uint32_t address, uint32_t data, int bits)/*{{{*/
 			case 0x080000:				// Real Time Clock
 				ENFORCE_SIZE_W(bits, address, 16, "RTCWRITE");
 				/*printf("IoWrite RTCWRITE %x\n", data);*/
-				tc8250_set_chip_enable(&state.rtc_ctx, data & 0x8000);
-				tc8250_set_address_latch_enable(&state.rtc_ctx, data & 0x4000);
-				tc8250_set_write_enable(&state.rtc_ctx, data & 0x2000);
-				tc8250_write_reg(&state.rtc_ctx, (data & 0x0F00) >> 8);
+				tc8250_set_chip_enable(&state->rtc_ctx, data & 0x8000);
+				tc8250_set_address_latch_enable(&state->rtc_ctx, data & 0x4000);
+				tc8250_set_write_enable(&state->rtc_ctx, data & 0x2000);
+				tc8250_write_reg(&state->rtc_ctx, (data & 0x0F00) >> 8);
 				handled = true;
 				break;
 			case 0x090000:				// Phone registers
@@ -417,20 +662,22 @@ void IoWrite(uint32_t address, uint32_t data, int bits)/*{{{*/
 				ENFORCE_SIZE_W(bits, address, 16, "MISCCON");
 				// TODO: handle the ctrl bits properly
 				if (data & 0x8000){
-					state.timer_enabled = 1;
+					state->timer_enabled = 1;
 				}else{
-					state.timer_enabled = 0;
-					state.timer_asserted = 0;
+					state->timer_enabled = 0;
+					state->timer_asserted = 0;
 				}
-				state.dma_reading = (data & 0x4000);
-				if (state.leds != ((~data & 0xF00) >> 8)) {
-					state.leds = (~data & 0xF00) >> 8;
+				// The timer enable also masks the timer interrupt
+				irq_set_enabled(IRQ_TIMER, state->timer_enabled);
+				state->dma_reading = (data & 0x4000);
+				if (state->leds != ((~data & 0xF00) >> 8)) {
+					state->leds = (~data & 0xF00) >> 8;
 #ifdef SHOW_LEDS
 					printf("LEDs: %s %s %s %s\n",
-							(state.leds & 8) ? "R" : "-",
-							(state.leds & 4) ? "G" : "-",
-							(state.leds & 2) ? "Y" : "-",
-							(state.leds & 1) ? "R" : "-");
+							(state->leds & 8) ? "R" : "-",
+							(state->leds & 4) ? "G" : "-",
+							(state->leds & 2) ? "Y" : "-",
+							(state->leds & 1) ? "R" : "-");
 #endif
 				}
 				handled = true;
@@ -438,18 +685,18 @@ void IoWrite(uint32_t address, uint32_t data, int bits)/*{{{*/
 			case 0x0B0000:				// TM/DIALWR
 				break;
 			case 0x0C0000:				// Clear Status Register
-				state.genstat = 0xFFFF;
-				state.bsr0 = 0xFFFF;
-				state.bsr1 = 0xFFFF;
+				state->genstat = 0xFFFF;
+				state->bsr0 = 0xFFFF;
+				state->bsr1 = 0xFFFF;
 				handled = true;
 				break;
 			case 0x0D0000:				// DMA Address Register
 				if (address & 0x004000) {
 					// A14 high -- set most significant bits
-					state.dma_address = (state.dma_address & 0x1fe) | ((address & 0x3ffe) << 8);
+					state->dma_address = (state->dma_address & 0x1fe) | ((address & 0x3ffe) << 8);
 				} else {
 					// A14 low -- set least significant bits
-					state.dma_address = (state.dma_address & 0x3ffe00) | (address & 0x1fe);
+					state->dma_address = (state->dma_address & 0x3ffe00) | (address & 0x1fe);
 				}
 				handled = true;
 				break;
@@ -460,32 +707,32 @@ void IoWrite(uint32_t address, uint32_t data, int bits)/*{{{*/
 					bool hd_selected;
 					ENFORCE_SIZE_W(bits, address, 16, "DISKCON");
 					// B7 = FDD controller reset
-					if ((data & 0x80) == 0) wd2797_reset(&state.fdc_ctx);
+					if ((data & 0x80) == 0) wd2797_reset(&state->fdc_ctx);
 					// B6 = drive 0 select
 					fd_selected = (data & 0x40) != 0;
 					// B5 = motor enable -- TODO
 					// B4 = HDD controller reset
-					if ((data & 0x10) == 0) wd2010_reset(&state.hdc_ctx);
+					if ((data & 0x10) == 0) wd2010_reset(&state->hdc_ctx);
 					// B3 = HDD0 select
 					hd_selected = (data & 0x08) != 0;
 					// B2,1,0 = HDD0 head select
-					sdh = wd2010_read_reg(&state.hdc_ctx, WD2010_REG_SDH);
+					sdh = wd2010_read_reg(&state->hdc_ctx, WD2010_REG_SDH);
 					sdh = (sdh & ~0x07) | (data & 0x07);
-					wd2010_write_reg(&state.hdc_ctx, WD2010_REG_SDH, sdh);
+					wd2010_write_reg(&state->hdc_ctx, WD2010_REG_SDH, sdh);
 
 					//if both devices are selected, whichever one was selected
 					//last should be used
-					if (hd_selected && !state.hd_selected){
-						state.dma_dev = DMA_DEV_HD0;
-					}else if (fd_selected && !state.fd_selected){
-						state.dma_dev = DMA_DEV_FD;
+					if (hd_selected && !state->hd_selected){
+						state->dma_dev = DMA_DEV_HD0;
+					}else if (fd_selected && !state->fd_selected){
+						state->dma_dev = DMA_DEV_FD;
 					}else if (hd_selected && !fd_selected){
-						state.dma_dev = DMA_DEV_HD0;
+						state->dma_dev = DMA_DEV_HD0;
 					}else if (fd_selected && !hd_selected){
-						state.dma_dev = DMA_DEV_FD;
+						state->dma_dev = DMA_DEV_FD;
 					}
-					state.fd_selected = fd_selected;
-					state.hd_selected = hd_selected;
+					state->fd_selected = fd_selected;
+					state->hd_selected = hd_selected;
 					handled = true;
 					break;
 				}
@@ -506,7 +753,7 @@ void IoWrite(uint32_t address, uint32_t data, int bits)/*{{{*/
 					case 0xD40000:		// Expansion slot 5
 					case 0xD80000:		// Expansion slot 6
 					case 0xDC0000:		// Expansion slot 7
-						fprintf(stderr, "NOTE: WR%d to expansion card space, addr=0x%08X, data=0x%08X\n", bits, address, data);
+						LOG_NOTE("NOTE: WR%d to expansion card space, addr=0x%08X, data=0x%08X", bits, address, data);
 						handled = true;
 						break;
 				}
@@ -515,17 +762,17 @@ void IoWrite(uint32_t address, uint32_t data, int bits)/*{{{*/
 			case 0xF00000:
 				switch (address & 0x070000) {
 					case 0x000000:		// [ef][08]xxxx ==> WD2010 hard disc controller
-						wd2010_write_reg(&state.hdc_ctx, (address >> 1) & 7, data);
+						wd2010_write_reg(&state->hdc_ctx, (address >> 1) & 7, data);
 						handled = true;
 						break;
 					case 0x010000:		// [ef][19]xxxx ==> WD2797 floppy disc controller
 						/*ENFORCE_SIZE_W(bits, address, 16, "FDC REGISTERS");*/
-						wd2797_write_reg(&state.fdc_ctx, (address >> 1) & 3, data);
+						wd2797_write_reg(&state->fdc_ctx, (address >> 1) & 3, data);
 						handled = true;
 						break;
 					case 0x020000:		// [ef][2a]xxxx ==> Miscellaneous Control Register 2
 						// MCR2 - UNIX PC Rev. P5.1 HDD head select b3 and potential HDD#2 select
-						wd2010_write_reg(&state.hdc_ctx, UNIXPC_REG_MCR2, data);
+						wd2010_write_reg(&state->hdc_ctx, UNIXPC_REG_MCR2, data);
 						handled = true;
 						break;
 					case 0x030000:		// [ef][3b]xxxx ==> Real Time Clock data bits
@@ -535,19 +782,22 @@ void IoWrite(uint32_t address, uint32_t data, int bits)/*{{{*/
 							case 0x040000:		// [ef][4c][08]xxx ==> EE
 								// Error Enable. If =0, Level7 intrs and bus errors are masked.
 								ENFORCE_SIZE_W(bits, address, 16, "EE");
-								state.ee = ((data & 0x8000) == 0x8000);
+								state->ee = ((data & 0x8000) == 0x8000);
 								handled = true;
 								break;
 							case 0x041000:		// [ef][4c][19]xxx ==> PIE
 								ENFORCE_SIZE_W(bits, address, 16, "PIE");
-								state.pie = ((data & 0x8000) == 0x8000);
+								state->pie = ((data & 0x8000) == 0x8000);
 								handled = true;
 								break;
 							case 0x042000:		// [ef][4c][2A]xxx ==> BP
 								break;
 							case 0x043000:		// [ef][4c][3B]xxx ==> ROMLMAP
 								ENFORCE_SIZE_W(bits, address, 16, "ROMLMAP");
-								state.romlmap = ((data & 0x8000) == 0x8000);
+								if (state->romlmap != ((data & 0x8000) == 0x8000)) {
+									state->romlmap = ((data & 0x8000) == 0x8000);
+									memory_rebuild_page_table();
+								}
 								handled = true;
 								break;
 							case 0x044000:		// [ef][4c][4C]xxx ==> L1 MODEM
@@ -566,7 +816,14 @@ void IoWrite(uint32_t address, uint32_t data, int bits)/*{{{*/
 					case 0x050000:		// [ef][5d]xxxx ==> 8274
 						break;
 					case 0x060000:		// [ef][6e]xxxx ==> Control regs
-						switch (address & 0x07F000) {
+						switch (address & 0x00F000) {
+							case 0x00F000:		// [ef][6e]Fxxx ==> Host transfer device (paravirtual, see hostio.h)
+								if (hostio_enabled()) {
+									ENFORCE_SIZE_W(bits, address, 16 | 32, "HOSTIO");
+									hostio_write_reg(&state->hostio, (address >> 1) & 0x7FF, data, bits);
+									handled = true;
+								}
+								break;
 							default:
 								break;
 						}
@@ -575,12 +832,12 @@ void IoWrite(uint32_t address, uint32_t data, int bits)/*{{{*/
 						// TODO: figure out which sizes are valid (probably just 8 and 16)
 						// ENFORCE_SIZE_W(bits, address, 16, "KEYBOARD CONTROLLER");
 						if (bits == 8) {
-							printf("KBD WR %02X => %02X\n", (address >> 1) & 3, data);
-							keyboard_write(&state.kbd, (address >> 1) & 3, data);
+							LOG_NOTE("KBD WR %02X => %02X", (address >> 1) & 3, data);
+							keyboard_write(&state->kbd, (address >> 1) & 3, data);
 							handled = true;
 						} else if (bits == 16) {
-							printf("KBD WR %02X => %04X\n", (address >> 1) & 3, data);
-							keyboard_write(&state.kbd, (address >> 1) & 3, data >> 8);
+							LOG_NOTE("KBD WR %02X => %04X", (address >> 1) & 3, data);
+							keyboard_write(&state->kbd, (address >> 1) & 3, data >> 8);
 							handled = true;
 						}
 						break;
@@ -593,6 +850,11 @@ void IoWrite(uint32_t address, uint32_t data, int bits)/*{{{*/
 
 uint32_t IoRead(uint32_t address, int bits)/*{{{*/
 {
+	// Device registers may change interrupt or DMA state, so let the main
+	// loop look at them as soon as this instruction finishes
+	sched_sync();
+	STAT_INC(io_reads[stats_io_reg(address)]);
+
 	bool handled = false;
 	uint32_t data = EMPTY & 0xFFFFFFFF;
 
@@ -602,20 +864,20 @@ uint32_t IoRead(uint32_t address, int bits)/*{{{*/
 			case 0x010000:				// General Status Register
 				/* ENFORCE_SIZE_R(bits, address, 16, "GENSTAT"); */
 				if (bits == 32) {
-					return ((uint32_t)state.genstat << 16) + (uint32_t)state.genstat;
+					return ((uint32_t)state->genstat << 16) + (uint32_t)state->genstat;
 				} else if (bits == 16) {
-					return (uint16_t)state.genstat;
+					return (uint16_t)state->genstat;
 				} else {
-					return (uint8_t)(state.genstat & 0xff);
+					return (uint8_t)(state->genstat & 0xff);
 				}
 				break;
 			case 0x030000:				// Bus Status Register 0
 				ENFORCE_SIZE_R(bits, address, 16, "BSR0");
-				return ((uint32_t)state.bsr0 << 16) + (uint32_t)state.bsr0;
+				return ((uint32_t)state->bsr0 << 16) + (uint32_t)state->bsr0;
 				break;
 			case 0x040000:				// Bus Status Register 1
 				ENFORCE_SIZE_R(bits, address, 16, "BSR1");
-				return ((uint32_t)state.bsr1 << 16) + (uint32_t)state.bsr1;
+				return ((uint32_t)state->bsr1 << 16) + (uint32_t)state->bsr1;
 				break;
 			case 0x050000:				// Phone status
 				ENFORCE_SIZE_R(bits, address, 8 | 16, "PHONE STATUS");
@@ -625,16 +887,16 @@ uint32_t IoRead(uint32_t address, int bits)/*{{{*/
 				// TODO: U/OERR- is always inactive (bit set)... or should it be = DMAEN+?
 				// Bit 14 is always unused, so leave it set
 				ENFORCE_SIZE_R(bits, address, 16, "DMACOUNT");
-				return (state.dma_count & 0x3fff) | 0xC000;
+				return (state->dma_count & 0x3fff) | 0xC000;
 				break;
 			case 0x070000:				// Line Printer Status Register
 				data = 0x00120012;	// no parity error, no line printer error, no irqs from FDD or HDD
-				data |= wd2797_get_irq(&state.fdc_ctx) ? 0x00080008 : 0;
-				data |= wd2010_get_irq(&state.hdc_ctx) ? 0x00040004 : 0;
+				data |= wd2797_get_irq(&state->fdc_ctx) ? 0x00080008 : 0;
+				data |= wd2010_get_irq(&state->hdc_ctx) ? 0x00040004 : 0;
 				return data;
 				break;
 			case 0x080000:				// Real Time Clock
-				printf("READ NOTIMP: Realtime Clock\n");
+				LOG_NOTES("READ NOTIMP: Realtime Clock");
 				break;
 			case 0x090000:				// Phone registers
 				switch (address & 0x0FF000) {
@@ -693,7 +955,7 @@ uint32_t IoRead(uint32_t address, int bits)/*{{{*/
 					case 0xD40000:		// Expansion slot 5
 					case 0xD80000:		// Expansion slot 6
 					case 0xDC0000:		// Expansion slot 7
-						fprintf(stderr, "NOTE: RD%d from expansion card space, addr=0x%08X\n", bits, address);
+						LOG_NOTE("NOTE: RD%d from expansion card space, addr=0x%08X", bits, address);
 						handled = true;
 						break;
 				}
@@ -702,17 +964,17 @@ uint32_t IoRead(uint32_t address, int bits)/*{{{*/
 			case 0xF00000:
 				switch (address & 0x070000) {
 					case 0x000000:		// [ef][08]xxxx ==> WD1010 hard disc controller
-						return (wd2010_read_reg(&state.hdc_ctx, (address >> 1) & 7));
+						return (wd2010_read_reg(&state->hdc_ctx, (address >> 1) & 7));
 
 						break;
 					case 0x010000:		// [ef][19]xxxx ==> WD2797 floppy disc controller
 						/*ENFORCE_SIZE_R(bits, address, 16, "FDC REGISTERS");*/
-						return wd2797_read_reg(&state.fdc_ctx, (address >> 1) & 3);
+						return wd2797_read_reg(&state->fdc_ctx, (address >> 1) & 3);
 						break;
 					case 0x020000:		// [ef][2a]xxxx ==> Miscellaneous Control Register 2
 						break;
 					case 0x030000:		// [ef][3b]xxxx ==> Real Time Clock data bits
-						return (tc8250_read_reg(&state.rtc_ctx));
+						return (tc8250_read_reg(&state->rtc_ctx));
 					case 0x040000:		// [ef][4c]xxxx ==> General Control Register
 						switch (address & 0x077000) {
 							case 0x040000:		// [ef][4c][08]xxx ==> EE
@@ -736,6 +998,12 @@ uint32_t IoRead(uint32_t address, int bits)/*{{{*/
 							case 0x002000:
 								return (0);
 								break;
+							case 0x00F000:		// [ef][6e]Fxxx ==> Host transfer device (paravirtual, see hostio.h)
+								if (hostio_enabled()) {
+									ENFORCE_SIZE_R(bits, address, 16 | 32, "HOSTIO");
+									return hostio_read_reg(&state->hostio, (address >> 1) & 0x7FF, bits);
+								}
+								break;
 							default:
 								break;
 						}
@@ -745,9 +1013,9 @@ uint32_t IoRead(uint32_t address, int bits)/*{{{*/
 						//ENFORCE_SIZE_R(bits, address, 16, "KEYBOARD CONTROLLER");
 						{
 							if (bits == 8) {
-								return keyboard_read(&state.kbd, (address >> 1) & 3);
+								return keyboard_read(&state->kbd, (address >> 1) & 3);
 							} else {
-								return keyboard_read(&state.kbd, (address >> 1) & 3) << 8;
+								return keyboard_read(&state->kbd, (address >> 1) & 3) << 8;
 							}
 							return data;
 						}
@@ -769,63 +1037,142 @@ uint32_t IoRead(uint32_t address, int bits)/*{{{*/
 
 static uint16_t ram_read_16(uint32_t address)
 {
-	if (address < 0x1000 && !(m68k_get_reg(NULL, M68K_REG_SR) & 0x2000)){
+	if (address < 0x1000 && !cpu_is_supervisor()){
 		return (0);
 	}else if (address <= 0x1fffff) {
 		// Base memory wraps around
-		return RD16(state.base_ram, address, state.base_ram_size - 1);
+		return RD16(state->base_ram, address, state->base_ram_size - 1);
 	} else {
-		if ((address <= (state.exp_ram_size + 0x200000 - 1)) && (address >= 0x200000)){
-			return RD16(state.exp_ram, address - 0x200000, state.exp_ram_size - 1);
+		if ((address <= (state->exp_ram_size + 0x200000 - 1)) && (address >= 0x200000)){
+			return RD16(state->exp_ram, address - 0x200000, state->exp_ram_size - 1);
 		}else
 			return EMPTY & 0xffff;
 	}
 }
 
+/**
+ * @brief	Read a 16-bit word from a RAM zone page.
+ * @note	The caller must already have checked access permissions.
+ */
+static uint16_t ram_page_read_16(uint32_t address)/*{{{*/
+{
+	const PAGE_ENTRY *pe = &state->pages[(address >> 12) & (MEM_NUM_PAGES - 1)];
+
+	// Words straddling the top of the RAM zone read as empty memory
+	if (pe->type != PAGE_RAM)
+		return EMPTY & 0xffff;
+
+	updatePageStatus((address >> 12) & 0x3FF, false);
+	if (address < 0x1000 && !cpu_is_supervisor())
+		return (0);
+	if (pe->rd == NULL)
+		return EMPTY & 0xffff;
+	return RD16_FAST(pe->rd, address, pe->mask);
+}/*}}}*/
+
+/**
+ * @brief	Read a 32-bit longword from a RAM zone page.
+ * @note	The caller must already have checked access permissions.
+ */
+static uint32_t ram_page_read_32(uint32_t address)/*{{{*/
+{
+	const PAGE_ENTRY *pe = &state->pages[(address >> 12) & (MEM_NUM_PAGES - 1)];
+
+	// Longwords which cross into the next page are read a word at a time
+	if ((address & 0xFFF) > 0xFFC)
+		return ((uint32_t)ram_page_read_16(address) << 16) | ram_page_read_16(address + 2);
+
+	updatePageStatus((address >> 12) & 0x3FF, false);
+	if (address < 0x1000 && !cpu_is_supervisor())
+		return (0);
+	if (pe->rd == NULL)
+		return EMPTY & 0xFFFFFFFF;
+	return LD_BE32(pe->rd + (address & 0xFFF));
+}/*}}}*/
+
+/**
+ * @brief	Write a 16-bit word to a RAM zone page.
+ * @note	The caller must already have checked access permissions.
+ */
+static void ram_page_write_16(uint32_t address, uint32_t value)/*{{{*/
+{
+	const PAGE_ENTRY *pe = &state->pages[(address >> 12) & (MEM_NUM_PAGES - 1)];
+
+	if (pe->type != PAGE_RAM)
+		return;
+
+	if (address < 0x1000 && !cpu_is_supervisor())
+		return;
+	updatePageStatus((address >> 12) & 0x3FF, true);
+	if (pe->wr != NULL) {
+		WR16_FAST(pe->wr, address, pe->mask, value);
+		RAM_PAGE_WRITTEN(state->tlb[(address >> 12) & 0x3FF].phys);
+	}
+}/*}}}*/
+
+/**
+ * @brief	Write a 32-bit longword to a RAM zone page.
+ * @note	The caller must already have checked access permissions.
+ */
+static void ram_page_write_32(uint32_t address, uint32_t value)/*{{{*/
+{
+	const PAGE_ENTRY *pe = &state->pages[(address >> 12) & (MEM_NUM_PAGES - 1)];
+
+	// Longwords which cross into the next page are written a word at a time
+	if ((address & 0xFFF) > 0xFFC) {
+		ram_page_write_16(address, (value & 0xffff0000) >> 16);
+		ram_page_write_16(address + 2, (value & 0xffff));
+		return;
+	}
+
+	if (address < 0x1000 && !cpu_is_supervisor())
+		return;
+	updatePageStatus((address >> 12) & 0x3FF, true);
+	if (pe->wr != NULL) {
+		ST_BE32(pe->wr + (address & 0xFFF), value);
+		RAM_PAGE_WRITTEN(state->tlb[(address >> 12) & 0x3FF].phys);
+	}
+}/*}}}*/
+
 /**
  * @brief Read M68K memory, 32-bit
  */
 uint32_t m68k_read_memory_32(uint32_t address)/*{{{*/
 {
-	uint32_t data = EMPTY & 0xFFFFFFFF;
+	const PAGE_ENTRY *pe = &state->pages[(address >> 12) & (MEM_NUM_PAGES - 1)];
+	const PAGE_ENTRY *pe2 = &state->pages[((address + 2) >> 12) & (MEM_NUM_PAGES - 1)];
 
 	// If ROMLMAP is set, force system to access ROM
-	if (!state.romlmap)
+	if (!state->romlmap)
 		address |= 0x800000;
 
-	// Check access permissions
-	ACCESS_CHECK_RD(address, 32);
+	// Check access permissions, unless the TLB says it's allowed
+	if (!(pe->perm & pe2->perm & PERM_NEEDED(false)))
+		ACCESS_CHECK_RD(address, 32);
+	STAT_INC(mem_reads[stats_region(pe->type, address)]);
 
-	if ((address >= 0x800000) && (address <= 0xBFFFFF)) {
-		// ROM access
-		return RD32(state.rom, address, ROM_SIZE - 1);
-	} else if (address <= 0x3fffff) {
-		// RAM access
-		uint32_t newAddr = mapAddr(address, false);
-		// Base memory wraps around
-			
-		data = ((ram_read_16(newAddr) << 16) | 
-			ram_read_16(mapAddr(address + 2, false)));
-		return (data);
-	} else if ((address >= 0x400000) && (address <= 0x7FFFFF)) {
-		// I/O register space, zone A
-		switch (address & 0x0F0000) {
-			case 0x000000:				// Map RAM access
-				if (address > 0x4007FF) fprintf(stderr, "NOTE: RD32 from MapRAM mirror, addr=0x%08X\n", address);
-				return RD32(state.map, address, 0x7FF);
-				break;
-			case 0x020000:				// Video RAM
-				if (address > 0x427FFF) fprintf(stderr, "NOTE: RD32 from VideoRAM mirror, addr=0x%08X\n", address);
-				return RD32(state.vram, address, 0x7FFF);
-				break;
-			default:
-				return IoRead(address, 32);
-		}
-	} else {
-		return IoRead(address, 32);
+	uint32_t value;
+	switch (pe->type) {
+		case PAGE_ROM:
+			value = RD32_FAST(pe->rd, address, pe->mask);
+			break;
+		case PAGE_RAM:
+			value = ram_page_read_32(address);
+			break;
+		case PAGE_MAP:
+			if (address > 0x4007FF) LOG_NOTE("NOTE: RD32 from MapRAM mirror, addr=0x%08X", address);
+			value = RD32_FAST(pe->rd, address, pe->mask);
+			break;
+		case PAGE_VRAM:
+			if (address > 0x427FFF) LOG_NOTE("NOTE: RD32 from VideoRAM mirror, addr=0x%08X", address);
+			value = RD32_FAST(pe->rd, address, pe->mask);
+			break;
+		default:
+			value = IoRead(address, 32);
+			break;
 	}
-
-	return data;
+	TRACE_MEM(address, 32, false, value, MEM_ALLOWED);
+	return value;
 }/*}}}*/
 
 /**
@@ -833,51 +1180,39 @@ uint32_t m68k_read_memory_32(uint32_t address)/*{{{*/
  */
 uint32_t m68k_read_memory_16(uint32_t address)/*{{{*/
 {
-	uint16_t data = EMPTY & 0xFFFF;
+	const PAGE_ENTRY *pe = &state->pages[(address >> 12) & (MEM_NUM_PAGES - 1)];
 
 	// If ROMLMAP is set, force system to access ROM
-	if (!state.romlmap)
+	if (!state->romlmap)
 		address |= 0x800000;
 
-	// Check access permissions
-	ACCESS_CHECK_RD(address, 16);
-
-	if ((address >= 0x800000) && (address <= 0xBFFFFF)) {
-		// ROM access
-		data = RD16(state.rom, address, ROM_SIZE - 1);
-	} else if (address <= 0x3fffff) {
-		// RAM access
-		uint32_t newAddr = mapAddr(address, false);
-		if (address < 0x1000 && !(m68k_get_reg(NULL, M68K_REG_SR) & 0x2000)){
-			return (0);
-		}else if (newAddr <= 0x1fffff) {
-			// Base memory wraps around
-			return RD16(state.base_ram, newAddr, state.base_ram_size - 1);
-		} else {
-			if ((newAddr <= (state.exp_ram_size + 0x200000 - 1)) && (newAddr >= 0x200000))
-				return RD16(state.exp_ram, newAddr - 0x200000, state.exp_ram_size - 1);
-			else
-				return EMPTY & 0xffff;
-		}
-	} else if ((address >= 0x400000) && (address <= 0x7FFFFF)) {
-		// I/O register space, zone A
-		switch (address & 0x0F0000) {
-			case 0x000000:				// Map RAM access
-				if (address > 0x4007FF) fprintf(stderr, "NOTE: RD16 from MapRAM mirror, addr=0x%08X\n", address);
-				data = RD16(state.map, address, 0x7FF);
-				break;
-			case 0x020000:				// Video RAM
-				if (address > 0x427FFF) fprintf(stderr, "NOTE: RD16 from VideoRAM mirror, addr=0x%08X\n", address);
-				data = RD16(state.vram, address, 0x7FFF);
-				break;
-			default:
-				data = IoRead(address, 16);
-		}
-	} else {
-		data = IoRead(address, 16);
-	}
+	// Check access permissions, unless the TLB says it's allowed
+	if (!(pe->perm & PERM_NEEDED(false)))
+		ACCESS_CHECK_RD(address, 16);
+	STAT_INC(mem_reads[stats_region(pe->type, address)]);
 
-	return data;
+	uint32_t value;
+	switch (pe->type) {
+		case PAGE_ROM:
+			value = RD16_FAST(pe->rd, address, pe->mask);
+			break;
+		case PAGE_RAM:
+			value = ram_page_read_16(address);
+			break;
+		case PAGE_MAP:
+			if (address > 0x4007FF) LOG_NOTE("NOTE: RD16 from MapRAM mirror, addr=0x%08X", address);
+			value = RD16_FAST(pe->rd, address, pe->mask);
+			break;
+		case PAGE_VRAM:
+			if (address > 0x427FFF) LOG_NOTE("NOTE: RD16 from VideoRAM mirror, addr=0x%08X", address);
+			value = RD16_FAST(pe->rd, address, pe->mask);
+			break;
+		default:
+			value = IoRead(address, 16) & 0xffff;
+			break;
+	}
+	TRACE_MEM(address, 16, false, value, MEM_ALLOWED);
+	return value;
 }/*}}}*/
 
 /**
@@ -885,105 +1220,85 @@ uint32_t m68k_read_memory_16(uint32_t address)/*{{{*/
  */
 uint32_t m68k_read_memory_8(uint32_t address)/*{{{*/
 {
-	uint8_t data = EMPTY & 0xFF;
+	const PAGE_ENTRY *pe = &state->pages[(address >> 12) & (MEM_NUM_PAGES - 1)];
 
 	// If ROMLMAP is set, force system to access ROM
-	if (!state.romlmap)
+	if (!state->romlmap)
 		address |= 0x800000;
 
-	// Check access permissions
-	ACCESS_CHECK_RD(address, 8);
-
-	if ((address >= 0x800000) && (address <= 0xBFFFFF)) {
-		// ROM access
-		data = RD8(state.rom, address, ROM_SIZE - 1);
-	} else if (address <= 0x3fffff) {
-		// RAM access
-		uint32_t newAddr = mapAddr(address, false);
-		if (address < 0x1000 && !(m68k_get_reg(NULL, M68K_REG_SR) & 0x2000)){
-			return (0);
-		}else if (newAddr <= 0x1fffff) {
-			// Base memory wraps around
-			return RD8(state.base_ram, newAddr, state.base_ram_size - 1);
-		} else {
-			if ((newAddr <= (state.exp_ram_size + 0x200000 - 1)) && (newAddr >= 0x200000))
-				return RD8(state.exp_ram, newAddr - 0x200000, state.exp_ram_size - 1);
+	// Check access permissions, unless the TLB says it's allowed
+	if (!(pe->perm & PERM_NEEDED(false)))
+		ACCESS_CHECK_RD(address, 8);
+	STAT_INC(mem_reads[stats_region(pe->type, address)]);
+
+	uint32_t value;
+	switch (pe->type) {
+		case PAGE_ROM:
+			value = RD8(pe->rd, address, pe->mask);
+			break;
+		case PAGE_RAM:
+			updatePageStatus((address >> 12) & 0x3FF, false);
+			if (address < 0x1000 && !cpu_is_supervisor())
+				value = 0;
+			else if (pe->rd == NULL)
+				value = EMPTY & 0xff;
 			else
-				return EMPTY & 0xff;
-		}
-	} else if ((address >= 0x400000) && (address <= 0x7FFFFF)) {
-		// I/O register space, zone A
-		switch (address & 0x0F0000) {
-			case 0x000000:				// Map RAM access
-				if (address > 0x4007FF) fprintf(stderr, "NOTE: RD8 from MapRAM mirror, addr=0x%08X\n", address);
-				data = RD8(state.map, address, 0x7FF);
-				break;
-			case 0x020000:				// Video RAM
-				if (address > 0x427FFF) fprintf(stderr, "NOTE: RD8 from VideoRAM mirror, addr=0x%08X\n", address);
-				data = RD8(state.vram, address, 0x7FFF);
-				break;
-			default:
-				data = IoRead(address, 8);
-		}
-	} else {
-		data = IoRead(address, 8);
+				value = RD8(pe->rd, address, pe->mask);
+			break;
+		case PAGE_MAP:
+			if (address > 0x4007FF) LOG_NOTE("NOTE: RD8 from MapRAM mirror, addr=0x%08X", address);
+			value = RD8(pe->rd, address, pe->mask);
+			break;
+		case PAGE_VRAM:
+			if (address > 0x427FFF) LOG_NOTE("NOTE: RD8 from VideoRAM mirror, addr=0x%08X", address);
+			value = RD8(pe->rd, address, pe->mask);
+			break;
+		default:
+			value = IoRead(address, 8) & 0xff;
+			break;
 	}
-
-	return data;
+	TRACE_MEM(address, 8, false, value, MEM_ALLOWED);
+	return value;
 }/*}}}*/
 
-
-static void ram_write_16(uint32_t address, uint32_t value)/*{{{*/
-{
-	
-		
-	if (address < 0x1000 && !(m68k_get_reg(NULL, M68K_REG_SR) & 0x2000)){
-		return;
-	}else if (address <= 0x1fffff) {
-		if (address < state.base_ram_size) {
-			WR16(state.base_ram, address, state.base_ram_size - 1, value);
-		}
-	} else {
-		if ((address - 0x200000) < state.exp_ram_size) {
-			WR16(state.exp_ram, address - 0x200000, state.exp_ram_size - 1, value);
-		}
-	}
-}
-
 /**
  * @brief Write M68K memory, 32-bit
  */
 void m68k_write_memory_32(uint32_t address, uint32_t value)/*{{{*/
 {
+	const PAGE_ENTRY *pe = &state->pages[(address >> 12) & (MEM_NUM_PAGES - 1)];
+	const PAGE_ENTRY *pe2 = &state->pages[((address + 2) >> 12) & (MEM_NUM_PAGES - 1)];
+
 	// If ROMLMAP is set, force system to access ROM
-	if (!state.romlmap)
+	if (!state->romlmap)
 		address |= 0x800000;
 
-	// Check access permissions
-	ACCESS_CHECK_WR(address, 32);
-	if ((address >= 0x800000) && (address <= 0xBFFFFF)) {
-		// ROM access
-	} else if (address <= 0x3FFFFF) {
-		// RAM access
-		uint32_t newAddr = mapAddr(address, true);
-		ram_write_16(newAddr, (value & 0xffff0000) >> 16);
-		ram_write_16(mapAddr(address + 2, true), (value & 0xffff));
-	} else if ((address >= 0x400000) && (address <= 0x7FFFFF)) {
-		// I/O register space, zone A
-		switch (address & 0x0F0000) {
-			case 0x000000:				// Map RAM access
-				if (address > 0x4007FF) fprintf(stderr, "NOTE: WR32 to MapRAM mirror, addr=0x%08X\n", address);
-				WR32(state.map, address, 0x7FF, value);
-				break;
-			case 0x020000:				// Video RAM
-				if (address > 0x427FFF) fprintf(stderr, "NOTE: WR32 to VideoRAM mirror, addr=0x%08X\n", address);
-				WR32(state.vram, address, 0x7FFF, value);
-				break;
-			default:
-				IoWrite(address, value, 32);
-		}
-	} else {
-		IoWrite(address, value, 32);
+	// Check access permissions, unless the TLB says it's allowed
+	if (!(pe->perm & pe2->perm & PERM_NEEDED(true)))
+		ACCESS_CHECK_WR(address, 32, value);
+	STAT_INC(mem_writes[stats_region(pe->type, address)]);
+	TRACE_MEM(address, 32, true, value, MEM_ALLOWED);
+
+	switch (pe->type) {
+		case PAGE_ROM:
+			// ROM access (read only!)
+			break;
+		case PAGE_RAM:
+			ram_page_write_32(address, value);
+			break;
+		case PAGE_MAP:
+			if (address > 0x4007FF) LOG_NOTE("NOTE: WR32 to MapRAM mirror, addr=0x%08X", address);
+			WR32_FAST(pe->wr, address, pe->mask, value);
+			map_ram_written(address, 4);
+			break;
+		case PAGE_VRAM:
+			if (address > 0x427FFF) LOG_NOTE("NOTE: WR32 to VideoRAM mirror, addr=0x%08X", address);
+			WR32_FAST(pe->wr, address, pe->mask, value);
+			vram_written(address, 4);
+			break;
+		default:
+			IoWrite(address, value, 32);
+			break;
 	}
 }/*}}}*/
 
@@ -992,46 +1307,38 @@ void m68k_write_memory_32(uint32_t address, uint32_t value)/*{{{*/
  */
 void m68k_write_memory_16(uint32_t address, uint32_t value)/*{{{*/
 {
+	const PAGE_ENTRY *pe = &state->pages[(address >> 12) & (MEM_NUM_PAGES - 1)];
+
 	// If ROMLMAP is set, force system to access ROM
-	if (!state.romlmap)
+	if (!state->romlmap)
 		address |= 0x800000;
 
-	// Check access permissions
-	ACCESS_CHECK_WR(address, 16);
-
-	if (address < 0x1000 && !(m68k_get_reg(NULL, M68K_REG_SR) & 0x2000)){
-		return;
-	}else if ((address >= 0x800000) && (address <= 0xBFFFFF)) {
-		// ROM access
-	} else if (address <= 0x3FFFFF) {
-		// RAM access
-		uint32_t newAddr = mapAddr(address, true);
+	// Check access permissions, unless the TLB says it's allowed
+	if (!(pe->perm & PERM_NEEDED(true)))
+		ACCESS_CHECK_WR(address, 16, value);
+	STAT_INC(mem_writes[stats_region(pe->type, address)]);
+	TRACE_MEM(address, 16, true, value, MEM_ALLOWED);
 
-		if (newAddr <= 0x1fffff) {
-			if (newAddr < state.base_ram_size) {
-				WR16(state.base_ram, newAddr, state.base_ram_size - 1, value);
-			}
-		} else {
-			if ((newAddr - 0x200000) < state.exp_ram_size) {
-				WR16(state.exp_ram, newAddr - 0x200000, state.exp_ram_size - 1, value);
-			}
-		}
-	} else if ((address >= 0x400000) && (address <= 0x7FFFFF)) {
-		// I/O register space, zone A
-		switch (address & 0x0F0000) {
-			case 0x000000:				// Map RAM access
-				if (address > 0x4007FF) fprintf(stderr, "NOTE: WR16 to MapRAM mirror, addr=0x%08X, data=0x%04X\n", address, value);
-				WR16(state.map, address, 0x7FF, value);
-				break;
-			case 0x020000:				// Video RAM
-				if (address > 0x427FFF) fprintf(stderr, "NOTE: WR16 to VideoRAM mirror, addr=0x%08X, data=0x%04X\n", address, value);
-				WR16(state.vram, address, 0x7FFF, value);
-				break;
-			default:
-				IoWrite(address, value, 16);
-		}
-	} else {
-		IoWrite(address, value, 16);
+	switch (pe->type) {
+		case PAGE_ROM:
+			// ROM access (read only!)
+			break;
+		case PAGE_RAM:
+			ram_page_write_16(address, value);
+			break;
+		case PAGE_MAP:
+			if (address > 0x4007FF) LOG_NOTE("NOTE: WR16 to MapRAM mirror, addr=0x%08X, data=0x%04X", address, value);
+			WR16_FAST(pe->wr, address, pe->mask, value);
+			map_ram_written(address, 2);
+			break;
+		case PAGE_VRAM:
+			if (address > 0x427FFF) LOG_NOTE("NOTE: WR16 to VideoRAM mirror, addr=0x%08X, data=0x%04X", address, value);
+			WR16_FAST(pe->wr, address, pe->mask, value);
+			vram_written(address, 2);
+			break;
+		default:
+			IoWrite(address, value, 16);
+			break;
 	}
 }/*}}}*/
 
@@ -1040,53 +1347,75 @@ void m68k_write_memory_16(uint32_t address, uint32_t value)/*{{{*/
  */
 void m68k_write_memory_8(uint32_t address, uint32_t value)/*{{{*/
 {
+	const PAGE_ENTRY *pe = &state->pages[(address >> 12) & (MEM_NUM_PAGES - 1)];
+
 	// If ROMLMAP is set, force system to access ROM
-	if (!state.romlmap)
+	if (!state->romlmap)
 		address |= 0x800000;
 
-	// Check access permissions
-	ACCESS_CHECK_WR(address, 8);
+	// Check access permissions, unless the TLB says it's allowed
+	if (!(pe->perm & PERM_NEEDED(true)))
+		ACCESS_CHECK_WR(address, 8, value);
+	STAT_INC(mem_writes[stats_region(pe->type, address)]);
+	TRACE_MEM(address, 8, true, value, MEM_ALLOWED);
 
-	
-	if (address < 0x1000 && !(m68k_get_reg(NULL, M68K_REG_SR) & 0x2000)){
-		return;
-	}else if ((address >= 0x800000) && (address <= 0xBFFFFF)) {
-		// ROM access (read only!)
-	} else if (address <= 0x3FFFFF) {
-		// RAM access
-		uint32_t newAddr = mapAddr(address, true);
-		if (newAddr <= 0x1fffff) {
-			if (newAddr < state.base_ram_size) {
-				WR8(state.base_ram, newAddr, state.base_ram_size - 1, value);
-			}
-		} else {
-			if ((newAddr - 0x200000) < state.exp_ram_size) {
-				WR8(state.exp_ram, newAddr - 0x200000, state.exp_ram_size - 1, value);
+	switch (pe->type) {
+		case PAGE_ROM:
+			// ROM access (read only!)
+			break;
+		case PAGE_RAM:
+			if (address < 0x1000 && !cpu_is_supervisor())
+				return;
+			updatePageStatus((address >> 12) & 0x3FF, true);
+			if (pe->wr != NULL) {
+				WR8(pe->wr, address, pe->mask, value);
+				RAM_PAGE_WRITTEN(state->tlb[(address >> 12) & 0x3FF].phys);
 			}
-		}
-	} else if ((address >= 0x400000) && (address <= 0x7FFFFF)) {
-		// I/O register space, zone A
-		switch (address & 0x0F0000) {
-			case 0x000000:				// Map RAM access
-				if (address > 0x4007FF) fprintf(stderr, "NOTE: WR8 to MapRAM mirror, addr=0x%08X, data=0x%04X\n", address, value);
-				WR8(state.map, address, 0x7FF, value);
-				break;
-			case 0x020000:				// Video RAM
-				if (address > 0x427FFF) fprintf(stderr, "NOTE: WR8 to VideoRAM mirror, addr=0x%08X, data=0x%04X\n", address, value);
-				WR8(state.vram, address, 0x7FFF, value);
-				break;
-			default:
-				IoWrite(address, value, 8);
-		}
-	} else {
-		IoWrite(address, value, 8);
+			break;
+		case PAGE_MAP:
+			if (address > 0x4007FF) LOG_NOTE("NOTE: WR8 to MapRAM mirror, addr=0x%08X, data=0x%04X", address, value);
+			WR8(pe->wr, address, pe->mask, value);
+			map_ram_written(address, 1);
+			break;
+		case PAGE_VRAM:
+			if (address > 0x427FFF) LOG_NOTE("NOTE: WR8 to VideoRAM mirror, addr=0x%08X, data=0x%04X", address, value);
+			WR8(pe->wr, address, pe->mask, value);
+			vram_written(address, 1);
+			break;
+		default:
+			IoWrite(address, value, 8);
+			break;
 	}
 }/*}}}*/
 
 
 // for the disassembler
+
+/// Buffer set by memory_disasm_from(), or NULL to disassemble from memory
+static const uint16_t *disasm_words = NULL;
+static uint32_t disasm_addr;
+static int disasm_nwords;
+
+void memory_disasm_from(uint32_t address, const uint16_t *words, int n)
+{
+	disasm_words = words;
+	disasm_addr = address;
+	disasm_nwords = n;
+}
+
+/**
+ * @brief	Read a word from the memory_disasm_from() buffer.
+ */
+static uint16_t disasm_word(uint32_t addr)
+{
+	uint32_t i = (addr - disasm_addr) >> 1;
+	return (i < (uint32_t)disasm_nwords) ? disasm_words[i] : (EMPTY & 0xffff);
+}
+
 uint32_t m68k_read_disassembler_32(uint32_t addr)
 {
+	if (disasm_words != NULL)
+		return ((uint32_t)disasm_word(addr) << 16) | disasm_word(addr + 2);
 	if (addr < 0x400000) {
 		uint32_t newAddrHigh, newAddrLow;
 		newAddrHigh = map_address_debug(addr);
@@ -1102,18 +1431,20 @@ uint32_t m68k_read_disassembler_32(uint32_t addr)
 
 uint32_t m68k_read_disassembler_16(uint32_t addr)
 {
+	if (disasm_words != NULL)
+		return disasm_word(addr);
 	if (addr < 0x400000) {
 		uint16_t page = (addr >> 12) & 0x3FF;
 		uint32_t new_page_addr = MAPRAM(page) & 0x3FF;
 		uint32_t newAddr = (new_page_addr << 12) + (addr & 0xFFF);
 		if (newAddr <= 0x1fffff) {
-			if (newAddr >= state.base_ram_size)
+			if (newAddr >= state->base_ram_size)
 				return EMPTY & 0xffff;
 			else
-				return RD16(state.base_ram, newAddr, state.base_ram_size - 1);
+				return RD16(state->base_ram, newAddr, state->base_ram_size - 1);
 		} else {
-			if ((newAddr <= (state.exp_ram_size + 0x200000 - 1)) && (newAddr >= 0x200000))
-				return RD16(state.exp_ram, newAddr - 0x200000, state.exp_ram_size - 1);
+			if ((newAddr <= (state->exp_ram_size + 0x200000 - 1)) && (newAddr >= 0x200000))
+				return RD16(state->exp_ram, newAddr - 0x200000, state->exp_ram_size - 1);
 			else
 				return EMPTY & 0xffff;
 		}
@@ -1125,18 +1456,20 @@ uint32_t m68k_read_disassembler_16(uint32_t addr)
 
 uint32_t m68k_read_disassembler_8 (uint32_t addr)
 {
+	if (disasm_words != NULL)
+		return (addr & 1) ? (disasm_word(addr) & 0xff) : (disasm_word(addr) >> 8);
 	if (addr < 0x400000) {
 		uint16_t page = (addr >> 12) & 0x3FF;
 		uint32_t new_page_addr = MAPRAM(page) & 0x3FF;
 		uint32_t newAddr = (new_page_addr << 12) + (addr & 0xFFF);
 		if (newAddr <= 0x1fffff) {
-			if (newAddr >= state.base_ram_size)
+			if (newAddr >= state->base_ram_size)
 				return EMPTY & 0xff;
 			else
-				return RD8(state.base_ram, newAddr, state.base_ram_size - 1);
+				return RD8(state->base_ram, newAddr, state->base_ram_size - 1);
 		} else {
-			if ((newAddr <= (state.exp_ram_size + 0x200000 - 1)) && (newAddr >= 0x200000))
-				return RD8(state.exp_ram, newAddr - 0x200000, state.exp_ram_size - 1);
+			if ((newAddr <= (state->exp_ram_size + 0x200000 - 1)) && (newAddr >= 0x200000))
+				return RD8(state->exp_ram, newAddr - 0x200000, state->exp_ram_size - 1);
 			else
 				return EMPTY & 0xff;
 		}
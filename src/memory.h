@@ -1,6 +1,10 @@
 #ifndef _MEMORY_H
 #define _MEMORY_H
 
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
 /***********************************
  * Array read/write utility macros
  * "Don't Repeat Yourself" :)
@@ -41,6 +45,225 @@
 	array[(address + 0) & (andmask)] =  value        & 0xff;	\
 } while (0)
 
+/***********************************
+ * Big-endian host loads and stores
+ ***********************************/
+
+/*
+ * The 68010 is big-endian. These do a single (possibly unaligned) host
+ * access plus a byte swap, instead of assembling the value a byte at a
+ * time. The caller must make sure all the bytes are inside the array.
+ */
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#  define BE16_TO_HOST(x) (x)
+#  define BE32_TO_HOST(x) (x)
+#elif defined(__GNUC__)
+#  define BE16_TO_HOST(x) __builtin_bswap16(x)
+#  define BE32_TO_HOST(x) __builtin_bswap32(x)
+#else
+#  define BE16_TO_HOST(x) ((uint16_t)(((x) >> 8) | ((x) << 8)))
+#  define BE32_TO_HOST(x) ((((x) >> 24) & 0xff) | (((x) >> 8) & 0xff00) | \
+		(((x) << 8) & 0xff0000) | ((x) << 24))
+#endif
+
+/// Host load, 32-bit big-endian
+static inline uint32_t LD_BE32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return BE32_TO_HOST(v);
+}
+
+/// Host load, 16-bit big-endian
+static inline uint16_t LD_BE16(const uint8_t *p)
+{
+	uint16_t v;
+	memcpy(&v, p, sizeof(v));
+	return BE16_TO_HOST(v);
+}
+
+/// Host store, 32-bit big-endian
+static inline void ST_BE32(uint8_t *p, uint32_t value)
+{
+	uint32_t v = BE32_TO_HOST(value);
+	memcpy(p, &v, sizeof(v));
+}
+
+/// Host store, 16-bit big-endian
+static inline void ST_BE16(uint8_t *p, uint16_t value)
+{
+	uint16_t v = BE16_TO_HOST(value);
+	memcpy(p, &v, sizeof(v));
+}
+
+/// Array read, 32-bit -- single host load unless the access wraps around
+#define RD32_FAST(array, address, andmask)							\
+	((((address) & (andmask)) <= (andmask) - 3) ?					\
+	 LD_BE32(&(array)[(address) & (andmask)]) : RD32(array, address, andmask))
+
+/// Array read, 16-bit -- single host load unless the access wraps around
+#define RD16_FAST(array, address, andmask)							\
+	((((address) & (andmask)) <= (andmask) - 1) ?					\
+	 (uint32_t)LD_BE16(&(array)[(address) & (andmask)]) : RD16(array, address, andmask))
+
+/// Array write, 32-bit -- single host store unless the access wraps around
+#define WR32_FAST(array, address, andmask, value) do {				\
+	if (((address) & (andmask)) <= (andmask) - 3)					\
+		ST_BE32(&(array)[(address) & (andmask)], (value));			\
+	else															\
+		WR32(array, address, andmask, value);						\
+} while (0)
+
+/// Array write, 16-bit -- single host store unless the access wraps around
+#define WR16_FAST(array, address, andmask, value) do {				\
+	if (((address) & (andmask)) <= (andmask) - 1)					\
+		ST_BE16(&(array)[(address) & (andmask)], (value));			\
+	else															\
+		WR16(array, address, andmask, value);						\
+} while (0)
+
+/******************
+ * Page dispatch
+ ******************/
+
+/// Number of 4KiB pages in the 68010's 16MiB address space
+#define MEM_NUM_PAGES		4096
+
+/// Page handler classes for the memory dispatch table
+typedef enum {
+	PAGE_IO = 0,		///< I/O registers -- handled by IoRead() / IoWrite()
+	PAGE_RAM,			///< Mapped RAM (via Map RAM)
+	PAGE_ROM,			///< Boot PROM
+	PAGE_MAP,			///< Map RAM
+	PAGE_VRAM			///< Video RAM
+} PAGE_TYPE;
+
+/// Fast-path permission bits. A set bit means the access is known to be
+/// allowed and to have no side effects; otherwise the full check is done.
+enum {
+	PERM_SUPER_RD		= 0x01,		///< Supervisor read
+	PERM_SUPER_WR		= 0x02,		///< Supervisor write
+	PERM_USER_RD		= 0x04,		///< User read
+	PERM_USER_WR		= 0x08		///< User write
+};
+
+/**
+ * @brief	Memory dispatch table entry.
+ *
+ * One of these exists for each 4KiB page of the CPU address space. For
+ * memory-backed pages, the byte at CPU address A is rd[A & mask]. RAM pages
+ * point at the physical page selected by the Map RAM; either pointer is NULL
+ * if the physical page isn't populated (reads return EMPTY, writes are
+ * discarded).
+ */
+typedef struct {
+	uint8_t		type;		///< Page handler class (PAGE_xxx)
+	uint8_t		perm;		///< Fast-path permission bitmap (PERM_xxx)
+	uint8_t		*rd;		///< Host buffer to read from
+	uint8_t		*wr;		///< Host buffer to write to
+	uint32_t	mask;		///< Address mask applied before indexing rd/wr
+} PAGE_ENTRY;
+
+/// Number of pages in the RAM zone (one Map RAM entry each)
+#define MEM_NUM_MAP_PAGES	1024
+
+/// Number of 4KiB physical RAM pages. Base RAM is pages 0 to 511 and
+/// Expansion RAM starts at page 512, the same as physical addresses.
+#define MEM_NUM_RAM_PAGES	1024
+/// Size of a physical RAM page in bytes
+#define MEM_PAGE_SIZE		4096
+
+/**
+ * @brief	Note that a physical RAM page has been written.
+ *
+ * This is the emulator's own record, used for incremental checkpoints. It is
+ * separate from the Page Status bits in the Map RAM, which belong to the
+ * guest and are cleared by it.
+ */
+#define RAM_PAGE_WRITTEN(page)	(state->ram_dirty[(page) / 32] |= 1u << ((page) % 32))
+
+/**
+ * @brief	Decoded Map RAM entry (software TLB).
+ *
+ * Kept in step with the Map RAM by every write to it, so that address
+ * translation and permission checks don't need to decode the raw entry.
+ */
+typedef struct {
+	uint16_t	phys;		///< Physical page number
+	uint8_t		status;		///< Page status: 0=not present, 1=present, 2=accessed, 3=dirty
+	bool		we;			///< Page is write enabled
+	uint8_t		perm;		///< Fast-path permission bitmap (PERM_xxx)
+} TLB_ENTRY;
+
+/**
+ * @brief	Rebuild the memory dispatch table.
+ *
+ * Must be called whenever ROMLMAP changes, or after the RAM buffers have
+ * been reallocated.
+ */
+void memory_rebuild_page_table(void);
+
+/**
+ * @brief	Mark every Video RAM scanline as dirty, forcing a full screen
+ * 			redraw on the next refresh.
+ */
+void memory_vram_invalidate(void);
+
+/**
+ * @brief	Function code callback for Musashi.
+ * @param	fc			Function code of the access about to be made.
+ *
+ * Tracks whether the CPU is in supervisor mode, so the memory handlers don't
+ * need to read the SR on each access. Register this with
+ * m68k_set_fc_callback(). The Makefile builds the CPU core with
+ * M68K_EMULATE_FC (see musashi_conf.h); without it, this is never called and
+ * the SR is read instead.
+ */
+void memory_fc_callback(unsigned int fc);
+
+/**
+ * @brief	Read instruction words the way the CPU would fetch them, without
+ * 			any side effects.
+ * @param	address		CPU address of the first word.
+ * @param	words		Buffer for the words.
+ * @param	n			Number of words to read.
+ *
+ * Goes through the memory dispatch table, so it sees the current Map RAM and
+ * ROMLMAP. Nothing is checked and the Page Status bits are left alone. Words
+ * which aren't in RAM or ROM read as 0xFFFF.
+ */
+void memory_peek_code(uint32_t address, uint16_t *words, int n);
+
+/**
+ * @brief	Make the disassembler read from a buffer instead of memory.
+ * @param	address		Address of the first word in the buffer.
+ * @param	words		The buffer, or NULL to go back to reading memory.
+ * @param	n			Number of words in the buffer.
+ *
+ * For disassembling code which isn't in a machine's memory, e.g. from a
+ * trace. Addresses outside the buffer read as 0xFFFF.
+ */
+void memory_disasm_from(uint32_t address, const uint16_t *words, int n);
+
+/**
+ * @brief	Get a host pointer to the physical RAM a DMA transfer will use.
+ * @param	addr	Physical address.
+ * @param	writing	true if the transfer writes to RAM.
+ * @return	Host pointer, or NULL if nothing is there. Writes to NULL are
+ * 			dropped, reads from it return 0xFF.
+ *
+ * Matches the address wrapping of RD16() and WR16(). Valid up to the end
+ * of the 4KiB page containing addr.
+ */
+uint8_t *memory_phys_ptr(uint32_t addr, bool writing);
+
+/**
+ * @brief	Note that DMA has written to the physical RAM page containing addr.
+ *
+ * Wraps addresses the same way as memory_phys_ptr().
+ */
+void memory_phys_written(uint32_t addr);
+
 /******************
  * Memory mapping
  ******************/
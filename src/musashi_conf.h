@@ -0,0 +1,29 @@
+#ifndef _MUSASHI_CONF_H
+#define _MUSASHI_CONF_H
+
+/**
+ * Musashi build configuration.
+ *
+ * The Makefile points MUSASHI_CNF here, so the CPU core and everything which
+ * includes musashi/m68k.h see the same options. Start from Musashi's own
+ * defaults and turn on the callbacks the emulator depends on, plus the
+ * ones the build asked for.
+ */
+
+#include "musashi/m68kconf.h"
+
+/// Call memory_fc_callback() before each access, so the memory handlers know
+/// whether the CPU is in supervisor mode without reading the SR
+#undef M68K_EMULATE_FC
+#define M68K_EMULATE_FC				OPT_ON
+
+/// Call the instruction hook before each instruction, for --trace and the
+/// benchmark's instruction count (see insnhook.h). That's a call for every
+/// instruction even when nothing is listening, so only with
+/// 'make ENABLE_INSN_HOOK=yes'
+#ifdef ENABLE_INSN_HOOK
+#undef M68K_INSTRUCTION_HOOK
+#define M68K_INSTRUCTION_HOOK		OPT_ON
+#endif
+
+#endif
@@ -0,0 +1,262 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "zimage.h"
+#include "overlay.h"
+
+#ifndef OVERLAY_DEBUG
+#define NDEBUG
+#endif
+#include "utils.h"
+
+/// Overlay file magic number
+static const char OVERLAY_MAGIC[8] = "FBCOW1\r\n";
+
+/// Size of the overlay header; the sector bitmap follows it
+#define OVERLAY_HEADER_SIZE		512
+/// Sector data starts on a boundary of this many bytes
+#define OVERLAY_DATA_ALIGN		4096
+
+/// Overlay header field offsets. Multi-byte fields are little-endian.
+enum {
+	HDR_MAGIC		= 0,		///< OVERLAY_MAGIC
+	HDR_SECSZ		= 8,		///< Sector size, 32 bits
+	HDR_NSECTORS	= 12,		///< Number of sectors in the bitmap, 32 bits
+	HDR_SIZE		= 16		///< Size of the base image in bytes, 64 bits
+};
+
+/// Open overlay
+typedef struct {
+	FILE		*base;				///< Base image, which may be compressed
+	int			delta_fd;
+	size_t		secsz;
+	uint64_t	size;				///< Image size in bytes
+	uint32_t	nsectors;			///< Number of sectors, including any partial last sector
+	uint8_t		*bitmap;			///< Set bits are sectors which are in the overlay
+	off_t		data_start;			///< Offset of sector 0's data in the overlay
+	off64_t		pos;				///< Current stream position
+	uint8_t		*scratch;			///< One sector, for partial sector writes
+} OVERLAY;
+
+static void put_le(uint8_t *p, uint64_t val, int bytes)
+{
+	for (int i = 0; i < bytes; i++, val >>= 8)
+		p[i] = val & 0xff;
+}
+
+static uint64_t get_le(const uint8_t *p, int bytes)
+{
+	uint64_t val = 0;
+	for (int i = bytes - 1; i >= 0; i--)
+		val = (val << 8) | p[i];
+	return val;
+}
+
+/**
+ * @brief	Read from the base image, like pread().
+ */
+static ssize_t base_read(OVERLAY *o, void *buf, size_t n, off64_t pos)
+{
+	if (fseeko(o->base, pos, SEEK_SET) != 0)
+		return -1;
+	size_t r = fread(buf, 1, n, o->base);
+	return ((r == 0) && ferror(o->base)) ? -1 : (ssize_t)r;
+}
+
+static inline bool sector_present(OVERLAY *o, uint32_t sec)
+{
+	return (o->bitmap[sec / 8] >> (sec % 8)) & 1;
+}
+
+static ssize_t overlay_read(void *cookie, char *buf, size_t size)
+{
+	OVERLAY *o = cookie;
+	size_t done = 0;
+
+	if ((uint64_t)o->pos >= o->size)
+		return 0;
+	if (size > (o->size - o->pos))
+		size = o->size - o->pos;
+
+	while (done < size) {
+		uint32_t sec = o->pos / o->secsz;
+		size_t n = o->secsz - (o->pos % o->secsz);
+		if (n > (size - done))
+			n = size - done;
+
+		// Sector data sits at the same offset in both files, give or take the overlay header
+		ssize_t r;
+		if (sector_present(o, sec))
+			r = pread(o->delta_fd, buf + done, n, o->data_start + o->pos);
+		else
+			r = base_read(o, buf + done, n, o->pos);
+		if (r < 0)
+			return (done > 0) ? (ssize_t)done : -1;
+
+		done += r;
+		o->pos += r;
+		if ((size_t)r < n)
+			break;
+	}
+
+	return done;
+}
+
+static ssize_t overlay_write(void *cookie, const char *buf, size_t size)
+{
+	OVERLAY *o = cookie;
+	size_t done = 0;
+
+	while ((done < size) && ((uint64_t)o->pos < o->size)) {
+		uint32_t sec = o->pos / o->secsz;
+		off64_t sec_start = (off64_t)sec * o->secsz;
+		size_t seclen = ((o->size - sec_start) < o->secsz) ? (o->size - sec_start) : o->secsz;
+		size_t off = o->pos - sec_start;
+		size_t n = seclen - off;
+		if (n > (size - done))
+			n = size - done;
+
+		ssize_t w;
+		if (!sector_present(o, sec) && (n < seclen)) {
+			// Partial write to a sector which isn't in the overlay yet; copy
+			// the rest of it from the base image
+			if (base_read(o, o->scratch, seclen, sec_start) != (ssize_t)seclen)
+				break;
+			memcpy(o->scratch + off, buf + done, n);
+			w = pwrite(o->delta_fd, o->scratch, seclen, o->data_start + sec_start);
+			w = (w == (ssize_t)seclen) ? (ssize_t)n : -1;
+		} else {
+			w = pwrite(o->delta_fd, buf + done, n, o->data_start + o->pos);
+		}
+		if (w != (ssize_t)n)
+			break;
+
+		// Mark the sector present once its data is safely in the overlay,
+		// here as well as in the file only once the file has it
+		if (!sector_present(o, sec)) {
+			uint8_t bits = o->bitmap[sec / 8] | (1 << (sec % 8));
+			if (pwrite(o->delta_fd, &bits, 1, OVERLAY_HEADER_SIZE + (sec / 8)) != 1)
+				break;
+			o->bitmap[sec / 8] = bits;
+			LOG("sector %u copied to overlay", sec);
+		}
+
+		done += n;
+		o->pos += n;
+	}
+
+	// Anything short of the full amount is an error as far as stdio is concerned
+	return done;
+}
+
+static int overlay_seek(void *cookie, off64_t *offset, int whence)
+{
+	OVERLAY *o = cookie;
+	off64_t pos;
+
+	switch (whence) {
+		case SEEK_SET:	pos = *offset;				break;
+		case SEEK_CUR:	pos = o->pos + *offset;		break;
+		case SEEK_END:	pos = o->size + *offset;	break;
+		default:		errno = EINVAL;				return -1;
+	}
+	if (pos < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	o->pos = *offset = pos;
+	return 0;
+}
+
+static int overlay_close(void *cookie)
+{
+	OVERLAY *o = cookie;
+
+	if (o->base != NULL)	fclose(o->base);
+	if (o->delta_fd >= 0)	close(o->delta_fd);
+	free(o->bitmap);
+	free(o->scratch);
+	free(o);
+	return 0;
+}
+
+FILE *overlay_open(const char *base, const char *delta, size_t secsz)
+{
+	static const cookie_io_functions_t io = {
+		.read	= overlay_read,
+		.write	= overlay_write,
+		.seek	= overlay_seek,
+		.close	= overlay_close
+	};
+	uint8_t hdr[OVERLAY_HEADER_SIZE];
+	struct stat st;
+	size_t bitmap_len;
+	FILE *fp;
+	int err;
+
+	OVERLAY *o = calloc(1, sizeof(OVERLAY));
+	if (o == NULL)
+		return NULL;
+	o->delta_fd = -1;
+	o->secsz = secsz;
+
+	// The base image fixes the size of the disc
+	if (((o->base = zimage_open(base, false)) == NULL) || (fseeko(o->base, 0, SEEK_END) != 0))
+		goto fail;
+	o->size = ftello(o->base);
+	o->nsectors = (o->size + secsz - 1) / secsz;
+	bitmap_len = (o->nsectors + 7) / 8;
+	o->data_start = (OVERLAY_HEADER_SIZE + bitmap_len + OVERLAY_DATA_ALIGN - 1) & ~(off_t)(OVERLAY_DATA_ALIGN - 1);
+
+	o->bitmap = calloc(1, bitmap_len);
+	o->scratch = malloc(secsz);
+	if ((o->bitmap == NULL) || (o->scratch == NULL))
+		goto fail;
+
+	if (((o->delta_fd = open(delta, O_RDWR | O_CREAT, 0644)) < 0) || (fstat(o->delta_fd, &st) != 0))
+		goto fail;
+
+	if (st.st_size == 0) {
+		// New overlay: write a header and an empty bitmap
+		memset(hdr, 0, sizeof(hdr));
+		memcpy(hdr + HDR_MAGIC, OVERLAY_MAGIC, sizeof(OVERLAY_MAGIC));
+		put_le(hdr + HDR_SECSZ, secsz, 4);
+		put_le(hdr + HDR_NSECTORS, o->nsectors, 4);
+		put_le(hdr + HDR_SIZE, o->size, 8);
+		if ((pwrite(o->delta_fd, hdr, sizeof(hdr), 0) != sizeof(hdr)) || (ftruncate(o->delta_fd, o->data_start) != 0))
+			goto fail;
+		LOG("created overlay '%s' for '%s', %u sectors", delta, base, o->nsectors);
+	} else {
+		// Existing overlay: make sure it was made for an image like this one
+		if ((pread(o->delta_fd, hdr, sizeof(hdr), 0) != sizeof(hdr)) ||
+				(memcmp(hdr + HDR_MAGIC, OVERLAY_MAGIC, sizeof(OVERLAY_MAGIC)) != 0) ||
+				(get_le(hdr + HDR_SECSZ, 4) != secsz) ||
+				(get_le(hdr + HDR_NSECTORS, 4) != o->nsectors) ||
+				(get_le(hdr + HDR_SIZE, 8) != o->size)) {
+			errno = EINVAL;
+			goto fail;
+		}
+		if (pread(o->delta_fd, o->bitmap, bitmap_len, OVERLAY_HEADER_SIZE) != (ssize_t)bitmap_len) {
+			errno = EINVAL;
+			goto fail;
+		}
+	}
+
+	if ((fp = fopencookie(o, "r+", io)) == NULL)
+		goto fail;
+	return fp;
+
+fail:
+	err = errno;
+	overlay_close(o);
+	errno = err;
+	return NULL;
+}
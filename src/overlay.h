@@ -0,0 +1,28 @@
+#ifndef _OVERLAY_H
+#define _OVERLAY_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/**
+ * @brief	Open a disc image through a copy-on-write overlay.
+ * @param	base	Base image file name, which may be compressed (see
+ * 					zimage_open()). Opened read-only and never written, so
+ * 					any number of emulators can share it.
+ * @param	delta	Overlay file name. Created if it doesn't exist.
+ * @param	secsz	Sector size in bytes.
+ * @return	A read/write stream onto the combined image, or NULL on error
+ * 			(with errno set).
+ *
+ * The overlay holds a header, a bitmap of the sectors which have been
+ * written, and those sectors' data at the same offsets they have in the
+ * image. It is a sparse file, so it only takes up space for the sectors
+ * which have been written. Reads of other sectors come from the base image.
+ *
+ * The stream has no file descriptor, so it can't be used with
+ * wd2010_map_image() or wd2010_cache_image(). The combined image can't grow
+ * beyond the size of the base image.
+ */
+FILE *overlay_open(const char *base, const char *delta, size_t secsz);
+
+#endif
@@ -0,0 +1,509 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include "musashi/m68k.h"
+#include "state.h"
+#include "sched.h"
+#include "profile.h"
+
+#ifndef PROFILE_DEBUG
+#define NDEBUG
+#endif
+#include "utils.h"
+
+/// A distinct sampled call stack
+typedef struct {
+	uint32_t	count;							///< Number of samples, 0 if the slot is free
+	uint8_t		depth;							///< Number of entries in pc[]
+	bool		super;							///< Taken in supervisor mode
+	uint32_t	pc[PROFILE_MAX_DEPTH + 1];		///< Sampled PC, then return addresses
+} PROFILE_STACK;
+
+/// A code symbol, or the end of one
+typedef struct {
+	uint32_t	addr;
+	char		*name;							///< NULL for the end of the code before
+} PROFILE_SYMBOL;
+
+/// A name made up for code with no symbol
+typedef struct {
+	uint32_t	pc;
+	char		*name;							///< NULL if the slot is free
+} PROFILE_LABEL;
+
+/// Sampled stacks: open-addressed hash table, size a power of two
+static PROFILE_STACK *stacks = NULL;
+static size_t nstacks = 0, stacks_size = 0;
+/// Symbols, sorted by address
+static PROFILE_SYMBOL *symbols = NULL;
+static size_t nsymbols = 0;
+/// Disassembly labels for unnamed code: open-addressed hash table
+static PROFILE_LABEL *labels = NULL;
+static size_t nlabels = 0, labels_size = 0;
+
+static uint32_t sample_interval = 0;
+static int sample_depth = 0;
+/// Machine being profiled
+static S_state *profiled = NULL;
+
+/********************************************************
+ * Symbol tables
+ ********************************************************/
+
+static uint32_t get_be(const uint8_t *p, int bytes)
+{
+	uint32_t val = 0;
+	for (int i = 0; i < bytes; i++)
+		val = (val << 8) | p[i];
+	return val;
+}
+
+/**
+ * @brief	Add a symbol to the table.
+ * @param	name	Symbol name, or NULL to mark the end of the code before
+ * 					(nothing at or after addr belongs to the previous symbol).
+ */
+static bool add_symbol(uint32_t addr, const char *name, size_t len)
+{
+	static size_t alloc = 0;
+
+	// Leave out section names and the like
+	if ((name != NULL) && ((len == 0) || (name[0] == '.')))
+		return true;
+
+	if (nsymbols == alloc) {
+		size_t n = alloc ? alloc * 2 : 1024;
+		PROFILE_SYMBOL *p = realloc(symbols, n * sizeof(PROFILE_SYMBOL));
+		if (p == NULL)
+			return false;
+		symbols = p;
+		alloc = n;
+	}
+	if (name == NULL) {
+		symbols[nsymbols].name = NULL;
+	} else {
+		if ((symbols[nsymbols].name = malloc(len + 1)) == NULL)
+			return false;
+		memcpy(symbols[nsymbols].name, name, len);
+		symbols[nsymbols].name[len] = '\0';
+	}
+	symbols[nsymbols].addr = addr;
+	nsymbols++;
+	return true;
+}
+
+/**
+ * @brief	Read the symbols from a 68K COFF file (e.g. the 3B1 /unix).
+ */
+static bool load_coff(const uint8_t *buf, size_t len)
+{
+	// File header: magic, nscns, timdat, symptr, nsyms, opthdr, flags
+	if (len < 20)
+		return false;
+	uint32_t nscns = get_be(buf + 2, 2), symptr = get_be(buf + 8, 4), nsyms = get_be(buf + 12, 4);
+	uint32_t scnptr = 20 + get_be(buf + 16, 2);
+	uint32_t strptr = symptr + (nsyms * 18);
+	if ((nsyms > len / 18) || (strptr > len) || (scnptr + (nscns * 40) > len))
+		return false;
+
+	// Section headers: name, paddr, vaddr, size, ..., flags at 36
+	for (uint32_t i = 0; i < nscns; i++) {
+		const uint8_t *scn = buf + scnptr + (i * 40);
+		if (!add_symbol(get_be(scn + 12, 4) + get_be(scn + 16, 4), NULL, 0))
+			return false;
+	}
+
+	for (uint32_t i = 0; i < nsyms; i++) {
+		const uint8_t *sym = buf + symptr + (i * 18);
+		int16_t scnum = (int16_t)get_be(sym + 12, 2);
+		uint8_t sclass = sym[16], numaux = sym[17];
+		bool text = (scnum > 0) && ((uint32_t)scnum <= nscns) &&
+			(get_be(buf + scnptr + ((scnum - 1) * 40) + 36, 4) & 0x20);
+
+		// Data and bss symbols end the code before them
+		if ((sclass == 2) && (scnum > 0) && !text) {
+			if (!add_symbol(get_be(sym + 8, 4), NULL, 0))
+				return false;
+		}
+
+		// External and static symbols in a text section
+		if (((sclass == 2) || (sclass == 3)) && text) {
+			const char *name;
+			size_t namelen;
+			if (get_be(sym, 4) == 0) {
+				// Long name, in the string table
+				uint32_t off = strptr + get_be(sym + 4, 4);
+				if (off >= len)
+					return false;
+				name = (const char *)buf + off;
+				namelen = strnlen(name, len - off);
+			} else {
+				name = (const char *)sym;
+				namelen = strnlen(name, 8);
+			}
+			if (!add_symbol(get_be(sym + 8, 4), name, namelen))
+				return false;
+		}
+		i += numaux;
+	}
+	return true;
+}
+
+/**
+ * @brief	Read the symbols from a big-endian a.out file.
+ */
+static bool load_aout(const uint8_t *buf, size_t len)
+{
+	// Header: magic, text, data, bss, syms, entry, trsize, drsize
+	if (len < 32)
+		return false;
+	uint32_t magic = get_be(buf, 4) & 0xFFFF;
+	uint32_t text = get_be(buf + 4, 4), data = get_be(buf + 8, 4), syms = get_be(buf + 16, 4);
+	uint32_t trsize = get_be(buf + 24, 4), drsize = get_be(buf + 28, 4);
+	// Demand-paged files count the header as part of the text
+	uint32_t symoff = ((magic == 0413) ? 0 : 32) + text + data + trsize + drsize;
+	uint32_t stroff = symoff + syms;
+	if ((symoff > len) || (syms > len - symoff))
+		return false;
+
+	for (uint32_t i = 0; i + 12 <= syms; i += 12) {
+		const uint8_t *nl = buf + symoff + i;
+		uint32_t strx = get_be(nl, 4);
+		uint8_t type = nl[4];
+
+		// No debugger entries; data and bss symbols end the code before them
+		if ((type & 0xE0) != 0)
+			continue;
+		if (((type & 0x1E) == 0x06) || ((type & 0x1E) == 0x08)) {
+			if (!add_symbol(get_be(nl + 8, 4), NULL, 0))
+				return false;
+			continue;
+		}
+		if ((type & 0x1E) != 0x04)
+			continue;
+		if ((stroff + strx) >= len)
+			return false;
+		const char *name = (const char *)buf + stroff + strx;
+		size_t namelen = strnlen(name, len - stroff - strx);
+		// Skip the leading underscore the C compiler adds
+		if ((namelen > 1) && (name[0] == '_')) {
+			name++;
+			namelen--;
+		}
+		if (!add_symbol(get_be(nl + 8, 4), name, namelen))
+			return false;
+	}
+	return true;
+}
+
+/**
+ * @brief	Read symbols from nm output.
+ */
+static bool load_nm(const char *buf, size_t len)
+{
+	const char *p = buf, *end = buf + len;
+
+	while (p < end) {
+		const char *eol = memchr(p, '\n', end - p);
+		if (eol == NULL)
+			eol = end;
+
+		char line[256], name[256], type;
+		unsigned int addr;
+		size_t n = eol - p;
+		if (n >= sizeof(line))
+			n = sizeof(line) - 1;
+		memcpy(line, p, n);
+		line[n] = '\0';
+		if (sscanf(line, "%x %c %255s", &addr, &type, name) == 3) {
+			// Anything other than code ends the code before it
+			bool text = (tolower(type) == 't');
+			if (!add_symbol(addr, text ? name : NULL, strlen(name)))
+				return false;
+		}
+		p = eol + 1;
+	}
+	return true;
+}
+
+static int symbol_cmp(const void *a, const void *b)
+{
+	const PROFILE_SYMBOL *sa = a, *sb = b;
+	if (sa->addr != sb->addr)
+		return (sa->addr > sb->addr) ? 1 : -1;
+	// Code symbols win over ends at the same address
+	return (sa->name != NULL) - (sb->name != NULL);
+}
+
+bool profile_load_symbols(const char *filename)
+{
+	FILE *fp = fopen(filename, "rb");
+	if (fp == NULL)
+		return false;
+
+	fseek(fp, 0, SEEK_END);
+	long len = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	uint8_t *buf = (len > 0) ? malloc(len) : NULL;
+	bool ok = (buf != NULL) && (fread(buf, 1, len, fp) == (size_t)len);
+	fclose(fp);
+
+	if (ok) {
+		uint32_t magic = get_be(buf, 2);
+		if ((len >= 2) && ((magic & 0xFFF8) == 0x0150))
+			ok = load_coff(buf, len);
+		else if ((len >= 4) && (((get_be(buf, 4) & 0xFFFF) == 0407) || ((get_be(buf, 4) & 0xFFFF) == 0410) || ((get_be(buf, 4) & 0xFFFF) == 0413)))
+			ok = load_aout(buf, len);
+		else
+			ok = load_nm((const char *)buf, len);
+	}
+	free(buf);
+
+	qsort(symbols, nsymbols, sizeof(PROFILE_SYMBOL), symbol_cmp);
+	LOG("%zu symbols from '%s'", nsymbols, filename);
+	return ok && (nsymbols > 0);
+}
+
+/**
+ * @brief	Find the symbol a code address belongs to.
+ * @return	The symbol name, or NULL if the address isn't in any known code.
+ */
+static const char *find_symbol(uint32_t pc)
+{
+	size_t lo = 0, hi = nsymbols;
+
+	// Find the last symbol at or below pc
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (symbols[mid].addr <= pc)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo > 0) ? symbols[lo - 1].name : NULL;
+}
+
+/********************************************************
+ * Sampling
+ ********************************************************/
+
+static inline uint32_t hash_pc(uint32_t pc)
+{
+	return pc * 2654435761u;
+}
+
+/**
+ * @brief	Make up a name for code with no symbol: its address and the
+ * 			instruction there.
+ *
+ * Done when the PC is first seen, while the code is still in memory.
+ */
+static void add_label(uint32_t pc)
+{
+	if ((labels_size == 0) || ((nlabels + 1) * 2 > labels_size)) {
+		// Grow the table, rehashing everything in it
+		size_t n = labels_size ? labels_size * 2 : 1024;
+		PROFILE_LABEL *p = calloc(n, sizeof(PROFILE_LABEL));
+		if (p == NULL)
+			return;
+		for (size_t i = 0; i < labels_size; i++) {
+			if (labels[i].name == NULL)
+				continue;
+			size_t j = hash_pc(labels[i].pc) & (n - 1);
+			while (p[j].name != NULL)
+				j = (j + 1) & (n - 1);
+			p[j] = labels[i];
+		}
+		free(labels);
+		labels = p;
+		labels_size = n;
+	}
+
+	size_t i = hash_pc(pc) & (labels_size - 1);
+	while (labels[i].name != NULL) {
+		if (labels[i].pc == pc)
+			return;
+		i = (i + 1) & (labels_size - 1);
+	}
+
+	// The disassembler can only see the RAM zone
+	char insn[128] = "", name[160];
+	if (pc < 0x400000) {
+		m68k_disassemble(insn, pc, M68K_CPU_TYPE_68010);
+		// Semicolons would split the frame in two
+		for (char *c = insn; *c; c++)
+			if (*c == ';')
+				*c = ',';
+	}
+	snprintf(name, sizeof(name), "0x%06X%s%s", pc, insn[0] ? " " : "", insn);
+	if ((labels[i].name = strdup(name)) != NULL) {
+		labels[i].pc = pc;
+		nlabels++;
+	}
+}
+
+static const char *find_label(uint32_t pc)
+{
+	if (labels_size == 0)
+		return NULL;
+	size_t i = hash_pc(pc) & (labels_size - 1);
+	while (labels[i].name != NULL) {
+		if (labels[i].pc == pc)
+			return labels[i].name;
+		i = (i + 1) & (labels_size - 1);
+	}
+	return NULL;
+}
+
+static uint32_t hash_stack(const PROFILE_STACK *s)
+{
+	uint32_t h = 2166136261u ^ s->super;
+	for (int i = 0; i < s->depth; i++)
+		h = (h ^ s->pc[i]) * 16777619u;
+	return h;
+}
+
+static bool same_stack(const PROFILE_STACK *a, const PROFILE_STACK *b)
+{
+	return (a->depth == b->depth) && (a->super == b->super) &&
+		(memcmp(a->pc, b->pc, a->depth * sizeof(uint32_t)) == 0);
+}
+
+static void add_sample(const PROFILE_STACK *s)
+{
+	if ((stacks_size == 0) || ((nstacks + 1) * 2 > stacks_size)) {
+		size_t n = stacks_size ? stacks_size * 2 : 4096;
+		PROFILE_STACK *p = calloc(n, sizeof(PROFILE_STACK));
+		if (p == NULL)
+			return;
+		for (size_t i = 0; i < stacks_size; i++) {
+			if (stacks[i].count == 0)
+				continue;
+			size_t j = hash_stack(&stacks[i]) & (n - 1);
+			while (p[j].count != 0)
+				j = (j + 1) & (n - 1);
+			p[j] = stacks[i];
+		}
+		free(stacks);
+		stacks = p;
+		stacks_size = n;
+	}
+
+	size_t i = hash_stack(s) & (stacks_size - 1);
+	while (stacks[i].count != 0) {
+		if (same_stack(&stacks[i], s)) {
+			stacks[i].count++;
+			return;
+		}
+		i = (i + 1) & (stacks_size - 1);
+	}
+
+	// First time this stack has been seen; name any new code in it
+	stacks[i] = *s;
+	stacks[i].count = 1;
+	nstacks++;
+	for (int d = 0; d < s->depth; d++)
+		if (find_symbol(s->pc[d]) == NULL)
+			add_label(s->pc[d]);
+}
+
+/**
+ * @brief	Scheduler event: take a sample.
+ */
+static void profile_event(void *arg)
+{
+	PROFILE_STACK s;
+
+	(void)arg;
+
+	// The event handlers are shared between machines, and another machine
+	// may have been restored from a snapshot taken while profiling
+	if (state != profiled)
+		return;
+
+	s.super = (m68k_get_reg(NULL, M68K_REG_SR) & 0x2000) != 0;
+	s.pc[0] = m68k_get_reg(NULL, M68K_REG_PC);
+	s.depth = 1;
+
+	// Follow the frame pointer chain: LINK A6 leaves the caller's A6 at
+	// (A6) and the return address at 4(A6). Stacks grow downwards, so each
+	// caller's frame is above the last; anything else means A6 isn't being
+	// used as a frame pointer. Reads go through the disassembler's memory
+	// handlers, which have no side effects.
+	uint32_t fp = m68k_get_reg(NULL, M68K_REG_A6);
+	while ((s.depth <= sample_depth) && ((fp & 1) == 0) && (fp != 0) && (fp < 0x400000 - 8)) {
+		uint32_t ret = m68k_read_disassembler_32(fp + 4);
+		uint32_t next = m68k_read_disassembler_32(fp);
+		if ((ret == 0) || (ret & 1))
+			break;
+		s.pc[s.depth++] = ret;
+		if (next <= fp)
+			break;
+		fp = next;
+	}
+
+	add_sample(&s);
+	sched_add(SCHED_EV_PROFILE, sample_interval);
+}
+
+void profile_start(uint32_t interval, int depth)
+{
+	sample_interval = interval ? interval : 1;
+	sample_depth = (depth < 0) ? 0 : (depth > PROFILE_MAX_DEPTH) ? PROFILE_MAX_DEPTH : depth;
+	profiled = state;
+	sched_register(SCHED_EV_PROFILE, profile_event, NULL);
+	sched_add(SCHED_EV_PROFILE, sample_interval);
+}
+
+bool profile_write(const char *filename)
+{
+	FILE *fp = fopen(filename, "w");
+	if (fp == NULL)
+		return false;
+
+	for (size_t i = 0; i < stacks_size; i++) {
+		const PROFILE_STACK *s = &stacks[i];
+		if (s->count == 0)
+			continue;
+
+		fputs(s->super ? "kernel" : "user", fp);
+		for (int d = s->depth - 1; d >= 0; d--) {
+			const char *name = find_symbol(s->pc[d]);
+			if (name == NULL)
+				name = find_label(s->pc[d]);
+			if (name != NULL)
+				fprintf(fp, ";%s", name);
+			else
+				fprintf(fp, ";0x%06X", s->pc[d]);
+		}
+		fprintf(fp, " %u\n", s->count);
+	}
+
+	bool ok = !ferror(fp);
+	ok = (fclose(fp) == 0) && ok;
+	LOG("wrote %zu stacks to '%s'", nstacks, filename);
+	return ok;
+}
+
+void profile_done(void)
+{
+	sched_cancel(SCHED_EV_PROFILE);
+	sched_register(SCHED_EV_PROFILE, NULL, NULL);
+	profiled = NULL;
+
+	for (size_t i = 0; i < nsymbols; i++)
+		free(symbols[i].name);
+	for (size_t i = 0; i < labels_size; i++)
+		free(labels[i].name);
+	free(symbols);
+	free(labels);
+	free(stacks);
+	symbols = NULL;
+	labels = NULL;
+	stacks = NULL;
+	nsymbols = nlabels = nstacks = 0;
+	labels_size = stacks_size = 0;
+}
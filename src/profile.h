@@ -0,0 +1,48 @@
+#ifndef _PROFILE_H
+#define _PROFILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/// Deepest call stack recorded with each sample, not counting the PC itself
+#define PROFILE_MAX_DEPTH	16
+
+/**
+ * @brief	Load a symbol table to name the sampled code with.
+ * @param	filename	UNIX kernel or program (COFF or a.out), or a text
+ * 						symbol list in nm format ("ADDRESS TYPE NAME").
+ * @return	true on success.
+ *
+ * Only text (code) symbols are used. Call before profile_start().
+ */
+bool profile_load_symbols(const char *filename);
+
+/**
+ * @brief	Start sampling the guest PC.
+ * @param	interval	Emulated CPU cycles between samples.
+ * @param	depth		Number of callers to record as well, by following the
+ * 						A6 frame pointer chain (0 to PROFILE_MAX_DEPTH).
+ *
+ * Samples are taken by a scheduler event, so they cost nothing between
+ * samples. Call after the machine is set up (and any snapshot restored).
+ */
+void profile_start(uint32_t interval, int depth);
+
+/**
+ * @brief	Write the samples in folded stack format, for flame graphs.
+ * @param	filename	Output file name.
+ * @return	true on success.
+ *
+ * One line per distinct stack: frames from outermost to innermost separated
+ * by semicolons, then a space and the number of samples. The first frame is
+ * "kernel" or "user", for the CPU mode the sample was taken in. Code with no
+ * symbol is named by its address and disassembly.
+ */
+bool profile_write(const char *filename);
+
+/**
+ * @brief	Stop sampling and free the samples and symbol table.
+ */
+void profile_done(void);
+
+#endif
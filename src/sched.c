@@ -0,0 +1,233 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "musashi/m68k.h"
+#include "state.h"
+#include "sched.h"
+#include "irq.h"
+#include "stats.h"
+
+#ifndef SCHED_DEBUG
+#define NDEBUG
+#endif
+#include "utils.h"
+
+/// Event handlers. Not part of the saved state; registered at start-up.
+static struct {
+	SCHED_CALLBACK	cb;
+	void			*data;
+} handlers[SCHED_EV_COUNT];
+
+static void (*sync_hook)(void) = NULL;
+
+/// Instructions which leave the CPU waiting for an interrupt
+#define OP_STOP			0x4E72		///< STOP #imm
+#define OP_BRA_SELF		0x60FE		///< BRA.S to itself
+
+/**
+ * Check whether the CPU is waiting for an interrupt: stopped by a STOP
+ * instruction, or spinning on a branch to itself, with nothing pending that
+ * it would take. Running it until the next event would change nothing but
+ * the clock.
+ */
+static bool cpu_idle(void)
+{
+	uint32_t pc = m68k_get_reg(NULL, M68K_REG_PC);
+	uint32_t ppc = m68k_get_reg(NULL, M68K_REG_PPC);
+	uint16_t op;
+
+	// The last instruction executed is the STOP just behind the PC, or the
+	// branch at it
+	if ((ppc != pc - 4) && (ppc != pc))
+		return false;
+	memory_peek_code(ppc, &op, 1);
+	if ((ppc == pc - 4) ? (op != OP_STOP) : (op != OP_BRA_SELF))
+		return false;
+
+	// Trace mode would stop after each instruction
+	uint32_t sr = m68k_get_reg(NULL, M68K_REG_SR);
+	if (sr & 0x8000)
+		return false;
+	return !irq_wakes_cpu((sr >> 8) & 7);
+}
+
+/********************************************************
+ * Binary min-heap of pending events
+ ********************************************************/
+
+static inline bool heap_less(SCHED_CTX *ctx, int a, int b)
+{
+	return ctx->deadline[ctx->heap[a]] < ctx->deadline[ctx->heap[b]];
+}
+
+static inline void heap_swap(SCHED_CTX *ctx, int a, int b)
+{
+	int t = ctx->heap[a];
+	ctx->heap[a] = ctx->heap[b];
+	ctx->heap[b] = t;
+	ctx->heap_pos[ctx->heap[a]] = a;
+	ctx->heap_pos[ctx->heap[b]] = b;
+}
+
+static void heap_up(SCHED_CTX *ctx, int i)
+{
+	while ((i > 0) && heap_less(ctx, i, (i - 1) / 2)) {
+		heap_swap(ctx, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void heap_down(SCHED_CTX *ctx, int i)
+{
+	for (;;) {
+		int l = (2 * i) + 1, r = l + 1, m = i;
+		if ((l < ctx->heap_len) && heap_less(ctx, l, m)) m = l;
+		if ((r < ctx->heap_len) && heap_less(ctx, r, m)) m = r;
+		if (m == i) return;
+		heap_swap(ctx, i, m);
+		i = m;
+	}
+}
+
+static void heap_remove(SCHED_CTX *ctx, int ev)
+{
+	int i = ctx->heap_pos[ev];
+
+	// Move the last event into the hole and restore the heap order
+	ctx->heap_len--;
+	if (i != ctx->heap_len) {
+		heap_swap(ctx, i, ctx->heap_len);
+		heap_up(ctx, i);
+		heap_down(ctx, i);
+	}
+	ctx->heap_pos[ev] = -1;
+}
+
+/********************************************************
+ * Public interface
+ ********************************************************/
+
+void sched_init(SCHED_CTX *ctx)
+{
+	ctx->now = 0;
+	ctx->burst_end = 0;
+	ctx->in_burst = false;
+	ctx->heap_len = 0;
+	for (int i = 0; i < SCHED_EV_COUNT; i++) {
+		ctx->deadline[i] = 0;
+		ctx->heap_pos[i] = -1;
+	}
+}
+
+void sched_register(SCHED_EVENT ev, SCHED_CALLBACK cb, void *data)
+{
+	handlers[ev].cb = cb;
+	handlers[ev].data = data;
+}
+
+void sched_set_sync_hook(void (*hook)(void))
+{
+	sync_hook = hook;
+}
+
+uint64_t sched_now(void)
+{
+	if (state->sched.in_burst)
+		return state->sched.now + m68k_cycles_run();
+	return state->sched.now;
+}
+
+void sched_add(SCHED_EVENT ev, uint64_t delay)
+{
+	sched_add_at(ev, sched_now() + delay);
+}
+
+void sched_add_at(SCHED_EVENT ev, uint64_t when)
+{
+	SCHED_CTX *ctx = &state->sched;
+
+	if (ctx->heap_pos[ev] >= 0)
+		heap_remove(ctx, ev);
+
+	ctx->deadline[ev] = when;
+	ctx->heap[ctx->heap_len] = ev;
+	ctx->heap_pos[ev] = ctx->heap_len;
+	ctx->heap_len++;
+	heap_up(ctx, ctx->heap_pos[ev]);
+
+	// Cut the CPU burst short if it would run past the new deadline
+	if (ctx->in_burst && (when < ctx->burst_end))
+		sched_sync();
+}
+
+void sched_cancel(SCHED_EVENT ev)
+{
+	if (state->sched.heap_pos[ev] >= 0)
+		heap_remove(&state->sched, ev);
+}
+
+uint64_t sched_deadline(SCHED_EVENT ev)
+{
+	return state->sched.deadline[ev];
+}
+
+bool sched_pending(SCHED_EVENT ev)
+{
+	return state->sched.heap_pos[ev] >= 0;
+}
+
+void sched_sync(void)
+{
+	if (!state->sched.in_burst)
+		return;
+
+	// m68k_end_timeslice() makes m68k_execute() return the wrong cycle
+	// count, so take the remaining cycles off the timeslice instead.
+	int remaining = m68k_cycles_remaining();
+	if (remaining > 0)
+		m68k_modify_timeslice(-remaining);
+	state->sched.burst_end = sched_now();
+}
+
+uint64_t sched_run(uint64_t cycles)
+{
+	SCHED_CTX *ctx = &state->sched;
+	uint64_t start = ctx->now, end = ctx->now + cycles;
+
+	while (ctx->now < end) {
+		// Run any events which have fallen due
+		while ((ctx->heap_len > 0) && (ctx->deadline[ctx->heap[0]] <= ctx->now)) {
+			int ev = ctx->heap[0];
+			heap_remove(ctx, ev);
+			LOG("event %d at %llu (due %llu)", ev, (unsigned long long)ctx->now, (unsigned long long)ctx->deadline[ev]);
+			if (handlers[ev].cb)
+				handlers[ev].cb(handlers[ev].data);
+		}
+		if (sync_hook)
+			sync_hook();
+
+		// Run the CPU up to the next deadline
+		uint64_t target = end;
+		if ((ctx->heap_len > 0) && (ctx->deadline[ctx->heap[0]] < target))
+			target = ctx->deadline[ctx->heap[0]];
+		if (target <= ctx->now)
+			continue;
+
+		ctx->burst_end = target;
+
+		// A waiting CPU can skip straight to the next event
+		if (cpu_idle()) {
+			LOG("idle from %llu to %llu", (unsigned long long)ctx->now, (unsigned long long)target);
+			STAT_ADD(idle_cycles, target - ctx->now);
+			ctx->now = target;
+			continue;
+		}
+
+		ctx->in_burst = true;
+		int ran = m68k_execute(target - ctx->now);
+		ctx->in_burst = false;
+		ctx->now += ran;
+	}
+
+	return ctx->now - start;
+}
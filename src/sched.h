@@ -0,0 +1,122 @@
+#ifndef _SCHED_H
+#define _SCHED_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/// Emulated CPU clock frequency, Hz
+#define SCHED_CLOCK_HZ			10000000
+
+/// Convert milliseconds of emulated time to CPU cycles
+#define SCHED_MS_TO_CYCLES(ms)	((uint64_t)(ms) * (SCHED_CLOCK_HZ / 1000))
+
+/**
+ * Scheduled events. Each event can be pending at most once; scheduling an
+ * event which is already pending moves its deadline.
+ */
+typedef enum {
+	SCHED_EV_TICK60,		///< 60Hz periodic interrupt and keyboard scan
+	SCHED_EV_TIMER_PULSE,	///< End of the 60Hz interrupt pulse
+	SCHED_EV_DMA,			///< Disc DMA engine service
+	SCHED_EV_HDC_SEEK,		///< WD2010 seek complete
+	SCHED_EV_PROFILE,		///< Guest PC sample for the profiler
+	SCHED_EV_COUNT			///< Number of events (not an event)
+} SCHED_EVENT;
+
+/// Event handler
+typedef void (*SCHED_CALLBACK)(void *ctx);
+
+/**
+ * @brief Scheduler state
+ *
+ * Events are kept in a binary min-heap ordered by deadline.
+ */
+typedef struct {
+	uint64_t	now;							///< Cycles executed before the current CPU burst
+	uint64_t	burst_end;						///< Cycle at which the current CPU burst ends
+	bool		in_burst;						///< True while m68k_execute() is running
+	uint64_t	deadline[SCHED_EV_COUNT];		///< Deadline of each pending event
+	int			heap[SCHED_EV_COUNT];			///< Pending events, heap ordered by deadline
+	int			heap_pos[SCHED_EV_COUNT];		///< Position of each event in the heap, -1 if not pending
+	int			heap_len;						///< Number of pending events
+} SCHED_CTX;
+
+/**
+ * @brief	Initialise the scheduler. No events are pending afterwards.
+ */
+void sched_init(SCHED_CTX *ctx);
+
+/**
+ * @brief	Set the handler for an event.
+ * @param	ev		Event.
+ * @param	cb		Function to call when the event's deadline is reached.
+ * @param	data	Passed to the handler.
+ *
+ * Handlers are shared by every machine in the process, so a handler finds
+ * the machine it's for through state, not data.
+ */
+void sched_register(SCHED_EVENT ev, SCHED_CALLBACK cb, void *data);
+
+/**
+ * @brief	Set the function which is called after every CPU burst and
+ * 			every batch of events, to re-evaluate DMA requests.
+ */
+void sched_set_sync_hook(void (*hook)(void));
+
+/**
+ * @brief	Get the current emulated time, in CPU cycles since reset.
+ */
+uint64_t sched_now(void);
+
+/**
+ * @brief	Schedule an event.
+ * @param	ev		Event.
+ * @param	delay	Number of CPU cycles from now.
+ */
+void sched_add(SCHED_EVENT ev, uint64_t delay);
+
+/**
+ * @brief	Schedule an event at an absolute time.
+ * @param	ev		Event.
+ * @param	when	Emulated time, in CPU cycles since reset.
+ */
+void sched_add_at(SCHED_EVENT ev, uint64_t when);
+
+/**
+ * @brief	Get the deadline an event was last scheduled for.
+ *
+ * Periodic events can use this to reschedule themselves without drifting.
+ */
+uint64_t sched_deadline(SCHED_EVENT ev);
+
+/**
+ * @brief	Cancel a pending event. Does nothing if the event isn't pending.
+ */
+void sched_cancel(SCHED_EVENT ev);
+
+/**
+ * @brief	Check whether an event is pending.
+ */
+bool sched_pending(SCHED_EVENT ev);
+
+/**
+ * @brief	End the current CPU burst after the current instruction.
+ *
+ * Call this when the CPU changes device state which may affect interrupts
+ * or DMA, so the sync hook gets to see it straight away.
+ */
+void sched_sync(void);
+
+/**
+ * @brief	Run the CPU and any events which fall due.
+ * @param	cycles	Number of CPU cycles to run for.
+ * @return	Number of cycles actually run (may overshoot by an instruction).
+ *
+ * The CPU runs uninterrupted until the next event deadline, or until a
+ * device access calls sched_sync(). If it's waiting for an interrupt (after a
+ * STOP, or on a branch to itself) with none pending, the clock skips straight
+ * to the next deadline instead.
+ */
+uint64_t sched_run(uint64_t cycles);
+
+#endif
@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include "SDL.h"
+#include "state.h"
+#include "keyboard.h"
+#include "video.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "bench.h"
+#include "log.h"
+#include "script.h"
+
+#ifndef SCRIPT_DEBUG
+#define NDEBUG
+#endif
+#include "utils.h"
+
+/// Longest script line
+#define SCRIPT_LINE_MAX 1024
+
+/// A single keystroke
+typedef struct {
+	SDLKey	sym;
+	bool	shift;
+} KEYSTROKE;
+
+/// Named keys for the 'key' command
+static const struct {
+	const char	*name;
+	SDLKey		sym;
+} key_names[] = {
+	{ "return",		SDLK_RETURN },
+	{ "escape",		SDLK_ESCAPE },
+	{ "tab",		SDLK_TAB },
+	{ "backspace",	SDLK_BACKSPACE },
+	{ "space",		SDLK_SPACE },
+	{ "f1",			SDLK_F1 },
+	{ "f2",			SDLK_F2 },
+	{ "f3",			SDLK_F3 },
+	{ "f4",			SDLK_F4 },
+	{ "f5",			SDLK_F5 },
+	{ "f6",			SDLK_F6 },
+	{ "f7",			SDLK_F7 },
+	{ "f8",			SDLK_F8 }
+};
+
+/// Shifted characters on a US keyboard, and the keys they're on
+static const char shifted_chars[]	= "~!@#$%^&*()_+{}|:\"<>?";
+static const char unshifted_chars[]	= "`1234567890-=[]\\;',./";
+
+static FILE *script_fp = NULL;
+static int script_lineno = 0;
+
+/// Keystrokes left to send for the current command
+static KEYSTROKE keys[SCRIPT_LINE_MAX];
+static size_t nkeys = 0, keypos = 0;
+/// True if keys[keypos-1] is being held down
+static bool key_held = false;
+/// Frames left to wait before running the next command
+static uint32_t wait_frames = 0;
+
+bool script_load(const char *filename)
+{
+	if (script_fp != NULL)
+		fclose(script_fp);
+	script_fp = fopen(filename, "r");
+	if (script_fp == NULL)
+		return false;
+	script_lineno = 0;
+	nkeys = keypos = 0;
+	key_held = false;
+	wait_frames = 0;
+	return true;
+}
+
+static void send_key(SDLKey sym, bool down)
+{
+	SDL_Event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = down ? SDL_KEYDOWN : SDL_KEYUP;
+	ev.key.keysym.sym = sym;
+	ev.key.keysym.mod = KMOD_NONE;
+	keyboard_event(&state->kbd, &ev);
+}
+
+static void send_keystroke(const KEYSTROKE *k, bool down)
+{
+	if (k->shift && down)
+		send_key(SDLK_LSHIFT, true);
+	send_key(k->sym, down);
+	if (k->shift && !down)
+		send_key(SDLK_LSHIFT, false);
+}
+
+/**
+ * @brief	Convert a character to a keystroke.
+ * @return	false if the character can't be typed.
+ */
+static bool char_to_key(char c, KEYSTROKE *k)
+{
+	const char *p;
+
+	k->shift = false;
+	if ((c >= 'A') && (c <= 'Z')) {
+		k->shift = true;
+		c = c - 'A' + 'a';
+	} else if ((c != '\0') && ((p = strchr(shifted_chars, c)) != NULL)) {
+		k->shift = true;
+		c = unshifted_chars[p - shifted_chars];
+	}
+
+	switch (c) {
+		case '\n':	k->sym = SDLK_RETURN;		return true;
+		case '\t':	k->sym = SDLK_TAB;			return true;
+		case 0x1b:	k->sym = SDLK_ESCAPE;		return true;
+		default:
+			// Printable, unshifted ASCII characters have the same SDL keysym value
+			if ((c >= ' ') && (c <= '~')) {
+				k->sym = (SDLKey)c;
+				return true;
+			}
+			return false;
+	}
+}
+
+/**
+ * @brief	Queue the keystrokes for a 'type' command.
+ */
+static void queue_text(const char *text)
+{
+	nkeys = keypos = 0;
+	for (const char *p = text; *p != '\0' && nkeys < NELEMS(keys); p++) {
+		char c = *p;
+		if (c == '\\') {
+			switch (*++p) {
+				case 'n':	c = '\n';	break;
+				case 't':	c = '\t';	break;
+				case 'e':	c = 0x1b;	break;
+				case '\\':	c = '\\';	break;
+				case '\0':	return;
+				default:	c = *p;		break;
+			}
+		}
+		if (char_to_key(c, &keys[nkeys]))
+			nkeys++;
+		else
+			fprintf(stderr, "script:%d: can't type character 0x%02X\n", script_lineno, (unsigned char)c);
+	}
+}
+
+/**
+ * @brief	Read and run script commands until one takes some time.
+ * @return	true if the script has asked the emulator to exit.
+ */
+static bool next_command(void)
+{
+	char line[SCRIPT_LINE_MAX];
+
+	while ((script_fp != NULL) && (fgets(line, sizeof(line), script_fp) != NULL)) {
+		script_lineno++;
+
+		// Strip the line ending and split off the command
+		line[strcspn(line, "\r\n")] = '\0';
+		char *cmd = line + strspn(line, " \t");
+		if ((*cmd == '\0') || (*cmd == '#'))
+			continue;
+		char *arg = cmd + strcspn(cmd, " \t");
+		if (*arg != '\0') {
+			*arg++ = '\0';
+			arg += strspn(arg, " \t");
+		}
+		LOG("line %d: '%s' '%s'", script_lineno, cmd, arg);
+
+		if (strcasecmp(cmd, "wait") == 0) {
+			wait_frames = (strtoul(arg, NULL, 0) * 60) / 1000;
+			return false;
+		} else if (strcasecmp(cmd, "type") == 0) {
+			queue_text(arg);
+			return false;
+		} else if (strcasecmp(cmd, "key") == 0) {
+			size_t i;
+			for (i = 0; i < NELEMS(key_names); i++) {
+				if (strcasecmp(arg, key_names[i].name) == 0) {
+					keys[0].sym = key_names[i].sym;
+					keys[0].shift = false;
+					nkeys = 1;
+					keypos = 0;
+					return false;
+				}
+			}
+			fprintf(stderr, "script:%d: unknown key '%s'\n", script_lineno, arg);
+		} else if (strcasecmp(cmd, "dump") == 0) {
+			if (!video_dump_pbm(arg))
+				fprintf(stderr, "script:%d: couldn't write screen dump '%s'\n", script_lineno, arg);
+		} else if (strcasecmp(cmd, "save") == 0) {
+			snapshot_request(arg);
+		} else if (strcasecmp(cmd, "stats") == 0) {
+			if (!stats_write(arg, stats_format_for(arg)))
+				fprintf(stderr, "script:%d: couldn't write counters to '%s'\n", script_lineno, arg);
+		} else if (strcasecmp(cmd, "mark") == 0) {
+			bench_mark(arg);
+		} else if (strcasecmp(cmd, "log") == 0) {
+			if (!log_set_filter(arg))
+				fprintf(stderr, "script:%d: too many names in log filter '%s'\n", script_lineno, arg);
+		} else if (strcasecmp(cmd, "floppy") == 0) {
+			if ((*arg == '\0') || (strcasecmp(arg, "next") == 0))
+				state_fd_next();
+			else if (strcasecmp(arg, "eject") == 0)
+				state_fd_select(-1);
+			else if ((strtol(arg, NULL, 0) >= 1) && (strtol(arg, NULL, 0) <= state->fdc_ndiscs))
+				state_fd_select(strtol(arg, NULL, 0) - 1);
+			else
+				fprintf(stderr, "script:%d: no floppy disc image '%s'\n", script_lineno, arg);
+		} else if (strcasecmp(cmd, "quit") == 0) {
+			return true;
+		} else {
+			fprintf(stderr, "script:%d: unknown command '%s'\n", script_lineno, cmd);
+		}
+	}
+
+	// End of script
+	if (script_fp != NULL) {
+		fclose(script_fp);
+		script_fp = NULL;
+	}
+	return false;
+}
+
+bool script_frame(void)
+{
+	// Each keystroke is held down for one frame and released for one, so the
+	// keyboard scan sees both edges.
+	if (key_held) {
+		send_keystroke(&keys[keypos - 1], false);
+		key_held = false;
+		return false;
+	}
+	if (keypos < nkeys) {
+		send_keystroke(&keys[keypos++], true);
+		key_held = true;
+		return false;
+	}
+
+	if (wait_frames > 0) {
+		wait_frames--;
+		return false;
+	}
+
+	return next_command();
+}
@@ -0,0 +1,39 @@
+#ifndef _SCRIPT_H
+#define _SCRIPT_H
+
+#include <stdbool.h>
+
+/**
+ * @brief	Load an input script.
+ * @param	filename	Script file name.
+ * @return	true on success, false if the file couldn't be read.
+ *
+ * A script is a plain text file with one command per line. Blank lines and
+ * lines starting with '#' are ignored. Commands are:
+ *
+ *   wait MS		Do nothing for MS milliseconds of emulated time
+ *   type TEXT		Type TEXT; \n, \t, \e and \\ are Return, Tab, Escape and '\'
+ *   key NAME		Press and release a named key (return, escape, tab,
+ * 					backspace, space, f1..f8)
+ *   dump FILE		Write the screen to FILE as a PBM image
+ *   save FILE		Save a snapshot of the machine to FILE
+ *   stats FILE		Write the instrumentation counters to FILE (JSON if
+ * 					it ends in .json, otherwise Prometheus text)
+ *   mark NAME		Record a milestone in the benchmark report (see --bench)
+ *   log SPEC		Choose which source files' messages are logged (see --log)
+ *   floppy N		Insert floppy disc image N (counting from 1), or "next"
+ * 					(the default) to do the same as F11, or "eject"
+ *   quit			Exit the emulator
+ */
+bool script_load(const char *filename);
+
+/**
+ * @brief	Run the input script for one video frame.
+ * @return	true if the script has asked the emulator to exit.
+ *
+ * Call this once per 60Hz frame, before the keyboard is scanned. Does
+ * nothing if no script is loaded.
+ */
+bool script_frame(void);
+
+#endif
@@ -0,0 +1,666 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "musashi/m68k.h"
+#include "state.h"
+#include "memory.h"
+#include "snapshot.h"
+
+#ifndef SNAPSHOT_DEBUG
+#define NDEBUG
+#endif
+#include "utils.h"
+
+/// Snapshot file magic number
+static const char SNAPSHOT_MAGIC[8] = "FBSNAP1\n";
+/// Snapshot format version; bump this whenever the file layout changes
+#define SNAPSHOT_VERSION	1
+/// Every section starts on a boundary of this many bytes, so it can be mapped
+#define SNAPSHOT_ALIGN		4096
+
+/// Snapshot sections
+typedef enum {
+	SNAP_MACHINE,			///< S_state
+	SNAP_CPU,				///< Musashi CPU context
+	SNAP_BASE_RAM,			///< Base RAM contents
+	SNAP_EXP_RAM,			///< Expansion RAM contents
+	SNAP_FDC_DATA,			///< Floppy controller data buffer
+	SNAP_HDC_DATA,			///< Hard disc controller data buffer
+	SNAP_COUNT				///< Number of sections (not a section)
+} SNAPSHOT_SECTION_ID;
+
+/// Section table entry
+typedef struct {
+	uint64_t	offset;		///< Offset of the section in the file
+	uint64_t	length;		///< Length of the section in bytes
+} SNAPSHOT_SECTION;
+
+/// Snapshot file header. Stored in host byte order, like the sections.
+typedef struct {
+	char				magic[8];				///< SNAPSHOT_MAGIC
+	uint32_t			version;				///< SNAPSHOT_VERSION
+	uint32_t			nsections;				///< SNAP_COUNT
+	SNAPSHOT_SECTION	sections[SNAP_COUNT];	///< Section table
+} SNAPSHOT_HEADER;
+
+/// Checkpoint log record magic numbers
+static const char CHECKPOINT_MAGIC[8] = "FBCKPT1\n";
+static const char CHECKPOINT_END[8] = "FBCKEND\n";
+/// Write a full snapshot instead of a log record after this many checkpoints
+#define CHECKPOINT_FULL_EVERY	30
+
+/// Checkpoint log record header. Followed by the S_state, the CPU context,
+/// the two controller data buffers, a uint16_t page number for each page,
+/// the pages themselves and finally CHECKPOINT_END.
+typedef struct {
+	char		magic[8];		///< CHECKPOINT_MAGIC
+	uint32_t	version;		///< SNAPSHOT_VERSION
+	uint32_t	npages;			///< Number of RAM pages in the record
+	uint64_t	machine_len;	///< sizeof(S_state)
+	uint64_t	cpu_len;		///< Musashi CPU context size
+	uint64_t	fdc_len;		///< Floppy controller data buffer length
+	uint64_t	hdc_len;		///< Hard disc controller data buffer length
+} CHECKPOINT_HEADER;
+
+/// Snapshot to save at the end of the current timeslot, or NULL
+static char *pending = NULL;
+
+/// Log records written since the last full checkpoint, or -1 if the next
+/// checkpoint has to be a full one
+static int checkpoints = -1;
+
+/**
+ * @brief	Write the disc images back, so the files match the machine state.
+ */
+static bool flush_discs(void)
+{
+	bool ok = true;
+
+	for (int i = 0; i < state->fdc_ndiscs; i++)
+		ok = wd2797_disc_flush(&state->fdc_discs[i]) && ok;
+	wd2010_sync(&state->hdc_ctx);
+	return ok;
+}
+
+bool snapshot_save(const char *filename)
+{
+	SNAPSHOT_HEADER hdr;
+	const void *data[SNAP_COUNT];
+	bool ok = true;
+
+	if (!flush_discs())
+		return false;
+
+	uint8_t *cpu = malloc(m68k_context_size());
+	if (cpu == NULL)
+		return false;
+	m68k_get_context(cpu);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+	hdr.version = SNAPSHOT_VERSION;
+	hdr.nsections = SNAP_COUNT;
+
+	data[SNAP_MACHINE] = state;
+	hdr.sections[SNAP_MACHINE].length = sizeof(S_state);
+	data[SNAP_CPU] = cpu;
+	hdr.sections[SNAP_CPU].length = m68k_context_size();
+	data[SNAP_BASE_RAM] = state->base_ram;
+	hdr.sections[SNAP_BASE_RAM].length = state->base_ram_size;
+	data[SNAP_EXP_RAM] = state->exp_ram;
+	hdr.sections[SNAP_EXP_RAM].length = state->exp_ram_size;
+	// A sector being read may be a view into a memory-mapped disc image; the
+	// bytes are copied either way
+	data[SNAP_FDC_DATA] = state->fdc_ctx.data;
+	hdr.sections[SNAP_FDC_DATA].length = state->fdc_ctx.data ? state->fdc_ctx.data_len : 0;
+	data[SNAP_HDC_DATA] = state->hdc_ctx.data;
+	hdr.sections[SNAP_HDC_DATA].length = state->hdc_ctx.data ? state->hdc_ctx.data_len : 0;
+
+	// Lay the sections out after the header, each on an aligned boundary
+	uint64_t offset = SNAPSHOT_ALIGN;
+	for (int i = 0; i < SNAP_COUNT; i++) {
+		hdr.sections[i].offset = offset;
+		offset += (hdr.sections[i].length + SNAPSHOT_ALIGN - 1) & ~(uint64_t)(SNAPSHOT_ALIGN - 1);
+	}
+
+	// Write to a temporary file and rename it into place. This also keeps a
+	// running emulator which mapped its RAM from the old file safe.
+	char *tmpname = malloc(strlen(filename) + 5);
+	if (tmpname == NULL) {
+		free(cpu);
+		return false;
+	}
+	sprintf(tmpname, "%s.tmp", filename);
+
+	FILE *fp = fopen(tmpname, "wb");
+	if (fp == NULL) {
+		free(tmpname);
+		free(cpu);
+		return false;
+	}
+	ok = (fwrite(&hdr, sizeof(hdr), 1, fp) == 1);
+	for (int i = 0; ok && (i < SNAP_COUNT); i++) {
+		if (hdr.sections[i].length == 0)
+			continue;
+		ok = (fseek(fp, hdr.sections[i].offset, SEEK_SET) == 0) &&
+			(fwrite(data[i], 1, hdr.sections[i].length, fp) == hdr.sections[i].length);
+	}
+	ok = (fclose(fp) == 0) && ok;
+	if (ok)
+		ok = (rename(tmpname, filename) == 0);
+	if (!ok)
+		remove(tmpname);
+
+	LOG("saved '%s', %s", filename, ok ? "ok" : "failed");
+	free(tmpname);
+	free(cpu);
+	return ok;
+}
+
+static bool read_section(int fd, const SNAPSHOT_SECTION *sec, void *buf)
+{
+	return pread(fd, buf, sec->length, sec->offset) == (ssize_t)sec->length;
+}
+
+/**
+ * @brief	Load a RAM section, mapping it copy-on-write if possible.
+ * @param	mapped	Set to true if the RAM was mapped rather than read.
+ * @return	RAM buffer, or NULL on error.
+ */
+static uint8_t *load_ram(int fd, const SNAPSHOT_SECTION *sec, bool *mapped)
+{
+	uint8_t *ram;
+
+	*mapped = false;
+	if ((sec->length > 0) && ((sec->offset % sysconf(_SC_PAGESIZE)) == 0)) {
+		ram = mmap(NULL, sec->length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, sec->offset);
+		if (ram != MAP_FAILED) {
+			*mapped = true;
+			return ram;
+		}
+	}
+
+	// Fall back to reading it all in. Zero-sized Expansion RAM ends up here too.
+	ram = malloc(sec->length);
+	if ((ram != NULL) && !read_section(fd, sec, ram)) {
+		free(ram);
+		ram = NULL;
+	}
+	return ram;
+}
+
+static void release_ram(uint8_t *ram, size_t size, bool mapped)
+{
+	if (ram == NULL)
+		return;
+	if (mapped)
+		munmap(ram, size);
+	else
+		free(ram);
+}
+
+/**
+ * @brief	Check the snapshot was saved with discs like the ones loaded now.
+ *
+ * The hard disc must match. A floppy disc this process doesn't have (the
+ * extra machines of --instances have none) is ejected on restore instead,
+ * as if it had been taken out of the drive; only one which is here has to
+ * have the same geometry.
+ */
+static bool discs_match(const S_state *saved)
+{
+	const WD2010_CTX *hdc = &saved->hdc_ctx;
+	if ((hdc->geom_tracks != state->hdc_ctx.geom_tracks) || (hdc->geom_heads != state->hdc_ctx.geom_heads) ||
+			(hdc->geom_spt != state->hdc_ctx.geom_spt) || (hdc->geom_secsz != state->hdc_ctx.geom_secsz))
+		return false;
+
+	if ((saved->fdc_cur < 0) || (saved->fdc_cur >= state->fdc_ndiscs) ||
+			(state->fdc_files[saved->fdc_cur] == NULL))
+		return true;
+	const WD2797_DISC *disc = &state->fdc_discs[saved->fdc_cur];
+	const WD2797_CTX *fdc = &saved->fdc_ctx;
+	return (fdc->geom_tracks == disc->tracks) && (fdc->geom_heads == disc->heads) &&
+		(fdc->geom_spt == disc->spt) && (fdc->geom_secsz == disc->secsz);
+}
+
+/**
+ * @brief	Check saved machine state can be restored, and get ready for it.
+ * @param	saved	Saved machine state.
+ * @param	fdc_len	Length of the saved floppy controller data buffer.
+ * @param	hdc_len	Length of the saved hard disc controller data buffer.
+ * @return	NULL if it can be restored, or a description of the problem.
+ *
+ * Nothing visible to the guest changes, so it's safe to give up afterwards.
+ */
+static const char *prepare_machine(const S_state *saved, size_t fdc_len, size_t hdc_len)
+{
+	if (fdc_len > (size_t)(saved->fdc_ctx.geom_secsz * saved->fdc_ctx.geom_spt))
+		return "corrupt snapshot file";
+	if (!discs_match(saved))
+		return "snapshot was saved with different disc images";
+
+	// A multi-sector read from a memory-mapped hard disc can be longer than
+	// the track buffer
+	if (hdc_len > (size_t)(state->hdc_ctx.geom_secsz * state->hdc_ctx.geom_spt)) {
+		uint8_t *p = realloc(state->hdc_ctx.buffer, hdc_len);
+		if (p == NULL)
+			return "out of memory";
+		if (state->hdc_ctx.data == state->hdc_ctx.buffer)
+			state->hdc_ctx.data = p;
+		state->hdc_ctx.buffer = p;
+	}
+	return NULL;
+}
+
+/**
+ * @brief	Restore saved machine state. RAM contents are left alone.
+ *
+ * Must only be called once prepare_machine() has said it's OK. Whatever
+ * belongs to this process rather than the machine is kept: RAM and ROM
+ * buffers, controller buffers, disc images and host pointers.
+ */
+static void apply_machine(const S_state *saved, const uint8_t *cpu, const uint8_t *fdc_data, size_t fdc_len, const uint8_t *hdc_data, size_t hdc_len)
+{
+	state_fd_select(-1);
+	WD2797_CTX fdc_live = state->fdc_ctx;
+	WD2010_CTX hdc_live = state->hdc_ctx;
+	WD2797_DISC *fdc_discs = state->fdc_discs;
+	FILE **fdc_files = state->fdc_files;
+	int fdc_ndiscs = state->fdc_ndiscs;
+	FILE *hdc_disc0 = state->hdc_disc0, *hdc_disc1 = state->hdc_disc1;
+	uint8_t *base_ram = state->base_ram, *exp_ram = state->exp_ram;
+	size_t base_ram_size = state->base_ram_size, exp_ram_size = state->exp_ram_size;
+	bool base_mapped = state->base_ram_mapped, exp_mapped = state->exp_ram_mapped;
+	uint32_t ram_dirty[MEM_NUM_RAM_PAGES / 32];
+	memcpy(ram_dirty, state->ram_dirty, sizeof(ram_dirty));
+	uint8_t *rom = state->rom;
+	void *cpu_ctx = state->cpu_ctx;
+	struct TRACE *trace = state->trace;
+	INSN_HOOKS insn_hooks = state->insn_hooks;
+
+	// Host files can't be carried over, so the handles are all closed
+	hostio_done(&state->hostio);
+
+	memcpy(state, saved, sizeof(S_state));
+
+	state->base_ram = base_ram;
+	state->base_ram_size = base_ram_size;
+	state->base_ram_mapped = base_mapped;
+	state->exp_ram = exp_ram;
+	state->exp_ram_size = exp_ram_size;
+	state->exp_ram_mapped = exp_mapped;
+	memcpy(state->ram_dirty, ram_dirty, sizeof(ram_dirty));
+	state->fdc_discs = fdc_discs;
+	state->fdc_files = fdc_files;
+	state->fdc_ndiscs = fdc_ndiscs;
+	state->hdc_disc0 = hdc_disc0;
+	state->hdc_disc1 = hdc_disc1;
+	state->rom = rom;
+	state->cpu_ctx = cpu_ctx;
+	state->trace = trace;
+	state->insn_hooks = insn_hooks;
+	hostio_forget(&state->hostio);
+
+	// The hard disc controller takes its registers from the snapshot and
+	// its buffer, mapping and cache from this process
+	state->hdc_ctx.buffer = hdc_live.buffer;
+	state->hdc_ctx.image_map = hdc_live.image_map;
+	state->hdc_ctx.image_size = hdc_live.image_size;
+	state->hdc_ctx.sync_policy = hdc_live.sync_policy;
+	state->hdc_ctx.map_dirty = hdc_live.map_dirty;
+	state->hdc_ctx.cache = hdc_live.cache;
+	state->hdc_ctx.disc_image = hdc_live.disc_image;
+	state->hdc_ctx.data = state->hdc_ctx.buffer;
+	if (hdc_len > 0)
+		memcpy(state->hdc_ctx.data, hdc_data, hdc_len);
+
+	// Put the same floppy disc back in the drive if it's here, then restore
+	// the controller's registers
+	state->fdc_ctx = fdc_live;
+	state->fdc_cur = -1;
+	if ((saved->fdc_cur >= 0) && (saved->fdc_cur < state->fdc_ndiscs)) {
+		state_fd_select(saved->fdc_cur);
+		// A disc image which is only opened on insert may have changed
+		const WD2797_CTX *fdc = &saved->fdc_ctx;
+		if ((state->fdc_ctx.geom_tracks != fdc->geom_tracks) || (state->fdc_ctx.geom_heads != fdc->geom_heads) ||
+				(state->fdc_ctx.geom_spt != fdc->geom_spt) || (state->fdc_ctx.geom_secsz != fdc->geom_secsz))
+			state_fd_select(-1);
+	}
+	uint8_t *fdc_buf = state->fdc_ctx.data;
+	WD2797_DISC *fdc_disc = state->fdc_ctx.disc;
+	state->fdc_ctx = saved->fdc_ctx;
+	state->fdc_ctx.data = fdc_buf;
+	state->fdc_ctx.disc = fdc_disc;
+	if (state->fdc_cur < 0)
+		// No disc, so the drive is empty whatever the snapshot says
+		wd2797_unload(&state->fdc_ctx);
+	else if (fdc_buf != NULL)
+		memcpy(fdc_buf, fdc_data, fdc_len);
+	else
+		state->fdc_ctx.data_pos = state->fdc_ctx.data_len = 0;
+
+	// The CPU context holds host pointers (cycle tables and callbacks) which
+	// were only valid in the process which saved it, so set them up again
+	// the way main() does
+	m68k_set_context((void *)cpu);
+	m68k_set_cpu_type(M68K_CPU_TYPE_68010);
+	m68k_set_int_ack_callback(NULL);
+	m68k_set_bkpt_ack_callback(NULL);
+	m68k_set_reset_instr_callback(NULL);
+	m68k_set_pc_changed_callback(NULL);
+	insn_hook_install();
+	m68k_set_fc_callback(memory_fc_callback);
+
+	// Rebuild everything derived from the Map RAM and RAM pointers
+	memory_rebuild_page_table();
+	memory_vram_invalidate();
+}
+
+bool snapshot_load(const char *filename)
+{
+	SNAPSHOT_HEADER hdr;
+	struct stat st;
+	S_state *saved = NULL;
+	uint8_t *cpu = NULL, *base_ram = NULL, *exp_ram = NULL, *fdc_data = NULL, *hdc_data = NULL;
+	bool base_mapped = false, exp_mapped = false;
+	const char *err = "corrupt snapshot file";
+
+	memset(&hdr, 0, sizeof(hdr));
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "ERROR: Can't open snapshot '%s': %s.\n", filename, strerror(errno));
+		return false;
+	}
+
+	// Check the header and make sure every section is in the file
+	if ((fstat(fd, &st) != 0) || (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) ||
+			(memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0))
+		goto fail;
+	if ((hdr.version != SNAPSHOT_VERSION) || (hdr.nsections != SNAP_COUNT) ||
+			(hdr.sections[SNAP_MACHINE].length != sizeof(S_state)) ||
+			(hdr.sections[SNAP_CPU].length != m68k_context_size())) {
+		err = "snapshot was saved by a different version of the emulator";
+		goto fail;
+	}
+	for (int i = 0; i < SNAP_COUNT; i++)
+		if ((hdr.sections[i].length > 0) && ((hdr.sections[i].offset + hdr.sections[i].length) > (uint64_t)st.st_size))
+			goto fail;
+
+	// Read the small sections first, so they can be checked before anything changes
+	saved = malloc(sizeof(S_state));
+	cpu = malloc(m68k_context_size());
+	fdc_data = malloc(hdr.sections[SNAP_FDC_DATA].length);
+	hdc_data = malloc(hdr.sections[SNAP_HDC_DATA].length);
+	if (!saved || !cpu || !fdc_data || !hdc_data) {
+		err = "out of memory";
+		goto fail;
+	}
+	if (!read_section(fd, &hdr.sections[SNAP_MACHINE], saved) || !read_section(fd, &hdr.sections[SNAP_CPU], cpu) ||
+			!read_section(fd, &hdr.sections[SNAP_FDC_DATA], fdc_data) || !read_section(fd, &hdr.sections[SNAP_HDC_DATA], hdc_data))
+		goto fail;
+	if ((hdr.sections[SNAP_BASE_RAM].length != saved->base_ram_size) || (saved->base_ram_size == 0) ||
+			(hdr.sections[SNAP_EXP_RAM].length != saved->exp_ram_size))
+		goto fail;
+	if ((err = prepare_machine(saved, hdr.sections[SNAP_FDC_DATA].length, hdr.sections[SNAP_HDC_DATA].length)) != NULL)
+		goto fail;
+
+	base_ram = load_ram(fd, &hdr.sections[SNAP_BASE_RAM], &base_mapped);
+	exp_ram = load_ram(fd, &hdr.sections[SNAP_EXP_RAM], &exp_mapped);
+	if ((base_ram == NULL) || ((exp_ram == NULL) && (saved->exp_ram_size > 0))) {
+		err = "couldn't read RAM";
+		goto fail;
+	}
+
+	// Nothing can fail from here on
+	state_free_ram();
+	state->base_ram = base_ram;
+	state->base_ram_size = saved->base_ram_size;
+	state->base_ram_mapped = base_mapped;
+	state->exp_ram = exp_ram;
+	state->exp_ram_size = saved->exp_ram_size;
+	state->exp_ram_mapped = exp_mapped;
+	apply_machine(saved, cpu, fdc_data, hdr.sections[SNAP_FDC_DATA].length, hdc_data, hdr.sections[SNAP_HDC_DATA].length);
+
+	// RAM no longer matches the last checkpoint, so the next one starts afresh
+	memset(state->ram_dirty, 0, sizeof(state->ram_dirty));
+	checkpoints = -1;
+
+	LOG("restored '%s', base RAM %s", filename, base_mapped ? "mapped" : "read");
+	close(fd);
+	free(saved);
+	free(cpu);
+	free(fdc_data);
+	free(hdc_data);
+	return true;
+
+fail:
+	fprintf(stderr, "ERROR: Can't restore snapshot '%s': %s.\n", filename, err);
+	release_ram(base_ram, hdr.sections[SNAP_BASE_RAM].length, base_mapped);
+	release_ram(exp_ram, hdr.sections[SNAP_EXP_RAM].length, exp_mapped);
+	close(fd);
+	free(saved);
+	free(cpu);
+	free(fdc_data);
+	free(hdc_data);
+	return false;
+}
+
+void snapshot_request(const char *filename)
+{
+	free(pending);
+	pending = strdup(filename);
+}
+
+void snapshot_service(void)
+{
+	if (pending == NULL)
+		return;
+
+	if (snapshot_save(pending))
+		fprintf(stderr, "Snapshot saved to '%s'.\n", pending);
+	else
+		fprintf(stderr, "ERROR: Could not save snapshot '%s'.\n", pending);
+	free(pending);
+	pending = NULL;
+}
+
+/**
+ * @brief	Find a RAM page by its dirty bitmap index.
+ * @return	Pointer to the page, or NULL if there's no such page.
+ */
+static uint8_t *ram_page(uint32_t page)
+{
+	if (page < 512)
+		return ((page + 1) * MEM_PAGE_SIZE <= state->base_ram_size) ? state->base_ram + (page * MEM_PAGE_SIZE) : NULL;
+	page -= 512;
+	return ((page + 1) * MEM_PAGE_SIZE <= state->exp_ram_size) ? state->exp_ram + (page * MEM_PAGE_SIZE) : NULL;
+}
+
+static char *log_name(const char *filename)
+{
+	char *logname = malloc(strlen(filename) + 5);
+	if (logname != NULL)
+		sprintf(logname, "%s.log", filename);
+	return logname;
+}
+
+/**
+ * @brief	Append a checkpoint record to the log.
+ */
+static bool write_record(const char *logname)
+{
+	CHECKPOINT_HEADER hdr;
+	uint16_t pages[MEM_NUM_RAM_PAGES];
+	uint32_t npages = 0;
+	bool ok;
+
+	for (uint32_t i = 0; i < MEM_NUM_RAM_PAGES; i++)
+		if (((state->ram_dirty[i / 32] >> (i % 32)) & 1) && (ram_page(i) != NULL))
+			pages[npages++] = i;
+
+	if (!flush_discs())
+		return false;
+	uint8_t *cpu = malloc(m68k_context_size());
+	if (cpu == NULL)
+		return false;
+	m68k_get_context(cpu);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+	hdr.version = SNAPSHOT_VERSION;
+	hdr.npages = npages;
+	hdr.machine_len = sizeof(S_state);
+	hdr.cpu_len = m68k_context_size();
+	hdr.fdc_len = state->fdc_ctx.data ? state->fdc_ctx.data_len : 0;
+	hdr.hdc_len = state->hdc_ctx.data ? state->hdc_ctx.data_len : 0;
+
+	FILE *fp = fopen(logname, "ab");
+	if (fp == NULL) {
+		free(cpu);
+		return false;
+	}
+	ok = (fwrite(&hdr, sizeof(hdr), 1, fp) == 1) &&
+		(fwrite(state, sizeof(S_state), 1, fp) == 1) &&
+		(fwrite(cpu, 1, hdr.cpu_len, fp) == hdr.cpu_len) &&
+		(fwrite(state->fdc_ctx.data, 1, hdr.fdc_len, fp) == hdr.fdc_len) &&
+		(fwrite(state->hdc_ctx.data, 1, hdr.hdc_len, fp) == hdr.hdc_len) &&
+		(fwrite(pages, sizeof(uint16_t), npages, fp) == npages);
+	for (uint32_t i = 0; ok && (i < npages); i++)
+		ok = (fwrite(ram_page(pages[i]), MEM_PAGE_SIZE, 1, fp) == 1);
+	ok = ok && (fwrite(CHECKPOINT_END, sizeof(CHECKPOINT_END), 1, fp) == 1);
+	// Get the record onto the disc before claiming it's there
+	ok = (fflush(fp) == 0) && ok;
+	ok = (fsync(fileno(fp)) == 0) && ok;
+	ok = (fclose(fp) == 0) && ok;
+
+	LOG("checkpoint record, %u pages, %s", npages, ok ? "ok" : "failed");
+	free(cpu);
+	return ok;
+}
+
+bool snapshot_checkpoint(const char *filename)
+{
+	bool ok;
+
+	char *logname = log_name(filename);
+	if (logname == NULL)
+		return false;
+
+	if ((checkpoints < 0) || (checkpoints >= CHECKPOINT_FULL_EVERY)) {
+		// Empty the log before replacing the snapshot. If anything goes
+		// wrong in between, the old snapshot on its own is still consistent
+		// (just older).
+		FILE *fp = fopen(logname, "wb");
+		ok = (fp != NULL) && (fclose(fp) == 0) && snapshot_save(filename);
+		if (ok)
+			checkpoints = 0;
+	} else {
+		// A failed append may leave a torn record at the end of the log,
+		// which would hide any records after it, so start afresh next time
+		ok = write_record(logname);
+		checkpoints = ok ? checkpoints + 1 : -1;
+	}
+
+	if (ok)
+		memset(state->ram_dirty, 0, sizeof(state->ram_dirty));
+	free(logname);
+	return ok;
+}
+
+bool snapshot_resume(const char *filename)
+{
+	CHECKPOINT_HEADER hdr;
+	S_state *saved = NULL;
+	uint8_t *cpu = NULL, *fdc_data = NULL, *hdc_data = NULL, *data = NULL;
+	uint16_t *pages = NULL;
+	int records = 0;
+	bool ok = true;
+
+	if (!snapshot_load(filename))
+		return false;
+
+	char *logname = log_name(filename);
+	FILE *fp = logname ? fopen(logname, "rb") : NULL;
+	if (fp == NULL) {
+		// No log (yet): the snapshot is all there is
+		free(logname);
+		return true;
+	}
+
+	saved = malloc(sizeof(S_state));
+	cpu = malloc(m68k_context_size());
+	pages = malloc(MEM_NUM_RAM_PAGES * sizeof(uint16_t));
+	data = malloc(MEM_NUM_RAM_PAGES * MEM_PAGE_SIZE);
+	if (!saved || !cpu || !pages || !data) {
+		ok = false;
+		goto done;
+	}
+
+	// Replay records until the log runs out. A record is only applied once
+	// all of it has been read, so one torn by a crash is ignored.
+	while (fread(&hdr, sizeof(hdr), 1, fp) == 1) {
+		char end[sizeof(CHECKPOINT_END)];
+
+		if ((memcmp(hdr.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0) ||
+				(hdr.version != SNAPSHOT_VERSION) || (hdr.npages > MEM_NUM_RAM_PAGES) ||
+				(hdr.machine_len != sizeof(S_state)) || (hdr.cpu_len != m68k_context_size()) ||
+				(hdr.fdc_len > SIZE_MAX / 2) || (hdr.hdc_len > SIZE_MAX / 2))
+			break;
+
+		uint8_t *f = realloc(fdc_data, hdr.fdc_len + 1);
+		if (f != NULL) fdc_data = f;
+		uint8_t *h = realloc(hdc_data, hdr.hdc_len + 1);
+		if (h != NULL) hdc_data = h;
+		if ((f == NULL) || (h == NULL)) {
+			ok = false;
+			break;
+		}
+
+		if ((fread(saved, sizeof(S_state), 1, fp) != 1) ||
+				(fread(cpu, 1, hdr.cpu_len, fp) != hdr.cpu_len) ||
+				(fread(fdc_data, 1, hdr.fdc_len, fp) != hdr.fdc_len) ||
+				(fread(hdc_data, 1, hdr.hdc_len, fp) != hdr.hdc_len) ||
+				(fread(pages, sizeof(uint16_t), hdr.npages, fp) != hdr.npages) ||
+				(fread(data, MEM_PAGE_SIZE, hdr.npages, fp) != hdr.npages) ||
+				(fread(end, sizeof(end), 1, fp) != 1) ||
+				(memcmp(end, CHECKPOINT_END, sizeof(end)) != 0))
+			break;
+
+		// RAM doesn't change size between checkpoints
+		bool valid = (saved->base_ram_size == state->base_ram_size) && (saved->exp_ram_size == state->exp_ram_size);
+		for (uint32_t i = 0; valid && (i < hdr.npages); i++)
+			valid = (ram_page(pages[i]) != NULL);
+		const char *err = valid ? prepare_machine(saved, hdr.fdc_len, hdr.hdc_len) : "corrupt checkpoint log";
+		if (err != NULL) {
+			fprintf(stderr, "ERROR: Can't replay checkpoint log '%s': %s.\n", logname, err);
+			ok = false;
+			break;
+		}
+
+		for (uint32_t i = 0; i < hdr.npages; i++)
+			memcpy(ram_page(pages[i]), data + (i * MEM_PAGE_SIZE), MEM_PAGE_SIZE);
+		// Each record has the whole machine state, so the last one wins
+		apply_machine(saved, cpu, fdc_data, hdr.fdc_len, hdc_data, hdr.hdc_len);
+		records++;
+	}
+
+	LOG("resumed '%s' with %d checkpoint records", filename, records);
+
+done:
+	fclose(fp);
+	free(logname);
+	free(saved);
+	free(cpu);
+	free(fdc_data);
+	free(hdc_data);
+	free(pages);
+	free(data);
+	return ok;
+}
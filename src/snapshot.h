@@ -0,0 +1,78 @@
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include <stdbool.h>
+
+/**
+ * @brief	Save the state of the whole machine.
+ * @param	filename	Snapshot file name. Replaced atomically if it exists.
+ * @return	true on success.
+ *
+ * Captures the emulator state (RAM, Video RAM, Map RAM, registers and every
+ * device context), the CPU context and the controllers' data buffers. Disc
+ * images are not copied: they are written back first, and the snapshot only
+ * records their geometry and which floppy disc was in the drive. Restoring
+ * a snapshot only makes sense with the disc images as they were when it was
+ * saved (e.g. keep a copy of the --hd-overlay file alongside it).
+ *
+ * Must be called between CPU bursts, never from a device handler.
+ *
+ * The file holds raw structures, so it can only be loaded by the same build
+ * of the emulator on the same kind of host.
+ */
+bool snapshot_save(const char *filename);
+
+/**
+ * @brief	Restore the state of the whole machine.
+ * @param	filename	Snapshot file name.
+ * @return	true on success. On failure the machine state is unchanged,
+ * 			unless the failure happened while reading RAM (which is reported).
+ *
+ * The disc images must already be loaded. RAM is mapped copy-on-write from
+ * the snapshot file where possible, so only the pages the guest touches are
+ * ever read in.
+ */
+bool snapshot_load(const char *filename);
+
+/**
+ * @brief	Ask for a snapshot to be saved at the end of the current timeslot.
+ * @param	filename	Snapshot file name (copied).
+ *
+ * For use by device handlers and scripts, which run in the middle of a
+ * timeslot.
+ */
+void snapshot_request(const char *filename);
+
+/**
+ * @brief	Save any snapshot asked for with snapshot_request().
+ *
+ * Call this from the emulation loop, between calls to sched_run().
+ */
+void snapshot_service(void);
+
+/**
+ * @brief	Save a checkpoint of the whole machine.
+ * @param	filename	Snapshot file name. The log goes in filename.log.
+ * @return	true on success.
+ *
+ * The first checkpoint, and every so often after that, is a full snapshot
+ * which empties the log. The rest only append a record to the log, holding
+ * the device and CPU state and just the RAM pages written since the previous
+ * checkpoint. Records are synced to disc before this returns, so a crash
+ * loses at most what happened since the last checkpoint.
+ *
+ * Same rules as snapshot_save() otherwise.
+ */
+bool snapshot_checkpoint(const char *filename);
+
+/**
+ * @brief	Restore the most recent checkpoint.
+ * @param	filename	Snapshot file name given to snapshot_checkpoint().
+ * @return	true on success.
+ *
+ * Loads the snapshot, then replays the log on top of it. A record left half
+ * written by a crash ends the replay.
+ */
+bool snapshot_resume(const char *filename);
+
+#endif
@@ -1,59 +1,225 @@
-#define _STATE_C
 #include <stddef.h>
 #include <malloc.h>
 #include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "musashi/m68k.h"
 #include "wd279x.h"
 #include "wd2010.h"
 #include "keyboard.h"
 #include "state.h"
+#include "memory.h"
+#include "sched.h"
 
-int state_init(size_t base_ram_size, size_t exp_ram_size)
+/// The machine every thread starts out with
+static S_state primary;
+__thread S_state *state = &primary;
+
+/// Boot PROM image shared by all the machines, and how many are using it
+static uint8_t *shared_rom = NULL;
+static int rom_users = 0;
+/// shared_rom is a mapping of the ROM cache, not malloc()ed
+static bool rom_mapped = false;
+
+/// Boot PROM files, and where to cache the interleaved image (or NULL)
+static const char *rom_14c_file = "roms/14c.bin";
+static const char *rom_15c_file = "roms/15c.bin";
+static const char *rom_cache_file = "roms/rom.img";
+
+/// Opens floppy disc images as they're inserted, or NULL to keep them open
+static STATE_FD_OPEN fd_reopen = NULL;
+
+S_state *state_new()
 {
-	// Free RAM if it's allocated
-	if (state.base_ram != NULL)
-		free(state.base_ram);
-	if (state.exp_ram != NULL)
-		free(state.exp_ram);
+	S_state *s = calloc(1, sizeof(S_state));
+	if (s == NULL)
+		return NULL;
 
-	// Initialise hardware registers
-	state.romlmap = false;
-	state.idmarw = state.dmaen = state.dmaenb = false;
-	state.dma_count = state.dma_address = 0;
-	state.pie = 0;
-	state.ee = 0;
-	state.leds = 0;
-	state.genstat = 0;				// FIXME: check this
-	state.bsr0 = state.bsr1 = 0;	// FIXME: check this
-	state.timer_enabled = state.timer_asserted = false;
-	state.dma_dev = DMA_DEV_UNDEF;
-	// Allocate Base RAM, making sure the user has specified a valid RAM amount first
-	// Basically: 512KiB minimum, 2MiB maximum, in increments of 512KiB.
-	if ((base_ram_size < 512*1024) || (base_ram_size > 2048*1024) || ((base_ram_size % (512*1024)) != 0))
-		return -1;
-	state.base_ram = malloc(base_ram_size);
-	if (state.base_ram == NULL)
-		return -2;
-	state.base_ram_size = base_ram_size;
+	// Start from a copy of the current CPU context, so it's a valid one;
+	// the caller resets the CPU anyway
+	if ((s->cpu_ctx = malloc(m68k_context_size())) == NULL) {
+		free(s);
+		return NULL;
+	}
+	m68k_get_context(s->cpu_ctx);
+	return s;
+}
 
-	// Now allocate expansion RAM
-	// The difference here is that we can have zero bytes of Expansion RAM; we're not limited to having a minimum of 512KiB.
-	if ((exp_ram_size > 2048*1024) || ((exp_ram_size % (512*1024)) != 0))
-		return -1;
-	state.exp_ram = malloc(exp_ram_size);
-	if (state.exp_ram == NULL)
-		return -2;
-	state.exp_ram_size = exp_ram_size;
+void state_free(S_state *s)
+{
+	if ((s == NULL) || (s == &primary) || (s == state))
+		return;
+	free(s->cpu_ctx);
+	free(s);
+}
+
+void state_select(S_state *s)
+{
+	if (s == state)
+		return;
+
+	// The primary machine doesn't get a context buffer until it's switched out
+	if ((state->cpu_ctx == NULL) && ((state->cpu_ctx = malloc(m68k_context_size())) == NULL)) {
+		fprintf(stderr, "[state] Out of memory switching machines.\n");
+		return;
+	}
+	m68k_get_context(state->cpu_ctx);
+	state = s;
+	m68k_set_context(state->cpu_ctx);
+}
+
+void state_set_rom_files(const char *rom14c, const char *rom15c, const char *cache)
+{
+	if (rom14c != NULL)
+		rom_14c_file = rom14c;
+	if (rom15c != NULL)
+		rom_15c_file = rom15c;
+	if (cache != NULL)
+		rom_cache_file = (*cache != '\0') ? cache : NULL;
+}
+
+/// Identifies the PROM files a ROM cache was built from
+typedef struct {
+	char		magic[8];		///< ROM_CACHE_MAGIC
+	struct {
+		uint64_t	dev, ino;	///< Which file it is
+		uint64_t	size;
+		uint64_t	mtime_sec, mtime_nsec;
+	} prom[2];					///< 14C, then 15C
+} ROM_CACHE_KEY;
+
+/// Written after the ROM image, so the image can be mapped at offset 0
+#define ROM_CACHE_MAGIC "FBROMC1"
+
+/**
+ * @brief	Describe the PROM files, as the ROM cache records them.
+ * @return	true on success, false if a file can't be found.
+ */
+static bool rom_cache_key(ROM_CACHE_KEY *key)
+{
+	const char *files[2] = { rom_14c_file, rom_15c_file };
+
+	memset(key, 0, sizeof(*key));
+	memcpy(key->magic, ROM_CACHE_MAGIC, sizeof(key->magic));
+	for (int i = 0; i < 2; i++) {
+		struct stat st;
+		if (stat(files[i], &st) != 0) {
+			fprintf(stderr, "[state] Error loading %s.\n", files[i]);
+			return false;
+		}
+		key->prom[i].dev = st.st_dev;
+		key->prom[i].ino = st.st_ino;
+		key->prom[i].size = st.st_size;
+		key->prom[i].mtime_sec = st.st_mtim.tv_sec;
+		key->prom[i].mtime_nsec = st.st_mtim.tv_nsec;
+	}
+	return true;
+}
+
+/**
+ * @brief	Map the cached ROM image into shared_rom, if it was built from
+ * 			the PROM files as they are now.
+ * @param	key		The PROM files.
+ * @return	true on success.
+ *
+ * The mapping is read-only and shared, so every emulator on the host which
+ * uses the same cache shares one copy of the ROM, and the PROMs aren't read
+ * at all. Replacing or touching either PROM file changes its inode or
+ * mtime, so the cache is rebuilt.
+ */
+static bool map_rom_cache(const ROM_CACHE_KEY *key)
+{
+	if (rom_cache_file == NULL)
+		return false;
+
+	int fd = open(rom_cache_file, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat cs;
+	ROM_CACHE_KEY saved;
+	if ((fstat(fd, &cs) != 0) || (cs.st_size != (off_t)(ROM_SIZE + sizeof(saved))) ||
+			(pread(fd, &saved, sizeof(saved), ROM_SIZE) != sizeof(saved)) ||
+			(memcmp(&saved, key, sizeof(saved)) != 0)) {
+		close(fd);
+		return false;
+	}
+	void *rom = mmap(NULL, ROM_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (rom == MAP_FAILED)
+		return false;
+
+	shared_rom = rom;
+	rom_mapped = true;
+	return true;
+}
+
+/**
+ * @brief	Save the interleaved ROM image for next time.
+ * @param	rom		Interleaved ROM image.
+ * @param	key		The PROM files it was built from.
+ *
+ * Written to a temporary file and renamed into place, so an emulator
+ * starting at the same time never sees half of it. A read-only roms
+ * directory just means doing without the cache, so that isn't reported.
+ */
+static void write_rom_cache(const uint8_t *rom, const ROM_CACHE_KEY *key)
+{
+	if (rom_cache_file == NULL)
+		return;
+
+	char *tmp = malloc(strlen(rom_cache_file) + 16);
+	if (tmp == NULL)
+		return;
+	sprintf(tmp, "%s.%ld", rom_cache_file, (long)getpid());
+
+	FILE *fp = fopen(tmp, "wb");
+	bool ok = (fp != NULL) && (fwrite(rom, 1, ROM_SIZE, fp) == ROM_SIZE) &&
+		(fwrite(key, sizeof(*key), 1, fp) == 1);
+	if ((fp != NULL) && (fclose(fp) != 0))
+		ok = false;
+	if (ok && (rename(tmp, rom_cache_file) != 0))
+		ok = false;
+	if (!ok) {
+		bool readonly = (errno == EACCES) || (errno == EPERM) || (errno == EROFS);
+		if (fp != NULL)
+			remove(tmp);
+		if (!readonly)
+			fprintf(stderr, "[state] Couldn't write the ROM cache %s.\n", rom_cache_file);
+	}
+	free(tmp);
+}
+
+/**
+ * @brief	Load the Boot PROMs into shared_rom.
+ * @return	0 on success, or -3 if the ROMs couldn't be loaded.
+ *
+ * If the cached image was built from the same PROM files, it's mapped.
+ * Otherwise the two ROMs (one for each byte lane) are read and interleaved,
+ * and the result is cached.
+ */
+static int load_rom()
+{
+	ROM_CACHE_KEY key;
+	if (!rom_cache_key(&key))
+		return -3;
+	if (map_rom_cache(&key))
+		return 0;
 
-	// Load ROMs
 	FILE *r14c, *r15c;
-	r14c = fopen("roms/14c.bin", "rb");
+	r14c = fopen(rom_14c_file, "rb");
 	if (r14c == NULL) {
-		fprintf(stderr, "[state] Error loading roms/14c.bin.\n");
+		fprintf(stderr, "[state] Error loading %s.\n", rom_14c_file);
 		return -3;
 	}
-	r15c = fopen("roms/15c.bin", "rb");
+	r15c = fopen(rom_15c_file, "rb");
 	if (r15c == NULL) {
-		fprintf(stderr, "[state] Error loading roms/15c.bin.\n");
+		fprintf(stderr, "[state] Error loading %s.\n", rom_15c_file);
+		fclose(r14c);
 		return -3;
 	}
 
@@ -64,32 +230,35 @@ int state_init(size_t base_ram_size, size_t exp_ram_size)
 	fseek(r15c, 0, SEEK_END);
 	size_t romlen2 = ftell(r15c);
 	fseek(r15c, 0, SEEK_SET);
+	uint8_t *romdat1 = NULL, *romdat2 = NULL, *rom = NULL;
 	if (romlen2 != romlen) {
 		fprintf(stderr, "[state] ROMs are not the same size!\n");
-		return -3;
+		goto fail;
 	}
 	if ((romlen + romlen2) > ROM_SIZE) {
 		fprintf(stderr, "[state] ROM files are too large!\n");
-		return -3;
+		goto fail;
 	}
 
 	// sanity checks completed; load the ROMs!
-	uint8_t *romdat1, *romdat2;
 	romdat1 = malloc(romlen);
 	romdat2 = malloc(romlen2);
+	rom = calloc(1, ROM_SIZE);
+	if ((romdat1 == NULL) || (romdat2 == NULL) || (rom == NULL))
+		goto fail;
 	if (fread(romdat1, 1, romlen, r15c) != romlen) {
 		fprintf(stderr, "[state] Error reading ROM 15C.\n");
-		return -3;
+		goto fail;
 	}
 	if (fread(romdat2, 1, romlen2, r14c) != romlen) {
 		fprintf(stderr, "[state] Error reading ROM 14C.\n");
-		return -3;
+		goto fail;
 	}
 
 	// convert the ROM data
 	for (size_t i=0; i<(romlen + romlen2); i+=2) {
-		state.rom[i+0] = romdat1[i/2];
-		state.rom[i+1] = romdat2[i/2];
+		rom[i+0] = romdat1[i/2];
+		rom[i+1] = romdat2[i/2];
 	}
 
 	// TODO: if ROM buffer not filled, repeat the ROM data we read until it is (wraparound emulation)
@@ -99,30 +268,208 @@ int state_init(size_t base_ram_size, size_t exp_ram_size)
 	free(romdat2);
 	fclose(r14c);
 	fclose(r15c);
+	shared_rom = rom;
+	rom_mapped = false;
+	write_rom_cache(rom, &key);
 
-	// Initialise the disc controller
-	wd2797_init(&state.fdc_ctx);
+	return 0;
+
+fail:
+	free(romdat1);
+	free(romdat2);
+	free(rom);
+	fclose(r14c);
+	fclose(r15c);
+	return -3;
+}
+
+/**
+ * @brief	Allocate a RAM bank.
+ * @return	The bank, or NULL if out of memory.
+ *
+ * Anonymous memory, so pages the guest never touches cost the host
+ * nothing. It comes zero-filled, neither of which real RAM guarantees.
+ */
+static uint8_t *alloc_ram(size_t size)
+{
+	void *ram = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	return (ram == MAP_FAILED) ? NULL : ram;
+}
+
+int state_init(size_t base_ram_size, size_t exp_ram_size)
+{
+	// Free RAM if it's allocated
+	state_free_ram();
+
+	// Initialise hardware registers
+	state->romlmap = false;
+	state->idmarw = state->dmaen = state->dmaenb = false;
+	state->dma_count = state->dma_address = 0;
+	state->pie = 0;
+	state->ee = 0;
+	state->leds = 0;
+	state->genstat = 0;				// FIXME: check this
+	state->bsr0 = state->bsr1 = 0;	// FIXME: check this
+	state->timer_enabled = state->timer_asserted = false;
+	state->dma_dev = DMA_DEV_UNDEF;
+	// The CPU comes out of reset in supervisor mode
+	state->supervisor = true;
+	sched_init(&state->sched);
+	irq_init(&state->irq);
+	// Allocate Base RAM, making sure the user has specified a valid RAM amount first
+	// Basically: 512KiB minimum, 2MiB maximum, in increments of 512KiB.
+	if ((base_ram_size < 512*1024) || (base_ram_size > 2048*1024) || ((base_ram_size % (512*1024)) != 0))
+		return -1;
+	state->base_ram = alloc_ram(base_ram_size);
+	if (state->base_ram == NULL)
+		return -2;
+	state->base_ram_size = base_ram_size;
+	state->base_ram_mapped = true;
+
+	// Now allocate expansion RAM
+	// The difference here is that we can have zero bytes of Expansion RAM; we're not limited to having a minimum of 512KiB.
+	if ((exp_ram_size > 2048*1024) || ((exp_ram_size % (512*1024)) != 0))
+		return -1;
+	if (exp_ram_size > 0) {
+		state->exp_ram = alloc_ram(exp_ram_size);
+		if (state->exp_ram == NULL)
+			return -2;
+		state->exp_ram_mapped = true;
+	}
+	state->exp_ram_size = exp_ram_size;
+
+	// Load the ROMs, unless another machine already has
+	if ((shared_rom == NULL) && (load_rom() != 0))
+		return -3;
+	if (state->rom == NULL) {
+		state->rom = shared_rom;
+		rom_users++;
+	}
+
+	// Set up the memory dispatch table now the RAM and ROM buffers exist
+	memory_rebuild_page_table();
+	memory_vram_invalidate();
+
+	// Initialise the disc controller, with an empty drive
+	wd2797_init(&state->fdc_ctx);
+	state->fdc_cur = -1;
 	// Initialise the keyboard controller
-	keyboard_init(&state.kbd);
+	keyboard_init(&state->kbd);
+	// Initialise the real-time clock, which reads the host's clock until
+	// told otherwise
+	tc8250_init(&state->rtc_ctx, TC8250_CLOCK_HOST, time(NULL));
+	// No host files open yet
+	hostio_init(&state->hostio);
 
 	return 0;
 }
 
-void state_done()
+void state_free_ram()
 {
-	if (state.base_ram != NULL) {
-		free(state.base_ram);
-		state.base_ram = NULL;
+	if (state->base_ram != NULL) {
+		if (state->base_ram_mapped)
+			munmap(state->base_ram, state->base_ram_size);
+		else
+			free(state->base_ram);
+		state->base_ram = NULL;
 	}
 
-	if (state.exp_ram != NULL) {
-		free(state.exp_ram);
-		state.exp_ram = NULL;
+	if (state->exp_ram != NULL) {
+		if (state->exp_ram_mapped)
+			munmap(state->exp_ram, state->exp_ram_size);
+		else
+			free(state->exp_ram);
+		state->exp_ram = NULL;
+	}
+
+	state->base_ram_mapped = state->exp_ram_mapped = false;
+}
+
+/**
+ * @brief	Write back a floppy disc image and close its file.
+ */
+static void close_fd(int n)
+{
+	if (state->fdc_files[n] == NULL)
+		return;
+	wd2797_disc_close(&state->fdc_discs[n]);
+	fclose(state->fdc_files[n]);
+	state->fdc_files[n] = NULL;
+}
+
+void state_done()
+{
+	state_free_ram();
+
+	// Free the ROMs once the last machine is done with them
+	if (state->rom != NULL) {
+		state->rom = NULL;
+		if (--rom_users == 0) {
+			if (rom_mapped)
+				munmap(shared_rom, ROM_SIZE);
+			else
+				free(shared_rom);
+			shared_rom = NULL;
+		}
 	}
 
 	// Deinitialise the disc controller
-	wd2797_done(&state.fdc_ctx);
-	wd2010_done(&state.hdc_ctx);
+	wd2797_unload(&state->fdc_ctx);
+	wd2797_done(&state->fdc_ctx);
+	wd2010_done(&state->hdc_ctx);
+	hostio_done(&state->hostio);
+
+	// Write back and close the floppy disc images
+	for (int i = 0; i < state->fdc_ndiscs; i++)
+		close_fd(i);
+	free(state->fdc_discs);
+	free(state->fdc_files);
+	state->fdc_discs = NULL;
+	state->fdc_files = NULL;
+	state->fdc_ndiscs = 0;
+	state->fdc_cur = -1;
+}
+
+void state_fd_set_reopen(STATE_FD_OPEN open)
+{
+	fd_reopen = open;
+}
+
+void state_fd_select(int n)
+{
+	if ((n < -1) || (n >= state->fdc_ndiscs))
+		return;
+
+	if (state->fdc_cur >= 0) {
+		wd2797_unload(&state->fdc_ctx);
+		// The user may replace the file before the next insert
+		if (fd_reopen != NULL)
+			close_fd(state->fdc_cur);
+		fprintf(stderr, "Disc image unloaded.\n");
+	}
+	state->fdc_cur = -1;
+
+	if (n >= 0) {
+		if ((state->fdc_files[n] == NULL) && (fd_reopen != NULL))
+			state->fdc_files[n] = fd_reopen(n, &state->fdc_discs[n]);
+		if (state->fdc_files[n] == NULL)
+			return;
+		if (wd2797_load(&state->fdc_ctx, &state->fdc_discs[n]) != WD2797_ERR_OK) {
+			fprintf(stderr, "ERROR inserting floppy disc %d.\n", n + 1);
+			return;
+		}
+		state->fdc_cur = n;
+		fprintf(stderr, "Disc image %d of %d loaded.\n", n + 1, state->fdc_ndiscs);
+	}
+}
+
+void state_fd_next()
+{
+	// From an empty drive, go back to the first disc
+	if ((state->fdc_cur + 1) < state->fdc_ndiscs)
+		state_fd_select(state->fdc_cur + 1);
+	else
+		state_fd_select(-1);
 }
 
 
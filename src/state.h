@@ -8,11 +8,21 @@
 #include "wd2010.h"
 #include "keyboard.h"
 #include "tc8250.h"
+#include "memory.h"
+#include "sched.h"
+#include "irq.h"
+#include "hostio.h"
+#include "insnhook.h"
 
 
 // Maximum size of the Boot PROMs. Must be a binary power of two.
 #define ROM_SIZE 32768
 
+// Video RAM geometry: 720x348 monochrome, LSB of each word is the leftmost pixel
+#define VRAM_WIDTH			720
+#define VRAM_HEIGHT			348
+#define VRAM_LINE_BYTES		(VRAM_WIDTH / 8)
+
 #define DMA_DEV_UNDEF -1
 #define DMA_DEV_FD 0
 #define DMA_DEV_HD0 1
@@ -33,21 +43,40 @@ typedef enum {
  * This structure stores the internal state of the emulator.
  */
 typedef struct {
-	// Boot PROM can be up to 32Kbytes total size
-	uint8_t		rom[ROM_SIZE];		///< Boot PROM data buffer
+	// Boot PROM can be up to 32Kbytes total size. Read-only, and shared by
+	// every machine in the process.
+	uint8_t		*rom;				///< Boot PROM data buffer
 
 	//// Main system RAM
 	uint8_t		*base_ram;			///< Base RAM data buffer
 	size_t		base_ram_size;		///< Size of Base RAM buffer in bytes
 	uint8_t		*exp_ram;			///< Expansion RAM data buffer
 	size_t		exp_ram_size;		///< Size of Expansion RAM buffer in bytes
+	bool		base_ram_mapped;	///< Base RAM is mmap()ed (anonymous, or a private mapping of a snapshot file), not malloc()ed
+	bool		exp_ram_mapped;		///< Expansion RAM is mmap()ed (anonymous, or a private mapping of a snapshot file), not malloc()ed
+	/// Physical RAM pages written since the last checkpoint, one bit per page
+	uint32_t	ram_dirty[MEM_NUM_RAM_PAGES / 32];
 
 	/// Video RAM
 	uint8_t		vram[0x8000];
+	/// Scanlines written since the last screen refresh, one bit per line
+	uint32_t	vram_dirty[(VRAM_HEIGHT + 31) / 32];
 
 	/// Map RAM
 	uint8_t		map[0x800];
 
+	/// Memory dispatch table, one entry per 4KiB page of CPU address space
+	PAGE_ENTRY	pages[MEM_NUM_PAGES];
+
+	/// Decoded Map RAM entries
+	TLB_ENTRY	tlb[MEM_NUM_MAP_PAGES];
+
+	/// CPU is in supervisor mode (as of the last function code callback)
+	bool		supervisor;
+	/// The last function code callback was for a program space access (an
+	/// instruction fetch)
+	bool		program;
+
 	//// Registers
 	uint16_t	genstat;			///< General Status Register
 	uint16_t	bsr0;				///< Bus Status Register 0
@@ -88,8 +117,14 @@ typedef struct {
 	int         dma_dev;
 	/// Floppy disc controller context
 	WD2797_CTX	fdc_ctx;
-	/// Current disc image file
-	FILE *fdc_disc;
+	/// Floppy disc images, read into memory at startup so they can be
+	/// swapped without touching the filesystem (or, with
+	/// state_fd_set_reopen(), each time they're inserted)
+	WD2797_DISC	*fdc_discs;
+	/// Image file for each disc, or NULL if it isn't open
+	FILE		**fdc_files;
+	/// Number of floppy disc images, and the one in the drive (-1 if empty)
+	int			fdc_ndiscs, fdc_cur;
 
 	/// Hard disc controller context
 	WD2010_CTX  hdc_ctx;
@@ -101,15 +136,70 @@ typedef struct {
 
 	/// Real time clock context
 	TC8250_CTX rtc_ctx;
+
+	/// Event scheduler
+	SCHED_CTX	sched;
+
+	/// Interrupt controller
+	IRQ_CTX		irq;
+
+	/// Host file transfer device (paravirtual)
+	HOSTIO_CTX	hostio;
+
+	/// Musashi CPU context, saved here while another machine is selected
+	void		*cpu_ctx;
+
+	/// Binary trace being recorded (see trace.h), or NULL
+	struct TRACE	*trace;
+
+	/// What the instruction hook calls for this machine (see insnhook.h)
+	INSN_HOOKS	insn_hooks;
 } S_state;
 
-// Global emulator state. Yes, I know global variables are evil, please don't
-// email me and lecture me about it.  -philpem
-#ifndef _STATE_C
-extern S_state state;
-#else
-S_state state;
-#endif
+/**
+ * @brief Machine being emulated by the calling thread.
+ *
+ * Every device and memory handler works on this machine. Each thread starts
+ * out with the primary machine; state_select() switches to another one.
+ */
+extern __thread S_state *state;
+
+/**
+ * @brief	Allocate another machine.
+ * @return	The new machine, or NULL if out of memory.
+ *
+ * Select the new machine, then call state_init() and reset the CPU to set it
+ * up, the same as the primary machine.
+ */
+S_state *state_new();
+
+/**
+ * @brief	Free a machine allocated by state_new().
+ *
+ * Call state_done() on it first. The machine must not be selected.
+ */
+void state_free(S_state *s);
+
+/**
+ * @brief	Switch the calling thread to another machine.
+ *
+ * Swaps the Musashi CPU context too. Musashi only has one CPU per process,
+ * so only one thread at a time may be running a machine.
+ */
+void state_select(S_state *s);
+
+/**
+ * @brief	Choose the Boot PROM files.
+ * @param	rom14c		ROM 14C (the odd bytes).
+ * @param	rom15c		ROM 15C (the even bytes).
+ * @param	cache		Where to keep the interleaved image, or "" for no
+ * 						cache.
+ *
+ * Passing NULL leaves that file as it was. Call before the first
+ * state_init(). The defaults are roms/14c.bin, roms/15c.bin and
+ * roms/rom.img.
+ */
+void state_set_rom_files(const char *rom14c, const char *rom15c, const char *cache);
 
 /**
  * @brief	Initialise system state
@@ -124,9 +214,48 @@ int state_init(size_t base_ram_size, size_t exp_ram_size);
 /**
  * @brief Deinitialise system state
  *
- * Deinitialises the saved state, and frees all memory. Call this function
+ * Deinitialises the current machine's state, and frees all its memory. Call this function
  * before exiting your program to avoid memory leaks.
  */
 void state_done();
 
+/**
+ * @brief	Free the Base and Expansion RAM buffers, however they were allocated.
+ */
+void state_free_ram();
+
+/**
+ * @brief	Change the disc in the floppy drive.
+ * @param	n	Index of the image to insert, or -1 to leave the drive empty.
+ *
+ * The current disc (if any) is ejected first, which writes back any tracks
+ * that have changed. Nothing happens if n is out of range.
+ */
+void state_fd_select(int n);
+
+/**
+ * @brief	Function which opens floppy disc image n and reads it into disc.
+ * @return	The image file, or NULL on error (after saying why).
+ */
+typedef FILE *(*STATE_FD_OPEN)(int n, WD2797_DISC *disc);
+
+/**
+ * @brief	Re-read floppy disc images from their files each time they're
+ * 			inserted, instead of keeping them in memory.
+ * @param	open	Opens an image, or NULL to keep them in memory.
+ *
+ * Ejecting a disc writes it back and closes the file, so another image can
+ * be copied over it before the disc is inserted again. Shared by every
+ * machine.
+ */
+void state_fd_set_reopen(STATE_FD_OPEN open);
+
+/**
+ * @brief	Move on to the next floppy disc image.
+ *
+ * Cycles through each image in turn and then an empty drive. With a single
+ * image this toggles between loaded and unloaded.
+ */
+void state_fd_next();
+
 #endif
@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "SDL.h"
+#include "stats.h"
+
+#ifndef STATS_DEBUG
+#define NDEBUG
+#endif
+#include "utils.h"
+
+STAT_IO_REG stats_io_reg(uint32_t address)
+{
+	if ((address >= 0x400000) && (address <= 0x7FFFFF))
+		return STAT_IO_A_0 + ((address >> 16) & 0xF);
+
+	if ((address >= 0xC00000) && (address <= 0xFFFFFF)) {
+		if (address < 0xE00000)
+			return STAT_IO_EXP_SLOT + ((address >> 18) & 7);
+		switch (address & 0x070000) {
+			case 0x000000:	return STAT_IO_HDC;
+			case 0x010000:	return STAT_IO_FDC;
+			case 0x020000:	return STAT_IO_MCR2;
+			case 0x030000:	return STAT_IO_RTC_DATA;
+			case 0x040000:	return STAT_IO_GCR + ((address >> 12) & 7);
+			case 0x050000:	return STAT_IO_8274;
+			case 0x060000:	return STAT_IO_CONTROL;
+			default:		return STAT_IO_KEYBOARD;
+		}
+	}
+
+	return STAT_IO_OTHER;
+}
+
+STATS_FORMAT stats_format_for(const char *filename)
+{
+	size_t len = strlen(filename);
+	if ((len >= 5) && (strcmp(filename + len - 5, ".json") == 0))
+		return STATS_FMT_JSON;
+	return STATS_FMT_PROMETHEUS;
+}
+
+const char *const stats_region_names[STAT_RGN_COUNT] = {
+	"rom", "ram", "map", "vram", "io_a", "io_b"
+};
+
+#ifdef ENABLE_STATS
+
+/// Names for the I/O registers, as they appear in exports
+static const char *const io_names[STAT_IO_COUNT] = {
+	"zone_a_0", "gsr", "zone_a_2", "bsr0",
+	"bsr1", "phone_status", "dma_count", "lp_status",
+	"rtc", "phone", "mcr", "tm_dialwr",
+	"csr", "dma_address", "disk_control", "lp_data",
+	"exp_slot0", "exp_slot1", "exp_slot2", "exp_slot3",
+	"exp_slot4", "exp_slot5", "exp_slot6", "exp_slot7",
+	"hdc", "fdc", "mcr2", "rtc_data",
+	"gcr_ee", "gcr_pie", "gcr_bp", "gcr_romlmap",
+	"gcr_l1_modem", "gcr_l2_modem", "gcr_dn_connect", "gcr_reverse_video",
+	"8274", "control", "keyboard", "other"
+};
+
+/// Names for the bus error causes (MEM_STATUS), as they appear in exports
+static const char *const fault_names[STAT_NUM_MEM_STATUS] = {
+	"allowed", "page_fault", "page_not_write_enabled", "kernel", "user_nonmemory"
+};
+
+__thread STATS stats_local;
+
+/// Maximum number of threads with counters
+#define STATS_MAX_THREADS	16
+
+/// Every thread's counters, and the lock which protects the list (not the
+/// counters themselves -- each thread only ever writes its own)
+static STATS *threads[STATS_MAX_THREADS];
+static int nthreads = 0;
+static SDL_mutex *threads_lock = NULL;
+/// Counters of the threads which have finished (protected by threads_lock)
+static STATS retired;
+
+/// Add one set of counters to another
+static void stats_add(STATS *dst, const STATS *src)
+{
+	const uint64_t *s = (const uint64_t *)src;
+	uint64_t *d = (uint64_t *)dst;
+	for (size_t i = 0; i < sizeof(STATS) / sizeof(uint64_t); i++)
+		d[i] += s[i];
+}
+
+void stats_thread_register(void)
+{
+	// The main thread registers before starting any others, so creating the
+	// lock here is safe
+	if (threads_lock == NULL)
+		threads_lock = SDL_CreateMutex();
+
+	SDL_mutexP(threads_lock);
+	bool found = false;
+	for (int i = 0; i < nthreads; i++)
+		found = found || (threads[i] == &stats_local);
+	if (!found && (nthreads < STATS_MAX_THREADS))
+		threads[nthreads++] = &stats_local;
+	SDL_mutexV(threads_lock);
+}
+
+void stats_thread_done(void)
+{
+	if (threads_lock == NULL)
+		return;
+
+	// The thread's counters go away with it, so keep a copy
+	SDL_mutexP(threads_lock);
+	for (int i = 0; i < nthreads; i++) {
+		if (threads[i] == &stats_local) {
+			stats_add(&retired, &stats_local);
+			threads[i] = threads[--nthreads];
+			break;
+		}
+	}
+	SDL_mutexV(threads_lock);
+}
+
+void stats_total(STATS *total)
+{
+	memset(total, 0, sizeof(STATS));
+	if (threads_lock == NULL)
+		return;
+
+	SDL_mutexP(threads_lock);
+	stats_add(total, &retired);
+	for (int t = 0; t < nthreads; t++)
+		stats_add(total, threads[t]);
+	SDL_mutexV(threads_lock);
+}
+
+static void write_json(FILE *fp, const STATS *s)
+{
+	fprintf(fp, "{\n\t\"memory\": {");
+	for (int i = 0; i < STAT_RGN_COUNT; i++)
+		fprintf(fp, "%s\n\t\t\"%s\": { \"reads\": %llu, \"writes\": %llu }", i ? "," : "",
+				stats_region_names[i], (unsigned long long)s->mem_reads[i], (unsigned long long)s->mem_writes[i]);
+	fprintf(fp, "\n\t},\n\t\"io\": {");
+	for (int i = 0; i < STAT_IO_COUNT; i++)
+		fprintf(fp, "%s\n\t\t\"%s\": { \"reads\": %llu, \"writes\": %llu }", i ? "," : "",
+				io_names[i], (unsigned long long)s->io_reads[i], (unsigned long long)s->io_writes[i]);
+	fprintf(fp, "\n\t},\n\t\"faults\": {");
+	for (int i = MEM_PAGEFAULT; i < STAT_NUM_MEM_STATUS; i++)
+		fprintf(fp, "%s\n\t\t\"%s\": %llu", (i > MEM_PAGEFAULT) ? "," : "",
+				fault_names[i], (unsigned long long)s->faults[i]);
+	fprintf(fp, "\n\t},\n\t\"dma_words\": %llu,\n\t\"idle_cycles\": %llu,\n\t\"hostio_bytes\": %llu\n}\n",
+			(unsigned long long)s->dma_words, (unsigned long long)s->idle_cycles, (unsigned long long)s->hostio_bytes);
+}
+
+static void write_prometheus(FILE *fp, const STATS *s)
+{
+	fprintf(fp, "# HELP freebee_memory_accesses_total CPU accesses by memory region.\n");
+	fprintf(fp, "# TYPE freebee_memory_accesses_total counter\n");
+	for (int i = 0; i < STAT_RGN_COUNT; i++) {
+		fprintf(fp, "freebee_memory_accesses_total{region=\"%s\",op=\"read\"} %llu\n", stats_region_names[i], (unsigned long long)s->mem_reads[i]);
+		fprintf(fp, "freebee_memory_accesses_total{region=\"%s\",op=\"write\"} %llu\n", stats_region_names[i], (unsigned long long)s->mem_writes[i]);
+	}
+	fprintf(fp, "# HELP freebee_io_accesses_total I/O register accesses.\n");
+	fprintf(fp, "# TYPE freebee_io_accesses_total counter\n");
+	for (int i = 0; i < STAT_IO_COUNT; i++) {
+		fprintf(fp, "freebee_io_accesses_total{register=\"%s\",op=\"read\"} %llu\n", io_names[i], (unsigned long long)s->io_reads[i]);
+		fprintf(fp, "freebee_io_accesses_total{register=\"%s\",op=\"write\"} %llu\n", io_names[i], (unsigned long long)s->io_writes[i]);
+	}
+	fprintf(fp, "# HELP freebee_bus_errors_total Bus errors by cause.\n");
+	fprintf(fp, "# TYPE freebee_bus_errors_total counter\n");
+	for (int i = MEM_PAGEFAULT; i < STAT_NUM_MEM_STATUS; i++)
+		fprintf(fp, "freebee_bus_errors_total{cause=\"%s\"} %llu\n", fault_names[i], (unsigned long long)s->faults[i]);
+	fprintf(fp, "# HELP freebee_dma_words_total Words transferred by DMA.\n");
+	fprintf(fp, "# TYPE freebee_dma_words_total counter\n");
+	fprintf(fp, "freebee_dma_words_total %llu\n", (unsigned long long)s->dma_words);
+	fprintf(fp, "# HELP freebee_idle_cycles_total CPU cycles skipped while the guest was idle.\n");
+	fprintf(fp, "# TYPE freebee_idle_cycles_total counter\n");
+	fprintf(fp, "freebee_idle_cycles_total %llu\n", (unsigned long long)s->idle_cycles);
+	fprintf(fp, "# HELP freebee_hostio_bytes_total Bytes moved by the host transfer device.\n");
+	fprintf(fp, "# TYPE freebee_hostio_bytes_total counter\n");
+	fprintf(fp, "freebee_hostio_bytes_total %llu\n", (unsigned long long)s->hostio_bytes);
+}
+
+bool stats_write(const char *filename, STATS_FORMAT fmt)
+{
+	STATS total;
+	bool ok;
+
+	stats_total(&total);
+
+	// Write to a temporary file and rename it into place, so anything
+	// scraping the file never sees half of it
+	char *tmpname = malloc(strlen(filename) + 5);
+	if (tmpname == NULL)
+		return false;
+	sprintf(tmpname, "%s.tmp", filename);
+
+	FILE *fp = fopen(tmpname, "w");
+	if (fp == NULL) {
+		free(tmpname);
+		return false;
+	}
+	if (fmt == STATS_FMT_JSON)
+		write_json(fp, &total);
+	else
+		write_prometheus(fp, &total);
+	ok = !ferror(fp);
+	ok = (fclose(fp) == 0) && ok;
+	if (ok)
+		ok = (rename(tmpname, filename) == 0);
+	if (!ok)
+		remove(tmpname);
+
+	LOG("wrote '%s', %s", filename, ok ? "ok" : "failed");
+	free(tmpname);
+	return ok;
+}
+
+#else
+
+void stats_thread_register(void)
+{
+}
+
+void stats_thread_done(void)
+{
+}
+
+void stats_total(STATS *total)
+{
+	memset(total, 0, sizeof(STATS));
+}
+
+bool stats_write(const char *filename, STATS_FORMAT fmt)
+{
+	(void)fmt;
+	fprintf(stderr, "ERROR: Can't write '%s': not built with ENABLE_STATS=yes.\n", filename);
+	return false;
+}
+
+#endif
@@ -0,0 +1,156 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "memory.h"
+
+/**
+ * Instrumentation counters.
+ *
+ * Build with ENABLE_STATS=yes (which defines ENABLE_STATS) to count what the
+ * guest does: CPU accesses to each memory region, accesses to each I/O
+ * register, bus errors by cause and words moved by DMA. Without it the
+ * STAT_xxx macros compile to nothing and there's no cost on the hot paths.
+ *
+ * Each thread counts into its own block, so counting never needs a lock.
+ * The blocks are added together when the counters are exported.
+ */
+
+/// Memory regions
+typedef enum {
+	STAT_RGN_ROM,
+	STAT_RGN_RAM,
+	STAT_RGN_MAP,
+	STAT_RGN_VRAM,
+	STAT_RGN_IO_A,			///< I/O zone A, 0x400000 to 0x7FFFFF (Map RAM and Video RAM aside)
+	STAT_RGN_IO_B,			///< I/O zone B, 0xC00000 to 0xFFFFFF
+	STAT_RGN_COUNT
+} STAT_REGION;
+
+/// I/O registers, following the cases in IoRead() and IoWrite()
+typedef enum {
+	// Zone A, one per 64K block
+	STAT_IO_A_0, STAT_IO_GSR, STAT_IO_A_2, STAT_IO_BSR0,
+	STAT_IO_BSR1, STAT_IO_PHONE_STATUS, STAT_IO_DMA_COUNT, STAT_IO_LP_STATUS,
+	STAT_IO_RTC, STAT_IO_PHONE, STAT_IO_MCR, STAT_IO_TM_DIALWR,
+	STAT_IO_CSR, STAT_IO_DMA_ADDRESS, STAT_IO_DISK_CONTROL, STAT_IO_LP_DATA,
+	// Zone B
+	STAT_IO_EXP_SLOT,		///< Expansion slots 0 to 7 (8 counters)
+	STAT_IO_HDC = STAT_IO_EXP_SLOT + 8,
+	STAT_IO_FDC,
+	STAT_IO_MCR2,
+	STAT_IO_RTC_DATA,
+	STAT_IO_GCR,			///< General Control Register bits, EE to reverse video (8 counters)
+	STAT_IO_8274 = STAT_IO_GCR + 8,
+	STAT_IO_CONTROL,
+	STAT_IO_KEYBOARD,
+	STAT_IO_OTHER,			///< Anything else
+	STAT_IO_COUNT
+} STAT_IO_REG;
+
+/// Number of MEM_STATUS values
+#define STAT_NUM_MEM_STATUS	(MEM_UIE + 1)
+
+/// One thread's counters
+typedef struct {
+	uint64_t	mem_reads[STAT_RGN_COUNT];			///< CPU reads by region
+	uint64_t	mem_writes[STAT_RGN_COUNT];			///< CPU writes by region
+	uint64_t	io_reads[STAT_IO_COUNT];			///< I/O register reads
+	uint64_t	io_writes[STAT_IO_COUNT];			///< I/O register writes
+	uint64_t	faults[STAT_NUM_MEM_STATUS];		///< Bus errors (CPU and DMA) by cause
+	uint64_t	dma_words;							///< Words moved by DMA
+	uint64_t	idle_cycles;						///< CPU cycles skipped while the guest was idle
+	uint64_t	hostio_bytes;						///< Bytes moved by the host transfer device
+} STATS;
+
+/// Names for the regions, as they appear in exports
+extern const char *const stats_region_names[STAT_RGN_COUNT];
+
+/// Export formats
+typedef enum {
+	STATS_FMT_JSON,
+	STATS_FMT_PROMETHEUS	///< Prometheus text exposition format
+} STATS_FORMAT;
+
+#ifdef ENABLE_STATS
+
+/// This thread's counters
+extern __thread STATS stats_local;
+
+/// Add one to a counter, e.g. STAT_INC(dma_words)
+#define STAT_INC(counter)		(stats_local.counter++)
+/// Add n to a counter
+#define STAT_ADD(counter, n)	(stats_local.counter += (n))
+
+#else
+
+#define STAT_INC(counter)		((void)0)
+#define STAT_ADD(counter, n)	((void)0)
+
+#endif
+
+/**
+ * @brief	Work out which region a CPU access falls in.
+ * @param	type		Type of the page (PAGE_xxx).
+ * @param	address		Address being accessed.
+ */
+static inline STAT_REGION stats_region(uint8_t type, uint32_t address)
+{
+	switch (type) {
+		case PAGE_ROM:	return STAT_RGN_ROM;
+		case PAGE_RAM:	return STAT_RGN_RAM;
+		case PAGE_MAP:	return STAT_RGN_MAP;
+		case PAGE_VRAM:	return STAT_RGN_VRAM;
+		default:		return (address >= 0xC00000) ? STAT_RGN_IO_B : STAT_RGN_IO_A;
+	}
+}
+
+/**
+ * @brief	Work out which I/O register an address belongs to.
+ */
+STAT_IO_REG stats_io_reg(uint32_t address);
+
+/**
+ * @brief	Include the calling thread's counters in exports.
+ *
+ * Call this once at the start of each thread which runs a machine. Calling
+ * it again from the same thread does nothing.
+ */
+void stats_thread_register(void);
+
+/**
+ * @brief	Keep the calling thread's counters once it has finished.
+ *
+ * Call this just before a thread which called stats_thread_register()
+ * exits; its counters are added to the totals of the finished threads.
+ */
+void stats_thread_done(void);
+
+/**
+ * @brief	Add up every thread's counters.
+ * @param	total		Filled in with the totals; all zero if the emulator
+ * 						wasn't built with ENABLE_STATS.
+ *
+ * Other threads may be counting while this runs; a counter read part way
+ * through an update is a little out of date, which is fine for statistics.
+ */
+void stats_total(STATS *total);
+
+/**
+ * @brief	Write the counters out.
+ * @param	filename	File to write to. Replaced atomically if it exists.
+ * @param	fmt			Format to write them in.
+ * @return	true on success; false on error, or if the emulator wasn't
+ * 			built with ENABLE_STATS.
+ */
+bool stats_write(const char *filename, STATS_FORMAT fmt);
+
+/**
+ * @brief	Pick an export format from a file name.
+ * @return	STATS_FMT_JSON for names ending in ".json", otherwise
+ * 			STATS_FMT_PROMETHEUS.
+ */
+STATS_FORMAT stats_format_for(const char *filename);
+
+#endif
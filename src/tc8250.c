@@ -3,23 +3,62 @@
 #include <malloc.h>
 #include <time.h>
 #include "tc8250.h"
+#include "sched.h"
 
 #ifndef TC8250_DEBUG
 #define NDEBUG
 #endif
 #include "utils.h"
 
-void tc8250_init(TC8250_CTX *ctx)
+/// How long a latched time stays good if the guest keeps the chip enabled
+#define LATCH_CYCLES		SCHED_MS_TO_CYCLES(100)
+
+void tc8250_init(TC8250_CTX *ctx, TC8250_CLOCK clock, int64_t epoch)
 {
 	ctx->chip_enable = false;
 	ctx->address_latch_enable = false;
 	ctx->write_enable = false;
 	ctx->address = 0;
+	ctx->clock = clock;
+	ctx->epoch = epoch;
+	ctx->latched = false;
+}
+
+void tc8250_set_clock(TC8250_CTX *ctx, TC8250_CLOCK clock, int64_t epoch)
+{
+	ctx->clock = clock;
+	if (epoch >= 0)
+		ctx->epoch = epoch;
+	ctx->latched = false;
+}
+
+/**
+ * Take a copy of the current time for the guest to read.
+ *
+ * The guest reads the time a digit at a time, so this is done once when it
+ * enables the chip rather than on every read. That way the digits can't
+ * tear across a rollover, and the clock is only looked at a handful of
+ * times a second.
+ */
+static void latch_time(TC8250_CTX *ctx)
+{
+	time_t t;
+	uint64_t now = sched_now();
+
+	if (ctx->clock == TC8250_CLOCK_VIRTUAL)
+		t = (time_t)(ctx->epoch + (int64_t)(now / SCHED_CLOCK_HZ));
+	else
+		t = time(NULL);
+	gmtime_r(&t, &ctx->now);
+	ctx->latched = true;
+	ctx->latch_cycle = now;
 }
 
 void tc8250_set_chip_enable(TC8250_CTX *ctx, bool enabled)
 {
 	LOG("tc8250_set_chip_enable %d\n", enabled);
+	if (enabled && !ctx->chip_enable)
+		latch_time(ctx);
 	ctx->chip_enable = enabled;
 }
 
@@ -37,57 +76,27 @@ void tc8250_set_write_enable(TC8250_CTX *ctx, bool enabled)
 
 uint8_t get_second(TC8250_CTX *ctx)
 {
-	time_t t;
-	struct tm g;
-	uint8_t ret;
-	t = time(NULL);
-	gmtime_r(&t, &g);
-	ret = g.tm_sec;
-	return (ret);
+	return (ctx->now.tm_sec);
 }
 
 uint8_t get_minute(TC8250_CTX *ctx)
 {
-	time_t t;
-	struct tm g;
-	uint8_t ret;
-	t = time(NULL);
-	gmtime_r(&t, &g);
-	ret = g.tm_min;
-	return (ret);
+	return (ctx->now.tm_min);
 }
 
 uint8_t get_hour(TC8250_CTX *ctx)
 {
-	time_t t;
-	struct tm g;
-	uint8_t ret;
-	t = time(NULL);
-	gmtime_r(&t, &g);
-	ret = g.tm_hour;
-	return (ret);
+	return (ctx->now.tm_hour);
 }
 
 uint8_t get_day(TC8250_CTX *ctx)
 {
-	time_t t;
-	struct tm g;
-	uint8_t ret;
-	t = time(NULL);
-	gmtime_r(&t, &g);
-	ret = g.tm_mday;
-	return (ret);
+	return (ctx->now.tm_mday);
 }
 
 uint8_t get_month(TC8250_CTX *ctx)
 {
-	time_t t;
-	struct tm g;
-	uint8_t ret;
-	t = time(NULL);
-	gmtime_r(&t, &g);
-	ret = g.tm_mon;
-	return (ret);
+	return (ctx->now.tm_mon);
 }
 
 uint8_t get_year(TC8250_CTX *ctx)
@@ -104,18 +113,15 @@ uint8_t get_year(TC8250_CTX *ctx)
 
 uint8_t get_weekday(TC8250_CTX *ctx)
 {
-	time_t t;
-	struct tm g;
-	uint8_t ret;
-	t = time(NULL);
-	gmtime_r(&t, &g);
-	ret = g.tm_wday;
-	return (ret);
+	return (ctx->now.tm_wday);
 }
 
 uint8_t tc8250_read_reg(TC8250_CTX *ctx)
 {
 	LOG("tc8250_read_reg %x\n", ctx->address);
+	// Read without enabling the chip first, or held enabled for a long time
+	if (!ctx->latched || ((sched_now() - ctx->latch_cycle) >= LATCH_CYCLES))
+		latch_time(ctx);
 	switch (ctx->address){
 		case ONE_SEC_DIGT:
 			return (get_second(ctx) % 10);
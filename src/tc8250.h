@@ -5,6 +5,13 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <time.h>
+
+/// Where the clock gets the time from
+typedef enum {
+	TC8250_CLOCK_HOST = 0,		///< The host's clock
+	TC8250_CLOCK_VIRTUAL		///< The epoch plus the emulated time since reset
+} TC8250_CLOCK;
 
 typedef struct {
 	bool chip_enable;
@@ -18,9 +25,31 @@ typedef struct {
 	uint8_t months_offset;
 	uint8_t years_offset;
 	uint8_t weekday_offset;
+	TC8250_CLOCK clock;			///< Time source
+	int64_t epoch;				///< Time at emulated cycle 0 (TC8250_CLOCK_VIRTUAL)
+	bool latched;				///< now is valid
+	uint64_t latch_cycle;		///< sched_now() when now was latched
+	struct tm now;				///< The time the guest is reading
 } TC8250_CTX;
 
-void tc8250_init(TC8250_CTX *ctx);
+/**
+ * @brief	Reset the clock chip and choose its time source.
+ * @param	ctx		Clock chip.
+ * @param	clock	Time source.
+ * @param	epoch	Time (seconds since 1970) at emulated cycle 0; only used
+ * 					by TC8250_CLOCK_VIRTUAL.
+ */
+void tc8250_init(TC8250_CTX *ctx, TC8250_CLOCK clock, int64_t epoch);
+
+/**
+ * @brief	Change the clock chip's time source, e.g. after a snapshot has
+ * 			been restored.
+ * @param	ctx		Clock chip.
+ * @param	clock	Time source.
+ * @param	epoch	New epoch, or -1 to keep the current one.
+ */
+void tc8250_set_clock(TC8250_CTX *ctx, TC8250_CLOCK clock, int64_t epoch);
+
 void tc8250_set_chip_enable(TC8250_CTX *ctx, bool enabled);
 void tc8250_set_address_latch_enable(TC8250_CTX *ctx, bool enabled);
 void tc8250_set_write_enable(TC8250_CTX *ctx, bool enabled);
@@ -0,0 +1,440 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "musashi/m68k.h"
+#include "state.h"
+#include "memory.h"
+#include "sched.h"
+#include "insnhook.h"
+#include "trace.h"
+
+#ifndef TRACE_DEBUG
+#define NDEBUG
+#endif
+#include "utils.h"
+
+/// Longest record: tag, absolute PC and the instruction words
+#define TRACE_MAX_RECORD	(1 + 4 + (TRACE_CODE_WORDS * 2))
+
+/// Code dictionary slot
+typedef struct {
+	uint32_t	pc;
+	uint32_t	seq;				///< Chunk the slot was filled in (low 32 bits), 0 if empty
+	uint16_t	words[TRACE_CODE_WORDS];
+} TRACE_SLOT;
+
+typedef struct TRACE TRACE;
+
+/// A machine's trace
+struct TRACE {
+	uint8_t			*map;			///< The trace file, mapped
+	size_t			size;
+	TRACE_HEADER	*hdr;
+	bool			mem;			///< Record data accesses
+	bool			stopped;		///< Reached the stop PC
+	uint64_t		seq;			///< Current chunk's sequence number
+	TRACE_CHUNK		*chunk;			///< Current chunk
+	uint8_t			*p, *end;		///< Next record, and the end of the chunk
+	uint32_t		last_pc;		///< PC of the last instruction record
+	uint32_t		last_addr;		///< Address of the last data access record
+	TRACE_SLOT		code[TRACE_CODE_SLOTS];
+};
+
+/********************************************************
+ * Recording
+ ********************************************************/
+
+/**
+ * @brief	Move on to the next chunk in the ring.
+ */
+static void next_chunk(TRACE *t)
+{
+	t->seq++;
+	TRACE_CHUNK *c = (TRACE_CHUNK *)(t->map + TRACE_HEADER_SIZE + (((t->seq - 1) % t->hdr->nchunks) * TRACE_CHUNK_SIZE));
+
+	// Mark the chunk unused while the old records in it are thrown away, so
+	// a crash doesn't leave them looking like new ones. The fences stop the
+	// compiler moving the stores around; a crash only loses what the
+	// process hasn't stored yet.
+	c->seq = 0;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	c->used = 0;
+	c->cycles = sched_now();
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	c->seq = t->seq;
+
+	t->chunk = c;
+	t->p = (uint8_t *)(c + 1);
+	t->end = (uint8_t *)c + TRACE_CHUNK_SIZE;
+	t->last_pc = t->last_addr = 0;
+}
+
+/**
+ * @brief	Finish a record, making it part of the chunk.
+ * @param	p	End of the record.
+ */
+static inline void commit(TRACE *t, uint8_t *p)
+{
+	t->p = p;
+	__atomic_signal_fence(__ATOMIC_RELEASE);
+	t->chunk->used = p - (uint8_t *)(t->chunk + 1);
+}
+
+static inline uint8_t *put_be16(uint8_t *p, uint16_t v)
+{
+	*p++ = v >> 8;
+	*p++ = v;
+	return p;
+}
+
+static inline uint8_t *put_be32(uint8_t *p, uint32_t v)
+{
+	*p++ = v >> 24;
+	*p++ = v >> 16;
+	*p++ = v >> 8;
+	*p++ = v;
+	return p;
+}
+
+/**
+ * @brief	Instruction hook: record an instruction.
+ */
+static void trace_insn(unsigned int pc)
+{
+	TRACE *t = state->trace;
+
+	if ((t->end - t->p) < TRACE_MAX_RECORD)
+		next_chunk(t);
+
+	// Only send the instruction words if the dictionary doesn't have them
+	uint16_t words[TRACE_CODE_WORDS];
+	memory_peek_code(pc, words, TRACE_CODE_WORDS);
+	TRACE_SLOT *slot = &t->code[(pc >> 1) & (TRACE_CODE_SLOTS - 1)];
+	uint8_t kind = TRACE_R_INSN;
+	if ((slot->seq != (uint32_t)t->seq) || (slot->pc != pc) || (memcmp(slot->words, words, sizeof(words)) != 0)) {
+		slot->seq = t->seq;
+		slot->pc = pc;
+		memcpy(slot->words, words, sizeof(words));
+		kind = TRACE_R_CODE;
+	}
+
+	uint8_t *p = t->p;
+	int32_t delta = (int32_t)(pc - t->last_pc) / 2;
+	if (((pc & 1) == 0) && (delta > TRACE_PC_ABS) && (delta < -TRACE_PC_ABS)) {
+		*p++ = kind | ((delta & 0x3F) << 2);
+	} else {
+		*p++ = kind | ((TRACE_PC_ABS & 0x3F) << 2);
+		p = put_be32(p, pc);
+	}
+	if (kind == TRACE_R_CODE) {
+		for (int i = 0; i < TRACE_CODE_WORDS; i++)
+			p = put_be16(p, words[i]);
+	}
+	t->last_pc = pc;
+	commit(t, p);
+
+	// Keep what led up to the stop PC
+	if ((t->hdr->flags & TRACE_F_STOP_PC) && (pc == t->hdr->stop_pc)) {
+		t->hdr->flags |= TRACE_F_STOPPED;
+		t->stopped = true;
+		insn_hook_remove(trace_insn);
+		fprintf(stderr, "Trace stopped at PC %08X.\n", pc);
+	}
+}
+
+void trace_mem(uint32_t address, int bits, bool writing, uint32_t value, MEM_STATUS st)
+{
+	TRACE *t = state->trace;
+
+	if (!t->mem || t->stopped || (state->program && !writing))
+		return;
+	if ((t->end - t->p) < TRACE_MAX_RECORD)
+		next_chunk(t);
+
+	uint8_t *p = t->p;
+	int size = (bits == 32) ? 2 : (bits == 16) ? 1 : 0;
+	*p++ = TRACE_R_MEM | (writing ? TRACE_M_WRITE : 0) | (size << 3) | ((st != MEM_ALLOWED) ? TRACE_M_FAULT : 0);
+
+	// Zigzag encoding keeps small negative deltas short too
+	int32_t delta = address - t->last_addr;
+	uint32_t z = ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+	while (z > 0x7F) {
+		*p++ = (z & 0x7F) | 0x80;
+		z >>= 7;
+	}
+	*p++ = z;
+
+	for (int i = (1 << size) - 1; i >= 0; i--)
+		*p++ = value >> (i * 8);
+	if (st != MEM_ALLOWED)
+		*p++ = st;
+
+	t->last_addr = address;
+	commit(t, p);
+}
+
+bool trace_start(const char *filename, size_t size, uint32_t flags, int64_t stop_pc)
+{
+#if (M68K_INSTRUCTION_HOOK != OPT_ON) || (M68K_EMULATE_FC != OPT_ON)
+	// Without these the core can't say where each instruction starts, or
+	// tell instruction fetches from data reads
+	(void)filename; (void)size; (void)flags; (void)stop_pc;
+	errno = ENOTSUP;
+	return false;
+#else
+	uint32_t nchunks = (size > TRACE_HEADER_SIZE) ? (size - TRACE_HEADER_SIZE) / TRACE_CHUNK_SIZE : 0;
+	if (nchunks < 2)
+		nchunks = 2;
+	size = TRACE_HEADER_SIZE + ((size_t)nchunks * TRACE_CHUNK_SIZE);
+
+	TRACE *t = calloc(1, sizeof(TRACE));
+	if (t == NULL)
+		return false;
+
+	// A new file is all zeroes, so every chunk starts out unused
+	int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		free(t);
+		return false;
+	}
+	if (ftruncate(fd, size) != 0) {
+		int err = errno;
+		close(fd);
+		free(t);
+		errno = err;
+		return false;
+	}
+	t->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	int err = errno;
+	close(fd);
+	if (t->map == MAP_FAILED) {
+		free(t);
+		errno = err;
+		return false;
+	}
+	t->size = size;
+
+	t->hdr = (TRACE_HEADER *)t->map;
+	memcpy(t->hdr->magic, TRACE_MAGIC, sizeof(t->hdr->magic));
+	t->hdr->version = TRACE_VERSION;
+	t->hdr->flags = flags & TRACE_F_MEM;
+	t->hdr->chunk_size = TRACE_CHUNK_SIZE;
+	t->hdr->nchunks = nchunks;
+	if (stop_pc >= 0) {
+		t->hdr->flags |= TRACE_F_STOP_PC;
+		t->hdr->stop_pc = stop_pc;
+	}
+	t->mem = (flags & TRACE_F_MEM) != 0;
+	next_chunk(t);
+
+	LOG("tracing to '%s', %u chunks, flags %02X", filename, nchunks, t->hdr->flags);
+	state->trace = t;
+	if (!insn_hook_add(trace_insn)) {
+		state->trace = NULL;
+		munmap(t->map, t->size);
+		free(t);
+		errno = EBUSY;
+		return false;
+	}
+	return true;
+#endif
+}
+
+void trace_done(void)
+{
+	TRACE *t = state->trace;
+	if (t == NULL)
+		return;
+
+	insn_hook_remove(trace_insn);
+	state->trace = NULL;
+	LOG("trace finished at chunk %llu", (unsigned long long)t->seq);
+	munmap(t->map, t->size);
+	free(t);
+}
+
+/********************************************************
+ * Decoding
+ ********************************************************/
+
+/// What each MEM_STATUS means
+static const char *status_names[] = {
+	"allowed",
+	"page fault",
+	"page not write enabled",
+	"kernel access",
+	"user non-memory access"
+};
+
+/// A chunk, for sorting
+typedef struct {
+	uint64_t	seq;
+	uint32_t	index;
+} CHUNK_REF;
+
+static int cmp_chunk(const void *a, const void *b)
+{
+	const CHUNK_REF *x = a, *y = b;
+	return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+static void print_insn(FILE *out, uint32_t pc, const uint16_t *words)
+{
+	char insn[128];
+
+	memory_disasm_from(pc, words, TRACE_CODE_WORDS);
+	unsigned int len = m68k_disassemble(insn, pc, M68K_CPU_TYPE_68010) / 2;
+	memory_disasm_from(0, NULL, 0);
+
+	fprintf(out, "%08X  ", pc);
+	for (unsigned int i = 0; i < TRACE_CODE_WORDS; i++) {
+		if (i < len)
+			fprintf(out, "%04X ", words[i]);
+		else
+			fprintf(out, "     ");
+	}
+	fprintf(out, " %s\n", insn);
+}
+
+/**
+ * @brief	Decode the records in one chunk.
+ * @return	false if the records don't make sense.
+ */
+static bool decode_chunk(FILE *out, const uint8_t *p, const uint8_t *end)
+{
+	static TRACE_SLOT code[TRACE_CODE_SLOTS];
+	uint32_t pc = 0, addr = 0;
+
+	memset(code, 0, sizeof(code));
+#define NEED(n) do { if ((end - p) < (n)) return false; } while (0)
+	while (p < end) {
+		uint8_t tag = *p++;
+		switch (tag & 3) {
+			case TRACE_R_INSN:
+			case TRACE_R_CODE: {
+				int delta = tag >> 2;
+				if (delta & 0x20)
+					delta -= 0x40;
+				if (delta == TRACE_PC_ABS) {
+					NEED(4);
+					pc = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+					p += 4;
+				} else {
+					pc += delta * 2;
+				}
+
+				TRACE_SLOT *slot = &code[(pc >> 1) & (TRACE_CODE_SLOTS - 1)];
+				if ((tag & 3) == TRACE_R_CODE) {
+					NEED(TRACE_CODE_WORDS * 2);
+					for (int i = 0; i < TRACE_CODE_WORDS; i++, p += 2)
+						slot->words[i] = (p[0] << 8) | p[1];
+					slot->pc = pc;
+					slot->seq = 1;
+				} else if ((slot->seq == 0) || (slot->pc != pc)) {
+					return false;
+				}
+				print_insn(out, pc, slot->words);
+				break;
+			}
+
+			case TRACE_R_MEM: {
+				uint32_t z = 0;
+				for (int shift = 0; ; shift += 7) {
+					NEED(1);
+					z |= (uint32_t)(*p & 0x7F) << shift;
+					if ((*p++ & 0x80) == 0)
+						break;
+					if (shift >= 28)
+						return false;
+				}
+				addr += (z >> 1) ^ -(z & 1);
+
+				int bytes = 1 << ((tag & TRACE_M_SIZE) >> 3);
+				NEED(bytes + ((tag & TRACE_M_FAULT) ? 1 : 0));
+				uint32_t value = 0;
+				for (int i = 0; i < bytes; i++)
+					value = (value << 8) | *p++;
+
+				fprintf(out, "          %s%-2d %08X = %0*X", (tag & TRACE_M_WRITE) ? "W" : "R", bytes * 8, addr, bytes * 2, value);
+				if (tag & TRACE_M_FAULT) {
+					uint8_t st = *p++;
+					fprintf(out, "  FAULT: %s", (st < NELEMS(status_names)) ? status_names[st] : "unknown");
+				}
+				fprintf(out, "\n");
+				break;
+			}
+
+			default:
+				return false;
+		}
+	}
+#undef NEED
+	return true;
+}
+
+bool trace_decode(const char *filename, FILE *out)
+{
+	TRACE_HEADER hdr;
+	FILE *fp = fopen(filename, "rb");
+	if (fp == NULL)
+		return false;
+
+	if ((fread(&hdr, sizeof(hdr), 1, fp) != 1) || (memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0) ||
+			(hdr.version != TRACE_VERSION) || (hdr.chunk_size <= sizeof(TRACE_CHUNK)) || (hdr.nchunks == 0)) {
+		fprintf(stderr, "ERROR: '%s' isn't a trace file.\n", filename);
+		fclose(fp);
+		return false;
+	}
+
+	// Find the chunks in use, oldest first
+	CHUNK_REF *refs = malloc(hdr.nchunks * sizeof(CHUNK_REF));
+	uint8_t *buf = malloc(hdr.chunk_size);
+	if ((refs == NULL) || (buf == NULL)) {
+		free(refs);
+		free(buf);
+		fclose(fp);
+		return false;
+	}
+	uint32_t nrefs = 0;
+	for (uint32_t i = 0; i < hdr.nchunks; i++) {
+		TRACE_CHUNK c;
+		if ((fseek(fp, TRACE_HEADER_SIZE + ((long)i * hdr.chunk_size), SEEK_SET) != 0) || (fread(&c, sizeof(c), 1, fp) != 1))
+			break;
+		if (c.seq != 0) {
+			refs[nrefs].seq = c.seq;
+			refs[nrefs].index = i;
+			nrefs++;
+		}
+	}
+	qsort(refs, nrefs, sizeof(CHUNK_REF), cmp_chunk);
+
+	bool ok = true;
+	for (uint32_t i = 0; i < nrefs; i++) {
+		if ((fseek(fp, TRACE_HEADER_SIZE + ((long)refs[i].index * hdr.chunk_size), SEEK_SET) != 0) ||
+				(fread(buf, hdr.chunk_size, 1, fp) != 1)) {
+			ok = false;
+			break;
+		}
+		const TRACE_CHUNK *c = (const TRACE_CHUNK *)buf;
+		uint32_t used = c->used;
+		if (used > hdr.chunk_size - sizeof(TRACE_CHUNK))
+			used = hdr.chunk_size - sizeof(TRACE_CHUNK);
+		fprintf(out, "# chunk %llu, cycle %llu\n", (unsigned long long)c->seq, (unsigned long long)c->cycles);
+		if (!decode_chunk(out, buf + sizeof(TRACE_CHUNK), buf + sizeof(TRACE_CHUNK) + used))
+			fprintf(out, "# chunk %llu is damaged, skipping the rest of it\n", (unsigned long long)c->seq);
+	}
+	if (hdr.flags & TRACE_F_STOPPED)
+		fprintf(out, "# stopped at PC %08X\n", hdr.stop_pc);
+
+	LOG("decoded %u chunks", nrefs);
+	free(refs);
+	free(buf);
+	fclose(fp);
+	return ok;
+}
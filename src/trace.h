@@ -0,0 +1,148 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "memory.h"
+
+/**
+ * Binary instruction and memory access trace.
+ *
+ * Records every instruction a machine executes (and optionally every data
+ * access it makes) into a ring in a memory-mapped file, so the last few
+ * seconds before something goes wrong can be decoded afterwards. The file is
+ * always consistent up to the last record written, even if the emulator
+ * crashes.
+ *
+ * File layout: a TRACE_HEADER, padded to TRACE_HEADER_SIZE bytes, then
+ * nchunks chunks of chunk_size bytes. All numbers in the headers are in host
+ * byte order. Chunks are filled in turn and reused once the ring has gone
+ * round; each starts with a TRACE_CHUNK and can be decoded on its own, so the
+ * decoder sorts them by sequence number and skips the unused ones.
+ *
+ * Records in a chunk start with a tag byte. The low two bits are the kind:
+ *
+ *   TRACE_R_INSN	Instruction. The upper six bits are the PC minus the
+ *   TRACE_R_CODE	previous instruction's PC, in words, as a signed number;
+ * 					TRACE_PC_ABS there means a 4-byte big-endian PC follows
+ * 					instead. A CODE record is followed by the first
+ * 					TRACE_CODE_WORDS words of the instruction (big-endian),
+ * 					which is enough to disassemble any 68010 instruction.
+ * 					An INSN record means the words are the same as the last
+ * 					CODE record for the same slot in the code dictionary:
+ * 					TRACE_CODE_SLOTS slots, indexed by (PC / 2), emptied at
+ * 					the start of each chunk.
+ *   TRACE_R_MEM	Data access. Bit 2 is set for a write, bits 3-4 are the
+ * 					size (0 to 2 for 8, 16 or 32 bits) and bit 5 is set if
+ * 					the access faulted. Then come the address minus the
+ * 					previous access's address as a zigzag-encoded LEB128
+ * 					number, the value (big-endian, the size of the access),
+ * 					and a MEM_STATUS byte if it faulted.
+ *
+ * Deltas in a chunk are from 0 for the first record.
+ */
+
+#define TRACE_MAGIC			"FBTRACE"
+#define TRACE_VERSION		1
+/// Bytes before the first chunk
+#define TRACE_HEADER_SIZE	4096
+/// Bytes in each chunk, header included
+#define TRACE_CHUNK_SIZE	65536
+/// Instruction words stored in a CODE record
+#define TRACE_CODE_WORDS	5
+/// Code dictionary size (a power of two)
+#define TRACE_CODE_SLOTS	4096
+/// PC delta which means an absolute PC follows
+#define TRACE_PC_ABS		(-32)
+
+/// Record kinds
+enum {
+	TRACE_R_INSN	= 0,
+	TRACE_R_CODE	= 1,
+	TRACE_R_MEM		= 2
+};
+
+/// TRACE_R_MEM flags
+enum {
+	TRACE_M_WRITE	= 0x04,
+	TRACE_M_SIZE	= 0x18,			///< Size field: log2(bytes) << 3
+	TRACE_M_FAULT	= 0x20
+};
+
+/// Trace flags
+enum {
+	TRACE_F_MEM		= 0x01,			///< Record data accesses as well as instructions
+	TRACE_F_STOP_PC	= 0x02,			///< Stop on reaching stop_pc
+	TRACE_F_STOPPED	= 0x04			///< Stopped on reaching stop_pc
+};
+
+/// File header
+typedef struct {
+	char		magic[8];			///< TRACE_MAGIC
+	uint32_t	version;			///< TRACE_VERSION
+	uint32_t	flags;				///< TRACE_F_xxx
+	uint32_t	chunk_size;
+	uint32_t	nchunks;
+	uint32_t	stop_pc;			///< PC to stop at, if TRACE_F_STOP_PC is set
+	uint32_t	reserved;
+} TRACE_HEADER;
+
+/// Chunk header
+typedef struct {
+	uint64_t	seq;				///< Chunk number, counting from 1; 0 if unused
+	uint64_t	cycles;				///< Emulated time when the chunk was started (sched_now())
+	uint32_t	used;				///< Bytes of records after the header
+	uint32_t	reserved;
+} TRACE_CHUNK;
+
+/**
+ * @brief	Start tracing the current machine.
+ * @param	filename	Trace file. Replaced if it exists.
+ * @param	size		File size in bytes; rounded down to a whole number of
+ * 						chunks, with a minimum of two.
+ * @param	flags		TRACE_F_MEM to record data accesses too.
+ * @param	stop_pc		Stop tracing once the CPU gets here (e.g. the guest's
+ * 						panic routine), so what led up to it isn't
+ * 						overwritten; or -1 to carry on to the end.
+ * @return	true on success. Fails with errno set to ENOTSUP if the CPU core
+ * 			was built without M68K_INSTRUCTION_HOOK or M68K_EMULATE_FC
+ * 			(see musashi_conf.h), or EBUSY if the machine's instruction
+ * 			hook has no room for another function.
+ *
+ * Adds a function to the machine's instruction hook (see insnhook.h).
+ */
+bool trace_start(const char *filename, size_t size, uint32_t flags, int64_t stop_pc);
+
+/**
+ * @brief	Stop tracing the current machine and close the trace file.
+ *
+ * Does nothing if the machine isn't being traced.
+ */
+void trace_done(void);
+
+/**
+ * @brief	Record a data access. Called by the memory handlers.
+ * @param	address		CPU address.
+ * @param	bits		Size of the access (8, 16 or 32).
+ * @param	writing		true for a write.
+ * @param	value		Value read or written.
+ * @param	st			MEM_ALLOWED, or the reason the access faulted.
+ *
+ * Instruction fetches are left out; the instruction records already have
+ * the words.
+ */
+void trace_mem(uint32_t address, int bits, bool writing, uint32_t value, MEM_STATUS st);
+
+/**
+ * @brief	Decode a trace file.
+ * @param	filename	Trace file.
+ * @param	out			Where to write the listing.
+ * @return	true on success, false if the file couldn't be read or isn't a
+ * 			trace.
+ *
+ * Lists the instructions (disassembled) and data accesses, oldest first.
+ */
+bool trace_decode(const char *filename, FILE *out);
+
+#endif
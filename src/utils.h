@@ -2,14 +2,28 @@
 #define _UTILS_H
 
 #include <stdio.h>
+#include "log.h"
+
+/// Hand a message to the logger. The dead fprintf() is there so the
+/// compiler still checks the arguments against the format.
+#define LOG_EMIT(flags, x, ...) do {												\
+	static LOG_SITE log_site_ = { __FILE__, __LINE__, __func__, x, (flags) };		\
+	if (0) fprintf(stderr, x, ##__VA_ARGS__);										\
+	log_write(&log_site_, ##__VA_ARGS__);											\
+} while (0)
+/// The same, for a message with no arguments
+#define LOG_EMITS(flags, x) do {													\
+	static LOG_SITE log_site_ = { __FILE__, __LINE__, __func__, x, (flags) };		\
+	log_write(&log_site_);															\
+} while (0)
 
 #ifndef NDEBUG
 /// Log a message to stderr
-#  define LOG(x, ...) do { fprintf(stderr, "%s:%d:%s(): " x "\n", __FILE__, __LINE__, __func__, ##__VA_ARGS__); } while (0)
-#  define LOGS(x) do { fprintf(stderr, "%s:%d:%s(): " x "\n", __FILE__, __LINE__, __func__); } while (0)
+#  define LOG(x, ...) LOG_EMIT(LOG_F_WHERE, x, ##__VA_ARGS__)
+#  define LOGS(x) LOG_EMITS(LOG_F_WHERE, x)
 /// Log a message to stderr if 'cond' is true
-#  define LOG_IF(cond, x, ...) do { if (cond) fprintf(stderr, "%s:%d:%s(): " x "\n", __FILE__, __LINE__, __func__, ##__VA_ARGS__); } while (0)
-#  define LOG_IFS(cond, x) do { if (cond) fprintf(stderr, "%s:%d:%s(): " x "\n", __FILE__, __LINE__, __func__); } while (0)
+#  define LOG_IF(cond, x, ...) do { if (cond) LOG_EMIT(LOG_F_WHERE, x, ##__VA_ARGS__); } while (0)
+#  define LOG_IFS(cond, x) do { if (cond) LOG_EMITS(LOG_F_WHERE, x); } while (0)
 #else
 #define LOG(x, ...)
 #define LOGS(x)
@@ -17,6 +31,11 @@
 #define LOG_IFS(cond, x)
 #endif
 
+/// Log a notice to stderr, even in release builds. Rate-limited like the
+/// rest, so it's safe to use on paths the guest can hit over and over.
+#define LOG_NOTE(x, ...) LOG_EMIT(0, x, ##__VA_ARGS__)
+#define LOG_NOTES(x) LOG_EMITS(0, x)
+
 /// Get the number of elements in an array
 #define NELEMS(x) (sizeof(x)/sizeof(x[0]))
 
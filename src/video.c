@@ -0,0 +1,273 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "SDL.h"
+#include "state.h"
+#include "video.h"
+
+#ifndef VIDEO_DEBUG
+#define NDEBUG
+#endif
+#include "utils.h"
+
+/// Foreground colours for each palette, as R, G, B
+static const uint8_t palette_fg[VIDEO_PAL_COUNT][3] = {
+	{ 0x00, 0xFF, 0x00 },	// green
+	{ 0xFF, 0xC1, 0x06 },	// amber
+	{ 0xFF, 0xFF, 0xFF }	// white
+};
+
+/// Size of the displayed part of Video RAM
+#define FRAME_BYTES (VRAM_HEIGHT * VRAM_LINE_BYTES)
+#define FRAME_DIRTY_WORDS NELEMS(state->vram_dirty)
+
+/// A published video frame
+typedef struct {
+	uint8_t		vram[FRAME_BYTES];			///< Video RAM contents
+	uint32_t	dirty[FRAME_DIRTY_WORDS];	///< Lines changed since the last frame drawn
+} FRAME;
+
+/*
+ * Triple buffer between the emulation thread (producer) and the display
+ * thread (consumer). Each side owns one buffer; the third is exchanged
+ * through 'fb_ready', whose FB_FRESH bit is set if it holds a frame which
+ * hasn't been picked up yet.
+ */
+#define FB_FRESH 0x4
+static FRAME frames[3];
+static unsigned int fb_back = 0;			///< Owned by the emulation thread
+static unsigned int fb_front = 1;			///< Owned by the display thread
+static unsigned int fb_ready = 2;			///< Shared
+
+/// Lines changed since the last frame the display thread picked up (emulation thread)
+static uint32_t fb_pending[FRAME_DIRTY_WORDS];
+/// Redraw every line on the next refresh (display thread)
+static bool fb_redraw_all = true;
+
+/// Surface format the expansion tables were built for
+static SDL_PixelFormat *fmt = NULL;
+static VIDEO_PALETTE cur_palette = VIDEO_PAL_GREEN;
+
+/*
+ * Expansion tables: one entry per VRAM byte value, giving the eight host
+ * pixels it expands to (LSB leftmost). Only the table matching the surface
+ * depth is filled in.
+ */
+static uint8_t  lut8[256][8];
+static uint16_t lut16[256][8];
+static uint8_t  lut24[256][8*3];
+static uint32_t lut32[256][8];
+
+static void build_tables(void)
+{
+	Uint32 fg = SDL_MapRGB(fmt, palette_fg[cur_palette][0], palette_fg[cur_palette][1], palette_fg[cur_palette][2]);
+	Uint32 bg = SDL_MapRGB(fmt, 0x00, 0x00, 0x00);	// black background
+
+	for (int b = 0; b < 256; b++) {
+		for (int px = 0; px < 8; px++) {
+			Uint32 pixel = (b & (1 << px)) ? fg : bg;
+			switch (fmt->BytesPerPixel) {
+				case 1:
+					lut8[b][px] = pixel;
+					break;
+				case 2:
+					lut16[b][px] = pixel;
+					break;
+				case 3:
+					// 24bpp pixels are stored in host byte order
+					if (SDL_BYTEORDER == SDL_BIG_ENDIAN) {
+						lut24[b][px*3 + 0] = (pixel >> 16) & 0xff;
+						lut24[b][px*3 + 1] = (pixel >> 8) & 0xff;
+						lut24[b][px*3 + 2] = pixel & 0xff;
+					} else {
+						lut24[b][px*3 + 0] = pixel & 0xff;
+						lut24[b][px*3 + 1] = (pixel >> 8) & 0xff;
+						lut24[b][px*3 + 2] = (pixel >> 16) & 0xff;
+					}
+					break;
+				case 4:
+					lut32[b][px] = pixel;
+					break;
+			}
+		}
+	}
+	LOG("built %d bpp tables for palette %d", fmt->BitsPerPixel, cur_palette);
+}
+
+void video_init(SDL_Surface *s, VIDEO_PALETTE pal)
+{
+	fmt = s->format;
+	video_set_palette(pal);
+}
+
+void video_set_palette(VIDEO_PALETTE pal)
+{
+	if ((unsigned)pal >= VIDEO_PAL_COUNT)
+		pal = VIDEO_PAL_GREEN;
+	cur_palette = pal;
+	if (fmt != NULL)
+		build_tables();
+	fb_redraw_all = true;
+}
+
+VIDEO_PALETTE video_get_palette(void)
+{
+	return cur_palette;
+}
+
+const uint8_t *video_palette_rgb(VIDEO_PALETTE pal)
+{
+	if ((unsigned)pal >= VIDEO_PAL_COUNT)
+		pal = VIDEO_PAL_GREEN;
+	return palette_fg[pal];
+}
+
+void video_blit_line(SDL_Surface *s, int y, const uint8_t *src, int width)
+{
+	uint8_t *dst = (uint8_t *)s->pixels + (y * s->pitch);
+
+	// Each 16-bit word is big-endian, so the low byte (the leftmost eight
+	// pixels) comes second in memory.
+#define BLIT_LOOP(lut)														\
+	for (int x = 0; x < width; x += 16, src += 2) {							\
+		memcpy(dst, lut[src[1]], sizeof(lut[0]));		dst += sizeof(lut[0]);	\
+		memcpy(dst, lut[src[0]], sizeof(lut[0]));		dst += sizeof(lut[0]);	\
+	}
+
+	switch (s->format->BytesPerPixel) {
+		case 1:	BLIT_LOOP(lut8);	break;
+		case 2:	BLIT_LOOP(lut16);	break;
+		case 3:	BLIT_LOOP(lut24);	break;
+		case 4:	BLIT_LOOP(lut32);	break;
+		default:
+			break;           /* shouldn't happen, but avoids warnings */
+	}
+#undef BLIT_LOOP
+}
+
+void video_publish_frame(void)
+{
+	bool changed = false;
+	uint32_t fresh[FRAME_DIRTY_WORDS];
+
+	for (size_t i = 0; i < FRAME_DIRTY_WORDS; i++) {
+		fresh[i] = state->vram_dirty[i];
+		changed |= (fresh[i] != 0);
+		state->vram_dirty[i] = 0;
+	}
+	if (!changed)
+		return;
+
+	// A frame may be dropped before the display picks it up, so carry the
+	// dirty lines forward until one is known to have been taken.
+	FRAME *f = &frames[fb_back];
+	for (size_t i = 0; i < FRAME_DIRTY_WORDS; i++)
+		f->dirty[i] = (fb_pending[i] |= fresh[i]);
+	memcpy(f->vram, state->vram, FRAME_BYTES);
+
+	unsigned int old = __atomic_exchange_n(&fb_ready, fb_back | FB_FRESH, __ATOMIC_ACQ_REL);
+	fb_back = old & ~FB_FRESH;
+
+	// If the display took the previous frame, only lines changed since then
+	// need to go out with the next one
+	if (!(old & FB_FRESH))
+		memcpy(fb_pending, fresh, sizeof(fb_pending));
+}
+
+void video_invalidate(void)
+{
+	fb_redraw_all = true;
+}
+
+void video_refresh(SDL_Surface *s)
+{
+	FRAME *f;
+	bool have_frame = (__atomic_load_n(&fb_ready, __ATOMIC_ACQUIRE) & FB_FRESH) != 0;
+
+	if (have_frame) {
+		// Swap the newest frame in, and give the old one back
+		unsigned int r = __atomic_exchange_n(&fb_ready, fb_front, __ATOMIC_ACQ_REL);
+		fb_front = r & ~FB_FRESH;
+	} else if (!fb_redraw_all) {
+		// Nothing new to draw
+		return;
+	}
+	f = &frames[fb_front];
+
+	// Lock the screen surface (if necessary)
+	if (SDL_MUSTLOCK(s)) {
+		if (SDL_LockSurface(s) < 0) {
+			fprintf(stderr, "ERROR: Unable to lock screen!\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// Refresh the dirty scanlines of the 3B1 screen area, merging runs of
+	// adjacent lines into a single update rectangle
+	SDL_Rect rects[(VRAM_HEIGHT + 1) / 2];
+	int nrects = 0;
+	for (int y=0; y<VRAM_HEIGHT; y++) {
+		bool dirty = have_frame && (f->dirty[y / 32] & ((uint32_t)1 << (y % 32)));
+		if (!dirty && !fb_redraw_all) continue;
+
+		// 720 pixels, monochrome, packed into 16bit words
+		video_blit_line(s, y, &f->vram[y * VRAM_LINE_BYTES], VRAM_WIDTH);
+
+		if ((nrects > 0) && (rects[nrects-1].y + rects[nrects-1].h == y)) {
+			rects[nrects-1].h++;
+		} else {
+			rects[nrects].x = 0;
+			rects[nrects].y = y;
+			rects[nrects].w = VRAM_WIDTH;
+			rects[nrects].h = 1;
+			nrects++;
+		}
+	}
+	fb_redraw_all = false;
+
+	// TODO: blit LEDs and status info
+
+	// Unlock the screen surface
+	if (SDL_MUSTLOCK(s)) {
+		SDL_UnlockSurface(s);
+	}
+
+	// Push the changed lines out to the display
+	SDL_UpdateRects(s, nrects, rects);
+}
+
+/// Reverse the bit order of a byte
+static uint8_t bitrev8(uint8_t b)
+{
+	b = ((b & 0xF0) >> 4) | ((b & 0x0F) << 4);
+	b = ((b & 0xCC) >> 2) | ((b & 0x33) << 2);
+	b = ((b & 0xAA) >> 1) | ((b & 0x55) << 1);
+	return b;
+}
+
+bool video_dump_pbm(const char *filename)
+{
+	uint8_t row[VRAM_LINE_BYTES];
+	FILE *fp = fopen(filename, "wb");
+
+	if (fp == NULL)
+		return false;
+
+	// PBM is MSB-first, 1=black; VRAM words are big-endian, LSB leftmost
+	fprintf(fp, "P4\n%d %d\n", VRAM_WIDTH, VRAM_HEIGHT);
+	for (int y = 0; y < VRAM_HEIGHT; y++) {
+		const uint8_t *src = &state->vram[y * VRAM_LINE_BYTES];
+		for (int x = 0; x < VRAM_LINE_BYTES; x += 2) {
+			row[x]   = bitrev8(src[x+1]);
+			row[x+1] = bitrev8(src[x]);
+		}
+		fwrite(row, 1, sizeof(row), fp);
+	}
+
+	bool ok = !ferror(fp);
+	if (fclose(fp) != 0)
+		ok = false;
+	return ok;
+}
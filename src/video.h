@@ -0,0 +1,94 @@
+#ifndef _VIDEO_H
+#define _VIDEO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "SDL.h"
+
+/**
+ * Display colour schemes (foreground on black)
+ */
+typedef enum {
+	VIDEO_PAL_GREEN = 0,	///< Green phosphor
+	VIDEO_PAL_AMBER,		///< Amber phosphor
+	VIDEO_PAL_WHITE,		///< White phosphor
+	VIDEO_PAL_COUNT			///< Number of palettes (not a palette)
+} VIDEO_PALETTE;
+
+/**
+ * @brief	Set up the pixel expansion tables for a display surface.
+ * @param	s		SDL surface which will be drawn on.
+ * @param	pal		Colour scheme to use.
+ *
+ * Must be called again if the surface's pixel format changes.
+ */
+void video_init(SDL_Surface *s, VIDEO_PALETTE pal);
+
+/**
+ * @brief	Change the display colour scheme.
+ * @param	pal		New colour scheme.
+ *
+ * Rebuilds the expansion tables. The caller is responsible for forcing a
+ * redraw of the screen.
+ */
+void video_set_palette(VIDEO_PALETTE pal);
+
+/**
+ * @brief	Get the current display colour scheme.
+ */
+VIDEO_PALETTE video_get_palette(void);
+
+/**
+ * @brief	Get the foreground colour of a colour scheme.
+ * @param	pal		Colour scheme.
+ * @return	Red, green and blue, 0 to 255. The background is always black.
+ */
+const uint8_t *video_palette_rgb(VIDEO_PALETTE pal);
+
+/**
+ * @brief	Draw one scanline of Video RAM onto the display surface.
+ * @note	The surface must be locked before calling this!
+ * @param	s		SDL surface upon which to draw.
+ * @param	y		Scanline number.
+ * @param	src		Video RAM data for the scanline, 16-bit big-endian words,
+ * 					LSB of each word is leftmost.
+ * @param	width	Width of the scanline in pixels (a multiple of 16).
+ */
+void video_blit_line(SDL_Surface *s, int y, const uint8_t *src, int width);
+
+/**
+ * @brief	Publish the current contents of Video RAM as a completed frame.
+ *
+ * Called by the emulation thread at the end of each video frame. Consumes
+ * the Video RAM dirty bitmap. Does nothing if no scanlines have changed.
+ */
+void video_publish_frame(void);
+
+/**
+ * @brief	Draw the most recently published frame.
+ * @param	s		SDL surface upon which to draw.
+ *
+ * Called by the display thread. Frames published since the last call
+ * which were not drawn are skipped; only scanlines which changed since the
+ * last frame drawn are redrawn and pushed to the display.
+ */
+void video_refresh(SDL_Surface *s);
+
+/**
+ * @brief	Force a full redraw on the next video_refresh().
+ *
+ * Called by the display thread, e.g. if the window contents were lost.
+ */
+void video_invalidate(void);
+
+/**
+ * @brief	Write the current contents of Video RAM to a PBM file.
+ * @param	filename	Output file name.
+ * @return	true on success, false on error.
+ *
+ * Lit pixels are written as black on a white background. Reads Video RAM
+ * directly, so must be called from the emulation thread.
+ */
+bool video_dump_pbm(const char *filename);
+
+#endif
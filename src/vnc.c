@@ -0,0 +1,1018 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <zlib.h>
+#include "SDL.h"
+#include "state.h"
+#include "memory.h"
+#include "video.h"
+#include "input.h"
+#include "keyboard.h"
+#include "vnc.h"
+
+#ifndef VNC_DEBUG
+#define NDEBUG
+#endif
+#include "utils.h"
+
+/// Size of the displayed part of Video RAM
+#define FRAME_BYTES		(VRAM_HEIGHT * VRAM_LINE_BYTES)
+#define DIRTY_WORDS		NELEMS(state->vram_dirty)
+/// Pixels per Video RAM word. Rectangles are always whole words wide.
+#define WORD_PIXELS		16
+/// Width and height of a ZRLE tile
+#define ZRLE_TILE		64
+/// Longest client message which is handled in one piece
+#define IN_BUF_SIZE		4096
+/// How long the client gets to finish the handshake, or to take an update
+#define CLIENT_TIMEOUT_SECS	10
+
+/// RFB encoding numbers
+enum {
+	ENC_RAW		= 0,
+	ENC_ZRLE	= 16
+};
+
+/// RFB client message types
+enum {
+	MSG_SET_PIXEL_FORMAT	= 0,
+	MSG_SET_ENCODINGS		= 2,
+	MSG_UPDATE_REQUEST		= 3,
+	MSG_KEY_EVENT			= 4,
+	MSG_POINTER_EVENT		= 5,
+	MSG_CUT_TEXT			= 6
+};
+
+/// RFB server message types
+enum {
+	MSG_FRAMEBUFFER_UPDATE	= 0,
+	MSG_SET_COLOUR_MAP		= 1
+};
+
+/// Pixel format, as sent in ServerInit and SetPixelFormat
+typedef struct {
+	uint8_t		bpp;			///< Bits per pixel: 8, 16 or 32
+	uint8_t		depth;
+	bool		big_endian;
+	bool		true_colour;	///< false if pixels are colour map indices
+	uint16_t	max[3];			///< Red, green and blue maxima
+	uint8_t		shift[3];		///< Red, green and blue shifts
+} PIXEL_FORMAT;
+
+/// Growable output buffer
+typedef struct {
+	uint8_t		*data;
+	size_t		len;
+	size_t		size;
+} BUF;
+
+typedef struct {
+	int			x, y, w, h;
+} RECT;
+
+/// A connected client. Only touched by the server thread.
+typedef struct {
+	int				fd;
+	PIXEL_FORMAT	pf;
+	uint8_t			fg[3];				///< Foreground colour the pixels were made for
+	uint8_t			pix[2][4];			///< Background and foreground pixels, in the client's format
+	int				pix_bytes;
+	int				cpix_off;			///< ZRLE CPIXEL: offset and length in pix[]
+	int				cpix_bytes;
+	bool			zrle;				///< Client takes ZRLE
+	bool			zs_ready;			///< zs has been set up
+	z_stream		zs;					///< ZRLE uses one zlib stream for the whole connection
+
+	bool			want_update;		///< An update request is outstanding
+	bool			incremental;		///< ...and only changes are wanted
+	RECT			req;				///< ...for this region
+
+	bool			have_frame;			///< cur holds the whole screen
+	bool			shadow_valid;		///< shadow holds the whole screen
+	uint8_t			cur[FRAME_BYTES];	///< Latest frame from the emulation thread
+	uint8_t			shadow[FRAME_BYTES];	///< What the client was last sent
+	uint32_t		pending[DIRTY_WORDS];	///< Lines where cur may differ from shadow
+
+	uint8_t			in[IN_BUF_SIZE];	///< Client messages not handled yet
+	size_t			in_len;
+	uint32_t		skip;				///< Bytes of cut text still to throw away
+
+	bool			ptr_valid;			///< ptr_x and ptr_y have been set
+	int				ptr_x, ptr_y;		///< Last pointer position
+	int				buttons;			///< Last MOUSE_BUTTON_* state
+	SDLMod			mod;				///< Modifier keys held down
+
+	BUF				out;				///< Message being built
+	BUF				tiles;				///< ZRLE data before compression
+	BUF				zout;				///< ZRLE data after compression
+} CLIENT;
+
+/*
+ * Shared between the emulation thread and the server thread. The frame and
+ * palette are protected by the lock; the flags are accessed atomically.
+ */
+static struct {
+	SDL_Thread	*thread;
+	SDL_mutex	*lock;
+	int			listen_fd;
+	int			wake[2];				///< Pipe which wakes the server thread up
+	bool		connected;				///< A client is connected (atomic)
+	bool		resync;					///< Send the whole screen with the next frame (atomic)
+	bool		stopping;				///< Server is shutting down (atomic)
+	bool		complete;				///< fb holds the whole screen
+	uint8_t		fb[FRAME_BYTES];		///< Latest Video RAM contents
+	uint32_t	dirty[DIRTY_WORDS];		///< Lines changed since the server last took fb
+	uint8_t		fg[3];					///< Foreground colour
+} srv = { .listen_fd = -1, .wake = { -1, -1 } };
+
+/********************************************************
+ * Output buffers
+ ********************************************************/
+
+/// Make room for another n bytes
+static bool buf_reserve(BUF *b, size_t n)
+{
+	if (b->len + n <= b->size)
+		return true;
+	size_t size = b->size ? b->size : 4096;
+	while (size < b->len + n)
+		size *= 2;
+	uint8_t *p = realloc(b->data, size);
+	if (p == NULL)
+		return false;
+	b->data = p;
+	b->size = size;
+	return true;
+}
+
+/// Append bytes; the caller must have reserved room for them
+static inline void buf_put(BUF *b, const void *p, size_t n)
+{
+	memcpy(b->data + b->len, p, n);
+	b->len += n;
+}
+
+static inline void buf_put8(BUF *b, uint8_t v)
+{
+	b->data[b->len++] = v;
+}
+
+static inline void buf_put16(BUF *b, uint16_t v)
+{
+	ST_BE16(b->data + b->len, v);
+	b->len += 2;
+}
+
+static inline void buf_put32(BUF *b, uint32_t v)
+{
+	ST_BE32(b->data + b->len, v);
+	b->len += 4;
+}
+
+static void buf_free(BUF *b)
+{
+	free(b->data);
+	memset(b, 0, sizeof(*b));
+}
+
+/// Send the whole of a buffer, waiting if the socket is full
+static bool send_all(int fd, const void *p, size_t n)
+{
+	const uint8_t *q = p;
+
+	while (n > 0) {
+		ssize_t r = send(fd, q, n, MSG_NOSIGNAL);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		q += r;
+		n -= r;
+	}
+	return true;
+}
+
+/// Receive exactly n bytes (handshake only)
+static bool recv_all(int fd, void *p, size_t n)
+{
+	uint8_t *q = p;
+
+	while (n > 0) {
+		ssize_t r = recv(fd, q, n, 0);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return false;
+		q += r;
+		n -= r;
+	}
+	return true;
+}
+
+/********************************************************
+ * Pixels
+ ********************************************************/
+
+/// Get pixel x of a Video RAM line: 16-bit big-endian words, LSB leftmost
+static inline int vram_pixel(const uint8_t *line, int x)
+{
+	return (line[((x / WORD_PIXELS) * 2) + 1 - ((x / 8) & 1)] >> (x % 8)) & 1;
+}
+
+/// Work out what the background and foreground look like to the client
+static void make_pixels(CLIENT *c)
+{
+	static const uint8_t black[3] = { 0, 0, 0 };
+	const PIXEL_FORMAT *pf = &c->pf;
+	int n = pf->bpp / 8;
+
+	for (int i = 0; i < 2; i++) {
+		const uint8_t *rgb = i ? c->fg : black;
+		uint32_t v = i;
+		if (pf->true_colour) {
+			v = 0;
+			for (int k = 0; k < 3; k++)
+				v |= (uint32_t)((rgb[k] * pf->max[k] + 127) / 255) << pf->shift[k];
+		}
+		for (int b = 0; b < n; b++)
+			c->pix[i][b] = v >> (8 * (pf->big_endian ? (n - 1 - b) : b));
+	}
+	c->pix_bytes = n;
+
+	// ZRLE drops the unused byte of a 32-bit pixel if the colours all fit
+	// in the other three
+	c->cpix_off = 0;
+	c->cpix_bytes = n;
+	if (pf->true_colour && (pf->bpp == 32) && (pf->depth <= 24)) {
+		uint32_t used = 0;
+		for (int k = 0; k < 3; k++)
+			used |= (uint32_t)pf->max[k] << pf->shift[k];
+		if (!(used & 0xff000000)) {
+			c->cpix_bytes = 3;
+			c->cpix_off = pf->big_endian ? 1 : 0;
+		} else if (!(used & 0x000000ff)) {
+			c->cpix_bytes = 3;
+			c->cpix_off = pf->big_endian ? 0 : 1;
+		}
+	}
+}
+
+/// Tell a colour map client what colours pixels 0 and 1 are
+static bool send_colour_map(CLIENT *c)
+{
+	uint8_t msg[6 + 2 * 6] = { MSG_SET_COLOUR_MAP, 0, 0, 0, 0, 2 };
+
+	for (int k = 0; k < 3; k++)
+		ST_BE16(&msg[12 + 2 * k], c->fg[k] * 257);
+	return send_all(c->fd, msg, sizeof(msg));
+}
+
+/********************************************************
+ * Framebuffer updates
+ ********************************************************/
+
+/**
+ * Find the parts of a region which differ from what the client has: runs
+ * of changed lines, each as wide as the changed words in it. Only lines the
+ * dirty bitmap says were written are compared.
+ */
+static int find_changes(CLIENT *c, const RECT *req, RECT *rects)
+{
+	int w0 = req->x / WORD_PIXELS, w1 = (req->x + req->w + WORD_PIXELS - 1) / WORD_PIXELS;
+	int n = 0;
+	bool open = false;
+
+	for (int y = req->y; y < req->y + req->h; y++) {
+		int lo = -1, hi = -1;
+		if (c->pending[y / 32] & ((uint32_t)1 << (y % 32))) {
+			const uint8_t *a = &c->cur[y * VRAM_LINE_BYTES], *b = &c->shadow[y * VRAM_LINE_BYTES];
+			for (int w = w0; w < w1; w++) {
+				if ((a[2*w] != b[2*w]) || (a[2*w+1] != b[2*w+1])) {
+					if (lo < 0) lo = w;
+					hi = w;
+				}
+			}
+		}
+		if (lo < 0) {
+			open = false;
+			continue;
+		}
+
+		int x0 = lo * WORD_PIXELS, x1 = (hi + 1) * WORD_PIXELS;
+		if (open) {
+			RECT *r = &rects[n - 1];
+			int r1 = r->x + r->w;
+			if (x0 < r->x) r->x = x0;
+			if (x1 < r1) x1 = r1;
+			r->w = x1 - r->x;
+			r->h++;
+		} else {
+			rects[n].x = x0;
+			rects[n].y = y;
+			rects[n].w = x1 - x0;
+			rects[n].h = 1;
+			n++;
+			open = true;
+		}
+	}
+	return n;
+}
+
+static bool encode_raw(CLIENT *c, const RECT *r)
+{
+	if (!buf_reserve(&c->out, (size_t)r->w * r->h * c->pix_bytes))
+		return false;
+	for (int y = r->y; y < r->y + r->h; y++) {
+		const uint8_t *line = &c->cur[y * VRAM_LINE_BYTES];
+		for (int x = r->x; x < r->x + r->w; x++)
+			buf_put(&c->out, c->pix[vram_pixel(line, x)], c->pix_bytes);
+	}
+	return true;
+}
+
+/*
+ * ZRLE: the rectangle is split into 64x64 tiles, each of which is either
+ * a solid colour (subencoding 1) or a two-colour palette (subencoding 2)
+ * followed by one bit per pixel, rows padded to a byte. Palette entry 0 is
+ * the background, so the bitmap is just the tile's Video RAM bits in RFB
+ * order.
+ */
+static bool encode_zrle(CLIENT *c, const RECT *r)
+{
+	const size_t tile_max = 1 + (2 * c->cpix_bytes) + (ZRLE_TILE * ZRLE_TILE / 8);
+
+	if (!c->zs_ready) {
+		memset(&c->zs, 0, sizeof(c->zs));
+		if (deflateInit(&c->zs, Z_DEFAULT_COMPRESSION) != Z_OK)
+			return false;
+		c->zs_ready = true;
+	}
+
+	c->tiles.len = 0;
+	for (int ty = r->y; ty < r->y + r->h; ty += ZRLE_TILE) {
+		int th = (r->y + r->h - ty < ZRLE_TILE) ? (r->y + r->h - ty) : ZRLE_TILE;
+		for (int tx = r->x; tx < r->x + r->w; tx += ZRLE_TILE) {
+			int tw = (r->x + r->w - tx < ZRLE_TILE) ? (r->x + r->w - tx) : ZRLE_TILE;
+			if (!buf_reserve(&c->tiles, tile_max))
+				return false;
+
+			// Build the bitmap after the palette, and count the lit pixels
+			size_t start = c->tiles.len;
+			uint8_t *bits = c->tiles.data + start + 1 + (2 * c->cpix_bytes);
+			size_t nbits = 0;
+			int lit = 0;
+			for (int y = ty; y < ty + th; y++) {
+				const uint8_t *line = &c->cur[y * VRAM_LINE_BYTES];
+				uint8_t acc = 0;
+				for (int i = 0; i < tw; i++) {
+					int p = vram_pixel(line, tx + i);
+					lit += p;
+					acc |= p << (7 - (i % 8));
+					if (((i % 8) == 7) || (i == tw - 1)) {
+						bits[nbits++] = acc;
+						acc = 0;
+					}
+				}
+			}
+
+			if ((lit == 0) || (lit == tw * th)) {
+				buf_put8(&c->tiles, 1);
+				buf_put(&c->tiles, &c->pix[lit != 0][c->cpix_off], c->cpix_bytes);
+			} else {
+				buf_put8(&c->tiles, 2);
+				buf_put(&c->tiles, &c->pix[0][c->cpix_off], c->cpix_bytes);
+				buf_put(&c->tiles, &c->pix[1][c->cpix_off], c->cpix_bytes);
+				c->tiles.len += nbits;
+			}
+		}
+	}
+
+	// Compress with a sync flush, so the client can decode it all now
+	c->zs.next_in = c->tiles.data;
+	c->zs.avail_in = c->tiles.len;
+	c->zout.len = 0;
+	do {
+		if (!buf_reserve(&c->zout, 16384))
+			return false;
+		c->zs.next_out = c->zout.data + c->zout.len;
+		c->zs.avail_out = c->zout.size - c->zout.len;
+		if (deflate(&c->zs, Z_SYNC_FLUSH) == Z_STREAM_ERROR)
+			return false;
+		c->zout.len = c->zout.size - c->zs.avail_out;
+	} while (c->zs.avail_out == 0);
+
+	if (!buf_reserve(&c->out, 4 + c->zout.len))
+		return false;
+	buf_put32(&c->out, c->zout.len);
+	buf_put(&c->out, c->zout.data, c->zout.len);
+	return true;
+}
+
+/**
+ * Answer the outstanding update request, if there's anything to send.
+ * Returns false if the client has to be dropped.
+ */
+static bool send_update(CLIENT *c)
+{
+	RECT rects[VRAM_HEIGHT];
+	RECT req = c->req;
+	int n;
+
+	// Widen the region to whole words, which is how the shadow is kept
+	int x1 = (req.x + req.w + WORD_PIXELS - 1) / WORD_PIXELS * WORD_PIXELS;
+	req.x = req.x / WORD_PIXELS * WORD_PIXELS;
+	req.w = x1 - req.x;
+
+	if (!c->incremental || !c->shadow_valid) {
+		rects[0] = req;
+		n = 1;
+	} else if ((n = find_changes(c, &req, rects)) == 0) {
+		// Nothing new, so wait for the next frame
+		return true;
+	}
+
+	// Lines compared right across can't differ any more once this is sent
+	if ((req.x == 0) && (req.w == VRAM_WIDTH)) {
+		for (int y = req.y; y < req.y + req.h; y++)
+			c->pending[y / 32] &= ~((uint32_t)1 << (y % 32));
+		if (req.h == VRAM_HEIGHT)
+			c->shadow_valid = true;
+	}
+
+	c->out.len = 0;
+	if (!buf_reserve(&c->out, 4))
+		return false;
+	buf_put8(&c->out, MSG_FRAMEBUFFER_UPDATE);
+	buf_put8(&c->out, 0);
+	buf_put16(&c->out, n);
+	for (int i = 0; i < n; i++) {
+		const RECT *r = &rects[i];
+		if (!buf_reserve(&c->out, 12))
+			return false;
+		buf_put16(&c->out, r->x);
+		buf_put16(&c->out, r->y);
+		buf_put16(&c->out, r->w);
+		buf_put16(&c->out, r->h);
+		buf_put32(&c->out, c->zrle ? ENC_ZRLE : ENC_RAW);
+		if (!(c->zrle ? encode_zrle(c, r) : encode_raw(c, r)))
+			return false;
+
+		for (int y = r->y; y < r->y + r->h; y++)
+			memcpy(&c->shadow[(y * VRAM_LINE_BYTES) + (r->x / 8)], &c->cur[(y * VRAM_LINE_BYTES) + (r->x / 8)], r->w / 8);
+	}
+
+	c->want_update = false;
+	LOG("sent %d rects, %zu bytes", n, c->out.len);
+	return send_all(c->fd, c->out.data, c->out.len);
+}
+
+/**
+ * Pick up the latest frame from the emulation thread. Returns false if the
+ * client has to be dropped.
+ */
+static bool take_frame(CLIENT *c)
+{
+	uint8_t fg[3];
+	bool complete;
+
+	SDL_LockMutex(srv.lock);
+	if ((complete = srv.complete)) {
+		memcpy(c->cur, srv.fb, FRAME_BYTES);
+		for (size_t i = 0; i < DIRTY_WORDS; i++) {
+			c->pending[i] |= srv.dirty[i];
+			srv.dirty[i] = 0;
+		}
+	}
+	memcpy(fg, srv.fg, sizeof(fg));
+	SDL_UnlockMutex(srv.lock);
+
+	if (!complete)
+		return true;
+	c->have_frame = true;
+
+	// A new palette changes every lit pixel
+	if (memcmp(fg, c->fg, sizeof(fg)) != 0) {
+		memcpy(c->fg, fg, sizeof(fg));
+		make_pixels(c);
+		c->shadow_valid = false;
+		if (!c->pf.true_colour && !send_colour_map(c))
+			return false;
+	}
+	return true;
+}
+
+/********************************************************
+ * Client input
+ ********************************************************/
+
+/// X11 keysyms which don't map to a printable ASCII character
+static const struct {
+	uint32_t	sym;
+	SDLKey		key;
+} special_keys[] = {
+	{ 0xff08, SDLK_BACKSPACE },		{ 0xff09, SDLK_TAB },
+	{ 0xff0d, SDLK_RETURN },		{ 0xff13, SDLK_BREAK },
+	{ 0xff1b, SDLK_ESCAPE },		{ 0xffff, SDLK_DELETE },
+	{ 0xff50, SDLK_HOME },			{ 0xff51, SDLK_LEFT },
+	{ 0xff52, SDLK_UP },			{ 0xff53, SDLK_RIGHT },
+	{ 0xff54, SDLK_DOWN },			{ 0xff55, SDLK_PAGEUP },
+	{ 0xff56, SDLK_PAGEDOWN },		{ 0xff57, SDLK_END },
+	{ 0xff63, SDLK_INSERT },		{ 0xff6b, SDLK_BREAK },
+	{ 0xff7f, SDLK_NUMLOCK },		{ 0xff8d, SDLK_KP_ENTER },
+	{ 0xffad, SDLK_KP_MINUS },		{ 0xffae, SDLK_KP_PERIOD },
+	{ 0xffe1, SDLK_LSHIFT },		{ 0xffe2, SDLK_RSHIFT },
+	{ 0xffe3, SDLK_LCTRL },			{ 0xffe4, SDLK_RCTRL },
+	{ 0xffe5, SDLK_CAPSLOCK },		{ 0xffe7, SDLK_LALT },
+	{ 0xffe8, SDLK_RALT },			{ 0xffe9, SDLK_LALT },
+	{ 0xffea, SDLK_RALT }
+};
+
+/**
+ * Convert an X11 keysym to an SDL key. The client sends the shifted
+ * character when shift is held, but the 3B1 wants the unshifted key, so
+ * that's put back.
+ */
+static SDLKey map_keysym(uint32_t sym)
+{
+	static const char shifted[]   = "!@#$%^&*()_+{}|:\"<>?~";
+	static const char unshifted[] = "1234567890-=[]\\;',./`";
+
+	if ((sym >= 'A') && (sym <= 'Z'))
+		return (SDLKey)(sym - 'A' + 'a');
+	if ((sym > ' ') && (sym < 0x7f)) {
+		const char *p = strchr(shifted, (int)sym);
+		return (SDLKey)(p ? unshifted[p - shifted] : (char)sym);
+	}
+	if (sym == ' ')
+		return SDLK_SPACE;
+	if ((sym >= 0xffbe) && (sym <= 0xffc9))
+		return (SDLKey)(SDLK_F1 + (sym - 0xffbe));
+	if ((sym >= 0xffb0) && (sym <= 0xffb9))
+		return (SDLKey)(SDLK_KP0 + (sym - 0xffb0));
+	for (size_t i = 0; i < NELEMS(special_keys); i++)
+		if (special_keys[i].sym == sym)
+			return special_keys[i].key;
+	return SDLK_UNKNOWN;
+}
+
+static void key_event(CLIENT *c, bool down, uint32_t sym)
+{
+	INPUT_EVENT ev;
+	SDLKey key = map_keysym(sym);
+	SDLMod bit = KMOD_NONE;
+
+	if (key == SDLK_UNKNOWN) {
+		LOG("unmapped keysym 0x%04X", sym);
+		return;
+	}
+
+	switch (key) {
+		case SDLK_LSHIFT:	bit = KMOD_LSHIFT;	break;
+		case SDLK_RSHIFT:	bit = KMOD_RSHIFT;	break;
+		case SDLK_LCTRL:	bit = KMOD_LCTRL;	break;
+		case SDLK_RCTRL:	bit = KMOD_RCTRL;	break;
+		case SDLK_LALT:		bit = KMOD_LALT;	break;
+		case SDLK_RALT:		bit = KMOD_RALT;	break;
+		default:										break;
+	}
+	c->mod = down ? (c->mod | bit) : (c->mod & ~bit);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = INPUT_KEY;
+	ev.key.type = down ? SDL_KEYDOWN : SDL_KEYUP;
+	ev.key.key.type = ev.key.type;
+	ev.key.key.state = down ? SDL_PRESSED : SDL_RELEASED;
+	ev.key.key.keysym.sym = key;
+	ev.key.key.keysym.mod = c->mod;
+	input_push(&ev);
+
+	// F11 swaps the floppy, the same as on the local display
+	if (down && (key == SDLK_F11)) {
+		ev.type = INPUT_FLOPPY_SWAP;
+		input_push(&ev);
+	}
+}
+
+static void pointer_event(CLIENT *c, int mask, int x, int y)
+{
+	INPUT_EVENT ev;
+	int buttons = 0;
+
+	if (mask & 0x01)	buttons |= MOUSE_BUTTON_LEFT;
+	if (mask & 0x02)	buttons |= MOUSE_BUTTON_MIDDLE;
+	if (mask & 0x04)	buttons |= MOUSE_BUTTON_RIGHT;
+
+	if (!c->ptr_valid) {
+		c->ptr_x = x;
+		c->ptr_y = y;
+		c->ptr_valid = true;
+	}
+	if ((x == c->ptr_x) && (y == c->ptr_y) && (buttons == c->buttons))
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = INPUT_MOUSE;
+	ev.mouse.dx = x - c->ptr_x;
+	ev.mouse.dy = y - c->ptr_y;
+	ev.mouse.buttons = buttons;
+	input_push(&ev);
+
+	c->ptr_x = x;
+	c->ptr_y = y;
+	c->buttons = buttons;
+}
+
+/// Handle one complete client message. Returns false to drop the client.
+static bool handle_message(CLIENT *c, const uint8_t *m)
+{
+	switch (m[0]) {
+		case MSG_SET_PIXEL_FORMAT: {
+			PIXEL_FORMAT pf = {
+				.bpp = m[4], .depth = m[5], .big_endian = m[6], .true_colour = m[7],
+				.max = { LD_BE16(&m[8]), LD_BE16(&m[10]), LD_BE16(&m[12]) },
+				.shift = { m[14], m[15], m[16] }
+			};
+			if ((pf.bpp != 8) && (pf.bpp != 16) && (pf.bpp != 32)) {
+				LOG_NOTE("vnc: client asked for %d bits per pixel", pf.bpp);
+				return false;
+			}
+			c->pf = pf;
+			make_pixels(c);
+			c->shadow_valid = false;
+			if (!pf.true_colour && !send_colour_map(c))
+				return false;
+			break;
+		}
+		case MSG_SET_ENCODINGS:
+			// Use the first one we know, in the client's order of preference
+			c->zrle = false;
+			for (int i = 0; i < LD_BE16(&m[2]); i++) {
+				int32_t enc = (int32_t)LD_BE32(&m[4 + (4 * i)]);
+				if ((enc == ENC_RAW) || (enc == ENC_ZRLE)) {
+					c->zrle = (enc == ENC_ZRLE);
+					break;
+				}
+			}
+			LOG("client takes %s", c->zrle ? "ZRLE" : "raw");
+			break;
+		case MSG_UPDATE_REQUEST: {
+			RECT r = { LD_BE16(&m[2]), LD_BE16(&m[4]), LD_BE16(&m[6]), LD_BE16(&m[8]) };
+			if (r.x > VRAM_WIDTH)					r.x = VRAM_WIDTH;
+			if (r.y > VRAM_HEIGHT)					r.y = VRAM_HEIGHT;
+			if (r.x + r.w > VRAM_WIDTH)				r.w = VRAM_WIDTH - r.x;
+			if (r.y + r.h > VRAM_HEIGHT)			r.h = VRAM_HEIGHT - r.y;
+			if ((r.w == 0) || (r.h == 0))
+				break;
+			// Requests which come in before the last is answered are merged
+			if (c->want_update) {
+				int x1 = c->req.x + c->req.w, y1 = c->req.y + c->req.h;
+				if (r.x + r.w > x1)		x1 = r.x + r.w;
+				if (r.y + r.h > y1)		y1 = r.y + r.h;
+				if (c->req.x < r.x)		r.x = c->req.x;
+				if (c->req.y < r.y)		r.y = c->req.y;
+				r.w = x1 - r.x;
+				r.h = y1 - r.y;
+				c->incremental = c->incremental && m[1];
+			} else {
+				c->incremental = m[1];
+			}
+			c->req = r;
+			c->want_update = true;
+			break;
+		}
+		case MSG_KEY_EVENT:
+			key_event(c, m[1] != 0, LD_BE32(&m[4]));
+			break;
+		case MSG_POINTER_EVENT:
+			pointer_event(c, m[1], LD_BE16(&m[2]), LD_BE16(&m[4]));
+			break;
+		case MSG_CUT_TEXT:
+			// Not supported; the text itself is skipped by the caller
+			break;
+	}
+	return true;
+}
+
+/// Read and handle whatever the client has sent. Returns false to drop it.
+static bool client_read(CLIENT *c)
+{
+	ssize_t r = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, MSG_DONTWAIT);
+	size_t pos = 0;
+
+	if (r < 0)
+		return (errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR);
+	if (r == 0)
+		return false;
+	c->in_len += r;
+
+	while (pos < c->in_len) {
+		const uint8_t *m = &c->in[pos];
+		size_t avail = c->in_len - pos, len;
+
+		if (c->skip > 0) {
+			len = (c->skip < avail) ? c->skip : avail;
+			c->skip -= len;
+			pos += len;
+			continue;
+		}
+
+		switch (m[0]) {
+			case MSG_SET_PIXEL_FORMAT:	len = 20;	break;
+			case MSG_SET_ENCODINGS:		len = (avail >= 4) ? 4 + (4 * (size_t)LD_BE16(&m[2])) : 4;	break;
+			case MSG_UPDATE_REQUEST:	len = 10;	break;
+			case MSG_KEY_EVENT:			len = 8;	break;
+			case MSG_POINTER_EVENT:		len = 6;	break;
+			case MSG_CUT_TEXT:			len = 8;	break;
+			default:
+				LOG_NOTE("vnc: unknown message type %d from client", m[0]);
+				return false;
+		}
+		if (len > sizeof(c->in)) {
+			LOG_NOTE("vnc: client message too long (%zu bytes)", len);
+			return false;
+		}
+		if (avail < len)
+			break;
+		if (!handle_message(c, m))
+			return false;
+		if (m[0] == MSG_CUT_TEXT)
+			c->skip = LD_BE32(&m[4]);
+		pos += len;
+	}
+
+	memmove(c->in, c->in + pos, c->in_len - pos);
+	c->in_len -= pos;
+	return true;
+}
+
+/********************************************************
+ * Connections
+ ********************************************************/
+
+/// RFB version handshake, security type None and initialisation
+static bool handshake(CLIENT *c)
+{
+	char ver[13];
+	int major, minor;
+	uint8_t b;
+
+	if (!send_all(c->fd, "RFB 003.008\n", 12) || !recv_all(c->fd, ver, 12))
+		return false;
+	ver[12] = '\0';
+	if ((sscanf(ver, "RFB %3d.%3d", &major, &minor) != 2) || (major != 3)) {
+		LOG_NOTE("vnc: client has unsupported protocol version");
+		return false;
+	}
+
+	if (minor >= 7) {
+		// List the security types, and check the client picked None
+		static const uint8_t types[] = { 1, 1 };
+		if (!send_all(c->fd, types, sizeof(types)) || !recv_all(c->fd, &b, 1) || (b != 1))
+			return false;
+		if (minor >= 8) {
+			static const uint8_t ok[4] = { 0, 0, 0, 0 };
+			if (!send_all(c->fd, ok, sizeof(ok)))
+				return false;
+		}
+	} else {
+		static const uint8_t none[4] = { 0, 0, 0, 1 };
+		if (!send_all(c->fd, none, sizeof(none)))
+			return false;
+	}
+
+	// ClientInit: the shared flag doesn't matter, there's only one client
+	if (!recv_all(c->fd, &b, 1))
+		return false;
+
+	// ServerInit: 32-bit true colour until the client asks for something else
+	static const char name[] = "FreeBee 3B1";
+	uint8_t init[24 + sizeof(name) - 1] = {
+		VRAM_WIDTH >> 8, VRAM_WIDTH & 0xff, VRAM_HEIGHT >> 8, VRAM_HEIGHT & 0xff,
+		32, 24, 0, 1, 0, 255, 0, 255, 0, 255, 16, 8, 0, 0, 0, 0,
+		0, 0, 0, sizeof(name) - 1
+	};
+	memcpy(&init[24], name, sizeof(name) - 1);
+	c->pf = (PIXEL_FORMAT){ 32, 24, false, true, { 255, 255, 255 }, { 16, 8, 0 } };
+	make_pixels(c);
+	return send_all(c->fd, init, sizeof(init));
+}
+
+static void client_close(CLIENT *c)
+{
+	__atomic_store_n(&srv.connected, false, __ATOMIC_RELEASE);
+	close(c->fd);
+	if (c->zs_ready)
+		deflateEnd(&c->zs);
+	buf_free(&c->out);
+	buf_free(&c->tiles);
+	buf_free(&c->zout);
+	free(c);
+	LOG_NOTES("vnc: client disconnected");
+}
+
+static CLIENT *client_open(int fd)
+{
+	struct timeval tv = { CLIENT_TIMEOUT_SECS, 0 };
+	int one = 1;
+	CLIENT *c;
+
+	if ((c = calloc(1, sizeof(CLIENT))) == NULL) {
+		close(fd);
+		return NULL;
+	}
+	c->fd = fd;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (!handshake(c)) {
+		client_close(c);
+		return NULL;
+	}
+
+	// Have the emulation thread send the whole screen over
+	SDL_LockMutex(srv.lock);
+	srv.complete = false;
+	memset(srv.dirty, 0, sizeof(srv.dirty));
+	SDL_UnlockMutex(srv.lock);
+	__atomic_store_n(&srv.resync, true, __ATOMIC_RELEASE);
+	__atomic_store_n(&srv.connected, true, __ATOMIC_RELEASE);
+
+	LOG_NOTES("vnc: client connected");
+	return c;
+}
+
+/// Server thread: accepts the client, and answers it
+static int server_thread(void *arg)
+{
+	CLIENT *c = NULL;
+	(void)arg;
+
+	while (!__atomic_load_n(&srv.stopping, __ATOMIC_ACQUIRE)) {
+		struct pollfd p[3] = {
+			{ .fd = srv.wake[0], .events = POLLIN },
+			{ .fd = srv.listen_fd, .events = POLLIN },
+			{ .fd = c ? c->fd : -1, .events = POLLIN }
+		};
+		if (poll(p, NELEMS(p), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		bool ok = true;
+		if (p[0].revents & POLLIN) {
+			uint8_t junk[64];
+			while (read(srv.wake[0], junk, sizeof(junk)) > 0)
+				;
+			if (c)
+				ok = take_frame(c);
+		}
+		if (ok && c && (p[2].revents & (POLLIN | POLLHUP | POLLERR)))
+			ok = client_read(c);
+		if (ok && c && c->want_update && c->have_frame)
+			ok = send_update(c);
+		if (!ok) {
+			client_close(c);
+			c = NULL;
+		}
+
+		if (p[1].revents & POLLIN) {
+			int fd = accept4(srv.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+			if (fd >= 0) {
+				// A new client replaces the old one
+				if (c)
+					client_close(c);
+				c = client_open(fd);
+			}
+		}
+	}
+
+	if (c)
+		client_close(c);
+	return 0;
+}
+
+/// Wake the server thread up
+static void wake_server(void)
+{
+	uint8_t b = 0;
+	if (write(srv.wake[1], &b, 1) < 0) {
+		// Full, so it's already due to wake up
+	}
+}
+
+bool vnc_start(const char *addr)
+{
+	struct addrinfo hints = { .ai_flags = AI_PASSIVE, .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+	struct addrinfo *ai = NULL;
+	char host[256] = "127.0.0.1";
+	const char *port = addr;
+	const char *colon = strrchr(addr, ':');
+	int one = 1;
+
+	// [HOST:]PORT, with an IPv6 address in square brackets
+	if (colon != NULL) {
+		size_t n = colon - addr;
+		if ((n >= 2) && (addr[0] == '[') && (addr[n - 1] == ']')) {
+			addr++;
+			n -= 2;
+		}
+		if (n >= sizeof(host)) {
+			fprintf(stderr, "ERROR: VNC address '%s' is too long.\n", addr);
+			return false;
+		}
+		memcpy(host, addr, n);
+		host[n] = '\0';
+		port = colon + 1;
+	}
+
+	int err = getaddrinfo(host, port, &hints, &ai);
+	if (err != 0) {
+		fprintf(stderr, "ERROR: Could not look up VNC address '%s:%s': %s.\n", host, port, gai_strerror(err));
+		return false;
+	}
+	srv.listen_fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+	if ((srv.listen_fd < 0) ||
+			(setsockopt(srv.listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0) ||
+			(bind(srv.listen_fd, ai->ai_addr, ai->ai_addrlen) < 0) ||
+			(listen(srv.listen_fd, 1) < 0)) {
+		fprintf(stderr, "ERROR: Could not listen for VNC clients on %s:%s: %s.\n", host, port, strerror(errno));
+		freeaddrinfo(ai);
+		vnc_done();
+		return false;
+	}
+	freeaddrinfo(ai);
+
+	if ((pipe2(srv.wake, O_NONBLOCK | O_CLOEXEC) < 0) || ((srv.lock = SDL_CreateMutex()) == NULL) ||
+			((srv.thread = SDL_CreateThread(server_thread, NULL)) == NULL)) {
+		fprintf(stderr, "ERROR: Could not start the VNC server.\n");
+		vnc_done();
+		return false;
+	}
+
+	fprintf(stderr, "VNC server listening on %s:%s\n", host, port);
+	return true;
+}
+
+void vnc_done(void)
+{
+	if (srv.thread != NULL) {
+		__atomic_store_n(&srv.stopping, true, __ATOMIC_RELEASE);
+		wake_server();
+		SDL_WaitThread(srv.thread, NULL);
+		srv.thread = NULL;
+	}
+	if (srv.lock)				SDL_DestroyMutex(srv.lock);
+	if (srv.listen_fd >= 0)		close(srv.listen_fd);
+	if (srv.wake[0] >= 0)		close(srv.wake[0]);
+	if (srv.wake[1] >= 0)		close(srv.wake[1]);
+	srv.lock = NULL;
+	srv.listen_fd = srv.wake[0] = srv.wake[1] = -1;
+	srv.stopping = false;
+}
+
+void vnc_publish_frame(void)
+{
+	if ((srv.thread == NULL) || !__atomic_load_n(&srv.connected, __ATOMIC_ACQUIRE))
+		return;
+
+	bool all = __atomic_exchange_n(&srv.resync, false, __ATOMIC_ACQ_REL);
+	const uint8_t *fg = video_palette_rgb(video_get_palette());
+	bool changed = all;
+
+	SDL_LockMutex(srv.lock);
+	if (memcmp(srv.fg, fg, sizeof(srv.fg)) != 0) {
+		memcpy(srv.fg, fg, sizeof(srv.fg));
+		changed = true;
+	}
+	if (all) {
+		memcpy(srv.fb, state->vram, FRAME_BYTES);
+		memset(srv.dirty, 0xff, sizeof(srv.dirty));
+		srv.complete = true;
+	} else {
+		for (int y = 0; y < VRAM_HEIGHT; y++) {
+			if (state->vram_dirty[y / 32] & ((uint32_t)1 << (y % 32))) {
+				memcpy(&srv.fb[y * VRAM_LINE_BYTES], &state->vram[y * VRAM_LINE_BYTES], VRAM_LINE_BYTES);
+				srv.dirty[y / 32] |= (uint32_t)1 << (y % 32);
+				changed = true;
+			}
+		}
+	}
+	SDL_UnlockMutex(srv.lock);
+
+	if (changed)
+		wake_server();
+}
@@ -0,0 +1,52 @@
+#ifndef _VNC_H
+#define _VNC_H
+
+#include <stdbool.h>
+
+/**
+ * Remote framebuffer (VNC) server.
+ *
+ * Serves the primary machine's screen over RFB 3.3, 3.7 or 3.8 with no
+ * authentication, so remote and headless machines can be watched and
+ * driven. One client at a time; a new connection replaces the old one.
+ *
+ * The emulation thread hands over the Video RAM lines which changed each
+ * frame (vnc_publish_frame()); the server's own thread answers update
+ * requests with just the parts of those lines which differ from what the
+ * client was last sent. Rectangles are sent ZRLE-encoded if the client
+ * supports it -- the screen only has two colours, so each 64x64 tile is
+ * either a single colour or a 1 bit per pixel bitmap -- and Raw otherwise.
+ *
+ * Key and pointer events are turned into INPUT_EVENTs and queued on the
+ * same path as the local keyboard and mouse. The guest's mouse is relative,
+ * so the client's pointer positions are sent to it as movements.
+ */
+
+/**
+ * @brief	Start the server.
+ * @param	addr	Where to listen, as "[HOST:]PORT". HOST defaults to
+ * 					127.0.0.1.
+ * @return	true on success.
+ *
+ * There's no password, so anything other than the loopback address lets
+ * anyone who can reach the port take over the machine.
+ */
+bool vnc_start(const char *addr);
+
+/**
+ * @brief	Stop the server and disconnect the client.
+ *
+ * Does nothing if the server isn't running.
+ */
+void vnc_done(void);
+
+/**
+ * @brief	Hand the Video RAM lines which changed over to the server.
+ *
+ * Called by the emulation thread at the end of each video frame, for the
+ * primary machine. Reads the Video RAM dirty bitmap without clearing it.
+ * Does nothing unless a client is connected.
+ */
+void vnc_publish_frame(void);
+
+#endif
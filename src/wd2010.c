@@ -1,9 +1,16 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <malloc.h>
-#include "SDL.h"
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "musashi/m68k.h"
+#include "state.h"
+#include "sched.h"
+#include "irq.h"
 #include "wd2010.h"
+#include "zimage.h"
 
 #define WD2010_DEBUG
 
@@ -12,10 +19,13 @@
 #endif
 #include "utils.h"
 
+/// Seek time, milliseconds of emulated time
 #ifndef WD2010_SEEK_DELAY
 #define WD2010_SEEK_DELAY 30
 #endif
 
+static void seek_complete(void *arg);
+
 #define CMD_ENABLE_RETRY 0x01
 #define CMD_LONG_MODE 0x02
 #define CMD_MULTI_SECTOR 0x04
@@ -48,6 +58,13 @@
 
 extern int cpu_log_enabled;
 
+/// Set the controller's interrupt line
+static inline void set_irq(WD2010_CTX *ctx, bool irq)
+{
+	ctx->irq = irq;
+	irq_set(IRQ_HDC, irq);
+}
+
 /// WD2010 command constants
 enum {
 	CMD_MASK				= 0xF0,		///< Bit mask to detect command bits
@@ -60,12 +77,45 @@ enum {
 	CMD_SEEK				= 0x70,		///< Seek to given track
 };
 
+/**
+ * @brief	Write back and unmap the memory-mapped disc image, if there is one.
+ */
+static void unmap_image(WD2010_CTX *ctx)
+{
+	if (ctx->image_map == NULL)
+		return;
+
+	wd2010_sync(ctx);
+	munmap(ctx->image_map, ctx->image_size);
+	ctx->image_map = NULL;
+	ctx->image_size = 0;
+	ctx->data = ctx->buffer;
+	ctx->data_pos = ctx->data_len = 0;
+}
+
+/**
+ * @brief	Write back and free the sector cache, if there is one.
+ */
+static void uncache_image(WD2010_CTX *ctx)
+{
+	if (ctx->cache == NULL)
+		return;
+
+	diskcache_done(ctx->cache);
+	free(ctx->cache);
+	ctx->cache = NULL;
+}
+
 int wd2010_init(WD2010_CTX *ctx, FILE *fp, int secsz, int spt, int heads)
 {
 	size_t filesize;
 
 	wd2010_reset(ctx);
 
+	// Seek completion is signalled by the scheduler. The handler table is
+	// shared by every machine, so the controller is found when it fires.
+	sched_register(SCHED_EV_HDC_SEEK, seek_complete, NULL);
+
 	// Start by finding out how big the image file is
 	fseek(fp, 0, SEEK_END);
 	filesize = ftell(fp);
@@ -80,12 +130,16 @@ int wd2010_init(WD2010_CTX *ctx, FILE *fp, int secsz, int spt, int heads)
 
 	LOG("WD2010 initialised, %d cylinders, %d heads, %d sectors per track", tracks, heads, spt);
 
+	// Drop any mapping or cache of the previous image
+	unmap_image(ctx);
+	uncache_image(ctx);
+
 	// Allocate enough memory to store one disc track
-	if (ctx->data) {
-		free(ctx->data);
+	if (ctx->buffer) {
+		free(ctx->buffer);
 	}
-	ctx->data = malloc(secsz * spt);
-	if (!ctx->data)
+	ctx->data = ctx->buffer = malloc(secsz * spt);
+	if (!ctx->buffer)
 		return WD2010_ERR_NO_MEMORY;
 
 	// Load the image and the geometry data
@@ -98,13 +152,73 @@ int wd2010_init(WD2010_CTX *ctx, FILE *fp, int secsz, int spt, int heads)
 	return WD2010_ERR_OK;
 }
 
+int wd2010_map_image(WD2010_CTX *ctx, WD2010_SYNC policy)
+{
+	struct stat st;
+	void *map;
+
+	unmap_image(ctx);
+
+	// Anything still sitting in the stdio buffer has to reach the file first
+	fflush(ctx->disc_image);
+	if ((fstat(fileno(ctx->disc_image), &st) != 0) || (st.st_size <= 0))
+		return WD2010_ERR_MAP_FAILED;
+
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(ctx->disc_image), 0);
+	if (map == MAP_FAILED)
+		return WD2010_ERR_MAP_FAILED;
+
+	ctx->image_map = map;
+	ctx->image_size = st.st_size;
+	ctx->sync_policy = policy;
+	ctx->map_dirty = false;
+	LOG("WD2010: mapped %zu byte image, sync policy %d", ctx->image_size, policy);
+
+	return WD2010_ERR_OK;
+}
+
+int wd2010_cache_image(WD2010_CTX *ctx, size_t dirty_limit)
+{
+	uncache_image(ctx);
+	// The cache needs a real file underneath it
+	if ((ctx->image_map != NULL) || (fileno(ctx->disc_image) < 0))
+		return WD2010_ERR_MAP_FAILED;
+
+	// From here on the file is only accessed through the cache
+	fflush(ctx->disc_image);
+	if ((ctx->cache = malloc(sizeof(DISKCACHE))) == NULL)
+		return WD2010_ERR_NO_MEMORY;
+	if (!diskcache_init(ctx->cache, fileno(ctx->disc_image), ctx->geom_secsz, dirty_limit)) {
+		free(ctx->cache);
+		ctx->cache = NULL;
+		return WD2010_ERR_NO_MEMORY;
+	}
+
+	return WD2010_ERR_OK;
+}
+
+void wd2010_sync(WD2010_CTX *ctx)
+{
+	if (ctx->cache != NULL)
+		diskcache_flush(ctx->cache);
+	else if ((ctx->image_map == NULL) && (ctx->disc_image != NULL))
+		// A compressed image holds the chunks which changed in memory
+		zimage_sync(ctx->disc_image);
+
+	if ((ctx->image_map == NULL) || !ctx->map_dirty)
+		return;
+
+	msync(ctx->image_map, ctx->image_size, MS_SYNC);
+	ctx->map_dirty = false;
+}
+
 void wd2010_reset(WD2010_CTX *ctx)
 {
 	// track, head and sector unknown
 	ctx->track = ctx->head = ctx->sector = 0;
 
 	// no IRQ pending
-	ctx->irq = false;
+	set_irq(ctx, false);
 
 	// no data available
 	ctx->data_pos = ctx->data_len = 0;
@@ -126,11 +240,14 @@ void wd2010_done(WD2010_CTX *ctx)
 	// Reset the WD2010
 	wd2010_reset(ctx);
 
-	// Free any allocated memory
-	if (ctx->data) {
-		free(ctx->data);
-		ctx->data = NULL;
+	// Write back the disc image and free any allocated memory
+	unmap_image(ctx);
+	uncache_image(ctx);
+	if (ctx->buffer) {
+		free(ctx->buffer);
+		ctx->buffer = NULL;
 	}
+	ctx->data = NULL;
 }
 
 
@@ -149,25 +266,72 @@ void wd2010_dma_miss(WD2010_CTX *ctx)
 	ctx->data_pos = ctx->data_len;
 	ctx->write_pos = 0;
 	ctx->status = SR_READY | SR_SEEK_COMPLETE;
-	ctx->irq = true;
+	set_irq(ctx, true);
+}
+
+/**
+ * @brief	Finish a read command once the host has taken the last data byte.
+ */
+static void read_done(WD2010_CTX *ctx)
+{
+	ctx->status = SR_READY | SR_SEEK_COMPLETE;
+	// Set IRQ
+	set_irq(ctx, true);
+	ctx->drq = false;
+	LOG("WD2010: read done");
+}
+
+/**
+ * @brief	Finish a write command once the host has sent the last data byte.
+ */
+static void write_done(WD2010_CTX *ctx)
+{
+	if (!ctx->formatting && (ctx->image_map != NULL) && (((size_t)ctx->write_pos + ctx->data_len) <= ctx->image_size)) {
+		// Only a complete transfer reaches the image, so an aborted write
+		// can't leave half a sector behind
+		memcpy(ctx->image_map + ctx->write_pos, ctx->data, ctx->data_len);
+		ctx->map_dirty = true;
+		if (ctx->sync_policy == WD2010_SYNC_COMMAND) {
+			// Hand the pages to the kernel, much like fflush() would
+			size_t start = ctx->write_pos & ~((size_t)sysconf(_SC_PAGESIZE) - 1);
+			msync(ctx->image_map + start, ctx->write_pos + ctx->data_len - start, MS_ASYNC);
+		}
+	} else if (!ctx->formatting && (ctx->cache != NULL)) {
+		diskcache_write(ctx->cache, ctx->write_pos / ctx->geom_secsz, ctx->data, ctx->data_len / ctx->geom_secsz);
+	} else if (!ctx->formatting){
+		fseek(ctx->disc_image, ctx->write_pos, SEEK_SET);
+		fwrite(ctx->data, 1, ctx->data_len, ctx->disc_image);
+		fflush(ctx->disc_image);
+	}
+	ctx->formatting = false;
+	ctx->status = SR_READY | SR_SEEK_COMPLETE;
+	// Set IRQ and reset write pointer
+	set_irq(ctx, true);
+	ctx->write_pos = -1;
+	ctx->drq = false;
+	LOG("WD2010: write done");
+}
+
+/**
+ * @brief	Update the sector registers if the data pointer is at the start of
+ * 			a new sector of a multi-sector transfer.
+ */
+static inline void next_sector(WD2010_CTX *ctx)
+{
+	if (ctx->multi_sector && (ctx->data_pos > 0) && ((ctx->data_pos % ctx->geom_secsz) == 0)){
+		ctx->sector_count--;
+		ctx->sector_number++;
+	}
 }
 
 uint8_t wd2010_read_data(WD2010_CTX *ctx)
 {
 	// If there's data in the buffer, return it. Otherwise return 0xFF.
 	if (ctx->data_pos < ctx->data_len) {
-		if (ctx->multi_sector && (ctx->data_pos > 0) && ((ctx->data_pos % ctx->geom_secsz) == 0)){
-			ctx->sector_count--;
-			ctx->sector_number++;
-		}
+		next_sector(ctx);
 		// set IRQ if this is the last data byte
-		if (ctx->data_pos == (ctx->data_len-1)) {
-			ctx->status = SR_READY | SR_SEEK_COMPLETE;
-			// Set IRQ
-			ctx->irq = true;
-			ctx->drq = false;
-			LOG("WD2010: read done");
-		}
+		if (ctx->data_pos == (ctx->data_len-1))
+			read_done(ctx);
 		// return data byte and increment pointer
 		return ctx->data[ctx->data_pos++];
 	} else {
@@ -183,44 +347,60 @@ void wd2010_write_data(WD2010_CTX *ctx, uint8_t val)
 	// buffer, allow the write.
 	if (ctx->write_pos >= 0 && ctx->data_pos < ctx->data_len) {
 		// store data byte and increment pointer
-		if (ctx->multi_sector && (ctx->data_pos > 0) && ((ctx->data_pos % ctx->geom_secsz) == 0)){
-			ctx->sector_count--;
-			ctx->sector_number++;
-		}
+		next_sector(ctx);
 		ctx->data[ctx->data_pos++] = val;
 		// set IRQ and write data if this is the last data byte
-		if (ctx->data_pos == ctx->data_len) {
-			if (!ctx->formatting){
-				fseek(ctx->disc_image, ctx->write_pos, SEEK_SET);
-				fwrite(ctx->data, 1, ctx->data_len, ctx->disc_image);
-				fflush(ctx->disc_image);
-			}
-			ctx->formatting = false;
-			ctx->status = SR_READY | SR_SEEK_COMPLETE;
-			// Set IRQ and reset write pointer
-			ctx->irq = true;
-			ctx->write_pos = -1;
-			ctx->drq = false;
-			LOG("WD2010: write done");
-		}
+		if (ctx->data_pos == ctx->data_len)
+			write_done(ctx);
 	}else{
 		LOGS("WD2010: attempt to write to data buffer without a write command in progress");
 	}
 }
 
-uint32_t seek_complete(uint32_t interval, WD2010_CTX *ctx)
+size_t wd2010_dma_buffer(WD2010_CTX *ctx, bool writing, uint8_t **buf)
+{
+	size_t len;
+
+	if ((ctx->data_pos >= ctx->data_len) || (writing && (ctx->write_pos < 0)))
+		return 0;
+
+	// Stop at the end of the current sector, so the sector registers are
+	// updated at the same points as a byte-by-byte transfer would
+	len = ctx->data_len - ctx->data_pos;
+	if (ctx->multi_sector && (ctx->geom_secsz - (ctx->data_pos % ctx->geom_secsz)) < len)
+		len = ctx->geom_secsz - (ctx->data_pos % ctx->geom_secsz);
+
+	*buf = ctx->data + ctx->data_pos;
+	return len;
+}
+
+void wd2010_dma_done(WD2010_CTX *ctx, bool writing, size_t count)
+{
+	if (count == 0)
+		return;
+
+	next_sector(ctx);
+	ctx->data_pos += count;
+	if (ctx->data_pos == ctx->data_len) {
+		if (writing)
+			write_done(ctx);
+		else
+			read_done(ctx);
+	}
+}
+
+static void seek_complete(void *arg)
 {
-	/*m68k_end_timeslice();*/
+	WD2010_CTX *ctx = &state->hdc_ctx;
+	(void)arg;
 	ctx->status = SR_READY | SR_SEEK_COMPLETE;
-	ctx->irq = true;
-	return (0);
+	set_irq(ctx, true);
 }
 
-uint32_t transfer_seek_complete(uint32_t interval, WD2010_CTX *ctx)
+void transfer_seek_complete(void *arg)
 {
-	/*m68k_end_timeslice();*/
+	WD2010_CTX *ctx = arg;
 	ctx->drq = true;
-	return (0);
 }
 
 uint8_t wd2010_read_reg(WD2010_CTX *ctx, uint8_t addr)
@@ -244,7 +424,7 @@ uint8_t wd2010_read_reg(WD2010_CTX *ctx, uint8_t addr)
 			return ctx->sdh;
 		case WD2010_REG_STATUS:             // Status register
 			// Read from status register clears IRQ
-			ctx->irq = false;
+			set_irq(ctx, false);
 			// Get current status flags (set by last command)
 			// DRQ bit
 			if (ctx->cmd_has_drq) {
@@ -275,7 +455,7 @@ void wd2010_write_reg(WD2010_CTX *ctx, uint8_t addr, uint8_t val)
 	int new_track;
 	int sector_count;
 
-	m68k_end_timeslice();
+	sched_sync();
 
 	/*cpu_log_enabled = 1;*/
 
@@ -312,7 +492,7 @@ void wd2010_write_reg(WD2010_CTX *ctx, uint8_t addr, uint8_t val)
 			break;
 		case WD2010_REG_COMMAND:	// Command register
 			// write to command register clears interrupt request
-			ctx->irq = false;
+			set_irq(ctx, false);
 			ctx->error_reg = 0;
 
 			/*cpu_log_enabled = 1;*/
@@ -320,7 +500,7 @@ void wd2010_write_reg(WD2010_CTX *ctx, uint8_t addr, uint8_t val)
 				case CMD_RESTORE:
 					// Restore. Set track to 0 and throw an IRQ.
 					ctx->track = 0;
-					SDL_AddTimer(WD2010_SEEK_DELAY, (SDL_NewTimerCallback)seek_complete, ctx);
+					sched_add(SCHED_EV_HDC_SEEK, SCHED_MS_TO_CYCLES(WD2010_SEEK_DELAY));
 					break;
 				case CMD_SCAN_ID:
 					ctx->cylinder_high_reg = (ctx->track >> 8) & CYLH_MASK;
@@ -341,7 +521,7 @@ void wd2010_write_reg(WD2010_CTX *ctx, uint8_t addr, uint8_t val)
 						LOG("WD2010 ALERT: track %d out of range", new_track);
 						ctx->status = SR_ERROR;
 						ctx->error_reg = ER_ID_NOT_FOUND;
-						ctx->irq = true;
+						set_irq(ctx, true);
 						break;
 					}
 					// The SDH register provides 3 head select bits; the 4th comes from MCR2.
@@ -351,7 +531,7 @@ void wd2010_write_reg(WD2010_CTX *ctx, uint8_t addr, uint8_t val)
 					ctx->formatting = cmd == CMD_WRITE_FORMAT;
 					switch (cmd){
 						case CMD_SEEK:
-							SDL_AddTimer(WD2010_SEEK_DELAY, (SDL_NewTimerCallback)seek_complete, ctx);
+							sched_add(SCHED_EV_HDC_SEEK, SCHED_MS_TO_CYCLES(WD2010_SEEK_DELAY));
 							break;
 						case CMD_READ_SECTOR:
 							/*XXX: does a separate function to set the head have to be added?*/
@@ -370,7 +550,7 @@ void wd2010_write_reg(WD2010_CTX *ctx, uint8_t addr, uint8_t val)
 								ctx->status = SR_ERROR;
 								ctx->error_reg = ER_ID_NOT_FOUND;
 								// Set IRQ
-								ctx->irq = true;
+								set_irq(ctx, true);
 								break;
 							}
 
@@ -384,24 +564,43 @@ void wd2010_write_reg(WD2010_CTX *ctx, uint8_t addr, uint8_t val)
 								ctx->multi_sector = 0;
 								sector_count = 1;
 							}
-							for (int i=0; i<sector_count; i++) {
-								// Calculate the LBA address of the required sector
-								// LBA = (C * nHeads * nSectors) + (H * nSectors) + S - 1
-								lba = (((ctx->track * ctx->geom_heads * ctx->geom_spt) + (ctx->head * ctx->geom_spt) + ctx->sector) + i);
-								// convert LBA to byte address
-								lba *= ctx->geom_secsz;
-								LOG("\tREAD lba = %zu", lba);
-
-								// Read the sector from the file
-								fseek(ctx->disc_image, lba, SEEK_SET);
-								// TODO: check fread return value! if < secsz, BAIL! (call it a crc error or secnotfound maybe? also log to stderr)
-								ctx->data_len += fread(&ctx->data[ctx->data_len], 1, ctx->geom_secsz, ctx->disc_image);
-								LOG("\tREAD len=%zu, pos=%zu, ssz=%d", ctx->data_len, ctx->data_pos, ctx->geom_secsz);
+							// LBA = (C * nHeads * nSectors) + (H * nSectors) + S - 1
+							lba = ((ctx->track * ctx->geom_heads * ctx->geom_spt) + (ctx->head * ctx->geom_spt) + ctx->sector);
+							if ((ctx->image_map != NULL) && (((lba + sector_count) * ctx->geom_secsz) <= ctx->image_size)) {
+								// The sectors are contiguous in the image, so just point at them
+								ctx->data = ctx->image_map + (lba * ctx->geom_secsz);
+								ctx->data_len = sector_count * ctx->geom_secsz;
+								LOG("\tREAD lba = %zu, len=%zu (mapped)", lba * ctx->geom_secsz, ctx->data_len);
+							} else {
+								ctx->data = ctx->buffer;
+								for (int i=0; i<sector_count; i++) {
+									// Calculate the LBA address of the required sector
+									lba = (((ctx->track * ctx->geom_heads * ctx->geom_spt) + (ctx->head * ctx->geom_spt) + ctx->sector) + i);
+									// convert LBA to byte address
+									lba *= ctx->geom_secsz;
+									LOG("\tREAD lba = %zu", lba);
+
+									if (ctx->image_map != NULL) {
+										// Copy what there is of the sector from the mapped image
+										size_t n = (lba < ctx->image_size) ? ctx->image_size - lba : 0;
+										if (n > (size_t)ctx->geom_secsz) n = ctx->geom_secsz;
+										memcpy(&ctx->data[ctx->data_len], ctx->image_map + lba, n);
+										ctx->data_len += n;
+									} else if (ctx->cache != NULL) {
+										ctx->data_len += diskcache_read(ctx->cache, lba / ctx->geom_secsz, &ctx->data[ctx->data_len], 1);
+									} else {
+										// Read the sector from the file
+										fseek(ctx->disc_image, lba, SEEK_SET);
+										// TODO: check fread return value! if < secsz, BAIL! (call it a crc error or secnotfound maybe? also log to stderr)
+										ctx->data_len += fread(&ctx->data[ctx->data_len], 1, ctx->geom_secsz, ctx->disc_image);
+									}
+									LOG("\tREAD len=%zu, pos=%zu, ssz=%d", ctx->data_len, ctx->data_pos, ctx->geom_secsz);
+								}
 							}
 
 							ctx->status = 0;
 							ctx->status |= (ctx->data_pos < ctx->data_len) ? SR_DRQ | SR_COMMAND_IN_PROGRESS | SR_BUSY : 0x00;
-							/*SDL_AddTimer(WD2010_SEEK_DELAY, (SDL_NewTimerCallback)transfer_seek_complete, ctx);*/
+							/*sched_add(SCHED_EV_HDC_SEEK, SCHED_MS_TO_CYCLES(WD2010_SEEK_DELAY));*/
 							ctx->drq = true;
 
 							break;
@@ -422,7 +621,7 @@ void wd2010_write_reg(WD2010_CTX *ctx, uint8_t addr, uint8_t val)
 								ctx->status = SR_ERROR;
 								ctx->error_reg = ER_ID_NOT_FOUND;
 								// Set IRQ
-								ctx->irq = true;
+								set_irq(ctx, true);
 								break;
 							}
 
@@ -442,9 +641,12 @@ void wd2010_write_reg(WD2010_CTX *ctx, uint8_t addr, uint8_t val)
 							ctx->write_pos = (lba *= ctx->geom_secsz);
 							LOG("\tWRITE lba = %zu", lba);
 
+							// Collect the data in the buffer; write_done() puts it in the image
+							ctx->data = ctx->buffer;
+
 							ctx->status = 0;
 							ctx->status |= (ctx->data_pos < ctx->data_len) ? SR_DRQ | SR_COMMAND_IN_PROGRESS | SR_BUSY : 0x00;
-							/*SDL_AddTimer(WD2010_SEEK_DELAY, (SDL_NewTimerCallback)transfer_seek_complete, ctx);*/
+							/*sched_add(SCHED_EV_HDC_SEEK, SCHED_MS_TO_CYCLES(WD2010_SEEK_DELAY));*/
 							ctx->drq = true;
 
 							break;
@@ -458,7 +660,7 @@ void wd2010_write_reg(WD2010_CTX *ctx, uint8_t addr, uint8_t val)
 					LOG("WD2010: unknown command %x\n", cmd);
 					ctx->status = SR_ERROR;
 					ctx->error_reg = ER_ABORTED_COMMAND;
-					ctx->irq = true;
+					set_irq(ctx, true);
 					break;
 			}
 			break;
@@ -5,6 +5,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include "diskcache.h"
 
 /// WD2010 registers
 typedef enum {
@@ -24,9 +25,17 @@ typedef enum {
 typedef enum {
 	WD2010_ERR_OK			= 0,		///< Operation succeeded
 	WD2010_ERR_BAD_GEOM		= -1,		///< Bad geometry, or image file too small
-	WD2010_ERR_NO_MEMORY	= -2		///< Out of memory
+	WD2010_ERR_NO_MEMORY	= -2,		///< Out of memory
+	WD2010_ERR_MAP_FAILED	= -3		///< Couldn't memory-map the image file
 } WD2010_ERR;
 
+/// When changes to a memory-mapped disc image are written back to the file
+typedef enum {
+	WD2010_SYNC_COMMAND,		///< At the end of every write command
+	WD2010_SYNC_PERIODIC,		///< Whenever wd2010_sync() is called
+	WD2010_SYNC_SHUTDOWN		///< Only when the image is closed
+} WD2010_SYNC;
+
 typedef struct {
 	// Current track, head and sector
 	int						track, head, sector;
@@ -52,9 +61,20 @@ typedef struct {
 	bool					cmd_has_drq;
 	// Current write is a format?
 	bool					formatting;
-	// Data buffer, current DRQ pointer and length
+	// Data buffer, current DRQ pointer and length. The buffer is either the
+	// track buffer or, for reads, a view of the memory-mapped disc image.
 	uint8_t					*data;
 	size_t					data_pos, data_len;
+	// Track buffer
+	uint8_t					*buffer;
+	// Memory-mapped disc image (NULL if the image is accessed through stdio)
+	uint8_t					*image_map;
+	size_t					image_size;
+	// Write-back policy for the mapped image, and whether it has unsynced changes
+	WD2010_SYNC				sync_policy;
+	bool					map_dirty;
+	// Write-back sector cache (NULL if writes go straight to the file)
+	DISKCACHE				*cache;
 	// Current disc image file
 	FILE					*disc_image;
 	// LBA at which to start writing
@@ -71,6 +91,44 @@ typedef struct {
  */
 int wd2010_init(WD2010_CTX *ctx, FILE *fp, int secsz, int spt, int heads);
 
+/**
+ * @brief	Access the disc image through a memory mapping instead of stdio.
+ * @param	ctx		WD2010 context.
+ * @param	policy	When changes are written back to the image file.
+ * @return	WD2010_ERR_OK on success, WD2010_ERR_MAP_FAILED if the image
+ * 			couldn't be mapped (the stdio path is still usable).
+ *
+ * Must be called after wd2010_init(). Sector reads become views into the
+ * mapping, and sector writes are copied into it once the last byte of the
+ * transfer has arrived.
+ */
+int wd2010_map_image(WD2010_CTX *ctx, WD2010_SYNC policy);
+
+/**
+ * @brief	Put a write-back sector cache between the controller and the
+ * 			disc image.
+ * @param	ctx			WD2010 context.
+ * @param	dirty_limit	Number of unwritten bytes at which the cache starts
+ * 						writing back.
+ * @return	WD2010_ERR_OK on success, WD2010_ERR_NO_MEMORY if out of memory,
+ * 			WD2010_ERR_MAP_FAILED if the image isn't a plain file.
+ *
+ * Must be called after wd2010_init(). Can't be combined with
+ * wd2010_map_image().
+ */
+int wd2010_cache_image(WD2010_CTX *ctx, size_t dirty_limit);
+
+/**
+ * @brief	Write any outstanding changes back to the disc image file.
+ * @param	ctx		WD2010 context.
+ *
+ * Waits for the sector cache to drain, syncs a memory-mapped image and
+ * writes back the changed chunks of a compressed one.
+ * Call this regularly when using WD2010_SYNC_PERIODIC, and before saving
+ * or copying the image. Does nothing if there are no outstanding changes.
+ */
+void wd2010_sync(WD2010_CTX *ctx);
+
 /**
  * @brief	Reset a WD2010 context.
  * @param	ctx		WD2010 context.
@@ -125,5 +183,26 @@ uint8_t wd2010_read_data(WD2010_CTX *ctx);
  */
 void wd2010_write_data(WD2010_CTX *ctx, uint8_t val);
 
+/**
+ * @brief	Get direct access to the data buffer for a block DMA transfer.
+ * @param	ctx		WD2010 context
+ * @param	writing	True if the host is writing to the controller
+ * @param	buf		Set to point at the next byte in the data buffer
+ * @return	Number of bytes which may be moved in one go; zero if the
+ * 			buffer is empty or no write command is in progress.
+ *
+ * The caller copies up to the returned number of bytes to or from buf, and
+ * then calls wd2010_dma_done() with the number actually moved.
+ */
+size_t wd2010_dma_buffer(WD2010_CTX *ctx, bool writing, uint8_t **buf);
+
+/**
+ * @brief	Complete a block DMA transfer started with wd2010_dma_buffer().
+ * @param	ctx		WD2010 context
+ * @param	writing	True if the host wrote to the controller
+ * @param	count	Number of bytes moved
+ */
+void wd2010_dma_done(WD2010_CTX *ctx, bool writing, size_t count);
+
 void wd2010_dma_miss(WD2010_CTX *ctx);
 #endif
@@ -1,8 +1,13 @@
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
 #include <malloc.h>
 #include "musashi/m68k.h"
+#include "sched.h"
+#include "irq.h"
 #include "wd279x.h"
+#include "zimage.h"
 
 #ifndef WD279X_DEBUG
 #define NDEBUG
@@ -30,6 +35,13 @@ enum {
 	CMD_FORMAT_TRACK		= 0xF0		///< Format Track
 };
 
+/// Set the controller's interrupt line
+static inline void set_irq(WD2797_CTX *ctx, bool irq)
+{
+	ctx->irq = irq;
+	irq_set(IRQ_FDC, irq);
+}
+
 
 void wd2797_init(WD2797_CTX *ctx)
 {
@@ -38,7 +50,7 @@ void wd2797_init(WD2797_CTX *ctx)
 	ctx->track_reg = 0;
 
 	// no IRQ pending
-	ctx->irq = false;
+	set_irq(ctx, false);
 
 	// no data available
 	ctx->data_pos = ctx->data_len = 0;
@@ -57,8 +69,8 @@ void wd2797_init(WD2797_CTX *ctx)
 	// Last step direction = "towards zero"
 	ctx->last_step_dir = -1;
 
-	// No disc image loaded
-	ctx->disc_image = NULL;
+	// No disc in the drive
+	ctx->disc = NULL;
 	ctx->geom_secsz = ctx->geom_spt = ctx->geom_heads = ctx->geom_tracks = 0;
 }
 
@@ -70,7 +82,7 @@ void wd2797_reset(WD2797_CTX *ctx)
 	ctx->track_reg = 0;
 
 	// no IRQ pending
-	ctx->irq = false;
+	set_irq(ctx, false);
 
 	// no data available
 	ctx->data_pos = ctx->data_len = 0;
@@ -110,7 +122,7 @@ bool wd2797_get_drq(WD2797_CTX *ctx)
 }
 
 
-WD2797_ERR wd2797_load(WD2797_CTX *ctx, FILE *fp, int secsz, int spt, int heads, int writeable)
+WD2797_ERR wd2797_disc_open(WD2797_DISC *disc, FILE *fp, int secsz, int spt, int heads, int writeable)
 {
 	size_t filesize;
 
@@ -126,21 +138,89 @@ WD2797_ERR wd2797_load(WD2797_CTX *ctx, FILE *fp, int secsz, int spt, int heads,
 		return WD2797_ERR_BAD_GEOM;
 	}
 
-	// Allocate enough memory to store one disc track
-	if (ctx->data) {
-		free(ctx->data);
+	// Read the whole disc into memory. Any partial track at the end of the
+	// file is ignored, as it was before.
+	disc->size = (size_t)tracks * heads * spt * secsz;
+	disc->data = malloc(disc->size);
+	disc->dirty = calloc(tracks * heads, sizeof(bool));
+	if (!disc->data || !disc->dirty) {
+		free(disc->data);
+		free(disc->dirty);
+		return WD2797_ERR_NO_MEMORY;
 	}
-	ctx->data = malloc(secsz * spt);
+	if (fread(disc->data, 1, disc->size, fp) != disc->size) {
+		free(disc->data);
+		free(disc->dirty);
+		return WD2797_ERR_BAD_GEOM;
+	}
+
+	disc->fp = fp;
+	disc->tracks = tracks;
+	disc->secsz = secsz;
+	disc->heads = heads;
+	disc->spt = spt;
+	disc->writeable = writeable;
+	return WD2797_ERR_OK;
+}
+
+
+bool wd2797_disc_flush(WD2797_DISC *disc)
+{
+	size_t tracklen = disc->spt * disc->secsz;
+	bool ok = true, written = false;
+
+	if (disc->data == NULL)
+		return true;
+
+	for (int i = 0; i < (disc->tracks * disc->heads); i++) {
+		if (!disc->dirty[i])
+			continue;
+		LOG("\twriting back track %d", i);
+		if ((fseek(disc->fp, i * tracklen, SEEK_SET) != 0) ||
+				(fwrite(&disc->data[i * tracklen], 1, tracklen, disc->fp) != tracklen)) {
+			ok = false;
+			continue;
+		}
+		disc->dirty[i] = false;
+		written = true;
+	}
+	if (written && !zimage_sync(disc->fp))
+		ok = false;
+
+	return ok;
+}
+
+
+void wd2797_disc_close(WD2797_DISC *disc)
+{
+	if (!disc->data)
+		return;
+
+	if (!wd2797_disc_flush(disc))
+		fprintf(stderr, "WD279X: error writing back floppy disc image\n");
+	free(disc->data);
+	free(disc->dirty);
+	disc->data = NULL;
+	disc->dirty = NULL;
+}
+
+
+WD2797_ERR wd2797_load(WD2797_CTX *ctx, WD2797_DISC *disc)
+{
+	wd2797_unload(ctx);
+
+	// Allocate enough memory to store one disc track
+	ctx->data = malloc(disc->secsz * disc->spt);
 	if (!ctx->data)
 		return WD2797_ERR_NO_MEMORY;
 
 	// Load the image and the geometry data
-	ctx->disc_image = fp;
-	ctx->geom_tracks = tracks;
-	ctx->geom_secsz = secsz;
-	ctx->geom_heads = heads;
-	ctx->geom_spt = spt;
-	ctx->writeable = writeable;
+	ctx->disc = disc;
+	ctx->geom_tracks = disc->tracks;
+	ctx->geom_secsz = disc->secsz;
+	ctx->geom_heads = disc->heads;
+	ctx->geom_spt = disc->spt;
+	ctx->writeable = disc->writeable;
 	return WD2797_ERR_OK;
 }
 
@@ -153,23 +233,28 @@ void wd2797_unload(WD2797_CTX *ctx)
 		ctx->data = NULL;
 	}
 
-	// Clear file pointer
-	ctx->disc_image = NULL;
+	// Write back anything which changed while the disc was in the drive
+	if (ctx->disc && !wd2797_disc_flush(ctx->disc))
+		fprintf(stderr, "WD279X: error writing back floppy disc image\n");
+
+	// Clear disc pointer
+	ctx->disc = NULL;
 
 	// Clear the disc geometry
 	ctx->geom_tracks = ctx->geom_secsz = ctx->geom_spt = ctx->geom_heads = 0;
+	ctx->data_pos = ctx->data_len = 0;
 }
 
 
 uint8_t wd2797_read_reg(WD2797_CTX *ctx, uint8_t addr)
 {
 	uint8_t temp = 0;
-	m68k_end_timeslice();
+	sched_sync();
 
 	switch (addr & 0x03) {
 		case WD2797_REG_STATUS:		// Status register
 			// Read from status register clears IRQ
-			ctx->irq = false;
+			set_irq(ctx, false);
 
 			// Get current status flags (set by last command)
 			// DRQ bit
@@ -197,7 +282,7 @@ uint8_t wd2797_read_reg(WD2797_CTX *ctx, uint8_t addr)
 				// set IRQ if this is the last data byte
 				if (ctx->data_pos == (ctx->data_len-1)) {
 					// Set IRQ
-					ctx->irq = true;
+					set_irq(ctx, true);
 				}
 				// return data byte and increment pointer
 				return ctx->data[ctx->data_pos++];
@@ -214,25 +299,46 @@ uint8_t wd2797_read_reg(WD2797_CTX *ctx, uint8_t addr)
 }
 
 
+/**
+ * @brief	Finish a write command once the host has sent the last data byte.
+ */
+static void write_done(WD2797_CTX *ctx)
+{
+	if (!ctx->formatting && ((size_t)ctx->write_pos < ctx->disc->size)) {
+		// Update the in-memory image and mark the tracks it covers as changed
+		size_t len = ctx->data_len;
+		size_t tracklen = ctx->geom_spt * ctx->geom_secsz;
+		if (len > (ctx->disc->size - ctx->write_pos))
+			len = ctx->disc->size - ctx->write_pos;
+		memcpy(&ctx->disc->data[ctx->write_pos], ctx->data, len);
+		for (size_t t = ctx->write_pos / tracklen; t <= (ctx->write_pos + len - 1) / tracklen; t++)
+			ctx->disc->dirty[t] = true;
+	}
+	// Set IRQ and reset write pointer
+	set_irq(ctx, true);
+	ctx->write_pos = -1;
+	ctx->formatting = false;
+}
+
 void wd2797_write_reg(WD2797_CTX *ctx, uint8_t addr, uint8_t val)
 {
 	uint8_t cmd = val & CMD_MASK;
 	size_t lba;
 	bool is_type1 = false;
 	int temp;
-	m68k_end_timeslice();
+	sched_sync();
 
 	switch (addr) {
 		case WD2797_REG_COMMAND:	// Command register
 			// write to command register clears interrupt request
 			LOG("WD279X: command %x", val);		
-			ctx->irq = false;
+			set_irq(ctx, false);
 
 			// Is the drive ready?
-			if (ctx->disc_image == NULL) {
+			if (ctx->disc == NULL) {
 				// No disc image, thus the drive is busy.
 				ctx->status = 0x80;
-				ctx->irq = true;
+				set_irq(ctx, true);
 				return;
 			}
 
@@ -314,7 +420,7 @@ void wd2797_write_reg(WD2797_CTX *ctx, uint8_t addr, uint8_t val)
 				// 		TODO: Set a timer for seeks, and ONLY clear BUSY when that timer expires. Need periodics for that.
 				
 				// Set IRQ
-				ctx->irq = true;
+				set_irq(ctx, true);
 				return;
 			}
 
@@ -324,7 +430,7 @@ void wd2797_write_reg(WD2797_CTX *ctx, uint8_t addr, uint8_t val)
 			ctx->cmd_has_drq = true;
 
 			// If drive isn't ready, then set status B7 and exit
-			if (ctx->disc_image == NULL) {
+			if (ctx->disc == NULL) {
 				ctx->status = 0x80;
 				return;
 			}
@@ -337,7 +443,7 @@ void wd2797_write_reg(WD2797_CTX *ctx, uint8_t addr, uint8_t val)
 					ctx->status = 0x40;
 
 					// Set IRQ
-					ctx->irq = true;
+					set_irq(ctx, true);
 
 					return;
 				}
@@ -389,7 +495,7 @@ void wd2797_write_reg(WD2797_CTX *ctx, uint8_t addr, uint8_t val)
 						// CHS parameters exceed limits
 						ctx->status = 0x10;		// Record Not Found
 						// Set IRQ
-						ctx->irq = true;
+						set_irq(ctx, true);
 						break;
 					}
 
@@ -410,13 +516,24 @@ void wd2797_write_reg(WD2797_CTX *ctx, uint8_t addr, uint8_t val)
 						lba *= ctx->geom_secsz;
 						LOG("\tREAD lba = %lu", lba);
 
-						// Read the sector from the file
-						fseek(ctx->disc_image, lba, SEEK_SET);
-						// TODO: check fread return value! if < secsz, BAIL! (call it a crc error or secnotfound maybe? also log to stderr)
-						ctx->data_len += fread(&ctx->data[ctx->data_len], 1, ctx->geom_secsz, ctx->disc_image);
+						// Copy the sector from the in-memory image. A multi-sector
+						// read stops at the end of the disc.
+						if ((lba + ctx->geom_secsz) > ctx->disc->size)
+							break;
+						memcpy(&ctx->data[ctx->data_len], &ctx->disc->data[lba], ctx->geom_secsz);
+						ctx->data_len += ctx->geom_secsz;
 						LOG("\tREAD len=%lu, pos=%lu, ssz=%d", ctx->data_len, ctx->data_pos, ctx->geom_secsz);
 					}
 
+					if (ctx->data_len == 0) {
+						LOG("*** WD2797 ALERT: sector past the end of the disc image! CHS=%d:%d:%d",
+								ctx->track, ctx->head, ctx->sector);
+						ctx->status = 0x10;		// Record Not Found
+						// Set IRQ
+						set_irq(ctx, true);
+						break;
+					}
+
 					ctx->status = 0;
 					// B6 = 0
 					// B5 = Record Type -- 1 = deleted, 0 = normal. We can't emulate anything but normal data blocks.
@@ -436,7 +553,7 @@ void wd2797_write_reg(WD2797_CTX *ctx, uint8_t addr, uint8_t val)
 					// B2 = Lost Data. Caused if DRQ isn't serviced in time. FIXME-not emulated
 					// B1 = DRQ. Data request.
 					// ctx->status |= (ctx->data_pos < ctx->data_len) ? 0x02 : 0x00;
-					ctx->irq = true;
+					set_irq(ctx, true);
 					ctx->status = 0x10;
 					break;
 
@@ -497,7 +614,7 @@ void wd2797_write_reg(WD2797_CTX *ctx, uint8_t addr, uint8_t val)
 					ctx->data_pos = ctx->data_len = 0;
 					if (cmd & 8){
 						// Set IRQ
-						ctx->irq = true;
+						set_irq(ctx, true);
 					}
 					break;
 			}
@@ -522,27 +639,46 @@ void wd2797_write_reg(WD2797_CTX *ctx, uint8_t addr, uint8_t val)
 				ctx->data_pos++;
 
 				// set IRQ and write data if this is the last data byte
-				if (ctx->data_pos == ctx->data_len) {
-					if (!ctx->formatting){
-						fseek(ctx->disc_image, ctx->write_pos, SEEK_SET);
-						fwrite(ctx->data, 1, ctx->data_len, ctx->disc_image);
-						fflush(ctx->disc_image);
-					}
-					// Set IRQ and reset write pointer
-					ctx->irq = true;
-					ctx->write_pos = -1;
-					ctx->formatting = false;
-				}
+				if (ctx->data_pos == ctx->data_len)
+					write_done(ctx);
 
 			}
 			break;
 	}
 }
 
+size_t wd2797_dma_buffer(WD2797_CTX *ctx, bool writing, uint8_t **buf)
+{
+	// Format commands don't keep the data they're sent, so leave those to
+	// the data register.
+	if ((ctx->data_pos >= ctx->data_len) || (writing && (ctx->write_pos < 0 || ctx->formatting)))
+		return 0;
+
+	*buf = ctx->data + ctx->data_pos;
+	return ctx->data_len - ctx->data_pos;
+}
+
+void wd2797_dma_done(WD2797_CTX *ctx, bool writing, size_t count)
+{
+	if (count == 0)
+		return;
+
+	ctx->data_pos += count;
+	if (writing) {
+		// Save the value written into the data register
+		ctx->data_reg = ctx->data[ctx->data_pos - 1];
+		if (ctx->data_pos == ctx->data_len)
+			write_done(ctx);
+	} else if (ctx->data_pos == ctx->data_len) {
+		// Set IRQ, the last data byte has been read
+		set_irq(ctx, true);
+	}
+}
+
 void wd2797_dma_miss(WD2797_CTX *ctx)
 {
 	ctx->data_pos = ctx->data_len;
 	ctx->write_pos = 0;
 	ctx->status = 4; /* lost data */
-	ctx->irq = true;
+	set_irq(ctx, true);
 }
@@ -22,6 +22,28 @@ typedef enum {
 	WD2797_ERR_NO_MEMORY	= -2		///< Out of memory
 } WD2797_ERR;
 
+/**
+ * @brief A floppy disc image, held in memory.
+ *
+ * The whole image is read in when it is opened, so the controller never
+ * touches the filesystem while the emulated machine is running. Tracks
+ * which have been written are copied back to the image file when the disc
+ * is flushed, ejected or closed.
+ */
+typedef struct {
+	/// Image file, used to write changed tracks back
+	FILE					*fp;
+	/// Disc contents and size in bytes
+	uint8_t					*data;
+	size_t					size;
+	/// Geometry
+	int						secsz, spt, heads, tracks;
+	/// Write protect flag
+	int						writeable;
+	/// One flag per track per side; true if it has changed since it was written back
+	bool					*dirty;
+} WD2797_DISC;
+
 typedef struct {
 	// Current track, head and sector
 	int						track, head, sector;
@@ -42,8 +64,8 @@ typedef struct {
 	// Data buffer, current DRQ pointer and length
 	uint8_t					*data;
 	size_t					data_pos, data_len;
-	// Current disc image file
-	FILE					*disc_image;
+	// Disc in the drive, or NULL if the drive is empty
+	WD2797_DISC				*disc;
 	// Write protect flag
 	int						writeable;
 	// LBA at which to start writing
@@ -88,18 +110,43 @@ bool wd2797_get_irq(WD2797_CTX *ctx);
 bool wd2797_get_drq(WD2797_CTX *ctx);
 
 /**
- * @brief	Assign a disc image to the WD2797.
- * @param	ctx		WD2797 context.
- * @param	fp		Disc image file, already opened in "r+b" mode.
+ * @brief	Read a disc image into memory.
+ * @param	disc	Disc to set up.
+ * @param	fp		Disc image file, already opened in "r+b" mode (or "rb" if
+ * 					not writeable). It must stay open until the disc is closed.
  * @param	secsz	Sector size: either 128, 256, 512 or 1024.
  * @param	spt		Sectors per track.
  * @param	heads	Number of heads (1 or 2).
- * @return	Error code; WD279X_E_OK if everything worked OK.
+ * @param	writeable	Nonzero if the disc may be written to.
+ * @return	Error code; WD2797_ERR_OK if everything worked OK.
+ */
+WD2797_ERR wd2797_disc_open(WD2797_DISC *disc, FILE *fp, int secsz, int spt, int heads, int writeable);
+
+/**
+ * @brief	Write changed tracks back to the image file.
+ * @param	disc	Disc to flush.
+ * @return	true on success, false if a write failed (the tracks stay dirty).
+ */
+bool wd2797_disc_flush(WD2797_DISC *disc);
+
+/**
+ * @brief	Flush a disc and free its memory. The image file isn't closed.
+ * @param	disc	Disc to close. Must not be in a drive.
  */
-WD2797_ERR wd2797_load(WD2797_CTX *ctx, FILE *fp, int secsz, int spt, int heads, int writeable);
+void wd2797_disc_close(WD2797_DISC *disc);
 
 /**
- * @brief	Deassign the current image file.
+ * @brief	Insert a disc into the drive.
+ * @param	ctx		WD2797 context.
+ * @param	disc	Disc, opened with wd2797_disc_open().
+ * @return	Error code; WD2797_ERR_OK if everything worked OK.
+ *
+ * Any disc already in the drive is ejected first.
+ */
+WD2797_ERR wd2797_load(WD2797_CTX *ctx, WD2797_DISC *disc);
+
+/**
+ * @brief	Eject the current disc, writing back any tracks which changed.
  * @param	ctx		WD2797 context.
  */
 void wd2797_unload(WD2797_CTX *ctx);
@@ -119,5 +166,26 @@ uint8_t wd2797_read_reg(WD2797_CTX *ctx, uint8_t addr);
  */
 void wd2797_write_reg(WD2797_CTX *ctx, uint8_t addr, uint8_t val);
 
+/**
+ * @brief	Get direct access to the data buffer for a block DMA transfer.
+ * @param	ctx		WD2797 context
+ * @param	writing	True if the host is writing to the controller
+ * @param	buf		Set to point at the next byte in the data buffer
+ * @return	Number of bytes which may be moved in one go; zero if the
+ * 			buffer is empty or the data must go through the data register.
+ *
+ * The caller copies up to the returned number of bytes to or from buf, and
+ * then calls wd2797_dma_done() with the number actually moved.
+ */
+size_t wd2797_dma_buffer(WD2797_CTX *ctx, bool writing, uint8_t **buf);
+
+/**
+ * @brief	Complete a block DMA transfer started with wd2797_dma_buffer().
+ * @param	ctx		WD2797 context
+ * @param	writing	True if the host wrote to the controller
+ * @param	count	Number of bytes moved
+ */
+void wd2797_dma_done(WD2797_CTX *ctx, bool writing, size_t count);
+
 void wd2797_dma_miss(WD2797_CTX *ctx);
 #endif
@@ -0,0 +1,659 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "zimage.h"
+
+#ifndef ZIMAGE_DEBUG
+#define NDEBUG
+#endif
+#include "utils.h"
+
+/**
+ * Compressed image layout. All fields are little-endian.
+ *
+ *   Header		ZIMAGE_HEADER_SIZE bytes: magic, chunk size (32 bits),
+ *   			number of chunks (32 bits), uncompressed size (64 bits)
+ *   Index		one ZIMAGE_INDEX_ENTRY per chunk: offset of the chunk's data
+ *   			(64 bits), length of the data (32 bits), space reserved for
+ *   			the data (32 bits)
+ *   Data		chunks, deflate compressed
+ *
+ * A chunk with a length of zero is all zeroes. A chunk whose length equals
+ * its uncompressed size is stored as it is.
+ *
+ * A chunk is never rewritten where it is: the new data goes into free space
+ * and is flushed to disc before the index entry is changed to point at it,
+ * so the image is intact whenever the writes stop. The space between chunks
+ * isn't recorded anywhere; it's worked out from the index on opening.
+ *
+ * Writes only change the decompressed chunk in the cache. It's compressed
+ * and written back when it leaves the cache, zimage_sync() is called or the
+ * image is closed, so a burst of sector writes to one chunk costs one
+ * compression and one flush.
+ */
+static const char ZIMAGE_MAGIC[8] = "FBZIMG1\n";
+
+#define ZIMAGE_HEADER_SIZE		64
+#define ZIMAGE_INDEX_ENTRY		16
+
+/// Number of decompressed chunks kept in memory
+#define ZIMAGE_CACHE_CHUNKS		8
+
+/// Marks an empty cache entry
+#define NO_CHUNK				UINT32_MAX
+
+/// Space in the file which no chunk is using
+typedef struct {
+	uint64_t	offset;
+	uint32_t	len;
+	bool		pending;		///< Freed since the last flush, so the index may still point to it
+} ZIMAGE_EXTENT;
+
+/// Decompressed chunk
+typedef struct {
+	uint32_t	chunk;			///< Chunk number, or NO_CHUNK
+	uint32_t	last_used;		///< Value of the use counter when last used
+	bool		dirty;			///< Changed since it was last written back
+	uint8_t		*data;
+} ZIMAGE_CACHED;
+
+typedef struct ZIMAGE ZIMAGE;
+
+/// Open compressed image
+struct ZIMAGE {
+	FILE			*fp;					///< Stream onto the image
+	ZIMAGE			*next;					///< Next open image
+	int				fd;
+	uint32_t		chunk_size, nchunks;
+	uint64_t		size;					///< Uncompressed size
+	uint64_t		*offset;				///< Index: where each chunk's data is
+	uint32_t		*length, *reserved;		///< Index: data length and space reserved
+	off_t			file_end;				///< End of the last chunk's data
+	ZIMAGE_EXTENT	*free;					///< Unused space before file_end
+	size_t			nfree, free_alloc;
+	off64_t			pos;					///< Current stream position
+	ZIMAGE_CACHED	cache[ZIMAGE_CACHE_CHUNKS];
+	uint32_t		use_count;
+	uint8_t			*zbuf;					///< Compressed data buffer
+	size_t			zbuf_size;
+};
+
+/// Open images, so zimage_sync() can find one from its stream
+static ZIMAGE *open_images = NULL;
+/// Protects open_images; images may be opened on any thread
+static char open_lock = 0;
+
+static void lock_open_images(void)
+{
+	while (__atomic_test_and_set(&open_lock, __ATOMIC_ACQUIRE))
+		;
+}
+
+static void unlock_open_images(void)
+{
+	__atomic_clear(&open_lock, __ATOMIC_RELEASE);
+}
+
+static void put_le(uint8_t *p, uint64_t val, int bytes)
+{
+	for (int i = 0; i < bytes; i++, val >>= 8)
+		p[i] = val & 0xff;
+}
+
+static uint64_t get_le(const uint8_t *p, int bytes)
+{
+	uint64_t val = 0;
+	for (int i = bytes - 1; i >= 0; i--)
+		val = (val << 8) | p[i];
+	return val;
+}
+
+/// Uncompressed size of a chunk (the last one may be short)
+static inline size_t chunk_len(ZIMAGE *z, uint32_t chunk)
+{
+	uint64_t start = (uint64_t)chunk * z->chunk_size;
+	return ((z->size - start) < z->chunk_size) ? (size_t)(z->size - start) : z->chunk_size;
+}
+
+static bool write_index_entry(ZIMAGE *z, uint32_t chunk)
+{
+	uint8_t e[ZIMAGE_INDEX_ENTRY];
+
+	put_le(e, z->offset[chunk], 8);
+	put_le(e + 8, z->length[chunk], 4);
+	put_le(e + 12, z->reserved[chunk], 4);
+	return pwrite(z->fd, e, sizeof(e), ZIMAGE_HEADER_SIZE + ((off_t)chunk * ZIMAGE_INDEX_ENTRY)) == sizeof(e);
+}
+
+/**
+ * @brief	Add an extent to the free space list.
+ * @return	false if out of memory (the space is lost until the image is
+ * 			reopened).
+ */
+static bool add_free(ZIMAGE *z, uint64_t offset, uint32_t len, bool pending)
+{
+	if (z->nfree == z->free_alloc) {
+		size_t n = z->free_alloc ? (z->free_alloc * 2) : 16;
+		ZIMAGE_EXTENT *f = realloc(z->free, n * sizeof(ZIMAGE_EXTENT));
+		if (f == NULL)
+			return false;
+		z->free = f;
+		z->free_alloc = n;
+	}
+	z->free[z->nfree].offset = offset;
+	z->free[z->nfree].len = len;
+	z->free[z->nfree].pending = pending;
+	z->nfree++;
+	return true;
+}
+
+/**
+ * @brief	Give up the space a chunk was using.
+ * @param	pending	true if the index on disc may still point to it.
+ */
+static bool release_space(ZIMAGE *z, uint64_t offset, uint32_t len, bool pending)
+{
+	if (len == 0)
+		return true;
+
+	// Space at the end of the file is given back to the end of the file,
+	// unless it mustn't be reused yet
+	if (!pending && ((off_t)(offset + len) == z->file_end)) {
+		z->file_end = offset;
+		return true;
+	}
+	return add_free(z, offset, len, pending);
+}
+
+/**
+ * @brief	Find space for a chunk's data: the smallest free extent it fits
+ * 			in, or a new one at the end of the file.
+ *
+ * New extents have room for a whole uncompressed chunk, so once they're
+ * free again any chunk can use them.
+ */
+static void alloc_space(ZIMAGE *z, uint32_t len, uint64_t *offset, uint32_t *reserved)
+{
+	size_t best = z->nfree;
+
+	for (size_t i = 0; i < z->nfree; i++)
+		if (!z->free[i].pending && (z->free[i].len >= len) &&
+				((best == z->nfree) || (z->free[i].len < z->free[best].len)))
+			best = i;
+
+	if (best < z->nfree) {
+		*offset = z->free[best].offset;
+		*reserved = z->free[best].len;
+		z->free[best] = z->free[--z->nfree];
+	} else {
+		*offset = z->file_end;
+		*reserved = (len > z->chunk_size) ? len : z->chunk_size;
+		z->file_end += *reserved;
+	}
+}
+
+/**
+ * @brief	Compress a chunk and write it back to the image.
+ */
+static bool put_chunk(ZIMAGE *z, uint32_t chunk, const uint8_t *data)
+{
+	size_t len = chunk_len(z, chunk);
+	const uint8_t *src = z->zbuf;
+	uLongf zlen = z->zbuf_size;
+	size_t i;
+
+	// All-zero chunks take no space at all
+	for (i = 0; (i < len) && (data[i] == 0); i++)
+		;
+	if (i == len) {
+		zlen = 0;
+	} else if ((compress2(z->zbuf, &zlen, data, len, Z_BEST_SPEED) != Z_OK) || (zlen >= len)) {
+		// Doesn't compress, store it as it is
+		src = data;
+		zlen = len;
+	}
+
+	// Write the new data somewhere else, and make sure it's on disc before
+	// the index points to it. An index entry written before a flush may not
+	// be on disc yet either, so space freed since then isn't reused until
+	// this flush has been done.
+	uint64_t offset = 0, old_offset = z->offset[chunk];
+	uint32_t reserved = 0, old_length = z->length[chunk], old_reserved = z->reserved[chunk];
+	if (zlen > 0) {
+		alloc_space(z, zlen, &offset, &reserved);
+		if ((pwrite(z->fd, src, zlen, offset) != (ssize_t)zlen) || (fdatasync(z->fd) != 0)) {
+			release_space(z, offset, reserved, false);
+			return false;
+		}
+		for (size_t f = 0; f < z->nfree; f++)
+			z->free[f].pending = false;
+	}
+
+	z->offset[chunk] = offset;
+	z->length[chunk] = zlen;
+	z->reserved[chunk] = reserved;
+	if (!write_index_entry(z, chunk)) {
+		// The entry on disc may be either one, so neither copy can be freed
+		z->offset[chunk] = old_offset;
+		z->length[chunk] = old_length;
+		z->reserved[chunk] = old_reserved;
+		return false;
+	}
+	release_space(z, old_offset, old_reserved, true);
+	return true;
+}
+
+/**
+ * @brief	Write a cached chunk back to the image if it has changed.
+ * @return	false on error; the chunk stays in the cache, still changed.
+ */
+static bool write_back(ZIMAGE *z, ZIMAGE_CACHED *c)
+{
+	if (!c->dirty)
+		return true;
+	if (!put_chunk(z, c->chunk, c->data)) {
+		fprintf(stderr, "ERROR: Couldn't write chunk %u back to the compressed disc image.\n", c->chunk);
+		return false;
+	}
+	LOG("chunk %u written back", c->chunk);
+	c->dirty = false;
+	return true;
+}
+
+/// Write back every cached chunk which has changed
+static bool write_back_all(ZIMAGE *z)
+{
+	bool ok = true;
+
+	for (int i = 0; i < ZIMAGE_CACHE_CHUNKS; i++)
+		ok = write_back(z, &z->cache[i]) && ok;
+	return ok;
+}
+
+/**
+ * @brief	Get a chunk's uncompressed data, decompressing it if need be.
+ * @return	Pointer to the cache entry, or NULL on error.
+ */
+static ZIMAGE_CACHED *get_chunk(ZIMAGE *z, uint32_t chunk)
+{
+	ZIMAGE_CACHED *c = NULL;
+	size_t len = chunk_len(z, chunk);
+
+	// Use the cached copy if there is one, otherwise replace an empty entry
+	// or the least recently used one
+	for (int i = 0; i < ZIMAGE_CACHE_CHUNKS; i++) {
+		ZIMAGE_CACHED *e = &z->cache[i];
+		if (e->chunk == chunk) {
+			e->last_used = ++z->use_count;
+			return e;
+		}
+		if ((c == NULL) || ((c->chunk != NO_CHUNK) && ((e->chunk == NO_CHUNK) || (e->last_used < c->last_used))))
+			c = e;
+	}
+	if ((c->chunk != NO_CHUNK) && !write_back(z, c))
+		return NULL;
+	c->chunk = NO_CHUNK;
+
+	if (z->length[chunk] == 0) {
+		memset(c->data, 0, len);
+	} else if (z->length[chunk] == len) {
+		if (pread(z->fd, c->data, len, z->offset[chunk]) != (ssize_t)len)
+			return NULL;
+	} else {
+		uLongf out_len = len;
+		if ((z->length[chunk] > z->zbuf_size) ||
+				(pread(z->fd, z->zbuf, z->length[chunk], z->offset[chunk]) != (ssize_t)z->length[chunk]) ||
+				(uncompress(c->data, &out_len, z->zbuf, z->length[chunk]) != Z_OK) ||
+				(out_len != len)) {
+			fprintf(stderr, "ERROR: Compressed disc image chunk %u is damaged.\n", chunk);
+			return NULL;
+		}
+	}
+	LOG("chunk %u loaded", chunk);
+
+	c->chunk = chunk;
+	c->last_used = ++z->use_count;
+	return c;
+}
+
+static ssize_t zimage_read(void *cookie, char *buf, size_t size)
+{
+	ZIMAGE *z = cookie;
+	size_t done = 0;
+
+	if ((uint64_t)z->pos >= z->size)
+		return 0;
+	if (size > (z->size - z->pos))
+		size = z->size - z->pos;
+
+	while (done < size) {
+		uint32_t chunk = z->pos / z->chunk_size;
+		size_t off = z->pos % z->chunk_size;
+		size_t n = chunk_len(z, chunk) - off;
+		if (n > (size - done))
+			n = size - done;
+
+		ZIMAGE_CACHED *c = get_chunk(z, chunk);
+		if (c == NULL)
+			return (done > 0) ? (ssize_t)done : -1;
+		memcpy(buf + done, c->data + off, n);
+		done += n;
+		z->pos += n;
+	}
+
+	return done;
+}
+
+static ssize_t zimage_write(void *cookie, const char *buf, size_t size)
+{
+	ZIMAGE *z = cookie;
+	size_t done = 0;
+
+	// The chunks are only written back later, so nothing after the chunk is
+	// in the cache can fail part way through
+	while ((done < size) && ((uint64_t)z->pos < z->size)) {
+		uint32_t chunk = z->pos / z->chunk_size;
+		size_t off = z->pos % z->chunk_size;
+		size_t n = chunk_len(z, chunk) - off;
+		if (n > (size - done))
+			n = size - done;
+
+		ZIMAGE_CACHED *c = get_chunk(z, chunk);
+		if (c == NULL)
+			break;
+		memcpy(c->data + off, buf + done, n);
+		c->dirty = true;
+		done += n;
+		z->pos += n;
+	}
+
+	return done;
+}
+
+static int zimage_seek(void *cookie, off64_t *offset, int whence)
+{
+	ZIMAGE *z = cookie;
+	off64_t pos;
+
+	switch (whence) {
+		case SEEK_SET:	pos = *offset;				break;
+		case SEEK_CUR:	pos = z->pos + *offset;		break;
+		case SEEK_END:	pos = z->size + *offset;	break;
+		default:		errno = EINVAL;				return -1;
+	}
+	if (pos < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	z->pos = *offset = pos;
+	return 0;
+}
+
+static int zimage_close(void *cookie)
+{
+	ZIMAGE *z = cookie;
+	bool ok = true;
+
+	lock_open_images();
+	for (ZIMAGE **p = &open_images; *p != NULL; p = &(*p)->next) {
+		if (*p == z) {
+			*p = z->next;
+			break;
+		}
+	}
+	unlock_open_images();
+
+	if (z->fd >= 0) {
+		ok = write_back_all(z);
+		close(z->fd);
+	}
+	for (int i = 0; i < ZIMAGE_CACHE_CHUNKS; i++)
+		free(z->cache[i].data);
+	free(z->offset);
+	free(z->length);
+	free(z->reserved);
+	free(z->free);
+	free(z->zbuf);
+	free(z);
+	return ok ? 0 : -1;
+}
+
+/// qsort() comparison for extents, by where they start
+static int by_offset(const void *a, const void *b)
+{
+	uint64_t oa = ((const ZIMAGE_EXTENT *)a)->offset, ob = ((const ZIMAGE_EXTENT *)b)->offset;
+	return (oa > ob) - (oa < ob);
+}
+
+/**
+ * @brief	Work out which parts of the file no chunk is using, and where the
+ * 			chunk data ends.
+ * @param	data_start	Where chunk data starts, after the index.
+ * @return	false if out of memory.
+ */
+static bool find_free_space(ZIMAGE *z, uint64_t data_start)
+{
+	ZIMAGE_EXTENT *used = malloc((z->nchunks + 1) * sizeof(ZIMAGE_EXTENT));
+	uint64_t end = data_start;
+	uint32_t n = 0;
+	bool ok = true;
+
+	if (used == NULL)
+		return false;
+	for (uint32_t i = 0; i < z->nchunks; i++) {
+		if (z->reserved[i] > 0) {
+			used[n].offset = z->offset[i];
+			used[n++].len = z->reserved[i];
+		}
+	}
+	qsort(used, n, sizeof(ZIMAGE_EXTENT), by_offset);
+
+	for (uint32_t i = 0; ok && (i < n); i++) {
+		while (ok && (used[i].offset > end)) {
+			uint64_t gap = used[i].offset - end;
+			uint32_t len = (gap > UINT32_MAX) ? UINT32_MAX : (uint32_t)gap;
+			ok = add_free(z, end, len, false);
+			end += len;
+		}
+		if ((used[i].offset + used[i].len) > end)
+			end = used[i].offset + used[i].len;
+	}
+	z->file_end = end;
+
+	free(used);
+	return ok;
+}
+
+/**
+ * @brief	Set up a ZIMAGE from a compressed image's header and index.
+ * @return	false if the file isn't a valid compressed image.
+ */
+static bool load_index(ZIMAGE *z)
+{
+	uint8_t hdr[ZIMAGE_HEADER_SIZE], *index;
+	size_t index_len;
+
+	if ((pread(z->fd, hdr, sizeof(hdr), 0) != sizeof(hdr)) || (memcmp(hdr, ZIMAGE_MAGIC, sizeof(ZIMAGE_MAGIC)) != 0))
+		return false;
+	z->chunk_size = get_le(hdr + 8, 4);
+	z->nchunks = get_le(hdr + 12, 4);
+	z->size = get_le(hdr + 16, 8);
+	if ((z->chunk_size == 0) || (z->nchunks != ((z->size + z->chunk_size - 1) / z->chunk_size)))
+		return false;
+
+	index_len = (size_t)z->nchunks * ZIMAGE_INDEX_ENTRY;
+	z->offset = malloc(z->nchunks * sizeof(uint64_t));
+	z->length = malloc(z->nchunks * sizeof(uint32_t));
+	z->reserved = malloc(z->nchunks * sizeof(uint32_t));
+	z->zbuf_size = compressBound(z->chunk_size);
+	z->zbuf = malloc(z->zbuf_size);
+	index = malloc(index_len);
+	if (!z->offset || !z->length || !z->reserved || !z->zbuf || !index) {
+		free(index);
+		return false;
+	}
+	for (int i = 0; i < ZIMAGE_CACHE_CHUNKS; i++) {
+		z->cache[i].chunk = NO_CHUNK;
+		if ((z->cache[i].data = malloc(z->chunk_size)) == NULL) {
+			free(index);
+			return false;
+		}
+	}
+
+	if (pread(z->fd, index, index_len, ZIMAGE_HEADER_SIZE) != (ssize_t)index_len) {
+		free(index);
+		return false;
+	}
+	for (uint32_t i = 0; i < z->nchunks; i++) {
+		z->offset[i] = get_le(index + (i * ZIMAGE_INDEX_ENTRY), 8);
+		z->length[i] = get_le(index + (i * ZIMAGE_INDEX_ENTRY) + 8, 4);
+		z->reserved[i] = get_le(index + (i * ZIMAGE_INDEX_ENTRY) + 12, 4);
+		// All-zero chunks don't own any space
+		if (z->length[i] == 0)
+			z->offset[i] = z->reserved[i] = 0;
+		else if (z->reserved[i] < z->length[i])
+			z->reserved[i] = z->length[i];
+	}
+	free(index);
+
+	LOG("compressed image, %u chunks of %u bytes, %llu bytes uncompressed",
+			z->nchunks, z->chunk_size, (unsigned long long)z->size);
+	return find_free_space(z, ZIMAGE_HEADER_SIZE + index_len);
+}
+
+FILE *zimage_open(const char *filename, bool writeable)
+{
+	static const cookie_io_functions_t io = {
+		.read	= zimage_read,
+		.write	= zimage_write,
+		.seek	= zimage_seek,
+		.close	= zimage_close
+	};
+	char magic[sizeof(ZIMAGE_MAGIC)];
+	FILE *fp;
+
+	ZIMAGE *z = calloc(1, sizeof(ZIMAGE));
+	if (z == NULL)
+		return NULL;
+	if ((z->fd = open(filename, writeable ? O_RDWR : O_RDONLY)) < 0) {
+		zimage_close(z);
+		return NULL;
+	}
+
+	// Anything without the magic number is a plain image
+	if ((pread(z->fd, magic, sizeof(magic), 0) != sizeof(magic)) || (memcmp(magic, ZIMAGE_MAGIC, sizeof(magic)) != 0)) {
+		zimage_close(z);
+		return fopen(filename, writeable ? "r+b" : "rb");
+	}
+
+	if (!load_index(z)) {
+		fprintf(stderr, "ERROR: '%s' is not a valid compressed disc image.\n", filename);
+		zimage_close(z);
+		return NULL;
+	}
+	if ((fp = fopencookie(z, writeable ? "r+" : "r", io)) == NULL) {
+		zimage_close(z);
+		return NULL;
+	}
+
+	z->fp = fp;
+	lock_open_images();
+	z->next = open_images;
+	open_images = z;
+	unlock_open_images();
+	return fp;
+}
+
+bool zimage_sync(FILE *fp)
+{
+	ZIMAGE *z;
+
+	if (fflush(fp) != 0)
+		return false;
+
+	lock_open_images();
+	for (z = open_images; (z != NULL) && (z->fp != fp); z = z->next)
+		;
+	unlock_open_images();
+
+	return (z == NULL) || write_back_all(z);
+}
+
+bool zimage_create(const char *in, const char *out, size_t chunk_size)
+{
+	FILE *fin, *fout;
+	uint8_t hdr[ZIMAGE_HEADER_SIZE];
+	uint8_t *data, *zbuf, *index;
+	uLongf zbuf_size = compressBound(chunk_size);
+	bool ok = false;
+
+	if ((fin = fopen(in, "rb")) == NULL)
+		return false;
+	if ((fout = fopen(out, "wb")) == NULL) {
+		fclose(fin);
+		return false;
+	}
+
+	fseek(fin, 0, SEEK_END);
+	uint64_t size = ftell(fin);
+	fseek(fin, 0, SEEK_SET);
+	uint32_t nchunks = (size + chunk_size - 1) / chunk_size;
+	uint64_t pos = ZIMAGE_HEADER_SIZE + ((uint64_t)nchunks * ZIMAGE_INDEX_ENTRY);
+
+	data = malloc(chunk_size);
+	zbuf = malloc(zbuf_size);
+	index = calloc(nchunks, ZIMAGE_INDEX_ENTRY);
+	if (!data || !zbuf || (!index && nchunks))
+		goto done;
+
+	// Chunk data goes after the index, which is filled in as we go
+	fseek(fout, pos, SEEK_SET);
+	for (uint32_t i = 0; i < nchunks; i++) {
+		size_t len = fread(data, 1, chunk_size, fin), j;
+		const uint8_t *src = zbuf;
+		uLongf zlen = zbuf_size;
+
+		for (j = 0; (j < len) && (data[j] == 0); j++)
+			;
+		if (j == len) {
+			zlen = 0;
+		} else if ((compress2(zbuf, &zlen, data, len, Z_BEST_COMPRESSION) != Z_OK) || (zlen >= len)) {
+			src = data;
+			zlen = len;
+		}
+		if ((zlen > 0) && (fwrite(src, 1, zlen, fout) != zlen))
+			goto done;
+
+		put_le(index + (i * ZIMAGE_INDEX_ENTRY), pos, 8);
+		put_le(index + (i * ZIMAGE_INDEX_ENTRY) + 8, zlen, 4);
+		put_le(index + (i * ZIMAGE_INDEX_ENTRY) + 12, zlen, 4);
+		pos += zlen;
+	}
+
+	memset(hdr, 0, sizeof(hdr));
+	memcpy(hdr, ZIMAGE_MAGIC, sizeof(ZIMAGE_MAGIC));
+	put_le(hdr + 8, chunk_size, 4);
+	put_le(hdr + 12, nchunks, 4);
+	put_le(hdr + 16, size, 8);
+	fseek(fout, 0, SEEK_SET);
+	ok = (fwrite(hdr, 1, sizeof(hdr), fout) == sizeof(hdr)) &&
+		(fwrite(index, ZIMAGE_INDEX_ENTRY, nchunks, fout) == nchunks);
+	fprintf(stderr, "Compressed %llu bytes to %llu.\n", (unsigned long long)size, (unsigned long long)pos);
+
+done:
+	free(index);
+	free(zbuf);
+	free(data);
+	fclose(fin);
+	if (fclose(fout) != 0)
+		ok = false;
+	return ok;
+}
@@ -0,0 +1,51 @@
+#ifndef _ZIMAGE_H
+#define _ZIMAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/// Default chunk size for new compressed images
+#define ZIMAGE_DEFAULT_CHUNK	65536
+
+/**
+ * @brief	Open a disc image, which may be compressed.
+ * @param	filename	Image file name.
+ * @param	writeable	true to open the image for reading and writing.
+ * @return	A stream onto the uncompressed image, or NULL on error.
+ *
+ * Plain images are opened with fopen(). Compressed images are recognised
+ * by their header and decompressed a chunk at a time as they're read, so
+ * seeking to the end of the stream gives the uncompressed size. Writes go
+ * to the decompressed chunks kept in memory; a changed chunk is recompressed
+ * and written to free space in the file when it leaves memory, on
+ * zimage_sync() or on fclose(), and only then is the chunk's index entry
+ * changed. So the image survives the emulator being killed or the host disc
+ * filling up part way through, with the writes since the last of those
+ * missing.
+ *
+ * Compressed images have no file descriptor, so can't be used with
+ * wd2010_map_image() or wd2010_cache_image().
+ */
+FILE *zimage_open(const char *filename, bool writeable);
+
+/**
+ * @brief	Write everything written to an image back to the file.
+ * @param	fp		Stream from zimage_open().
+ * @return	true on success.
+ *
+ * Flushes the stream; a compressed image then writes back every chunk
+ * which has changed.
+ */
+bool zimage_sync(FILE *fp);
+
+/**
+ * @brief	Compress a disc image.
+ * @param	in			Plain image file name.
+ * @param	out			Compressed image file name.
+ * @param	chunk_size	Size of each independently compressed chunk.
+ * @return	true on success.
+ */
+bool zimage_create(const char *in, const char *out, size_t chunk_size);
+
+#endif